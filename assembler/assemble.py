@@ -28,8 +28,8 @@
 | 0x18   | POP X            | Pop value from stack into register               | POP R1                |
 | 0x19   | HLT              | Halt the program                                 | HLT                   |
 | 0x1A   | NOP              | No Operation                                     | NOP                   |
-| 0x1B   | NOP              | No Operation                                     | NOP                   |
-| 0x1C   | NOP              | No Operation                                     | NOP                   |
+| 0x1B   | IRET             | Return from interrupt, pops flags and PC         | IRET                  |
+| 0x1C   | WAIT             | Sleep until an interrupt is delivered            | WAIT                  |
 | 0x1D   | NOP              | No Operation                                     | NOP                   |
 | 0x1E   | NOP              | No Operation                                     | NOP                   |
 | 0x1F   | NOP              | No Operation                                     | NOP                   |
@@ -137,6 +137,10 @@ def assemble_instruction(instruction):
             return parse_hlt(opcode, args)
         elif opcode == 'NOP':
             return parse_nop(opcode, args)
+        elif opcode == 'IRET':
+            return parse_iret(opcode, args)
+        elif opcode == 'WAIT':
+            return parse_wait(opcode, args)
         else:
             print(f"Error: Unsupported instruction {opcode}")
             return 0
@@ -25,6 +25,8 @@ instructions = {
     'POP': 0x18,
     'HLT': 0x19,
     'NOP': 0x1A,
+    'IRET': 0x1B,
+    'WAIT': 0x1C,
 }
 
 # Next, we need to define the registers and their numbers.
@@ -496,3 +498,19 @@ def parse_nop(opcode : str, args) -> int:
     else:
         op = (instructions[opcode] << 27) & 0xFFFFFFFF
         return op
+
+def parse_iret(opcode : str, args) -> int:
+    if len(args) != 0:
+        print(f"Error: Invalid number of arguments for IRET instruction")
+        return 0
+    else:
+        op = (instructions[opcode] << 27) & 0xFFFFFFFF
+        return op
+
+def parse_wait(opcode : str, args) -> int:
+    if len(args) != 0:
+        print(f"Error: Invalid number of arguments for WAIT instruction")
+        return 0
+    else:
+        op = (instructions[opcode] << 27) & 0xFFFFFFFF
+        return op
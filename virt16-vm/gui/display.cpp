@@ -0,0 +1,136 @@
+//
+// Texture-backed renderer for the Monitor display, see display.h.
+//
+
+#define GL_SILENCE_DEPRECATION
+#include "display.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <GLFW/glfw3.h> // Will drag system OpenGL headers
+
+namespace Virt16 {
+    Display::Display(Emulator &emulator) : emulator(emulator),
+                                           dirty(std::make_unique<unsigned long long[]>(DIRTY_WORDS)),
+                                           pixels(std::make_unique<unsigned int[]>(CONSOLE_SIZE * CONSOLE_SIZE)),
+                                           atlas(std::make_unique<unsigned int[][64]>(GLYPH_COUNT + 1)) {
+        std::fill_n(this->atlas[GLYPH_COUNT], 64, IM_COL32(0, 0, 0, 255));
+        this->emulator.trackWrites(TEXT_ADDR, CONSOLE_CELLS * CONSOLE_CELLS);
+        this->emulator.trackWrites(FONT_ADDR, GLYPH_COUNT * 4);
+
+        glGenTextures(1, &this->texture);
+        glBindTexture(GL_TEXTURE_2D, this->texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, CONSOLE_SIZE, CONSOLE_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    }
+
+    Display::~Display() {
+        glDeleteTextures(1, &this->texture);
+    }
+
+    void Display::mark(const unsigned long long *written) {
+        for (unsigned int i = 0; i < DIRTY_WORDS; i++) {
+            this->dirty[i] |= written[i];
+        }
+    }
+
+    bool Display::isDirty(const unsigned short addr) const {
+        return this->full || (this->dirty[addr >> 6] >> (addr & 63) & 1);
+    }
+
+    unsigned int Display::size() const {
+        return this->mode == Mode::Graphics ? GRAPHICS_SIZE : CONSOLE_SIZE;
+    }
+
+    void Display::buildGlyph(const Emulator::Frame &frame, const unsigned int glyph) {
+        unsigned int *pixel = this->atlas[glyph];
+        for (unsigned int line = 0; line < 8; line++) {
+            const unsigned short word = frame.memory[FONT_ADDR + glyph * 4 + line / 2];
+            const unsigned char bits = line % 2 ? word & 0xFF : word >> 8;
+            for (unsigned int i = 0; i < 8; i++) {
+                *pixel++ = bits >> (7 - i) & 1 ? IM_COL32(255, 255, 255, 255) : IM_COL32(0, 0, 0, 255);
+            }
+        }
+    }
+
+    void Display::drawCell(const Emulator::Frame &frame, const unsigned int x, const unsigned int y) {
+        const unsigned short c = frame.memory[TEXT_ADDR + y * CONSOLE_CELLS + x];
+        // Characters without a glyph are blank
+        const unsigned int *glyph = this->atlas[c >= 32 && c < 32 + GLYPH_COUNT ? c - 32 : GLYPH_COUNT];
+        unsigned int *row = &this->pixels[y * 8 * CONSOLE_SIZE + x * 8];
+        for (unsigned int line = 0; line < 8; line++, row += CONSOLE_SIZE, glyph += 8) {
+            std::copy_n(glyph, 8, row);
+        }
+    }
+
+    void Display::update(const Emulator::Frame &frame, const Mode mode) {
+        const unsigned short disp = frame.registers[DISP];
+        if (disp != this->disp) {
+            // Newly tracked pages are reported dirty once the emulator applies this, until then draw from the frame
+            this->emulator.trackWrites(disp, GRAPHICS_SIZE * GRAPHICS_SIZE);
+            this->disp = disp;
+            this->full |= mode == Mode::Graphics;
+        }
+        if (mode != this->mode) {
+            this->mode = mode;
+            this->full = true;
+            glBindTexture(GL_TEXTURE_2D, this->texture);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, this->size(), this->size(), 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        }
+
+        // Rows of the image that changed
+        unsigned int top = this->size();
+        unsigned int bottom = 0;
+        if (mode == Mode::Graphics) {
+            for (unsigned int i = 0; i < GRAPHICS_SIZE * GRAPHICS_SIZE; i++) {
+                const auto addr = static_cast<unsigned short>(disp + i);
+                if (!this->isDirty(addr)) {
+                    continue;
+                }
+                const unsigned short color = frame.memory[addr];
+                this->pixels[i] = IM_COL32((color >> 12) * 17, (color >> 8 & 0xF) * 17, (color >> 4 & 0xF) * 17, 255);
+                top = std::min(top, i / GRAPHICS_SIZE);
+                bottom = i / GRAPHICS_SIZE + 1;
+            }
+        } else {
+            bool glyphs[GLYPH_COUNT];
+            for (unsigned int glyph = 0; glyph < GLYPH_COUNT; glyph++) {
+                glyphs[glyph] = false;
+                for (unsigned int word = 0; word < 4; word++) {
+                    glyphs[glyph] |= this->isDirty(FONT_ADDR + glyph * 4 + word);
+                }
+                if (glyphs[glyph]) {
+                    this->buildGlyph(frame, glyph);
+                }
+            }
+            for (unsigned int y = 0; y < CONSOLE_CELLS; y++) {
+                for (unsigned int x = 0; x < CONSOLE_CELLS; x++) {
+                    const unsigned short addr = TEXT_ADDR + y * CONSOLE_CELLS + x;
+                    const unsigned short c = frame.memory[addr];
+                    if (this->isDirty(addr) || (c >= 32 && c < 32 + GLYPH_COUNT && glyphs[c - 32])) {
+                        this->drawCell(frame, x, y);
+                        top = std::min(top, y * 8);
+                        bottom = y * 8 + 8;
+                    }
+                }
+            }
+        }
+        std::fill_n(this->dirty.get(), DIRTY_WORDS, 0);
+        this->full = false;
+
+        if (top < bottom) {
+            // Rows are stored CONSOLE_SIZE pixels apart, graphics rows are packed at the start of the buffer
+            const unsigned int stride = mode == Mode::Graphics ? GRAPHICS_SIZE : CONSOLE_SIZE;
+            glBindTexture(GL_TEXTURE_2D, this->texture);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, static_cast<GLint>(top), static_cast<GLsizei>(this->size()),
+                            static_cast<GLsizei>(bottom - top), GL_RGBA, GL_UNSIGNED_BYTE, &this->pixels[top * stride]);
+        }
+    }
+
+    void Display::draw(const ImVec2 &size) const {
+        ImGui::Image((ImTextureID) (intptr_t) this->texture, size);
+    }
+} // Virt16
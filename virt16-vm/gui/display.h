@@ -0,0 +1,74 @@
+//
+// Texture-backed renderer for the Monitor display.
+//
+// The graphics framebuffer at DISP and the text console are rasterized into an RGBA image that is uploaded
+// as one OpenGL texture and drawn with a single ImGui::Image. The emulator reports which words were written,
+// so only pixels of changed framebuffer words, text cells or glyphs are redrawn and only their rows uploaded.
+// Console glyphs are decoded into an atlas once and rebuilt only when their font words change, drawing a cell
+// is a copy from the atlas.
+//
+
+#ifndef VIRT16_DISPLAY_H
+#define VIRT16_DISPLAY_H
+
+#include <memory>
+
+#include "imgui.h"
+#include "vm/emulator.h"
+
+namespace Virt16 {
+    class Display {
+    public:
+        enum class Mode { Console, Graphics };
+
+        // 32x32 pixels, one RGBA4444 word each (alpha is ignored)
+        static constexpr unsigned int GRAPHICS_SIZE = 32;
+        // 16x16 characters of 8x8 pixels, the text is one ASCII code per word
+        static constexpr unsigned int CONSOLE_CELLS = 16;
+        static constexpr unsigned int CONSOLE_SIZE = CONSOLE_CELLS * 8;
+        static constexpr unsigned short TEXT_ADDR = TEXT_MEMORY;
+        // Glyphs for ASCII 32 to 127, 4 words each holding two 8 pixel lines (high byte first)
+        static constexpr unsigned short FONT_ADDR = FONT_MEMORY;
+        static constexpr unsigned int GLYPH_COUNT = 96;
+
+    private:
+        Emulator &emulator;
+        std::unique_ptr<unsigned long long[]> dirty; // Collected by mark(), cleared by update()
+        std::unique_ptr<unsigned int[]> pixels; // RGBA, CONSOLE_SIZE wide so both modes fit
+        // RGBA 8x8 glyphs decoded from the font words, the one past the last is blank for unprintable characters
+        std::unique_ptr<unsigned int[][64]> atlas;
+        unsigned int texture = 0;
+        Mode mode = Mode::Console;
+        int disp = -1; // DISP the framebuffer was tracked and drawn for, -1 before the first update
+        bool full = true; // Redraw everything on the next update
+
+        [[nodiscard]] bool isDirty(unsigned short addr) const;
+
+        [[nodiscard]] unsigned int size() const;
+
+        void buildGlyph(const Emulator::Frame &frame, unsigned int glyph);
+
+        void drawCell(const Emulator::Frame &frame, unsigned int x, unsigned int y);
+
+    public:
+        // Needs the OpenGL context, tracks the text and font ranges right away
+        explicit Display(Emulator &emulator);
+
+        Display(const Display &) = delete;
+
+        Display &operator=(const Display &) = delete;
+
+        // Adds words reported by Emulator::takeDirty() for the next update
+        void mark(const unsigned long long *written);
+
+        // Rasterizes what changed in frame and uploads it to the texture
+        void update(const Emulator::Frame &frame, Mode mode);
+
+        // Draws the texture at the cursor, scaled to size
+        void draw(const ImVec2 &size) const;
+
+        ~Display();
+    };
+} // Virt16
+
+#endif //VIRT16_DISPLAY_H
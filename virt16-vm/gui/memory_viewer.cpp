@@ -0,0 +1,133 @@
+//
+// Hex viewer for the whole 64K word address space, see memory_viewer.h.
+//
+
+#include "memory_viewer.h"
+
+#include <algorithm>
+#include <bit>
+#include <cfloat>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "imgui.h"
+
+namespace Virt16 {
+    MemoryViewer::MemoryViewer(Emulator &emulator) : emulator(emulator),
+                                                     written(std::make_unique<float[]>(MEMORY_SIZE)) {
+        std::fill_n(this->written.get(), MEMORY_SIZE, -HIGHLIGHT_TIME);
+    }
+
+    void MemoryViewer::mark(const unsigned long long *dirty) {
+        const auto now = static_cast<float>(ImGui::GetTime());
+        constexpr unsigned int page_words = PAGE_WORDS / 64;
+        for (unsigned int page = 0; page < PAGE_COUNT; page++) {
+            const unsigned long long *words = &dirty[page * page_words];
+            if (this->pending[page] &&
+                std::all_of(words, words + page_words, [](const unsigned long long w) { return w == ~0ull; })) {
+                this->pending[page] = false;
+                continue;
+            }
+            for (unsigned int i = 0; i < page_words; i++) {
+                for (unsigned long long bits = words[i]; bits; bits &= bits - 1) {
+                    this->written[(page * page_words + i) * 64 + std::countr_zero(bits)] = now;
+                }
+            }
+        }
+    }
+
+    void MemoryViewer::draw(const Emulator::Frame &frame) {
+        ImGui::SetNextItemWidth(50);
+        bool visit = ImGui::InputText("##AddressInput", this->address_input, sizeof(this->address_input),
+                                      ImGuiInputTextFlags_CharsHexadecimal | ImGuiInputTextFlags_EnterReturnsTrue);
+        ImGui::SameLine();
+        visit |= ImGui::Button("Visit");
+        if (visit) {
+            this->goto_row = static_cast<int>(std::strtoul(this->address_input, nullptr, 16) & 0xFFFF) / COLUMNS;
+        }
+
+        if (!ImGui::BeginTable("Memory Dump", COLUMNS + 1,
+                               ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg | ImGuiTableFlags_ScrollY)) {
+            return;
+        }
+        static const char *column_names[COLUMNS] = {
+            "0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "A", "B", "C", "D", "E", "F"
+        };
+        ImGui::TableSetupScrollFreeze(0, 1);
+        ImGui::TableSetupColumn("Address");
+        for (const char *name: column_names) {
+            ImGui::TableSetupColumn(name);
+        }
+        ImGui::TableHeadersRow();
+
+        const auto now = static_cast<float>(ImGui::GetTime());
+        ImGuiListClipper clipper;
+        clipper.Begin(ROWS);
+        // Rows that have to be submitted even when scrolled out of view
+        if (this->goto_row >= 0) {
+            clipper.IncludeItemByIndex(this->goto_row);
+        }
+        if (this->editing >= 0) {
+            clipper.IncludeItemByIndex(this->editing / static_cast<int>(COLUMNS));
+        }
+        while (clipper.Step()) {
+            for (int row = clipper.DisplayStart; row < clipper.DisplayEnd; row++) {
+                const unsigned int base = row * COLUMNS;
+                if (!this->tracked[base / PAGE_WORDS]) {
+                    this->tracked[base / PAGE_WORDS] = true;
+                    this->pending[base / PAGE_WORDS] = true;
+                    this->emulator.trackWrites(base - base % PAGE_WORDS, PAGE_WORDS);
+                }
+
+                ImGui::TableNextRow();
+                if (row == this->goto_row) {
+                    ImGui::TableSetBgColor(ImGuiTableBgTarget_RowBg0, IM_COL32(255, 0, 0, 255));
+                    ImGui::SetScrollHereY();
+                    this->goto_row = -1;
+                }
+                ImGui::TableSetColumnIndex(0);
+                ImGui::Text("0x%04X", base);
+
+                for (unsigned int col = 0; col < COLUMNS; col++) {
+                    const unsigned int addr = base + col;
+                    ImGui::TableSetColumnIndex(static_cast<int>(col) + 1);
+                    // Fade out the highlight of recently written words
+                    if (const float age = now - this->written[addr]; age < HIGHLIGHT_TIME) {
+                        const auto alpha = static_cast<unsigned int>(160 * (1 - age / HIGHLIGHT_TIME));
+                        ImGui::TableSetBgColor(ImGuiTableBgTarget_CellBg, IM_COL32(255, 160, 0, alpha));
+                    }
+                    ImGui::PushID(static_cast<int>(addr));
+                    if (static_cast<int>(addr) == this->editing) {
+                        if (this->focus) {
+                            ImGui::SetKeyboardFocusHere();
+                            this->focus = false;
+                        }
+                        ImGui::SetNextItemWidth(-FLT_MIN);
+                        if (ImGui::InputText("##Edit", this->edit_buffer, sizeof(this->edit_buffer),
+                                             ImGuiInputTextFlags_CharsHexadecimal | ImGuiInputTextFlags_CharsUppercase |
+                                             ImGuiInputTextFlags_EnterReturnsTrue |
+                                             ImGuiInputTextFlags_AutoSelectAll)) {
+                            if (this->edit_buffer[0]) {
+                                this->emulator.setMemory(addr, std::strtoul(this->edit_buffer, nullptr, 16));
+                            }
+                            this->editing = -1;
+                        } else if (ImGui::IsItemDeactivated()) {
+                            this->editing = -1;
+                        }
+                    } else {
+                        char text[4 + 1];
+                        snprintf(text, sizeof(text), "%04X", frame.memory[addr]);
+                        if (ImGui::Selectable(text)) {
+                            this->editing = static_cast<int>(addr);
+                            this->focus = true;
+                            std::memcpy(this->edit_buffer, text, sizeof(text));
+                        }
+                    }
+                    ImGui::PopID();
+                }
+            }
+        }
+        ImGui::EndTable();
+    }
+} // Virt16
@@ -0,0 +1,51 @@
+//
+// Hex viewer for the whole 64K word address space.
+//
+// Only the rows on screen are submitted (ImGuiListClipper), cells are plain text until clicked, then the clicked
+// word becomes an input field. Words reported as written by the VM are highlighted for a moment, pages are
+// tracked for writes the first time they scroll into view.
+//
+
+#ifndef VIRT16_MEMORY_VIEWER_H
+#define VIRT16_MEMORY_VIEWER_H
+
+#include <memory>
+
+#include "vm/emulator.h"
+
+namespace Virt16 {
+    class MemoryViewer {
+    public:
+        static constexpr unsigned int COLUMNS = 16;
+        static constexpr unsigned int ROWS = MEMORY_SIZE / COLUMNS;
+        // Seconds a written word stays highlighted
+        static constexpr float HIGHLIGHT_TIME = 1.0f;
+
+    private:
+        Emulator &emulator;
+        std::unique_ptr<float[]> written; // ImGui::GetTime() of the last reported write per word
+        // Tracking was requested for the page, its first report marks the whole page and is not a write
+        bool tracked[PAGE_COUNT]{};
+        bool pending[PAGE_COUNT]{};
+        int editing = -1; // Address of the cell being edited
+        bool focus = false; // Give the input field keyboard focus on the next draw
+        char edit_buffer[4 + 1]{};
+        char address_input[4 + 1]{};
+        int goto_row = -1;
+
+    public:
+        explicit MemoryViewer(Emulator &emulator);
+
+        MemoryViewer(const MemoryViewer &) = delete;
+
+        MemoryViewer &operator=(const MemoryViewer &) = delete;
+
+        // Records words reported by Emulator::takeDirty() for highlighting
+        void mark(const unsigned long long *dirty);
+
+        // Address bar and table, fills the remaining space of the current window
+        void draw(const Emulator::Frame &frame);
+    };
+} // Virt16
+
+#endif //VIRT16_MEMORY_VIEWER_H
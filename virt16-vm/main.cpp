@@ -4,7 +4,7 @@
 #endif
 #include <complex>
 #include <string>
-#include <sstream>
+#include <algorithm>
 #include "imgui.h"
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl3.h"
@@ -14,7 +14,11 @@
 #include <vector>
 #include <GLFW/glfw3.h> // Will drag system OpenGL headers
 
-#include "vm/virt16.h"
+#include "gui/display.h"
+#include "gui/memory_viewer.h"
+#include "vm/assembler.h"
+#include "vm/emulator.h"
+#include "vm/rom.h"
 
 
 #if defined(_MSC_VER) && (_MSC_VER >= 1900) && !defined(IMGUI_DISABLE_WIN32_FUNCTIONS)
@@ -34,7 +38,6 @@ static void glfw_error_callback(int error, const char *description) {
 #define HEIGHT 720
 #define ORIGINAL_DISPLAY_SIZE ImVec2(32, 32)
 #define UPSCALE 16
-#define UPSCALE_CONSOLE 4
 #define SIZE ImVec2(WIDTH, HEIGHT)
 
 // Main code
@@ -97,16 +100,25 @@ int main(int, char **) {
 
     ImVec4 clear_color = ImVec4(0.45f, 0.55f, 0.60f, 1.00f);
 
-    // VM instance
-    auto *vm = new Virt16::virt16();
-    vm->setDisp(0x3000);
+    // VM instance, runs on its own thread and publishes its state once per frame
+    auto *emulator = new Virt16::Emulator();
+    emulator->setRegister(Virt16::DISP, Virt16::DISPLAY_MEMORY);
+    // Display texture, redrawn from the words the VM reports as written
+    auto *display = new Virt16::Display(*emulator);
+    auto *memory_viewer = new Virt16::MemoryViewer(*emulator);
+    std::vector<unsigned long long> dirty(Virt16::DIRTY_WORDS);
 
     // UI Defs
-    static uint16_t goto_address = 0;
-    char address_input[4 + 1] = {0};
+    char breakpoint_input[4 + 1] = {0};
+    char write_input[4 + 1] = {0};
+    char condition_input[32] = {0};
+    char watch_input[4 + 1] = {0};
+    unsigned long long clock_hz = 0; // 0 runs as fast as possible
     bool graphics_mode = false; // False is Console, True is Graphics
     // Array of strings for debug info
     std::vector<std::string> debug_info;
+    // Errors of the last .asm file loaded
+    std::vector<std::string> assembly_errors;
 
 
     // Main loop
@@ -128,6 +140,14 @@ int main(int, char **) {
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
 
+        // Latest state published by the emulation thread, never blocks. Written words first so the frame holds them.
+        if (emulator->takeDirty(dirty.data())) {
+            display->mark(dirty.data());
+            memory_viewer->mark(dirty.data());
+            std::fill(dirty.begin(), dirty.end(), 0);
+        }
+        const Virt16::Emulator::Frame &frame = emulator->latest();
+
 
         ImGui::Begin("Virt16 - Virtual Machine", nullptr,
                      ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoCollapse | ImGuiWindowFlags_NoResize |
@@ -145,28 +165,49 @@ int main(int, char **) {
                 ImGui::SetCursorPosY(ImGui::GetCursorPosY() + (ImGui::GetContentRegionAvail().y - 100) / 2);
                 ImGui::SetCursorPosX(ImGui::GetCursorPosX() + 180);
 
-                ImGui::InputText("ROM File Path", file_path, sizeof(file_path));
+                ImGui::InputText("ROM or .asm File Path", file_path, sizeof(file_path));
                 ImGui::SetCursorPosX(ImGui::GetCursorPosX() + 180);
                 if (ImGui::Button("Load ROM")) {
                     if (strlen(file_path) > 0) {
                         try {
-                            vm->load_program(file_path);
-                            // Remove the file extension in the end to get the path and name
                             std::string path(file_path);
-                            path = path.substr(0, path.find_last_of('.'));
-                            path += ".debug";
-
                             // Clear the debug info
                             debug_info.clear();
-
-                            // Read file and add each line to debug_info
-                            std::ifstream file(path);
-                            if (file.is_open()) {
-                                std::string line;
-                                while (std::getline(file, line)) {
-                                    debug_info.push_back(line);
+                            assembly_errors.clear();
+
+                            if (path.size() > 4 && path.compare(path.size() - 4, 4, ".asm") == 0) {
+                                // Assemble in process, the source map replaces the .debug file
+                                Virt16::Assembly assembly = Virt16::assembleFile(file_path);
+                                assembly_errors = assembly.errors;
+                                if (assembly.ok()) {
+                                    for (const Virt16::SourceLine &line: assembly.source_map) {
+                                        debug_info.push_back(line.text);
+                                    }
+                                    emulator->load(std::move(assembly.image));
+                                }
+                            } else if (Virt16::RomImage image; !image.open(file_path)) {
+                                assembly_errors.push_back(image.getError());
+                            } else if (image.hasHeader()) {
+                                // Images carry their own source map
+                                for (const Virt16::SourceLine &line: image.getSourceMap()) {
+                                    debug_info.push_back(line.text);
+                                }
+                                emulator->load(file_path);
+                            } else {
+                                emulator->load(file_path);
+                                // Remove the file extension in the end to get the path and name
+                                path = path.substr(0, path.find_last_of('.'));
+                                path += ".debug";
+
+                                // Read file and add each line to debug_info
+                                std::ifstream file(path);
+                                if (file.is_open()) {
+                                    std::string line;
+                                    while (std::getline(file, line)) {
+                                        debug_info.push_back(line);
+                                    }
+                                    file.close();
                                 }
-                                file.close();
                             }
                         } catch ([[maybe_unused]] std::runtime_error &e) {
                             ImGui::SetCursorPosX(ImGui::GetCursorPosX() + (ImGui::GetContentRegionAvail().x - 50) / 2);
@@ -184,66 +225,16 @@ int main(int, char **) {
 
                 ImGui::SameLine();
                 ImGui::Text("%s", file_path);
+                for (const std::string &error: assembly_errors) {
+                    ImGui::SetCursorPosX(ImGui::GetCursorPosX() + 180);
+                    ImGui::TextColored(ImVec4(1, 0.4f, 0.4f, 1), "%s", error.c_str());
+                }
 
                 ImGui::EndTabItem();
             }
 
             if (ImGui::BeginTabItem("Memory Viewer")) {
-                // Label on left
-                ImGui::InputText("##AddressInput", address_input, sizeof(address_input),
-                                 ImGuiInputTextFlags_CharsHexadecimal);
-                ImGui::SameLine();
-                if (ImGui::Button("Visit")) {
-                    goto_address = std::strtol(address_input, nullptr, 16);
-                }
-
-                // Create a table with 16 columns
-                if (ImGui::BeginTable("Memory Dump", 17, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
-                    // Create header row
-                    ImGui::TableSetupColumn("Address");
-                    for (int col = 0; col < 16; col++) {
-                        std::stringstream ss;
-                        ss << std::hex << col;
-                        ImGui::TableSetupColumn(ss.str().c_str());
-                    }
-                    ImGui::TableHeadersRow();
-
-                    // Populate the table
-                    for (int row = 0; row < 16384 / 16; row++) {
-                        ImGui::TableNextRow();
-                        if (goto_address > 0 && row == goto_address / 16) {
-                            ImGui::TableSetBgColor(ImGuiTableBgTarget_RowBg0, IM_COL32(255, 0, 0, 255));
-                            ImGui::SetScrollHereY();
-                            goto_address = 0;
-                        }
-
-
-                        ImGui::TableSetColumnIndex(0);
-                        ImGui::Text("0x%04X", row * 16); // Address column
-
-                        for (int col = 0; col < 16; col++) {
-                            ImGui::TableSetColumnIndex(col + 1);
-                            char buf[9];
-                            snprintf(buf, sizeof(buf), "%04X", vm->getMemory(row * 16 + col));
-
-                            // Align cell at the center
-                            ImGui::SetCursorPosX(
-                                ImGui::GetCursorPosX() + (ImGui::GetColumnWidth() - ImGui::CalcTextSize(buf).x) / 2);
-                            const int addr = row * 16 + col;
-                            char label[7];
-                            snprintf(label, sizeof(label), "##%04X", addr);
-                            if (ImGui::InputText(label,
-                                                 buf,
-                                                 sizeof(buf),
-                                                 ImGuiInputTextFlags_CharsHexadecimal |
-                                                 ImGuiInputTextFlags_CharsUppercase)) {
-                                vm->setMemory(row * 16 + col, std::stoul(buf, nullptr, 16));
-                            }
-                        }
-                    }
-                    ImGui::EndTable();
-                }
-
+                memory_viewer->draw(frame);
                 ImGui::EndTabItem();
             }
             if (ImGui::BeginTabItem("Monitor")) {
@@ -254,21 +245,97 @@ int main(int, char **) {
                 // Button to step, reset, run, reset
                 if (ImGui::Button("Step")) {
                     // Step
-                    vm->step();
+                    emulator->step();
                 }
                 ImGui::SameLine();
                 if (ImGui::Button("Reset")) {
                     // Reset
-                    vm->reset();
+                    emulator->reset();
                 }
                 ImGui::SameLine();
                 if (ImGui::Button("Run")) {
-                    vm->run();
+                    emulator->run();
                 }
                 ImGui::SameLine();
                 if (ImGui::Button("Stop")) {
                     // Stop
-                    vm->stop();
+                    emulator->stop();
+                }
+
+                // Execution engine used by Run
+                int engine = static_cast<int>(frame.engine);
+                if (ImGui::Combo("Engine", &engine, Virt16::engine_names, IM_ARRAYSIZE(Virt16::engine_names))) {
+                    emulator->setEngine(static_cast<Virt16::Engine>(engine));
+                }
+                // Target clock rate in ticks per second, 0 is unlimited
+                if (ImGui::InputScalar("Clock (Hz)", ImGuiDataType_U64, &clock_hz, nullptr, nullptr, "%llu",
+                                       ImGuiInputTextFlags_EnterReturnsTrue)) {
+                    emulator->setClock(clock_hz);
+                }
+                ImGui::Text("%s: %.2f MIPS", frame.breakpoint ? "Breakpoint" : !frame.running ? "Stopped"
+                                             : frame.waiting ? "Waiting" : "Running", frame.cycles_per_second / 1e6);
+                ImGui::Text("Cycles: %llu  Ticks: %llu", frame.cycles, frame.ticks);
+                if (frame.hit.kind != Virt16::DebugHit::None) {
+                    const char *kinds[] = {"", "Breakpoint at", "Read of", "Write to"};
+                    ImGui::Text("%s %04X", kinds[frame.hit.kind], frame.hit.addr);
+                }
+
+                // Reverse execution while stopped, as far back as the emulator's history reaches
+                if (ImGui::Button("Step Back")) {
+                    emulator->stepBack();
+                }
+                ImGui::SameLine();
+                if (ImGui::Button("Back 100")) {
+                    emulator->stepBack(100);
+                }
+                ImGui::Text("History from cycle %llu", frame.history_start);
+                ImGui::SetNextItemWidth(50);
+                ImGui::InputText("##WriteInput", write_input, sizeof(write_input), ImGuiInputTextFlags_CharsHexadecimal);
+                ImGui::SameLine();
+                if (ImGui::Button("Back to Write")) {
+                    emulator->backToWrite(std::strtol(write_input, nullptr, 16));
+                }
+
+                // Breakpoints stop Run before the instruction at the address executes
+                ImGui::SetNextItemWidth(50);
+                ImGui::InputText("##BreakpointInput", breakpoint_input, sizeof(breakpoint_input),
+                                 ImGuiInputTextFlags_CharsHexadecimal);
+                ImGui::SameLine();
+                if (ImGui::Button("Break")) {
+                    // Only while the condition holds, e.g. R3==5 or !Z, always when it is empty
+                    if (Virt16::BreakCondition condition; Virt16::BreakCondition::parse(condition_input, condition)) {
+                        emulator->setBreakpoint(std::strtol(breakpoint_input, nullptr, 16), condition);
+                    }
+                }
+                ImGui::SameLine();
+                if (ImGui::Button("Clear")) {
+                    emulator->clearBreakpoint(std::strtol(breakpoint_input, nullptr, 16));
+                }
+                ImGui::SetNextItemWidth(100);
+                ImGui::InputText("If", condition_input, sizeof(condition_input));
+                if (Virt16::BreakCondition condition; !Virt16::BreakCondition::parse(condition_input, condition)) {
+                    ImGui::TextColored(ImVec4(1, 0.4f, 0.4f, 1), "Invalid condition");
+                }
+
+                // Watchpoints stop Run after an instruction reads or writes the address
+                ImGui::SetNextItemWidth(50);
+                ImGui::InputText("##WatchInput", watch_input, sizeof(watch_input), ImGuiInputTextFlags_CharsHexadecimal);
+                const auto watch_addr = static_cast<unsigned short>(std::strtol(watch_input, nullptr, 16));
+                ImGui::SameLine();
+                if (ImGui::Button("R")) {
+                    emulator->setWatchpoint(watch_addr, Virt16::WATCH_READ);
+                }
+                ImGui::SameLine();
+                if (ImGui::Button("W")) {
+                    emulator->setWatchpoint(watch_addr, Virt16::WATCH_WRITE);
+                }
+                ImGui::SameLine();
+                if (ImGui::Button("RW")) {
+                    emulator->setWatchpoint(watch_addr, Virt16::WATCH_READ | Virt16::WATCH_WRITE);
+                }
+                ImGui::SameLine();
+                if (ImGui::Button("Unwatch")) {
+                    emulator->setWatchpoint(watch_addr, 0);
                 }
 
                 // Add a separator
@@ -289,7 +356,7 @@ int main(int, char **) {
                         ImGui::Text("%s", Virt16::register_names[row]);
                         ImGui::TableSetColumnIndex(1);
                         char buf[9];
-                        snprintf(buf, sizeof(buf), "%04X", vm->getRegister(static_cast<Virt16::Registers>(row)));
+                        snprintf(buf, sizeof(buf), "%04X", frame.registers[row]);
                         char reg_labels[8];
                         snprintf(reg_labels, sizeof(reg_labels), "##%s", Virt16::register_names[row]);
                         if (ImGui::InputText(reg_labels, buf, sizeof(buf),
@@ -297,7 +364,7 @@ int main(int, char **) {
                                              ImGuiInputTextFlags_CharsUppercase)) {
                             std::cout << "Setting Register " << Virt16::register_names[row] << " to " << buf <<
                                     std::endl;
-                            vm->setRegister(static_cast<Virt16::Registers>(row), std::stoul(buf, nullptr, 16));
+                            emulator->setRegister(static_cast<Virt16::Registers>(row), std::stoul(buf, nullptr, 16));
                         }
                     }
 
@@ -307,15 +374,15 @@ int main(int, char **) {
                 ImGui::Separator();
                 // Display Flags
                 ImGui::Text("Flags");
-                ImGui::Text("Z: %d", vm->getFlag(Virt16::Z));
+                ImGui::Text("Z: %d", frame.flags[Virt16::Z]);
                 ImGui::SameLine();
-                ImGui::Text("G: %d", vm->getFlag(Virt16::G));
+                ImGui::Text("G: %d", frame.flags[Virt16::G]);
                 ImGui::SameLine();
-                ImGui::Text("L: %d", vm->getFlag(Virt16::L));
+                ImGui::Text("L: %d", frame.flags[Virt16::L]);
                 ImGui::SameLine();
-                ImGui::Text("E: %d", vm->getFlag(Virt16::E));
+                ImGui::Text("E: %d", frame.flags[Virt16::E]);
                 ImGui::SameLine();
-                ImGui::Text("C: %d", vm->getFlag(Virt16::C));
+                ImGui::Text("C: %d", frame.flags[Virt16::C]);
 
                 ImGui::Separator();
 
@@ -337,112 +404,19 @@ int main(int, char **) {
                 canvas_pos.x += (ImGui::GetContentRegionAvail().x - (32 * UPSCALE)) / 2;
                 canvas_pos.y += (ImGui::GetContentRegionAvail().y - (32 * UPSCALE)) / 2;
 
-                if (graphics_mode) {
-                    ImVec2 canvas_size = ImVec2(32 * UPSCALE, 32 * UPSCALE);
-                    ImGui::InvisibleButton("canvas", canvas_size);
-                    ImDrawList *draw_list = ImGui::GetWindowDrawList();
-                    // Draw a 32x32 grid of colored rectangles
-                    for (int y = 0; y < 32; y++) {
-                        for (int x = 0; x < 32; x++) {
-                            //ImU32 color = IM_COL32(60, 60, 60, 60); // Set your desired color here
-                            // Color will be vm->getMemory(vm->GetDisp() + y * 32 + x)
-                            ImU32 color = IM_COL32(0xff, 0xff, 0xff, 0xff);
-                            const unsigned short c = vm->getMemory(vm->getDisp() + y * 32 + x);
-                            const unsigned char r = (c & 0xF000) >> 8;
-                            const unsigned char g = (c & 0x0F00) >> 4;
-                            const unsigned char b = (c & 0x00F0 >> 2);
-                            //const unsigned char a = (c & 0x000F);
-                            color = IM_COL32(r*17, g*17, b*0x17, 0xff);
-
-                            ImVec2 p_min = ImVec2(canvas_pos.x + static_cast<float>(x) * UPSCALE,
-                                                  canvas_pos.y + static_cast<float>(y) * UPSCALE);
-                            ImVec2 p_max = ImVec2(p_min.x + UPSCALE, p_min.y + UPSCALE);
-                            draw_list->AddRectFilled(p_min, p_max, color);
-                        }
-                    }
-                } else {
-                    //  Console mode consists in a 16x16 grid of text. Characters are 8x8 pixels
-                    //  and can be found at memory address 0x4000 in ascii order each line is one byte of 0 (black) and 1 (white)
-                    //  so each memory address on the font memory address have 2 lines of the character.
-                    //  The character font address is 0x3100 + (character_ascii - 32) and the next 3 addresses
-                    // Eg: ' ':32 is at 0x3100 to 0x3103, '!': is at 0x3104 to 0x3107 and so on
-                    // What characters to draw are in address 0x2900 to 0x29FF
-                    // Current algorithm is super inefficient and should be optimized
-
-                    // Set canvas size(16 characters, each 8x8 pixels, scaled by UPSCALE)
-                    auto canvas_size = ImVec2(16 * 8 * UPSCALE_CONSOLE, 16 * 8 * UPSCALE_CONSOLE);
-                    ImGui::InvisibleButton("canvas", canvas_size);
-                    ImDrawList *draw_list = ImGui::GetWindowDrawList();
-
-                    // Set background color (black)
-                    draw_list->AddRectFilled(canvas_pos, ImVec2(canvas_pos.x + 16 * 8 * UPSCALE_CONSOLE,
-                                                                canvas_pos.y + 16 * 8 * UPSCALE_CONSOLE),
-                                             IM_COL32(0, 0, 0, 0xff));
-
-                    // Loop over each character position in the 16x16 grid
-                    for (int y = 0; y < 16; y++) {
-                        for (int x = 0; x < 16; x++) {
-                            // Get the character at the (x, y) position
-                            const unsigned short c = vm->getMemory(0x2900 + y * 16 + x);
-
-                            // Check if the character is valid (ASCII 32 to 127)
-                            if (c < 32 || c > 127) continue;
-
-                            // Get the font address for this character
-                            const unsigned short font_addr = 0x3100 + (c - 32) * 4;
-
-                            // Get the 4 bytes of font data (each byte represents 2 lines, 1 bit per pixel)
-                            const unsigned short line1and2 = vm->getMemory(font_addr);
-                            const unsigned short line3and4 = vm->getMemory(font_addr + 1);
-                            const unsigned short line5and6 = vm->getMemory(font_addr + 2);
-                            const unsigned short line7and8 = vm->getMemory(font_addr + 3);
-
-                            // Now we have 8 lines (2 bits per byte) representing the character
-                            // We will draw this 8x8 grid of pixels on the canvas
-                            unsigned char lines[8];
-                            lines[0] = (line1and2 & 0xFF00) >> 8; // First half of line 1
-                            lines[1] = (line1and2 & 0x00FF); // First half of line 2
-                            lines[2] = (line3and4 & 0xFF00) >> 8; // First half of line 3
-                            lines[3] = (line3and4 & 0x00FF); // First half of line 4
-                            lines[4] = (line5and6 & 0xFF00) >> 8; // First half of line 5
-                            lines[5] = (line5and6 & 0x00FF); // First half of line 6
-                            lines[6] = (line7and8 & 0xFF00) >> 8; // First half of line 7
-                            lines[7] = (line7and8 & 0x00FF); // First half of line 8
-
-                            // Set the top-left corner of the character
-                            ImVec2 char_pos = ImVec2(canvas_pos.x + x * 8 * UPSCALE_CONSOLE,
-                                                     canvas_pos.y + y * 8 * UPSCALE_CONSOLE);
-
-                            // Draw each pixel of the character (8x8 grid)
-                            for (int i = 0; i < 8; i++) {
-                                // 8 lines
-                                unsigned char line = lines[i]; // Get the bits for this line
-                                for (int j = 0; j < 8; j++) {
-                                    // Extract the bit value (1 for white, 0 for black)
-                                    bool is_white = (line >> (7 - j)) & 1;
-
-                                    // Set color based on the bit value (1 = white, 0 = black)
-                                    ImU32 color = is_white ? IM_COL32(255, 255, 255, 255) : IM_COL32(0, 0, 0, 255);
-
-                                    // Calculate the pixel position on the canvas
-                                    ImVec2 p_min = ImVec2(char_pos.x + j * UPSCALE_CONSOLE, char_pos.y + i * UPSCALE_CONSOLE);
-                                    ImVec2 p_max = ImVec2(p_min.x + UPSCALE_CONSOLE, p_min.y + UPSCALE_CONSOLE);
-
-                                    // Draw the pixel as a filled rectangle
-                                    draw_list->AddRectFilled(p_min, p_max, color);
-                                }
-                            }
-                        }
-                    }
-                }
+                // Console is a 16x16 grid of 8x8 characters at TEXT_MEMORY drawn with the glyphs at FONT_MEMORY,
+                // graphics is the 32x32 framebuffer at DISP
+                display->update(frame, graphics_mode ? Virt16::Display::Mode::Graphics : Virt16::Display::Mode::Console);
+                ImGui::SetCursorScreenPos(canvas_pos);
+                display->draw(ImVec2(32 * UPSCALE, 32 * UPSCALE));
                 ImGui::EndChild();
                 ImGui::SameLine();
                 ImGui::BeginChild("Exclusive Registers and Peripherals", ImVec2(0, 0), true);
                 ImGui::BeginChild("Exclusive Registers", ImVec2(300, 150), true);
-                //ImGui::Text("Time: 0x%04X", vm->getRegister(Virt16::TIME));
+                ImGui::Text("Time: 0x%04X", frame.registers[Virt16::TIME]);
                 //ImGui::Text("PC: 0x%04X", vm->getRegister(Virt16::PC));
                 //ImGui::Text("SP: 0x%04X", vm->getRegister(Virt16::SP));
-                ImGui::Text("Disp: 0x%04X", vm->getDisp());
+                ImGui::Text("Disp: 0x%04X", frame.registers[Virt16::DISP]);
                 ImGui::Text(
                     "TODO: Implement Getters and Setters \n for exclusive register and display \n here in a table");
 
@@ -451,8 +425,8 @@ int main(int, char **) {
                 ImGui::SameLine();
                 ImGui::BeginChild("Peripherals", ImVec2(0, 150), true);
                 // Draw Hex Keyboard
-                ImGui::Text("Hex Keyboard (P0)");
-                // We draw 16 buttons 4x4 And when one is pressed, we set the corresponding bit in the peripheral register P0
+                ImGui::Text("Hex Keyboard (P1)");
+                // 16 buttons 4x4, a press is stored in P1 and raises its interrupt (see Virt16::Keyboard)
                 for (int i = 0; i < 16; i++) {
                     if (i % 4 != 0) {
                         ImGui::SameLine();
@@ -460,11 +434,10 @@ int main(int, char **) {
                     char label[3];
                     snprintf(label, sizeof(label), "%X", i);
                     if (ImGui::Button(label)) {
-                        // Set the bit in the peripheral register
-                        // To implement set peripheral
+                        emulator->pressKey(static_cast<unsigned char>(i));
                     }
                 }
-                ImGui::Text("(Action Not implemented!)");
+                ImGui::Text("P1: 0x%04X", frame.registers[Virt16::P1]);
 
                 ImGui::EndChild();
 
@@ -472,7 +445,7 @@ int main(int, char **) {
                 ImGui::Separator();
                 // Debug Info
                 ImGui::BeginChild("Debug Info", ImVec2(0, 0), true);
-                ImGui::Text("PC: 0x%04X", vm->getPC());
+                ImGui::Text("PC: 0x%04X", frame.pc);
                 // Iterate over vector and If pc matches the index highlight the line
                 for (int i = 0; i < debug_info.size(); i++) {
                     // Align center
@@ -481,7 +454,7 @@ int main(int, char **) {
                             ImGui::GetContentRegionAvail().x - ImGui::CalcTextSize(debug_info[i].c_str()).x) / 2,
                         ImGui::GetCursorScreenPos().y));
 
-                    if (vm->getPC() / 2 == i) {
+                    if (frame.pc / 2 == i) {
                         ImGui::TextColored(ImVec4(1, 1, 0, 1), "%s", debug_info[i].c_str());
                     } else {
                         ImGui::Text("%s", debug_info[i].c_str());
@@ -519,6 +492,9 @@ int main(int, char **) {
 #endif
 
     // Cleanup
+    delete memory_viewer;
+    delete display;
+    delete emulator;
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
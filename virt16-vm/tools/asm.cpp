@@ -0,0 +1,111 @@
+//
+// Command line front end of the C++ assembler.
+//
+// Writes the same <name>.bin and <name>.debug files as assembler/assemble.py, the .bin holds the
+// 16-bit words in little-endian order. An output ending in .v16 is written as a ROM image with a
+// header and debug table instead (see vm/rom.h).
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include "vm/assembler.h"
+#include "vm/rom.h"
+
+static bool parse_address(const char *text, unsigned short &out) {
+    char *end = nullptr;
+    const unsigned long value = std::strtoul(text, &end, 0);
+    out = static_cast<unsigned short>(value);
+    return end != text && *end == '\0' && value <= 0xFFFF;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [-o out.bin|out.v16] <source.asm>\n"
+            "  -o, --output FILE     Binary to write (default: source with a .bin extension),\n"
+            "                        the .debug source listing is written next to it. A .v16\n"
+            "                        file is a ROM image with the source map included instead\n"
+            "  -s, --sp ADDR         Initial SP stored in a .v16 image (default: 0)\n"
+            "  -d, --disp ADDR       Initial DISP stored in a .v16 image (default: 0x3000)\n"
+            "  -h, --help            Show this help\n",
+            argv0);
+}
+
+int main(int argc, char **argv) {
+    const char *source = nullptr;
+    std::string output;
+    unsigned short sp = 0;
+    unsigned short disp = 0x3000;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+            usage(argv[0]);
+            return 0;
+        }
+        if ((!strcmp(arg, "-o") || !strcmp(arg, "--output")) && i + 1 < argc) {
+            output = argv[++i];
+        } else if ((!strcmp(arg, "-s") || !strcmp(arg, "--sp")) && i + 1 < argc) {
+            if (!parse_address(argv[++i], sp)) {
+                fprintf(stderr, "Invalid SP: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-d") || !strcmp(arg, "--disp")) && i + 1 < argc) {
+            if (!parse_address(argv[++i], disp)) {
+                fprintf(stderr, "Invalid DISP address: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (arg[0] == '-' || source) {
+            usage(argv[0]);
+            return 1;
+        } else {
+            source = arg;
+        }
+    }
+    if (!source) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const Virt16::Assembly assembly = Virt16::assembleFile(source);
+    for (const std::string &error: assembly.errors) {
+        fprintf(stderr, "%s\n", error.c_str());
+    }
+    if (!assembly.ok()) {
+        return 1;
+    }
+
+    if (output.empty()) {
+        output = source;
+        output = output.substr(0, output.find_last_of('.')) + ".bin";
+    }
+    if (output.size() > 4 && output.compare(output.size() - 4, 4, ".v16") == 0) {
+        std::string error;
+        if (!Virt16::RomImage::write(output.c_str(), assembly, sp, disp, error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        printf("%s: %zu instructions, %zu words\n", output.c_str(), assembly.source_map.size(), assembly.image.size());
+        return 0;
+    }
+
+    const std::string debug = output.substr(0, output.find_last_of('.')) + ".debug";
+
+    std::string bytes;
+    for (const unsigned short word: assembly.image) {
+        bytes += static_cast<char>(word & 0xFF);
+        bytes += static_cast<char>(word >> 8);
+    }
+    std::ofstream bin(output, std::ios::binary);
+    bin.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    std::ofstream listing(debug);
+    listing << assembly.debugText();
+    if (!bin || !listing) {
+        fprintf(stderr, "Failed to write %s\n", output.c_str());
+        return 1;
+    }
+    printf("%s: %zu instructions, %zu words\n", output.c_str(), assembly.source_map.size(), assembly.image.size());
+    return 0;
+}
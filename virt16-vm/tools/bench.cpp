@@ -0,0 +1,450 @@
+//
+// Benchmark suite for the Virt16 execution engines.
+//
+// Runs a corpus of small kernels (arithmetic, memory copy, CALL/RET, PUSH/POP, display fill) on every
+// engine and reports millions of Virt16 instructions per second (MIPS) together with the dynamic
+// opcode mix of each kernel. Results can be saved as JSON and compared against a previous run.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "vm/coverage.h"
+#include "vm/opcodes.h"
+#include "vm/rom.h"
+#include "vm/virt16.h"
+
+using Virt16::Registers;
+
+struct Kernel {
+    std::string name;
+    std::string description;
+    std::vector<unsigned short> words; // Loaded at address 0
+    std::shared_ptr<Virt16::RomImage> image = nullptr; // Set for ROMs from the command line, booted instead of words
+};
+
+// Tiny encoder, see the opcode table in vm/opcodes.h
+class Program {
+public:
+    std::vector<unsigned short> words;
+
+    unsigned short here() const { return static_cast<unsigned short>(this->words.size()); }
+
+    Program &op(const unsigned opcode, const unsigned x = 0, const unsigned y = 0, const unsigned z = 0,
+                const unsigned imm = 0) {
+        const unsigned int instr = (opcode << 27) | (x << 22) | (y << 17) | (z << 12) | (imm & 0xFFFF);
+        this->words.push_back(static_cast<unsigned short>(instr >> 16));
+        this->words.push_back(static_cast<unsigned short>(instr));
+        return *this;
+    }
+
+    Program &load(const Registers x, const unsigned imm) { return this->op(LOAD_IMM, x, 0, 0, imm); }
+
+    // Jumps land on addr + 2, this takes the address of the instruction to continue with
+    Program &jump(const unsigned opcode, const unsigned short target) {
+        return this->op(opcode, 0, 0, 0, static_cast<unsigned short>(target - 2));
+    }
+
+    // Forward CALL, patched with resolve()
+    unsigned short call_later() {
+        const unsigned short at = this->here();
+        this->op(CALL);
+        return at;
+    }
+
+    void resolve(const unsigned short at, const unsigned short target) { this->words[at + 1] = target; }
+};
+
+static Kernel arithmetic() {
+    using namespace Virt16;
+    Program p;
+    p.load(R4, 3).load(R6, 0x8000).load(R7, 0x00FF);
+    const unsigned short loop = p.here();
+    p.op(INC, R1)
+            .op(XOR, R2, R2, R1)
+            .op(SHL, R3, R1, R4)
+            .op(OR, R3, R3, R2)
+            .op(AND, R5, R3, R7)
+            .op(NOT, R8, R5)
+            .op(SHR, R9, R8, R4)
+            .op(DEC, R10)
+            .op(MOV, R11, R9)
+            .op(CMP, R1, R6)
+            .jump(JG, loop)
+            .jump(JMP, loop);
+    return {"arith", "INC/XOR/SHL/OR/AND/NOT/SHR/DEC/MOV/CMP loop", p.words};
+}
+
+static Kernel memcopy() {
+    using namespace Virt16;
+    // POP is the only way to read memory through a register, SP walks the source block
+    Program p;
+    p.load(SP, 0x4000).load(R2, 0x5000).load(R7, 0x0FFF).load(R8, 0x5000).load(R9, 0x4000);
+    const unsigned short loop = p.here();
+    p.op(POP, R3)
+            .op(STORE_ADDR, R2, R3)
+            .op(INC, R2)
+            .op(AND, R2, R2, R7)
+            .op(OR, R2, R2, R8)
+            .op(AND, SP, SP, R7)
+            .op(OR, SP, SP, R9)
+            .jump(JMP, loop);
+    return {"memcpy", "POP/STORE copy of a 4K word block", p.words};
+}
+
+static Kernel calls() {
+    using namespace Virt16;
+    // Binary call tree of depth 4, flags are sticky so recursion is unrolled instead of counted
+    Program p;
+    p.load(SP, 0xF000);
+    const unsigned short loop = p.here();
+    const unsigned short root = p.call_later();
+    p.jump(JMP, loop);
+    unsigned short pending[2] = {root, 0};
+    int count = 1;
+    for (int depth = 0; depth < 4; depth++) {
+        const unsigned short fn = p.here();
+        for (int i = 0; i < count; i++) {
+            p.resolve(pending[i], fn);
+        }
+        if (depth == 3) {
+            p.op(INC, R1).op(RET);
+            break;
+        }
+        pending[0] = p.call_later();
+        pending[1] = p.call_later();
+        p.op(RET);
+        count = 2;
+    }
+    return {"calls", "CALL/RET binary tree of depth 4", p.words};
+}
+
+static Kernel stack() {
+    using namespace Virt16;
+    Program p;
+    p.load(SP, 0xF000);
+    const unsigned short loop = p.here();
+    p.op(PUSH, R1).op(PUSH, R2).op(PUSH, R3).op(PUSH, R4)
+            .op(POP, R5).op(POP, R6).op(POP, R7).op(POP, R8)
+            .op(INC, R1)
+            .jump(JMP, loop);
+    return {"stack", "PUSH/POP of four registers", p.words};
+}
+
+static Kernel display() {
+    using namespace Virt16;
+    // Fills the 32x32 display at DISP with a moving pattern
+    Program p;
+    p.op(MOV, R8, DISP).op(MOV, R1, DISP).load(R7, 0x03FF).load(R9, 0xE000);
+    const unsigned short loop = p.here();
+    p.op(STORE_ADDR, R1, R2)
+            .op(INC, R1)
+            .op(ADD, R9, R2, R1) // Sum written to the scratch words at 0xE000
+            .op(INC, R2)
+            .op(AND, R1, R1, R7)
+            .op(OR, R1, R1, R8)
+            .jump(JMP, loop);
+    return {"display", "STORE fill of the DISP region", p.words};
+}
+
+static Kernel clear() {
+    using namespace Virt16;
+    // CLEAR_SCREEN of assembler/test.asm with the register saves around its call. CMP flags are sticky, so after
+    // the first call the loop only runs once.
+    Program p;
+    p.load(SP, 0xF000);
+    const unsigned short loop = p.here();
+    p.op(PUSH, R0).op(PUSH, R1).op(PUSH, A)
+            .load(A, 0xFF).op(MOV, R0, DISP).load(R1, 0);
+    const unsigned short call = p.call_later();
+    p.op(POP, A).op(POP, R1).op(POP, R0)
+            .jump(JMP, loop);
+    const unsigned short fn = p.here();
+    p.resolve(call, fn);
+    p.op(STORE_ADDR, R0, R1)
+            .op(INC, R0)
+            .op(DEC, A)
+            .op(CMP, A, R1)
+            .jump(JNE, fn)
+            .op(RET);
+    return {"clear", "test.asm CLEAR_SCREEN call with its PUSH/POP saves", p.words};
+}
+
+static std::vector<Kernel> corpus() {
+    return {arithmetic(), memcopy(), calls(), stack(), display(), clear()};
+}
+
+static bool load_rom(const char *path, Kernel &out) {
+    out.image = std::make_shared<Virt16::RomImage>();
+    if (!out.image->open(path)) {
+        fprintf(stderr, "%s\n", out.image->getError().c_str());
+        return false;
+    }
+    out.name = path;
+    out.description = out.image->hasHeader() ? "ROM image" : "raw ROM image";
+    return true;
+}
+
+static void load_kernel(Virt16::virt16 &vm, const Kernel &kernel, const unsigned short disp) {
+    vm.reset();
+    if (kernel.image) {
+        kernel.image->load(vm);
+        if (!kernel.image->hasHeader()) {
+            vm.setDisp(disp);
+        }
+        return;
+    }
+    vm.setDisp(disp);
+    for (size_t i = 0; i < kernel.words.size() && i < MEMORY_SIZE; i++) {
+        vm.setMemory(static_cast<unsigned int>(i), kernel.words[i]);
+    }
+}
+
+static const char *opcode_groups[] = {"alu", "memory", "branch", "call", "stack", "other"};
+
+static int opcode_group(const unsigned opcode) {
+    switch (opcode) {
+        case LOAD_IMM: case MOV: case INC: case DEC: case AND: case OR: case XOR: case NOT: case SHL: case SHR: case CMP:
+            return 0;
+        case LOAD_ADDR: case STORE_ADDR: case ADD: case SUB:
+            return 1;
+        case JMP: case JZ: case JE: case JNE: case JG: case JL:
+            return 2;
+        case CALL: case RET:
+            return 3;
+        case PUSH: case POP:
+            return 4;
+        default:
+            return 5;
+    }
+}
+
+// Dynamic opcode mix in percent per group, measured by single stepping
+static std::vector<double> opcode_mix(Virt16::virt16 &vm, const Kernel &kernel, const unsigned short disp,
+                                      const unsigned long long instructions) {
+    load_kernel(vm, kernel, disp);
+    vm.setEngine(Virt16::Engine::Switch);
+    unsigned long long counts[std::size(opcode_groups)]{};
+    unsigned long long total = 0;
+    for (; total < instructions; total++) {
+        const unsigned opcode = vm.getMemory(vm.getPC()) >> 11;
+        if (vm.run(1) == 0 || !vm.isRunning()) {
+            break;
+        }
+        counts[opcode_group(opcode)]++;
+    }
+    std::vector<double> mix;
+    for (const unsigned long long count: counts) {
+        mix.push_back(total ? 100.0 * static_cast<double>(count) / static_cast<double>(total) : 0);
+    }
+    return mix;
+}
+
+// Median MIPS over the repetitions, every repetition starts from a freshly loaded kernel
+static double measure(Virt16::virt16 &vm, const Kernel &kernel, const Virt16::Engine engine,
+                      const unsigned short disp, const unsigned long long cycles, const int repeat, const bool fuse) {
+    std::vector<double> samples;
+    for (int i = 0; i < repeat; i++) {
+        load_kernel(vm, kernel, disp);
+        vm.setEngine(engine);
+        vm.setFusion(fuse);
+        const auto start = std::chrono::steady_clock::now();
+        const unsigned long long executed = vm.run(cycles);
+        const auto end = std::chrono::steady_clock::now();
+        const double seconds = std::chrono::duration<double>(end - start).count();
+        samples.push_back(seconds > 0 ? static_cast<double>(executed) / seconds / 1e6 : 0);
+    }
+    std::sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+}
+
+// Reads the "results" object written by save_json(), keys are "kernel/engine"
+static bool load_baseline(const char *path, std::map<std::string, double> &out) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        return false;
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    const std::string text = buffer.str();
+    size_t pos = text.find("\"results\"");
+    if (pos == std::string::npos) {
+        return false;
+    }
+    pos = text.find('{', pos);
+    const size_t end = text.find('}', pos);
+    while (pos != std::string::npos && pos < end) {
+        const size_t key_begin = text.find('"', pos);
+        if (key_begin == std::string::npos || key_begin > end) {
+            break;
+        }
+        const size_t key_end = text.find('"', key_begin + 1);
+        const size_t colon = text.find(':', key_end);
+        out[text.substr(key_begin + 1, key_end - key_begin - 1)] = std::strtod(text.c_str() + colon + 1, nullptr);
+        pos = text.find(',', colon);
+    }
+    return true;
+}
+
+static bool save_json(const char *path, const std::vector<Kernel> &kernels,
+                      const std::vector<std::vector<double>> &mixes, const std::map<std::string, double> &results,
+                      const unsigned long long cycles) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "{\n  \"cycles\": %llu,\n  \"mix\": {\n", cycles);
+    for (size_t k = 0; k < kernels.size(); k++) {
+        fprintf(file, "    \"%s\": {", kernels[k].name.c_str());
+        for (size_t g = 0; g < std::size(opcode_groups); g++) {
+            fprintf(file, "%s\"%s\": %.1f", g ? ", " : "", opcode_groups[g], mixes[k][g]);
+        }
+        fprintf(file, "}%s\n", k + 1 < kernels.size() ? "," : "");
+    }
+    fprintf(file, "  },\n  \"results\": {\n");
+    size_t i = 0;
+    for (const auto &[key, mips]: results) {
+        fprintf(file, "    \"%s\": %.2f%s\n", key.c_str(), mips, ++i < results.size() ? "," : "");
+    }
+    fprintf(file, "  }\n}\n");
+    fclose(file);
+    return true;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [options] [rom.bin|rom.v16 ...]\n"
+            "  -c, --cycles N        Instructions per run (default: 20000000)\n"
+            "  -r, --repeat N        Runs per kernel and engine, the median is reported (default: 5)\n"
+            "  -e, --engine NAME     Only benchmark this engine (may be repeated)\n"
+            "  -k, --kernel NAME     Only run this kernel (may be repeated)\n"
+            "  -F, --fuse            Run with superinstructions, see virt16::setFusion()\n"
+            "  -C, --coverage        Count coverage like virt16-fuzz, every engine runs the switch engine\n"
+            "  -o, --json FILE       Write the results as JSON\n"
+            "  -b, --baseline FILE   Compare against a JSON file written by --json\n"
+            "  -h, --help            Show this help\n"
+            "ROM images given on the command line are benchmarked after the built-in kernels.\n",
+            argv0);
+}
+
+int main(int argc, char **argv) {
+    unsigned long long cycles = 20000000;
+    unsigned long long repeat = 5;
+    std::vector<Virt16::Engine> engines;
+    std::vector<std::string> only;
+    const char *json = nullptr;
+    const char *baseline_path = nullptr;
+    bool fuse = false;
+    std::unique_ptr<Virt16::Coverage> coverage;
+    std::vector<Kernel> kernels = corpus();
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        char *end = nullptr;
+        if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+            usage(argv[0]);
+            return 0;
+        }
+        if ((!strcmp(arg, "-c") || !strcmp(arg, "--cycles")) && has_value) {
+            cycles = std::strtoull(argv[++i], &end, 0);
+            if (*end || cycles == 0) {
+                fprintf(stderr, "Invalid cycle count: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-r") || !strcmp(arg, "--repeat")) && has_value) {
+            repeat = std::strtoull(argv[++i], &end, 0);
+            if (*end || repeat == 0) {
+                fprintf(stderr, "Invalid repeat count: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-e") || !strcmp(arg, "--engine")) && has_value) {
+            const char *name = argv[++i];
+            const auto it = std::find_if(std::begin(Virt16::engine_names), std::end(Virt16::engine_names),
+                                         [name](const char *n) { return !strcmp(n, name); });
+            if (it == std::end(Virt16::engine_names)) {
+                fprintf(stderr, "Unknown engine: %s\n", name);
+                return 1;
+            }
+            engines.push_back(static_cast<Virt16::Engine>(it - std::begin(Virt16::engine_names)));
+        } else if (!strcmp(arg, "-F") || !strcmp(arg, "--fuse")) {
+            fuse = true;
+        } else if (!strcmp(arg, "-C") || !strcmp(arg, "--coverage")) {
+            coverage = std::make_unique<Virt16::Coverage>();
+        } else if ((!strcmp(arg, "-k") || !strcmp(arg, "--kernel")) && has_value) {
+            only.emplace_back(argv[++i]);
+        } else if ((!strcmp(arg, "-o") || !strcmp(arg, "--json")) && has_value) {
+            json = argv[++i];
+        } else if ((!strcmp(arg, "-b") || !strcmp(arg, "--baseline")) && has_value) {
+            baseline_path = argv[++i];
+        } else if (arg[0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            Kernel rom;
+            if (!load_rom(arg, rom)) {
+                return 1;
+            }
+            kernels.push_back(rom);
+        }
+    }
+    if (engines.empty()) {
+        for (size_t e = 0; e < std::size(Virt16::engine_names); e++) {
+            engines.push_back(static_cast<Virt16::Engine>(e));
+        }
+    }
+    if (!only.empty()) {
+        std::erase_if(kernels, [&](const Kernel &k) {
+            return std::find(only.begin(), only.end(), k.name) == only.end();
+        });
+    }
+
+    std::map<std::string, double> baseline;
+    if (baseline_path && !load_baseline(baseline_path, baseline)) {
+        fprintf(stderr, "Failed to read baseline: %s\n", baseline_path);
+        return 1;
+    }
+
+    const auto vm = std::make_unique<Virt16::virt16>();
+    vm->setCoverage(coverage.get());
+    const unsigned short disp = 0x3000;
+
+    std::vector<std::vector<double>> mixes;
+    std::map<std::string, double> results;
+    printf("%-10s %-10s %10s %10s   %s\n", "kernel", "engine", "MIPS", "baseline", "mix (alu/mem/branch/call/stack/other %)");
+    for (const Kernel &kernel: kernels) {
+        const std::vector<double> mix = opcode_mix(*vm, kernel, disp, 100000);
+        mixes.push_back(mix);
+        char mix_text[128];
+        snprintf(mix_text, sizeof(mix_text), "%.0f/%.0f/%.0f/%.0f/%.0f/%.0f", mix[0], mix[1], mix[2], mix[3], mix[4],
+                 mix[5]);
+        for (const Virt16::Engine engine: engines) {
+            const char *engine_name = Virt16::engine_names[static_cast<int>(engine)];
+            const double mips = measure(*vm, kernel, engine, disp, cycles, static_cast<int>(repeat), fuse);
+            const std::string key = kernel.name + "/" + engine_name;
+            results[key] = mips;
+
+            char base_text[32] = "-";
+            if (const auto it = baseline.find(key); it != baseline.end() && it->second > 0) {
+                snprintf(base_text, sizeof(base_text), "%+.1f%%", 100.0 * (mips / it->second - 1.0));
+            }
+            printf("%-10s %-10s %10.1f %10s   %s\n", kernel.name.c_str(), engine_name, mips, base_text, mix_text);
+            fflush(stdout);
+        }
+    }
+
+    if (json && !save_json(json, kernels, mixes, results, cycles)) {
+        fprintf(stderr, "Failed to write %s\n", json);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,33 @@
+#
+# Runs the command lines FIRST and SECOND (CMake lists) and fails unless both exit with the same status and print
+# the same machine state. Summary lines with cycle counts, timings and file sizes are left out. Used by the ctest
+# checks, e.g.
+#   cmake "-DFIRST=virt16-run;-c;700;test.asm" "-DSECOND=virt16-run;-c;1000;-B;300;test.asm" -P compare.cmake
+#
+
+foreach (side FIRST SECOND)
+    execute_process(COMMAND ${${side}} RESULT_VARIABLE status OUTPUT_VARIABLE output ERROR_VARIABLE error)
+    string(REPLACE ";" " " ${side}_command "${${side}}")
+    # virt16-run exits with 1 on errors, 0, 2 and 3 say how the run stopped
+    if (NOT status MATCHES "^[023]$")
+        message(FATAL_ERROR "${${side}_command} failed (${status}):\n${error}")
+    endif ()
+    string(REGEX REPLACE "[^\n]* cycles in [^\n]*\n" "" output "${output}")
+    string(REGEX REPLACE "(Stepped back|State:|Trace:) [^\n]*\n" "" output "${output}")
+    set(${side}_status ${status})
+    set(${side}_output "${output}")
+endforeach ()
+
+if (NOT FIRST_status STREQUAL SECOND_status)
+    message(FATAL_ERROR "Exit status ${FIRST_status} of ${FIRST_command} differs from ${SECOND_status} of "
+            "${SECOND_command}")
+endif ()
+if (NOT FIRST_output STREQUAL SECOND_output)
+    string(REPLACE "\n" ";" first_lines "${FIRST_output}")
+    string(REPLACE "\n" ";" second_lines "${SECOND_output}")
+    foreach (first second IN ZIP_LISTS first_lines second_lines)
+        if (NOT first STREQUAL second)
+            message(FATAL_ERROR "${FIRST_command}\n  ${first}\n${SECOND_command}\n  ${second}")
+        endif ()
+    endforeach ()
+endif ()
@@ -0,0 +1,219 @@
+//
+// Differential co-simulation of the execution engines.
+//
+// Runs every ROM on each candidate engine in lockstep with a reference VM driven by step() and reports
+// the first instruction after which they disagree, see vm/cosim.h. ROMs and engines are checked in
+// parallel, one CoSim per pair.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "vm/assembler.h"
+#include "vm/cosim.h"
+#include "vm/rom.h"
+#include "vm/virt16.h"
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [options] <rom.bin|rom.v16|source.asm> [...]\n"
+            "  -c, --cycles N        Compare at most N cycles per ROM (default: until HLT)\n"
+            "  -d, --disp ADDR       Initial value of the DISP register (default: 0x3000, or the one\n"
+            "                        in the header of a .v16 image)\n"
+            "  -e, --engine NAME     Engine to check against step(): switch, threaded, jit (may be repeated,\n"
+            "                        default: threaded and jit)\n"
+            "  -F, --fuse            Run the candidates with superinstructions, see virt16::setFusion()\n"
+            "  -j, --jobs N          Worker threads (default: one per core)\n"
+            "  -Q, --quantum N       Instructions per compared round (default: %llu)\n"
+            "  -q, --quiet           Only print divergences and the summary line\n"
+            "  -w, --writes          Also compare the order and values of the memory writes of each round,\n"
+            "                        the candidate's memory accesses then take the slow path\n"
+            "  -h, --help            Show this help\n"
+            "Registers, flags, PC, counters and written memory are compared after every round, a divergence\n"
+            "is narrowed down to the first instruction that differs and listed with the reference\n"
+            "instructions and writes leading up to it.\n"
+            "Numbers may be given in decimal or hexadecimal (0x prefix).\n"
+            "Exit status: 0 every engine agrees with step(), 2 divergence, 1 error.\n",
+            argv0, Virt16::CoSim::DEFAULT_QUANTUM);
+}
+
+static bool parse_number(const char *text, unsigned long long &out) {
+    char *end = nullptr;
+    out = std::strtoull(text, &end, 0);
+    return end != text && *end == '\0';
+}
+
+static bool parse_engine(const char *text, Virt16::Engine &out) {
+    for (int i = 0; i < static_cast<int>(std::size(Virt16::engine_names)); i++) {
+        if (!strcmp(text, Virt16::engine_names[i])) {
+            out = static_cast<Virt16::Engine>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Boots a ROM image or assembles a .asm source and returns the state it starts in, invalid on error
+static Virt16::Snapshot boot(const char *path, const unsigned short disp, const bool force_disp) {
+    const auto vm = std::make_unique<Virt16::virt16>();
+    const size_t length = strlen(path);
+    if (length < 4 || strcmp(path + length - 4, ".asm") != 0) {
+        Virt16::RomImage image;
+        if (!image.open(path)) {
+            fprintf(stderr, "%s\n", image.getError().c_str());
+            return {};
+        }
+        image.load(*vm);
+        if (force_disp || !image.hasHeader()) {
+            vm->setDisp(disp);
+        }
+        return vm->snapshot();
+    }
+    const Virt16::Assembly assembly = Virt16::assembleFile(path);
+    for (const std::string &error: assembly.errors) {
+        fprintf(stderr, "%s\n", error.c_str());
+    }
+    if (!assembly.ok()) {
+        return {};
+    }
+    assembly.load(*vm);
+    vm->setDisp(disp);
+    return vm->snapshot();
+}
+
+int main(int argc, char **argv) {
+    unsigned long long max_cycles = ~0ull;
+    unsigned long long disp = 0x3000;
+    bool force_disp = false;
+    unsigned long long quantum = Virt16::CoSim::DEFAULT_QUANTUM;
+    unsigned long long jobs = 0;
+    bool quiet = false;
+    bool writes = false;
+    bool fuse = false;
+    std::vector<Virt16::Engine> engines;
+    std::vector<const char *> roms;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+            usage(argv[0]);
+            return 0;
+        }
+        if (!strcmp(arg, "-q") || !strcmp(arg, "--quiet")) {
+            quiet = true;
+        } else if (!strcmp(arg, "-w") || !strcmp(arg, "--writes")) {
+            writes = true;
+        } else if (!strcmp(arg, "-F") || !strcmp(arg, "--fuse")) {
+            fuse = true;
+        } else if ((!strcmp(arg, "-c") || !strcmp(arg, "--cycles")) && has_value) {
+            if (!parse_number(argv[++i], max_cycles)) {
+                fprintf(stderr, "Invalid cycle budget: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-d") || !strcmp(arg, "--disp")) && has_value) {
+            if (!parse_number(argv[++i], disp) || disp > 0xFFFF) {
+                fprintf(stderr, "Invalid DISP address: %s\n", argv[i]);
+                return 1;
+            }
+            force_disp = true;
+        } else if ((!strcmp(arg, "-e") || !strcmp(arg, "--engine")) && has_value) {
+            Virt16::Engine engine;
+            if (!parse_engine(argv[++i], engine)) {
+                fprintf(stderr, "Unknown engine: %s\n", argv[i]);
+                return 1;
+            }
+            if (std::find(engines.begin(), engines.end(), engine) == engines.end()) {
+                engines.push_back(engine);
+            }
+        } else if ((!strcmp(arg, "-Q") || !strcmp(arg, "--quantum")) && has_value) {
+            if (!parse_number(argv[++i], quantum) || quantum == 0) {
+                fprintf(stderr, "Invalid quantum: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-j") || !strcmp(arg, "--jobs")) && has_value) {
+            if (!parse_number(argv[++i], jobs) || jobs > 1024) {
+                fprintf(stderr, "Invalid job count: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (arg[0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            roms.push_back(arg);
+        }
+    }
+
+    if (roms.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (engines.empty()) {
+        engines = {Virt16::Engine::Threaded, Virt16::Engine::Jit};
+    }
+
+    // Every CoSim starts from the same sealed pages, so the ROMs are loaded once up front
+    std::vector<Virt16::Snapshot> starts;
+    for (const char *rom: roms) {
+        starts.push_back(boot(rom, static_cast<unsigned short>(disp), force_disp));
+        if (!starts.back().valid()) {
+            return 1;
+        }
+    }
+
+    struct Result {
+        unsigned long long cycles = 0;
+        bool halted = false;
+        bool diverged = false;
+        std::string report;
+    };
+    const size_t count = roms.size() * engines.size();
+    std::vector<Result> results(count);
+    std::atomic<size_t> next{0};
+    const auto work = [&] {
+        for (size_t job; (job = next.fetch_add(1)) < count;) {
+            Virt16::CoSim cosim(starts[job / engines.size()], engines[job % engines.size()], quantum, writes);
+            cosim.setFusion(fuse);
+            Result &result = results[job];
+            result.diverged = !cosim.run(max_cycles);
+            result.cycles = cosim.getCycles();
+            result.halted = cosim.halted();
+            result.report = cosim.getReport();
+        }
+    };
+    if (jobs == 0) {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::vector<std::thread> threads;
+    for (unsigned long long i = 1; i < std::min<unsigned long long>(jobs, count); i++) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (std::thread &thread: threads) {
+        thread.join();
+    }
+
+    size_t diverged = 0;
+    for (size_t job = 0; job < count; job++) {
+        const Result &result = results[job];
+        const char *rom = roms[job / engines.size()];
+        const char *engine = Virt16::engine_names[static_cast<int>(engines[job % engines.size()])];
+        if (result.diverged) {
+            diverged++;
+            printf("%s [%s]: diverges from step() after %llu agreeing cycles\n%s", rom, engine, result.cycles,
+                   result.report.c_str());
+        } else if (!quiet) {
+            printf("%s [%s]: %llu cycles agree, %s\n", rom, engine, result.cycles,
+                   result.halted ? "halted" : "cycle budget exhausted");
+        }
+    }
+    printf("%zu of %zu runs agree with step()\n", count - diverged, count);
+    return diverged ? 2 : 0;
+}
@@ -0,0 +1,580 @@
+//
+// Coverage-guided fuzzer for the Virt16 VM.
+//
+// An input is a stream of big-endian 32-bit instructions loaded at address 0 of zeroed memory and run by
+// run() from PC 0 for a bounded number of instructions. The interpreter counts opcode pairs, control
+// transfer shapes and PC edges into a Coverage (see coverage.h). The counters, bucketed by hit count like AFL does,
+// are the feedback. The corpus keeps, per counter, the input that reached its highest bucket, the shortest
+// one on a tie, and mutates those further. Inputs that are the best for no counter any more are dropped from
+// time to time. Every execution restores the same booted VM from a snapshot, which only replaces the pages
+// the previous input wrote. Inputs that join the corpus are also run on the other engines through a CoSim
+// with their write streams compared.
+//
+// Crashes and sanitizer reports (build with -fsanitize=address,undefined) write the input being executed to
+// a crash-* file, divergences between the engines to a divergence-* file. Seeds ending in .asm are
+// assembled, tools/regressions holds the inputs of the bugs found so far.
+// With -DVIRT16_LIBFUZZER=ON (clang) the same execution is built as a libFuzzer target instead, with the
+// coverage counters copied to libFuzzer extra counters next to the compiler's coverage of the core.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "vm/assembler.h"
+#include "vm/cosim.h"
+#include "vm/coverage.h"
+#include "vm/opcodes.h"
+#include "vm/virt16.h"
+
+namespace {
+    // Inputs up to 1024 instructions, the rest of the first 8 pages stays zero
+    constexpr size_t INPUT_LIMIT = 4096;
+    constexpr unsigned long long DEFAULT_BUDGET = 256;
+
+    // Boots one VM and replays inputs on it
+    class Target {
+    private:
+        std::unique_ptr<Virt16::virt16> vm;
+        Virt16::Snapshot boot;
+        unsigned long long budget;
+
+    public:
+        // Counters of the last execution, cleared by the caller
+        std::unique_ptr<Virt16::Coverage> coverage;
+
+        explicit Target(const unsigned long long budget)
+            : vm(std::make_unique<Virt16::virt16>()), budget(budget), coverage(std::make_unique<Virt16::Coverage>()) {
+            this->vm->setDisp(static_cast<unsigned short>(Virt16::DISPLAY_MEMORY));
+            this->boot = this->vm->snapshot();
+        }
+
+        // Puts the VM back to the boot state with the input loaded
+        void load(const unsigned char *data, const size_t size) {
+            unsigned short words[INPUT_LIMIT / 2];
+            const size_t count = std::min(size, INPUT_LIMIT) / 2;
+            for (size_t i = 0; i < count; i++) {
+                words[i] = static_cast<unsigned short>(data[2 * i] << 8 | data[2 * i + 1]);
+            }
+            this->vm->restore(this->boot);
+            this->vm->load(words, static_cast<unsigned int>(count), 0);
+        }
+
+        // Booted state with the input loaded, the VM is left there
+        Virt16::Snapshot snapshot(const unsigned char *data, const size_t size) {
+            this->load(data, size);
+            return this->vm->snapshot();
+        }
+
+        // Runs the input with its counters added to coverage, returns the instructions executed
+        unsigned long long execute(const unsigned char *data, const size_t size) {
+            this->load(data, size);
+            this->vm->setCoverage(this->coverage.get());
+            const unsigned long long executed = this->vm->run(this->budget);
+            this->vm->setCoverage(nullptr);
+            return executed;
+        }
+    };
+}
+
+#ifdef VIRT16_LIBFUZZER
+__attribute__((section("__libfuzzer_extra_counters")))
+static unsigned char counters[Virt16::Coverage::SIZE];
+
+extern "C" int LLVMFuzzerTestOneInput(const unsigned char *data, const size_t size) {
+    static Target target(DEFAULT_BUDGET);
+    target.execute(data, size);
+    // libFuzzer zeroes its extra counters before every input
+    for (const unsigned int counter: target.coverage->touched) {
+        counters[counter] = target.coverage->hits[counter];
+    }
+    target.coverage->clear();
+    return 0;
+}
+#else
+namespace {
+    // Input being executed, written out if the process dies
+    const unsigned char *current_data = nullptr;
+    size_t current_size = 0;
+    const char *artifact_prefix = "";
+
+    unsigned long long hash(const unsigned char *data, const size_t size) {
+        unsigned long long value = 0xCBF29CE484222325ull;
+        for (size_t i = 0; i < size; i++) {
+            value = (value ^ data[i]) * 0x100000001B3ull;
+        }
+        return value;
+    }
+
+    // Only async-signal-safe calls, it runs in a signal handler
+    void dump_current() {
+        if (!current_data) {
+            return;
+        }
+        char path[4096];
+        const size_t prefix = std::min(strlen(artifact_prefix), sizeof(path) - 23);
+        memcpy(path, artifact_prefix, prefix);
+        memcpy(path + prefix, "crash-", 6);
+        const unsigned long long value = hash(current_data, current_size);
+        for (int i = 0; i < 16; i++) {
+            path[prefix + 6 + i] = "0123456789abcdef"[(value >> (60 - 4 * i)) & 0xF];
+        }
+        path[prefix + 22] = '\0';
+        const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            ssize_t written = write(fd, current_data, current_size);
+            written = write(STDERR_FILENO, "virt16-fuzz: input written to ", 30);
+            written = write(STDERR_FILENO, path, strlen(path));
+            written = write(STDERR_FILENO, "\n", 1);
+            static_cast<void>(written);
+            close(fd);
+        }
+        current_data = nullptr;
+    }
+
+    void crash_handler(const int signal) {
+        dump_current();
+        std::signal(signal, SIG_DFL);
+        std::raise(signal);
+    }
+}
+
+// Sanitizer reports abort() so the input gets written, UBSan stops at the first one
+extern "C" const char *__asan_default_options() {
+    return "abort_on_error=1";
+}
+
+extern "C" const char *__ubsan_default_options() {
+    return "halt_on_error=1:abort_on_error=1:print_stacktrace=1";
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [options] [seed file or directory] [...]\n"
+            "  -a, --artifacts PREFIX  Path prefix of the crash-* and divergence-* files (default: the\n"
+            "                          current directory)\n"
+            "  -b, --budget N          Instructions per execution (default: %llu)\n"
+            "  -e, --engine NAME       Engine to check against step() on inputs that add coverage: switch,\n"
+            "                          threaded, jit (may be repeated, default: threaded and jit)\n"
+            "  -F, --fuse              Run the checked engines with superinstructions, see virt16::setFusion()\n"
+            "  -n, --runs N            Stop after N executions (default: unlimited)\n"
+            "  -N, --no-cosim          Do not check the engines\n"
+            "  -o, --corpus DIR        Write the inputs that add coverage to DIR\n"
+            "  -s, --seed N            Seed of the mutations (default: random, printed on start)\n"
+            "  -t, --time SECONDS      Stop after SECONDS (default: unlimited)\n"
+            "  -h, --help              Show this help\n"
+            "An input is a sequence of big-endian 32-bit instructions loaded at address 0 and run from PC 0,\n"
+            "at most %zu bytes are used. Seed files are read as such, raw .bin ROMs included, and .asm sources\n"
+            "are assembled. Seeds are always checked against the engines, -n 0 only replays them.\n"
+            "Numbers may be given in decimal or hexadecimal (0x prefix).\n"
+            "Exit status: 0 nothing found, 2 an engine diverged from step(), 1 error. Crashes and sanitizer\n"
+            "reports end the process after writing the input.\n",
+            argv0, DEFAULT_BUDGET, INPUT_LIMIT);
+}
+
+static bool parse_number(const char *text, unsigned long long &out) {
+    char *end = nullptr;
+    out = std::strtoull(text, &end, 0);
+    return end != text && *end == '\0';
+}
+
+static bool parse_engine(const char *text, Virt16::Engine &out) {
+    for (int i = 0; i < static_cast<int>(std::size(Virt16::engine_names)); i++) {
+        if (!strcmp(text, Virt16::engine_names[i])) {
+            out = static_cast<Virt16::Engine>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool write_file(const std::string &path, const std::vector<unsigned char> &data) {
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char *>(data.data()), static_cast<std::streamsize>(data.size()));
+    return static_cast<bool>(file.flush());
+}
+
+static std::string hex(const unsigned long long value) {
+    char text[17];
+    snprintf(text, sizeof(text), "%016llx", value);
+    return text;
+}
+
+// Hit count bucket like AFL's: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+
+static unsigned char bucket(const unsigned int hits) {
+    return static_cast<unsigned char>(hits >= 128 ? 8 : hits >= 32 ? 7 : hits >= 16 ? 6 : hits >= 8 ? 5 :
+                                      hits >= 4 ? 4 : hits);
+}
+
+// Input kept in the corpus
+struct Entry {
+    std::vector<unsigned char> data;
+    std::string name; // Hash of data, the file name in the corpus directory
+};
+
+// Mutations in the spirit of libFuzzer's, most of them on whole instructions
+class Mutator {
+private:
+    std::mt19937_64 random;
+
+    // Values that sit on the edges of the instruction semantics: carries, shift counts, the stack, vectors
+    static constexpr unsigned short INTERESTING[] = {
+            0, 1, 2, 15, 16, 31, 32, 0x7FFF, 0x8000, 0xFFFE, 0xFFFF, 0x0100, 0x28FC, 0x3000, 0x7F00
+    };
+
+public:
+    explicit Mutator(const unsigned long long seed) : random(seed) {}
+
+    size_t below(const size_t n) {
+        return n ? static_cast<size_t>(this->random() % n) : 0;
+    }
+
+    void mutate(std::vector<unsigned char> &data, const std::vector<Entry> &corpus) {
+        const unsigned int count = 1 + static_cast<unsigned int>(this->below(4));
+        for (unsigned int n = 0; n < count; n++) {
+            data.resize(data.size() & ~size_t{3});
+            const size_t instructions = data.size() / 4;
+            const size_t at = 4 * this->below(instructions);
+            switch (this->below(instructions ? 9 : 1)) {
+                case 0: {
+                    // Insert a random instruction
+                    unsigned char bytes[4];
+                    const unsigned long long value = this->random();
+                    memcpy(bytes, &value, sizeof(bytes));
+                    if (data.size() + 4 <= INPUT_LIMIT) {
+                        data.insert(data.begin() + static_cast<std::ptrdiff_t>(at), bytes, bytes + 4);
+                    }
+                    break;
+                }
+                case 1:
+                    data[at + this->below(4)] ^= static_cast<unsigned char>(1 << this->below(8));
+                    break;
+                case 2:
+                    data[at + this->below(4)] = static_cast<unsigned char>(this->random());
+                    break;
+                case 3:
+                    // Another opcode, same operands
+                    data[at] = static_cast<unsigned char>((data[at] & 0x07) | this->below(32) << 3);
+                    break;
+                case 4: {
+                    // Immediate from the table or a jump into the input
+                    const unsigned short value = this->below(2)
+                                                     ? INTERESTING[this->below(std::size(INTERESTING))]
+                                                     : static_cast<unsigned short>(2 * this->below(instructions) - 2);
+                    data[at + 2] = static_cast<unsigned char>(value >> 8);
+                    data[at + 3] = static_cast<unsigned char>(value);
+                    break;
+                }
+                case 5: {
+                    // X, Y or Z to one of the 32 register slots, Z straddles the two words
+                    unsigned int word = 0;
+                    for (int i = 0; i < 4; i++) {
+                        word = word << 8 | data[at + i];
+                    }
+                    const unsigned int shift = 22 - 5 * static_cast<unsigned int>(this->below(3));
+                    word = (word & ~(0x1Fu << shift)) | static_cast<unsigned int>(this->below(32)) << shift;
+                    for (int i = 0; i < 4; i++) {
+                        data[at + i] = static_cast<unsigned char>(word >> (24 - 8 * i));
+                    }
+                    break;
+                }
+                case 6:
+                    data.erase(data.begin() + static_cast<std::ptrdiff_t>(at),
+                               data.begin() + static_cast<std::ptrdiff_t>(at + 4));
+                    break;
+                case 7: {
+                    // Copy an instruction over another one
+                    const size_t from = 4 * this->below(instructions);
+                    std::copy_n(data.begin() + static_cast<std::ptrdiff_t>(from), 4,
+                                data.begin() + static_cast<std::ptrdiff_t>(at));
+                    break;
+                }
+                default: {
+                    // Splice: our head, the tail of another input
+                    const std::vector<unsigned char> &other = corpus[this->below(corpus.size())].data;
+                    const size_t split = 4 * this->below(other.size() / 4 + 1);
+                    data.resize(at);
+                    data.insert(data.end(), other.begin() + static_cast<std::ptrdiff_t>(split), other.end());
+                    data.resize(std::min(data.size(), INPUT_LIMIT));
+                    break;
+                }
+            }
+        }
+    }
+};
+
+int main(int argc, char **argv) {
+    unsigned long long budget = DEFAULT_BUDGET;
+    unsigned long long runs = ~0ull;
+    unsigned long long seconds = 0;
+    unsigned long long seed = std::random_device{}();
+    bool cosim = true;
+    bool fuse = false;
+    const char *corpus_dir = nullptr;
+    std::vector<Virt16::Engine> engines;
+    std::vector<const char *> seeds;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+            usage(argv[0]);
+            return 0;
+        }
+        if (!strcmp(arg, "-N") || !strcmp(arg, "--no-cosim")) {
+            cosim = false;
+        } else if (!strcmp(arg, "-F") || !strcmp(arg, "--fuse")) {
+            fuse = true;
+        } else if ((!strcmp(arg, "-a") || !strcmp(arg, "--artifacts")) && has_value) {
+            artifact_prefix = argv[++i];
+        } else if ((!strcmp(arg, "-o") || !strcmp(arg, "--corpus")) && has_value) {
+            corpus_dir = argv[++i];
+        } else if ((!strcmp(arg, "-b") || !strcmp(arg, "--budget")) && has_value) {
+            if (!parse_number(argv[++i], budget) || budget == 0) {
+                fprintf(stderr, "Invalid instruction budget: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-n") || !strcmp(arg, "--runs")) && has_value) {
+            if (!parse_number(argv[++i], runs)) {
+                fprintf(stderr, "Invalid run count: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-t") || !strcmp(arg, "--time")) && has_value) {
+            if (!parse_number(argv[++i], seconds)) {
+                fprintf(stderr, "Invalid time limit: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-s") || !strcmp(arg, "--seed")) && has_value) {
+            if (!parse_number(argv[++i], seed)) {
+                fprintf(stderr, "Invalid seed: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-e") || !strcmp(arg, "--engine")) && has_value) {
+            Virt16::Engine engine;
+            if (!parse_engine(argv[++i], engine)) {
+                fprintf(stderr, "Unknown engine: %s\n", argv[i]);
+                return 1;
+            }
+            if (std::find(engines.begin(), engines.end(), engine) == engines.end()) {
+                engines.push_back(engine);
+            }
+        } else if (arg[0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            seeds.push_back(arg);
+        }
+    }
+    if (engines.empty()) {
+        engines = {Virt16::Engine::Threaded, Virt16::Engine::Jit};
+    }
+    if (corpus_dir) {
+        std::error_code error;
+        std::filesystem::create_directories(corpus_dir, error);
+        if (error) {
+            fprintf(stderr, "Cannot create %s\n", corpus_dir);
+            return 1;
+        }
+        seeds.push_back(corpus_dir);
+    }
+
+    std::vector<std::vector<unsigned char>> inputs;
+    bool assembled = true;
+    const auto read_seed = [&](const std::filesystem::path &path) {
+        std::vector<unsigned char> data;
+        if (path.extension() == ".asm") {
+            const Virt16::Assembly assembly = Virt16::assembleFile(path.string().c_str());
+            for (const std::string &error: assembly.errors) {
+                fprintf(stderr, "%s\n", error.c_str());
+            }
+            assembled &= assembly.ok();
+            for (const unsigned short word: assembly.image) {
+                data.push_back(static_cast<unsigned char>(word >> 8));
+                data.push_back(static_cast<unsigned char>(word));
+            }
+        } else {
+            std::ifstream file(path, std::ios::binary);
+            data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        }
+        data.resize(std::min(data.size(), INPUT_LIMIT));
+        inputs.push_back(std::move(data));
+    };
+    for (const char *path: seeds) {
+        std::error_code error;
+        if (std::filesystem::is_directory(path, error)) {
+            for (const auto &entry: std::filesystem::directory_iterator(path, error)) {
+                if (entry.is_regular_file()) {
+                    read_seed(entry.path());
+                }
+            }
+        } else if (std::filesystem::is_regular_file(path, error)) {
+            read_seed(path);
+        } else {
+            fprintf(stderr, "Cannot read %s\n", path);
+            return 1;
+        }
+    }
+    if (!assembled) {
+        return 1;
+    }
+    if (inputs.empty()) {
+        inputs.emplace_back(); // Zeroed memory runs LOAD R0, #0 until the budget runs out
+    }
+
+    // Signals a sanitizer already handles end in its report and abort()
+    for (const int signal: {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT}) {
+        struct sigaction current{};
+        if (sigaction(signal, nullptr, &current) == 0 && current.sa_handler == SIG_DFL) {
+            std::signal(signal, crash_handler);
+        }
+    }
+
+    fprintf(stderr, "virt16-fuzz: seed %llu, %zu seed inputs, budget %llu instructions\n", seed, inputs.size(),
+            budget);
+    Target target(budget);
+    Virt16::Coverage &coverage = *target.coverage;
+    Mutator mutator(seed);
+    // Best input per counter so far: the highest bucket it reached, the shortest input on a tie
+    struct Best {
+        unsigned int entry;
+        unsigned char bucket;
+    };
+    constexpr unsigned int NONE = ~0u;
+    std::vector<Best> best(Virt16::Coverage::SIZE, {NONE, 0});
+    std::vector<unsigned int> covered; // Counters with a best input
+    std::vector<Entry> corpus;
+    size_t culled = 0; // Corpus size after the last cull
+    unsigned long long executions = 0;
+    unsigned long long instructions = 0;
+    const auto start = std::chrono::steady_clock::now();
+    auto report_at = start;
+
+    const auto improves = [&](const Best &current, const unsigned char reached, const size_t size) {
+        return current.entry == NONE || reached > current.bucket ||
+               (reached == current.bucket && size < corpus[current.entry].data.size());
+    };
+
+    // Drops the inputs that are no longer the best for any counter
+    const auto cull = [&] {
+        std::vector<unsigned int> index(corpus.size(), NONE);
+        for (const unsigned int counter: covered) {
+            index[best[counter].entry] = 0;
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < corpus.size(); i++) {
+            if (index[i] == NONE) {
+                if (corpus_dir) {
+                    std::error_code error;
+                    std::filesystem::remove(std::string(corpus_dir) + "/" + corpus[i].name, error);
+                }
+                continue;
+            }
+            index[i] = static_cast<unsigned int>(kept);
+            if (kept != i) {
+                corpus[kept] = std::move(corpus[i]);
+            }
+            kept++;
+        }
+        corpus.resize(kept);
+        for (const unsigned int counter: covered) {
+            best[counter].entry = index[best[counter].entry];
+        }
+        culled = corpus.size();
+    };
+
+    // Runs data and keeps it if it improves the best input of a counter. Inputs kept, and every input with
+    // check, are compared between the engines. Returns false if an engine diverged.
+    const auto run = [&](const std::vector<unsigned char> &data, const bool check) {
+        current_data = data.data();
+        current_size = data.size();
+        instructions += target.execute(data.data(), data.size());
+        current_data = nullptr;
+        executions++;
+
+        bool fresh = false;
+        for (const unsigned int counter: coverage.touched) {
+            fresh |= improves(best[counter], bucket(coverage.hits[counter]), data.size());
+        }
+        const std::string name = fresh || check ? hex(hash(data.data(), data.size())) : std::string();
+        if (fresh) {
+            const auto entry = static_cast<unsigned int>(corpus.size());
+            for (const unsigned int counter: coverage.touched) {
+                const unsigned char reached = bucket(coverage.hits[counter]);
+                if (best[counter].entry == NONE) {
+                    covered.push_back(counter);
+                }
+                if (improves(best[counter], reached, data.size())) {
+                    best[counter] = {entry, reached};
+                }
+            }
+            corpus.push_back({data, name});
+            if (corpus_dir && !write_file(std::string(corpus_dir) + "/" + name, data)) {
+                fprintf(stderr, "Cannot write %s/%s\n", corpus_dir, name.c_str());
+            }
+        }
+        coverage.clear();
+        if (!cosim || (!fresh && !check)) {
+            return true;
+        }
+        const Virt16::Snapshot state = target.snapshot(data.data(), data.size());
+        for (const Virt16::Engine engine: engines) {
+            Virt16::CoSim lockstep(state, engine, Virt16::CoSim::DEFAULT_QUANTUM, true);
+            lockstep.setFusion(fuse);
+            if (!lockstep.run(budget)) {
+                const std::string divergence = std::string(artifact_prefix) + "divergence-" + name;
+                write_file(divergence, data);
+                printf("%s diverges from step(), input written to %s\n%s",
+                       Virt16::engine_names[static_cast<int>(engine)], divergence.c_str(),
+                       lockstep.getReport().c_str());
+                return false;
+            }
+        }
+        return true;
+    };
+
+    bool diverged = false;
+    // Seeds are always checked, they include the regression inputs. Every execution runs an instruction, so
+    // the first one always joins the corpus.
+    for (size_t i = 0; i < inputs.size() && !diverged; i++) {
+        diverged = !run(inputs[i], true);
+    }
+    std::vector<unsigned char> data;
+    while (!diverged && executions < runs) {
+        data = corpus[mutator.below(corpus.size())].data;
+        mutator.mutate(data, corpus);
+        diverged = !run(data, false);
+
+        if ((executions & 0xFFF) == 0) {
+            if (corpus.size() > culled + culled / 4) {
+                cull();
+            }
+            const auto now = std::chrono::steady_clock::now();
+            const double elapsed = std::chrono::duration<double>(now - start).count();
+            if (now - report_at >= std::chrono::seconds(1)) {
+                report_at = now;
+                fprintf(stderr, "#%llu  cov: %zu  corp: %zu  exec/s: %.0f  MIPS: %.1f\n", executions,
+                        covered.size(), corpus.size(), executions / elapsed, instructions / elapsed / 1e6);
+            }
+            if (seconds && elapsed >= static_cast<double>(seconds)) {
+                break;
+            }
+        }
+    }
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cull();
+    fprintf(stderr, "Done: %llu executions in %.1f s (%.0f/s), %zu counters, %zu inputs in the corpus\n",
+            executions, elapsed, executions / elapsed, covered.size(), corpus.size());
+    return diverged ? 2 : 0;
+}
+#endif
@@ -0,0 +1,17 @@
+; ADD and SUB results that do not fit 16 bits set C on every engine, the JIT left it clear. Only the 16th
+; run of the loop carries, by then the JIT runs it. Nothing but a reset clears C.
+
+.main:
+    LOAD R0, #0
+    LOAD R1, #0xFFEF
+    LOAD R2, #1
+    LOAD R3, #0x4000
+    LOAD A, #20
+.CARRY:
+    NOP ; Jumps continue after the instruction at the label
+    INC R1
+    ADD R3, R1, R2
+    DEC A
+    CMP A, R0
+    JNE .CARRY
+    HLT
@@ -0,0 +1,26 @@
+; SHL/SHR with counts of 16 and more give 0 on every engine. The interpreters shifted by the whole register
+; value, undefined from 32 on, and the JIT masked the count to 5 bits, so 33 shifted by 1. The loop runs
+; often enough for the JIT to translate it.
+
+.main:
+    LOAD R0, #0
+    LOAD R1, #0x8001
+    LOAD A, #8
+.SHIFT:
+    NOP ; Jumps continue after the instruction at the label
+    LOAD R2, #16
+    SHL R3, R1, R2
+    SHR R4, R1, R2
+    LOAD R2, #32
+    SHL R5, R1, R2
+    SHR R6, R1, R2
+    LOAD R2, #33
+    SHL R7, R1, R2
+    SHR R8, R1, R2
+    LOAD R2, #0xFFFF
+    SHL R9, R1, R2
+    SHR R10, R1, R2
+    DEC A
+    CMP A, R0
+    JNE .SHIFT
+    HLT
@@ -0,0 +1,9 @@
+; The spare encodings 0x1D-0x1F run as NOP on every engine. They used to print "Invalid opcode" to stdout on
+; every execution, run this with the output visible. The words at 0x100 are the three spare opcodes, then
+; STORE R0, R1 and HLT.
+.PLACE ARRAY 100 [E800 0000 F000 0000 F800 0000 1002 0000 C800 0000]
+
+.main:
+    LOAD R0, #0x4000
+    LOAD R1, #0x1234
+    JMP 0x0100
@@ -0,0 +1,622 @@
+//
+// Headless runner for the Virt16 VM.
+//
+// Loads a ROM, runs it until HLT or until the cycle budget is exhausted and dumps
+// the machine state. Does not depend on GLFW/OpenGL/ImGui so it can be used in CI.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "vm/assembler.h"
+#include "vm/bus.h"
+#include "vm/clock.h"
+#include "vm/history.h"
+#include "vm/pool.h"
+#ifdef VIRT16_PROFILE
+#include "vm/profile.h"
+#endif
+#include "vm/rom.h"
+#include "vm/savestate.h"
+#include "vm/trace.h"
+#include "vm/virt16.h"
+
+struct MemoryRange {
+    unsigned int begin;
+    unsigned int end; // Inclusive
+};
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [options] <rom.bin|rom.v16|source.asm> [...]\n"
+            "  -B, --back N          Step back N instructions before the state is dumped, through the checkpoints\n"
+            "                        and write journal of vm/history.h. --save and --trace end where the run\n"
+            "                        did (single ROM only)\n"
+            "  -b, --break ADDR[:IF] Stop in front of the instruction at ADDR, optionally only while a condition\n"
+            "                        like R3==5, SP<0x100, Z or !E holds (may be repeated, single ROM only)\n"
+            "  -c, --cycles N        Stop after N cycles (default: run until HLT)\n"
+            "  -C, --checkpoint N    With --save, save every N cycles: FILE in full first, then the pages changed\n"
+            "                        since into FILE.inc\n"
+            "  -d, --disp ADDR       Initial value of the DISP register (default: 0x3000, or the one\n"
+            "                        in the header of a .v16 image)\n"
+            "  -e, --engine NAME     Execution engine: switch, threaded, jit (default: switch)\n"
+            "  -F, --fuse            Let the threaded engine run superinstructions, see virt16::setFusion()\n"
+            "  -j, --jobs N          Worker threads when several ROMs are given (default: one per core)\n"
+            "  -k, --clock HZ        Pace the run to HZ clock ticks per second (default: unthrottled,\n"
+            "                        single ROM only)\n"
+            "  -m, --mem BEGIN:END   Dump memory range (inclusive, may be repeated)\n"
+#ifdef VIRT16_PROFILE
+            "  -p, --profile FILE    Write a flat profile of the run to FILE, - for stdout (single ROM only)\n"
+            "  -f, --folded FILE     Write the call stacks of the run to FILE in the folded format of\n"
+            "                        flamegraph.pl (single ROM only)\n"
+#endif
+            "  -q, --quiet           Only print the summary line\n"
+            "  -r, --resume FILE     Start from a save state instead of booting the ROM, an incremental state\n"
+            "                        is loaded on top of the ones before it (may be repeated, single ROM only)\n"
+            "  -S, --save FILE       Save the state of the VM to FILE when the run ends (single ROM only)\n"
+            "  -s, --serial          Serial console: stdin is received on P3, bytes sent on P4 go to stdout\n"
+            "                        (single ROM only)\n"
+            "  -T, --timer TICKS     Raise P2 every TICKS clock ticks (single ROM only)\n"
+            "  -t, --trace FILE      Record every instruction into FILE (single ROM only), see virt16-trace\n"
+            "  -w, --watch ADDR[:rw] Stop after an instruction reads (r) or writes (w) ADDR, default rw\n"
+            "                        (may be repeated, single ROM only)\n"
+            "  -h, --help            Show this help\n"
+            "Several ROMs run side by side on a VMPool, each one gets its own VM and cycle budget.\n"
+            "Files ending in .asm are assembled in process, images with a header (virt16-asm -o rom.v16)\n"
+            "boot at their entry point with SP and DISP from the header.\n"
+            "Numbers may be given in decimal or hexadecimal (0x prefix).\n"
+            "Exit status: 0 halted or asleep on WAIT with no device left to wake it, 2 cycle budget exhausted,\n"
+            "3 stopped by a breakpoint or watchpoint, 1 error.\n",
+            argv0);
+}
+
+static bool parse_number(const char *text, unsigned long long &out) {
+    char *end = nullptr;
+    out = std::strtoull(text, &end, 0);
+    return end != text && *end == '\0';
+}
+
+static bool parse_range(const char *text, MemoryRange &out) {
+    const std::string s(text);
+    const auto sep = s.find(':');
+    if (sep == std::string::npos) {
+        return false;
+    }
+    unsigned long long begin, end;
+    if (!parse_number(s.substr(0, sep).c_str(), begin) || !parse_number(s.substr(sep + 1).c_str(), end)) {
+        return false;
+    }
+    if (begin > end || end >= MEMORY_SIZE) {
+        return false;
+    }
+    out = {static_cast<unsigned int>(begin), static_cast<unsigned int>(end)};
+    return true;
+}
+
+// ADDR[:CONDITION]
+static bool parse_breakpoint(const char *text, unsigned short &addr, Virt16::BreakCondition &condition) {
+    const std::string s(text);
+    const auto sep = s.find(':');
+    unsigned long long value;
+    if (!parse_number(s.substr(0, sep).c_str(), value) || value > 0xFFFF) {
+        return false;
+    }
+    addr = static_cast<unsigned short>(value);
+    return Virt16::BreakCondition::parse(sep == std::string::npos ? "" : s.substr(sep + 1), condition);
+}
+
+// ADDR[:r|w|rw]
+static bool parse_watchpoint(const char *text, unsigned short &addr, unsigned char &access) {
+    const std::string s(text);
+    const auto sep = s.find(':');
+    unsigned long long value;
+    if (!parse_number(s.substr(0, sep).c_str(), value) || value > 0xFFFF) {
+        return false;
+    }
+    addr = static_cast<unsigned short>(value);
+    const std::string mode = sep == std::string::npos ? "rw" : s.substr(sep + 1);
+    access = 0;
+    for (const char c: mode) {
+        if (c != 'r' && c != 'w') {
+            return false;
+        }
+        access |= c == 'r' ? Virt16::WATCH_READ : Virt16::WATCH_WRITE;
+    }
+    return access != 0;
+}
+
+static bool parse_engine(const char *text, Virt16::Engine &out) {
+    for (int i = 0; i < static_cast<int>(std::size(Virt16::engine_names)); i++) {
+        if (!strcmp(text, Virt16::engine_names[i])) {
+            out = static_cast<Virt16::Engine>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Loads a ROM image, or assembles a .asm source straight into memory. Images are opened once, so every VM
+// started from the same file shares its pages copy-on-write. DISP is set to disp unless the image header
+// provides it and force_disp is false.
+static bool load(Virt16::virt16 &vm, const char *path, const unsigned short disp, const bool force_disp) {
+    static std::map<std::string, Virt16::RomImage> images;
+    const size_t length = strlen(path);
+    if (length < 4 || strcmp(path + length - 4, ".asm") != 0) {
+        auto [image, inserted] = images.try_emplace(path);
+        if (inserted && !image->second.open(path)) {
+            fprintf(stderr, "%s\n", image->second.getError().c_str());
+            images.erase(image);
+            return false;
+        }
+        image->second.load(vm);
+        if (force_disp || !image->second.hasHeader()) {
+            vm.setDisp(disp);
+        }
+        return true;
+    }
+    const Virt16::Assembly assembly = Virt16::assembleFile(path);
+    for (const std::string &error: assembly.errors) {
+        fprintf(stderr, "%s\n", error.c_str());
+    }
+    if (!assembly.ok()) {
+        return false;
+    }
+    assembly.load(vm);
+    vm.setDisp(disp);
+    return true;
+}
+
+#ifdef VIRT16_PROFILE
+// Source lines and routine names for the profile: from the assembler for .asm sources, from the header of
+// a .v16 image, or from the .debug file next to a raw .bin
+static void describe(Virt16::Profiler &profiler, const char *path) {
+    const size_t length = strlen(path);
+    if (length >= 4 && strcmp(path + length - 4, ".asm") == 0) {
+        const Virt16::Assembly assembly = Virt16::assembleFile(path);
+        profiler.setSourceMap(assembly.source_map);
+        for (const auto &[name, addr]: assembly.labels) {
+            profiler.setLabel(addr, name);
+        }
+        return;
+    }
+    Virt16::RomImage image;
+    if (image.open(path) && !image.getSourceMap().empty()) {
+        profiler.setSourceMap(image.getSourceMap());
+        for (const Virt16::Symbol &label: image.getLabels()) {
+            profiler.setLabel(label.addr, label.name);
+        }
+        return;
+    }
+    std::string debug(path);
+    const size_t dot = debug.find_last_of('.');
+    if (dot != std::string::npos && debug.find_first_of("/\\", dot) == std::string::npos) {
+        debug.resize(dot);
+    }
+    profiler.setSourceMap(Virt16::readDebugFile((debug + ".debug").c_str()));
+}
+
+static bool write_profile(const char *path, const Virt16::Profiler &profiler, const bool folded) {
+    FILE *out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Cannot create %s\n", path);
+        return false;
+    }
+    bool ok = folded ? profiler.writeFolded(out) : profiler.writeFlat(out);
+    if (out != stdout) {
+        ok &= fclose(out) == 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Cannot write %s\n", path);
+    }
+    return ok;
+}
+#endif
+
+static void dump_registers(const Virt16::virt16 &vm) {
+    printf("PC   %04X\n", vm.getPC());
+    for (int row = Virt16::R0; row <= Virt16::P4; row++) {
+        printf("%-4s %04X%s", Virt16::register_names[row], vm.getRegister(static_cast<Virt16::Registers>(row)),
+               (row % 8 == 7) ? "\n" : "  ");
+    }
+    printf("Flags Z:%d G:%d L:%d E:%d C:%d\n",
+           vm.getFlag(Virt16::Z), vm.getFlag(Virt16::G), vm.getFlag(Virt16::L),
+           vm.getFlag(Virt16::E), vm.getFlag(Virt16::C));
+    printf("Ticks %llu\n", vm.getTicks());
+}
+
+// Runs like virt16::run(max_cycles) in batches paced by clock
+static unsigned long long run_paced(Virt16::virt16 &vm, const unsigned long long max_cycles, Virt16::Clock &clock) {
+    unsigned long long executed = 0;
+    while (executed < max_cycles) {
+        const unsigned long long due = clock.due(vm.getTicks());
+        if (due == 0) {
+            clock.wait(vm.getTicks());
+            continue;
+        }
+        const unsigned long long ran = vm.run(std::min(due, max_cycles - executed));
+        executed += ran;
+        if (!vm.isRunning() || vm.getHit().kind != Virt16::DebugHit::None) {
+            break;
+        }
+    }
+    return executed;
+}
+
+// Runs with devices on the bus. A ROM asleep on WAIT sleeps here until the serial input posts something, the
+// run ends once nothing is left to wake it.
+static unsigned long long run_devices(Virt16::virt16 &vm, const unsigned long long max_cycles, Virt16::Clock &clock,
+                                      Virt16::Bus &bus, const Virt16::Serial &serial) {
+    unsigned long long executed = 0;
+    while (executed < max_cycles) {
+        const unsigned int seen = bus.rings();
+        const unsigned long long budget = max_cycles - executed;
+        executed += clock.getFrequency() ? run_paced(vm, budget, clock) : vm.run(budget);
+        if (vm.getHit().kind != Virt16::DebugHit::None || (!vm.isRunning() && !vm.isWaiting())) {
+            break;
+        }
+        if (vm.isRunning()) {
+            continue; // Skipped ahead to a timer
+        }
+        if (!serial.isOpen() && bus.rings() == seen) {
+            break;
+        }
+        bus.sleep(seen);
+        clock.restart(vm.getTicks());
+    }
+    return executed;
+}
+
+static void dump_memory(const Virt16::virt16 &vm, const MemoryRange &range) {
+    printf("Memory 0x%04X-0x%04X\n", range.begin, range.end);
+    for (unsigned int addr = range.begin & ~0xFu; addr <= range.end; addr += 16) {
+        printf("%04X:", addr);
+        for (unsigned int col = 0; col < 16; col++) {
+            const unsigned int a = addr + col;
+            if (a < range.begin || a > range.end) {
+                printf("     ");
+            } else {
+                printf(" %04X", vm.getMemory(a));
+            }
+        }
+        printf("\n");
+    }
+}
+
+static void dump(const Virt16::virt16 &vm, const std::vector<MemoryRange> &ranges) {
+    dump_registers(vm);
+    for (const auto &range: ranges) {
+        dump_memory(vm, range);
+    }
+}
+
+static int run_pool(const std::vector<const char *> &roms, const Virt16::Engine engine, const bool fuse,
+                    const unsigned short disp, const bool force_disp, const unsigned long long max_cycles,
+                    const unsigned jobs, const bool quiet, const std::vector<MemoryRange> &ranges) {
+    std::vector<std::unique_ptr<Virt16::virt16>> vms;
+    for (const char *rom: roms) {
+        auto vm = std::make_unique<Virt16::virt16>();
+        vm->setEngine(engine);
+        vm->setFusion(fuse);
+        if (!load(*vm, rom, disp, force_disp)) {
+            return 1;
+        }
+        vms.push_back(std::move(vm));
+    }
+
+    std::vector<Virt16::VMPool::Completion> results(roms.size());
+    Virt16::VMPool pool(jobs);
+    for (size_t i = 0; i < vms.size(); i++) {
+        pool.submit(*vms[i], max_cycles, [&results, i](const Virt16::VMPool::Completion &completion, Virt16::virt16 &) {
+            results[i] = completion;
+        });
+    }
+    pool.wait();
+    const Virt16::VMPool::Stats stats = pool.stats();
+
+    bool all_halted = true;
+    for (size_t i = 0; i < roms.size(); i++) {
+        if (!quiet) {
+            printf("== %s\n", roms[i]);
+            dump(*vms[i], ranges);
+        }
+        printf("%s: %s after %llu cycles\n", roms[i], results[i].halted ? "Halted" : "Budget exhausted",
+               results[i].cycles);
+        all_halted &= results[i].halted;
+    }
+    printf("%zu ROMs on %u threads, %llu cycles in %.6f s (%.0f cycles/s, %llu slices, %llu steals)\n",
+           stats.completed, pool.threadCount(), stats.cycles, stats.seconds, stats.cycles_per_second, stats.slices,
+           stats.steals);
+    return all_halted ? 0 : 2;
+}
+
+int main(int argc, char **argv) {
+    unsigned long long max_cycles = ~0ull;
+    unsigned long long disp = 0x3000;
+    bool force_disp = false;
+    Virt16::Engine engine = Virt16::Engine::Switch;
+    bool fuse = false;
+    unsigned long long jobs = 0;
+    unsigned long long clock_hz = 0;
+    unsigned long long timer_ticks = 0;
+    bool serial_console = false;
+    bool quiet = false;
+    const char *trace_path = nullptr;
+    const char *profile_path = nullptr;
+    const char *folded_path = nullptr;
+    const char *save_path = nullptr;
+    unsigned long long checkpoint = 0;
+    unsigned long long back = 0;
+    std::vector<const char *> resume_paths;
+    std::vector<std::pair<unsigned short, Virt16::BreakCondition>> breakpoints;
+    std::vector<std::pair<unsigned short, unsigned char>> watchpoints;
+    std::vector<const char *> roms;
+    std::vector<MemoryRange> ranges;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+            usage(argv[0]);
+            return 0;
+        }
+        if (!strcmp(arg, "-q") || !strcmp(arg, "--quiet")) {
+            quiet = true;
+        } else if (!strcmp(arg, "-F") || !strcmp(arg, "--fuse")) {
+            fuse = true;
+        } else if (!strcmp(arg, "-s") || !strcmp(arg, "--serial")) {
+            serial_console = true;
+        } else if ((!strcmp(arg, "-T") || !strcmp(arg, "--timer")) && has_value) {
+            if (!parse_number(argv[++i], timer_ticks) || timer_ticks == 0) {
+                fprintf(stderr, "Invalid timer period: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-t") || !strcmp(arg, "--trace")) && has_value) {
+            trace_path = argv[++i];
+        } else if ((!strcmp(arg, "-S") || !strcmp(arg, "--save")) && has_value) {
+            save_path = argv[++i];
+        } else if ((!strcmp(arg, "-r") || !strcmp(arg, "--resume")) && has_value) {
+            resume_paths.push_back(argv[++i]);
+        } else if ((!strcmp(arg, "-C") || !strcmp(arg, "--checkpoint")) && has_value) {
+            if (!parse_number(argv[++i], checkpoint) || checkpoint == 0) {
+                fprintf(stderr, "Invalid checkpoint interval: %s\n", argv[i]);
+                return 1;
+            }
+#ifdef VIRT16_PROFILE
+        } else if ((!strcmp(arg, "-p") || !strcmp(arg, "--profile")) && has_value) {
+            profile_path = argv[++i];
+        } else if ((!strcmp(arg, "-f") || !strcmp(arg, "--folded")) && has_value) {
+            folded_path = argv[++i];
+#endif
+        } else if ((!strcmp(arg, "-B") || !strcmp(arg, "--back")) && has_value) {
+            if (!parse_number(argv[++i], back)) {
+                fprintf(stderr, "Invalid step count: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-b") || !strcmp(arg, "--break")) && has_value) {
+            auto &[addr, condition] = breakpoints.emplace_back();
+            if (!parse_breakpoint(argv[++i], addr, condition)) {
+                fprintf(stderr, "Invalid breakpoint: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-w") || !strcmp(arg, "--watch")) && has_value) {
+            auto &[addr, access] = watchpoints.emplace_back();
+            if (!parse_watchpoint(argv[++i], addr, access)) {
+                fprintf(stderr, "Invalid watchpoint: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-c") || !strcmp(arg, "--cycles")) && has_value) {
+            if (!parse_number(argv[++i], max_cycles)) {
+                fprintf(stderr, "Invalid cycle budget: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-d") || !strcmp(arg, "--disp")) && has_value) {
+            if (!parse_number(argv[++i], disp) || disp > 0xFFFF) {
+                fprintf(stderr, "Invalid DISP address: %s\n", argv[i]);
+                return 1;
+            }
+            force_disp = true;
+        } else if ((!strcmp(arg, "-e") || !strcmp(arg, "--engine")) && has_value) {
+            if (!parse_engine(argv[++i], engine)) {
+                fprintf(stderr, "Unknown engine: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-k") || !strcmp(arg, "--clock")) && has_value) {
+            if (!parse_number(argv[++i], clock_hz)) {
+                fprintf(stderr, "Invalid clock rate: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-j") || !strcmp(arg, "--jobs")) && has_value) {
+            if (!parse_number(argv[++i], jobs) || jobs > 1024) {
+                fprintf(stderr, "Invalid job count: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-m") || !strcmp(arg, "--mem")) && has_value) {
+            MemoryRange range{};
+            if (!parse_range(argv[++i], range)) {
+                fprintf(stderr, "Invalid memory range: %s\n", argv[i]);
+                return 1;
+            }
+            ranges.push_back(range);
+        } else if (arg[0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            roms.push_back(arg);
+        }
+    }
+
+    if (roms.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (checkpoint && !save_path) {
+        fprintf(stderr, "--checkpoint needs --save\n");
+        return 1;
+    }
+    if (engine == Virt16::Engine::Jit && !std::make_unique<Virt16::virt16>()->jitAvailable()) {
+        fprintf(stderr, "The JIT is not available on this host (not x86-64 or no executable memory), running the "
+                "threaded engine\n");
+    }
+    if (roms.size() > 1) {
+        if (trace_path || profile_path || folded_path || clock_hz || serial_console || timer_ticks || save_path ||
+            !resume_paths.empty() || back || !breakpoints.empty() || !watchpoints.empty()) {
+            fprintf(stderr, "--trace, --profile, --folded, --clock, --serial, --timer, --save, --resume, --back, --break "
+                    "and --watch take a single ROM\n");
+            return 1;
+        }
+        return run_pool(roms, engine, fuse, static_cast<unsigned short>(disp), force_disp, max_cycles,
+                        static_cast<unsigned>(jobs), quiet, ranges);
+    }
+    const char *rom = roms[0];
+
+    const auto vm = std::make_unique<Virt16::virt16>();
+    vm->setEngine(engine);
+    vm->setFusion(fuse);
+    if (!load(*vm, rom, static_cast<unsigned short>(disp), force_disp)) {
+        return 1;
+    }
+    Virt16::SaveState state;
+    for (const char *path: resume_paths) {
+        if (!state.load(path, *vm)) {
+            fprintf(stderr, "%s\n", state.getError().c_str());
+            return 1;
+        }
+    }
+
+    Virt16::TraceWriter trace;
+    if (trace_path) {
+        if (!trace.open(trace_path)) {
+            fprintf(stderr, "%s\n", trace.getError().c_str());
+            return 1;
+        }
+        vm->setTrace(&trace);
+    }
+#ifdef VIRT16_PROFILE
+    Virt16::Profiler profiler;
+    if (profile_path || folded_path) {
+        describe(profiler, rom);
+        vm->setProfiler(&profiler);
+    }
+#endif
+    for (const auto &[addr, condition]: breakpoints) {
+        vm->setBreakpoint(addr, condition);
+    }
+    for (const auto &[addr, access]: watchpoints) {
+        vm->setWatchpoint(addr, access);
+    }
+
+    Virt16::Bus bus;
+    Virt16::Timer timer(timer_ticks);
+    Virt16::Serial serial(Virt16::P3, Virt16::P4);
+    if (timer_ticks) {
+        bus.attach(Virt16::P2, &timer);
+    }
+    if (serial_console) {
+        bus.attach(Virt16::P3, &serial);
+        bus.attach(Virt16::P4, &serial);
+        if (!serial.open(bus, 0)) {
+            fprintf(stderr, "--serial is not supported on this host\n");
+            return 1;
+        }
+    }
+    const bool devices = timer_ticks || serial_console;
+    if (devices) {
+        vm->setBus(&bus);
+    }
+
+    // Attached last, it checkpoints the state the run starts from
+    std::unique_ptr<Virt16::History> history;
+    if (back) {
+        history = std::make_unique<Virt16::History>(*vm);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    Virt16::Clock clock;
+    clock.setFrequency(clock_hz, vm->getTicks());
+    const auto run = [&](const unsigned long long budget) {
+        return devices ? run_devices(*vm, budget, clock, bus, serial)
+               : clock_hz ? run_paced(*vm, budget, clock)
+               : history ? history->run(budget)
+               : vm->run(budget);
+    };
+    unsigned long long executed = 0;
+    bool saved = true;
+    if (checkpoint) {
+        const std::string increment = std::string(save_path) + ".inc";
+        saved = state.save(save_path, *vm);
+        while (saved) {
+            executed += run(std::min(checkpoint, max_cycles - executed));
+            saved = state.saveIncremental(increment.c_str(), *vm);
+            if (executed == max_cycles || !vm->isRunning() || vm->getHit().kind != Virt16::DebugHit::None) {
+                break;
+            }
+        }
+    } else {
+        executed = run(max_cycles);
+        if (save_path) {
+            saved = state.save(save_path, *vm);
+        }
+    }
+    const auto end = std::chrono::steady_clock::now();
+    vm->setBus(nullptr);
+#ifdef VIRT16_PROFILE
+    // Replays of --back are not part of the run
+    vm->setProfiler(nullptr);
+#endif
+    if (!saved) {
+        fprintf(stderr, "%s\n", state.getError().c_str());
+        return 1;
+    }
+
+    if (trace_path) {
+        vm->setTrace(nullptr);
+        if (!trace.close(*vm)) {
+            fprintf(stderr, "%s: %s\n", trace_path, trace.getError().c_str());
+            return 1;
+        }
+        printf("Trace: %llu bytes (%.2f bytes/cycle)\n", trace.size(),
+               executed ? static_cast<double>(trace.size()) / static_cast<double>(executed) : 0.0);
+    }
+
+    if (save_path) {
+        printf("State: %llu bytes written (%s)\n", state.size(), checkpoint ? "incremental" : "full");
+    }
+
+    if (history) {
+        const unsigned long long stepped = history->stepBack(back);
+        printf("Stepped back %llu instructions to cycle %llu\n", stepped, vm->getCycles());
+    }
+
+    const Virt16::DebugHit hit = vm->getHit();
+    const bool halted = !vm->isRunning() && hit.kind == Virt16::DebugHit::None;
+    const bool asleep = halted && vm->isWaiting();
+    const double seconds = std::chrono::duration<double>(end - start).count();
+    const double rate = seconds > 0 ? static_cast<double>(executed) / seconds : 0;
+
+    if (!quiet) {
+        dump(*vm, ranges);
+    }
+    const char *stop = asleep ? "Asleep" : halted ? "Halted" : "Budget exhausted";
+    char stop_text[64];
+    if (hit.kind != Virt16::DebugHit::None) {
+        const char *kinds[] = {"", "Breakpoint at", "Read of", "Write to"};
+        snprintf(stop_text, sizeof(stop_text), "%s 0x%04X", kinds[hit.kind], hit.addr);
+        stop = stop_text;
+    }
+    printf("%s after %llu cycles in %.6f s (%.0f cycles/s)\n", stop, executed, seconds, rate);
+
+#ifdef VIRT16_PROFILE
+    if ((profile_path && !write_profile(profile_path, profiler, false)) ||
+        (folded_path && !write_profile(folded_path, profiler, true))) {
+        return 1;
+    }
+#endif
+    return hit.kind != Virt16::DebugHit::None ? 3 : halted ? 0 : 2;
+}
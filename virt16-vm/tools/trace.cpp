@@ -0,0 +1,274 @@
+//
+// Reader for execution traces recorded with virt16-run --trace (see vm/trace.h).
+//
+// show lists the instructions of a trace with the registers, flags and memory they changed, state
+// replays a trace up to a cycle and dumps the machine state there, diff walks two traces side by side
+// and reports the first instruction where they diverge, e.g. between two versions of a ROM.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "vm/trace.h"
+#include "vm/virt16.h"
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s show [-s CYCLE] [-n COUNT] <trace>\n"
+            "       %s state [-m BEGIN:END] <trace> [CYCLE]\n"
+            "       %s diff <trace> <trace>\n"
+            "  show                  List instructions with their effects\n"
+            "  state                 Replay up to CYCLE (default: the end) and dump registers, flags and memory\n"
+            "  diff                  Report the first instruction where two traces diverge\n"
+            "  -s, --start CYCLE     First cycle to list\n"
+            "  -n, --count N         Number of instructions to list\n"
+            "  -m, --mem BEGIN:END   Dump memory range (inclusive, may be repeated)\n"
+            "Exit status: 0 success (traces identical for diff), 1 error, 2 traces differ.\n",
+            argv0, argv0, argv0);
+}
+
+static bool parse_number(const char *text, unsigned long long &out) {
+    char *end = nullptr;
+    out = std::strtoull(text, &end, 0);
+    return end != text && *end == '\0';
+}
+
+static std::string flags_text(const unsigned char flags) {
+    std::string text;
+    const char names[] = {'Z', 'G', 'L', 'E', 'C'};
+    for (int i = 0; i < 5; i++) {
+        text += (flags & (1 << i)) ? names[i] : '-';
+    }
+    return text;
+}
+
+static void print_step(const Virt16::TraceStep &step, const Virt16::TraceState &state) {
+    printf("%10llu  %04X  %-5s", step.cycle, step.pc, Virt16::opcode_names[step.opcode]);
+    for (const auto &[reg, value]: step.registers) {
+        printf("  %s=%04X", reg <= Virt16::P4 ? Virt16::register_names[reg] : "?", value);
+    }
+    for (const auto &[addr, value]: step.writes) {
+        printf("  [%04X]=%04X", addr, value);
+    }
+    if (step.flags_changed) {
+        printf("  flags=%s", flags_text(state.flags).c_str());
+    }
+    printf("\n");
+}
+
+// Stops at the end of the trace, reports a malformed one
+static bool next(Virt16::TraceReader &reader, Virt16::TraceStep &step, const char *path) {
+    if (reader.next(step)) {
+        return true;
+    }
+    if (!reader.getError().empty()) {
+        fprintf(stderr, "%s: %s\n", path, reader.getError().c_str());
+    } else if (!reader.complete()) {
+        fprintf(stderr, "%s: trace ends without an end record, the recording was cut short\n", path);
+    }
+    return false;
+}
+
+static int show(const char *path, const unsigned long long first, const unsigned long long count) {
+    Virt16::TraceReader reader;
+    if (!reader.open(path)) {
+        fprintf(stderr, "%s\n", reader.getError().c_str());
+        return 1;
+    }
+    Virt16::TraceStep step;
+    unsigned long long shown = 0;
+    while (shown < count && next(reader, step, path)) {
+        if (step.cycle >= first) {
+            print_step(step, reader.state());
+            shown++;
+        }
+    }
+    return reader.getError().empty() ? 0 : 1;
+}
+
+static int state(const char *path, const unsigned long long cycle,
+                 const std::vector<std::pair<unsigned, unsigned>> &ranges) {
+    Virt16::TraceReader reader;
+    if (!reader.open(path)) {
+        fprintf(stderr, "%s\n", reader.getError().c_str());
+        return 1;
+    }
+    Virt16::TraceStep step;
+    while (reader.state().cycles < cycle && next(reader, step, path)) {
+    }
+    if (!reader.getError().empty()) {
+        return 1;
+    }
+
+    const Virt16::TraceState &current = reader.state();
+    printf("Cycle %llu\n", current.cycles);
+    printf("PC   %04X\n", current.pc);
+    for (int row = Virt16::R0; row <= Virt16::P4; row++) {
+        printf("%-4s %04X%s", Virt16::register_names[row], current.registers[row], (row % 8 == 7) ? "\n" : "  ");
+    }
+    printf("Flags %s\n", flags_text(current.flags).c_str());
+    for (const auto &[begin, end]: ranges) {
+        printf("Memory 0x%04X-0x%04X\n", begin, end);
+        for (unsigned int addr = begin & ~0xFu; addr <= end; addr += 16) {
+            printf("%04X:", addr);
+            for (unsigned int col = 0; col < 16; col++) {
+                const unsigned int a = addr + col;
+                if (a < begin || a > end) {
+                    printf("     ");
+                } else {
+                    printf(" %04X", current.memory[a]);
+                }
+            }
+            printf("\n");
+        }
+    }
+    return 0;
+}
+
+// Describes how two states differ, empty if they are the same
+static std::string compare(const Virt16::TraceState &a, const Virt16::TraceState &b, const bool memory) {
+    std::string text;
+    char line[64];
+    for (int reg = 0; reg < 32; reg++) {
+        if (a.registers[reg] != b.registers[reg]) {
+            snprintf(line, sizeof(line), "  %s: %04X vs %04X\n",
+                     reg <= Virt16::P4 ? Virt16::register_names[reg] : "?", a.registers[reg], b.registers[reg]);
+            text += line;
+        }
+    }
+    if (a.flags != b.flags) {
+        text += "  flags: " + flags_text(a.flags) + " vs " + flags_text(b.flags) + "\n";
+    }
+    if (a.pc != b.pc) {
+        snprintf(line, sizeof(line), "  next PC: %04X vs %04X\n", a.pc, b.pc);
+        text += line;
+    }
+    int shown = 0;
+    for (unsigned int addr = 0; memory && addr < MEMORY_SIZE && shown < 16; addr++) {
+        if (a.memory[addr] != b.memory[addr]) {
+            snprintf(line, sizeof(line), "  [%04X]: %04X vs %04X\n", addr, a.memory[addr], b.memory[addr]);
+            text += line;
+            shown++;
+        }
+    }
+    return text;
+}
+
+static int diff(const char *path_a, const char *path_b) {
+    Virt16::TraceReader a, b;
+    if (!a.open(path_a) || !b.open(path_b)) {
+        fprintf(stderr, "%s\n", (a.getError().empty() ? b : a).getError().c_str());
+        return 1;
+    }
+    Virt16::TraceStep step_a, step_b;
+    unsigned int keyframes_a = 0, keyframes_b = 0;
+    unsigned long long steps = 0;
+    while (true) {
+        const bool more_a = next(a, step_a, path_a);
+        const bool more_b = next(b, step_b, path_b);
+        if (!a.getError().empty() || !b.getError().empty()) {
+            return 1;
+        }
+        if (more_a != more_b) {
+            printf("%s ends after %llu instructions, the other trace continues\n", more_a ? path_b : path_a, steps);
+            return 2;
+        }
+
+        // Memory only has to be compared after keyframes, in between the writes are compared per step
+        const bool keyframe = a.keyframeCount() != keyframes_a || b.keyframeCount() != keyframes_b;
+        keyframes_a = a.keyframeCount();
+        keyframes_b = b.keyframeCount();
+        if (!more_a) {
+            if (const std::string difference = compare(a.state(), b.state(), true); !difference.empty()) {
+                printf("Final states differ after %llu instructions:\n%s", steps, difference.c_str());
+                return 2;
+            }
+            printf("Traces are identical, %llu instructions\n", steps);
+            return 0;
+        }
+
+        std::string difference = compare(a.state(), b.state(), keyframe);
+        if (step_a.pc != step_b.pc || step_a.opcode != step_b.opcode) {
+            difference = "  instruction differs\n" + difference;
+        } else if (step_a.writes != step_b.writes) {
+            difference += "  memory writes differ\n";
+        }
+        if (!difference.empty()) {
+            printf("Traces diverge at instruction %llu:\n", steps);
+            printf("%s:\n", path_a);
+            print_step(step_a, a.state());
+            printf("%s:\n", path_b);
+            print_step(step_b, b.state());
+            printf("Differences after it:\n%s", difference.c_str());
+            return 2;
+        }
+        steps++;
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    const std::string command = argv[1];
+    unsigned long long first = 0;
+    unsigned long long count = ~0ull;
+    std::vector<std::pair<unsigned, unsigned>> ranges;
+    std::vector<const char *> args;
+    for (int i = 2; i < argc; i++) {
+        const char *arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+            usage(argv[0]);
+            return 0;
+        }
+        if ((!strcmp(arg, "-s") || !strcmp(arg, "--start")) && has_value) {
+            if (!parse_number(argv[++i], first)) {
+                fprintf(stderr, "Invalid cycle: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-n") || !strcmp(arg, "--count")) && has_value) {
+            if (!parse_number(argv[++i], count)) {
+                fprintf(stderr, "Invalid count: %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-m") || !strcmp(arg, "--mem")) && has_value) {
+            unsigned long long begin, end;
+            const std::string range = argv[++i];
+            const auto sep = range.find(':');
+            if (sep == std::string::npos || !parse_number(range.substr(0, sep).c_str(), begin) ||
+                !parse_number(range.substr(sep + 1).c_str(), end) || begin > end || end >= MEMORY_SIZE) {
+                fprintf(stderr, "Invalid memory range: %s\n", argv[i]);
+                return 1;
+            }
+            ranges.emplace_back(static_cast<unsigned>(begin), static_cast<unsigned>(end));
+        } else if (arg[0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            args.push_back(arg);
+        }
+    }
+
+    if (command == "show" && args.size() == 1) {
+        return show(args[0], first, count);
+    }
+    if (command == "state" && (args.size() == 1 || args.size() == 2)) {
+        unsigned long long cycle = ~0ull;
+        if (args.size() == 2 && !parse_number(args[1], cycle)) {
+            fprintf(stderr, "Invalid cycle: %s\n", args[1]);
+            return 1;
+        }
+        return state(args[0], cycle, ranges);
+    }
+    if (command == "diff" && args.size() == 2) {
+        return diff(args[0], args[1]);
+    }
+    usage(argv[0]);
+    return 1;
+}
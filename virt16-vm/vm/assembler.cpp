@@ -0,0 +1,487 @@
+//
+// In-process assembler, see assembler.h.
+//
+
+#include "assembler.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+
+#include "opcodes.h"
+
+namespace Virt16 {
+    namespace {
+        struct Line {
+            unsigned int number;
+            std::string text; // Comment removed, trimmed
+        };
+
+        struct Macro {
+            std::vector<std::string> args;
+            std::vector<std::string> body;
+        };
+
+        struct Mnemonic {
+            const char *name;
+            unsigned char opcode;
+            // Operand kinds: r register, i LOAD source (#immediate or register), a jump target
+            const char *operands;
+        };
+
+        constexpr Mnemonic mnemonics[] = {
+            {"LOAD", LOAD_IMM, "ri"}, {"STORE", STORE_ADDR, "rr"}, {"MOV", MOV, "rr"}, {"INC", INC, "r"},
+            {"DEC", DEC, "r"}, {"ADD", ADD, "rrr"}, {"SUB", SUB, "rrr"}, {"AND", AND, "rrr"}, {"OR", OR, "rrr"},
+            {"XOR", XOR, "rrr"}, {"NOT", NOT, "rr"}, {"SHL", SHL, "rrr"}, {"SHR", SHR, "rrr"}, {"CMP", CMP, "rr"},
+            {"JMP", JMP, "a"}, {"JZ", JZ, "a"}, {"JE", JE, "a"}, {"JNE", JNE, "a"}, {"JG", JG, "a"},
+            {"JL", JL, "a"}, {"CALL", CALL, "a"}, {"RET", RET, ""}, {"PUSH", PUSH, "r"}, {"POP", POP, "r"},
+            {"HLT", HLT, ""}, {"NOP", NOP, ""}, {"IRET", IRET, ""}, {"WAIT", WAIT, ""},
+        };
+
+        std::string trim(const std::string &s) {
+            const size_t begin = s.find_first_not_of(" \t\r\n");
+            if (begin == std::string::npos) {
+                return {};
+            }
+            return s.substr(begin, s.find_last_not_of(" \t\r\n") - begin + 1);
+        }
+
+        bool startsWith(const std::string &s, const char *prefix) {
+            return s.rfind(prefix, 0) == 0;
+        }
+
+        // Splits on whitespace and commas
+        std::vector<std::string> tokenize(const std::string &s) {
+            std::vector<std::string> tokens;
+            std::string token;
+            for (const char c: s) {
+                if (std::isspace(static_cast<unsigned char>(c)) || c == ',') {
+                    if (!token.empty()) {
+                        tokens.push_back(std::move(token));
+                        token.clear();
+                    }
+                } else {
+                    token += c;
+                }
+            }
+            if (!token.empty()) {
+                tokens.push_back(std::move(token));
+            }
+            return tokens;
+        }
+
+        bool isWordChar(const char c) {
+            return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+        }
+
+        // Replaces whole-word occurrences of name
+        std::string replaceWord(const std::string &s, const std::string &name, const std::string &value) {
+            std::string out;
+            size_t pos = 0;
+            while (true) {
+                const size_t found = s.find(name, pos);
+                if (found == std::string::npos) {
+                    return out + s.substr(pos);
+                }
+                const size_t end = found + name.size();
+                const bool whole = (found == 0 || !isWordChar(s[found - 1])) && (end == s.size() || !isWordChar(s[end]));
+                out += s.substr(pos, found - pos);
+                out += whole ? value : name;
+                pos = end;
+            }
+        }
+
+        // base 0 takes a 0x or 0b prefix and is decimal otherwise, .PLACE numbers are always base 16 like in
+        // the Python assembler (with an optional 0x prefix)
+        bool parseNumber(const std::string &text, const int base, unsigned int &out) {
+            if (base == 0) {
+                if (startsWith(text, "0x") || startsWith(text, "0X")) {
+                    return parseNumber(text, 16, out);
+                }
+                if (startsWith(text, "0b") || startsWith(text, "0B")) {
+                    return parseNumber(text.substr(2), 2, out);
+                }
+                return parseNumber(text, 10, out);
+            }
+            if (text.empty() || !std::isxdigit(static_cast<unsigned char>(text[0]))) {
+                return false;
+            }
+            char *end = nullptr;
+            const unsigned long value = std::strtoul(text.c_str(), &end, base);
+            if (*end != '\0' || value > 0xFFFF) {
+                return false;
+            }
+            out = static_cast<unsigned int>(value);
+            return true;
+        }
+
+        class Assembler {
+        private:
+            std::string name;
+            Assembly &out;
+            std::map<std::string, Macro> macros;
+            std::map<std::string, std::string> definitions;
+
+            struct Routine {
+                std::string label;
+                std::vector<Line> body;
+            };
+
+            std::vector<Routine> routines;
+            std::vector<std::pair<unsigned int, std::string>> errors;
+
+            void error(const unsigned int line, const std::string &message) {
+                this->errors.emplace_back(line, this->name + ":" + std::to_string(line) + ": " + message);
+            }
+
+            void place(const unsigned int addr, const std::vector<unsigned short> &words) {
+                if (this->out.image.size() < addr + words.size()) {
+                    this->out.image.resize(addr + words.size());
+                }
+                std::copy(words.begin(), words.end(), this->out.image.begin() + addr);
+            }
+
+            // .PLACE [STRING|ARRAY] addr "text" or [values], an array may span lines. Returns the last line used.
+            size_t parsePlace(const std::vector<Line> &lines, size_t i,
+                              std::vector<std::pair<unsigned int, std::vector<unsigned short>>> &places) {
+                const Line &line = lines[i];
+                std::string rest = trim(line.text.substr(6));
+                for (const char *keyword: {"STRING", "ARRAY"}) {
+                    if (startsWith(rest, keyword)) {
+                        rest = trim(rest.substr(std::string(keyword).size()));
+                    }
+                }
+                const size_t split = rest.find_first_of(" \t\"[");
+                unsigned int addr;
+                if (!parseNumber(rest.substr(0, split), 16, addr)) {
+                    this->error(line.number, "invalid .PLACE address");
+                    return i;
+                }
+                rest = split == std::string::npos ? std::string() : trim(rest.substr(split));
+
+                std::vector<unsigned short> words;
+                if (startsWith(rest, "\"")) {
+                    const size_t close = rest.find('"', 1);
+                    if (close == std::string::npos) {
+                        this->error(line.number, "unterminated .PLACE string");
+                        return i;
+                    }
+                    for (const char c: rest.substr(1, close - 1)) {
+                        words.push_back(static_cast<unsigned char>(c));
+                    }
+                } else {
+                    // Values up to the closing bracket, or up to the end of the line without brackets
+                    const bool bracket = startsWith(rest, "[");
+                    std::string values = bracket ? rest.substr(1) : rest;
+                    while (bracket && values.find(']') == std::string::npos) {
+                        if (++i == lines.size()) {
+                            this->error(line.number, ".PLACE array without ]");
+                            return i - 1;
+                        }
+                        values += "," + lines[i].text;
+                    }
+                    for (const std::string &token: tokenize(values.substr(0, values.find(']')))) {
+                        unsigned int value;
+                        if (!parseNumber(token, 16, value)) {
+                            this->error(line.number, "invalid .PLACE value " + token);
+                            continue;
+                        }
+                        words.push_back(static_cast<unsigned short>(value));
+                    }
+                }
+                if (addr + words.size() > MEMORY_SIZE) {
+                    this->error(line.number, ".PLACE data runs past the end of memory");
+                    return i;
+                }
+                places.emplace_back(addr, std::move(words));
+                return i;
+            }
+
+            // Removes macro, definition and data directives, they apply to the whole file wherever they appear
+            std::vector<Line> collectDirectives(const std::vector<Line> &lines,
+                                                std::vector<std::pair<unsigned int, std::vector<unsigned short>>> &places) {
+                std::vector<Line> code;
+                for (size_t i = 0; i < lines.size(); i++) {
+                    const Line &line = lines[i];
+                    if (startsWith(line.text, "@macro")) {
+                        const std::string header = line.text.substr(6);
+                        const std::vector<std::string> parts = tokenize(header);
+                        if (parts.empty()) {
+                            this->error(line.number, "@macro without a name");
+                            continue;
+                        }
+                        Macro macro;
+                        const size_t open = header.find('[');
+                        if (open != std::string::npos) {
+                            std::string args = header.substr(open + 1);
+                            args = args.substr(0, args.find(']'));
+                            macro.args = tokenize(args);
+                        }
+                        for (i++; i < lines.size() && !startsWith(lines[i].text, "@endmacro"); i++) {
+                            macro.body.push_back(lines[i].text);
+                        }
+                        if (i == lines.size()) {
+                            this->error(line.number, "@macro " + parts[0] + " without @endmacro");
+                        }
+                        this->macros[parts[0]] = std::move(macro);
+                    } else if (startsWith(line.text, "@define")) {
+                        const std::vector<std::string> parts = tokenize(line.text.substr(7));
+                        if (parts.size() != 2) {
+                            this->error(line.number, "expected @define name value");
+                            continue;
+                        }
+                        this->definitions[parts[0]] = parts[1];
+                    } else if (startsWith(line.text, ".PLACE")) {
+                        i = this->parsePlace(lines, i, places);
+                    } else {
+                        code.push_back(line);
+                    }
+                }
+                return code;
+            }
+
+            // Expands @macro invocations and substitutes %definitions
+            std::vector<Line> substitute(const std::vector<Line> &lines) {
+                std::vector<Line> expanded;
+                for (const Line &line: lines) {
+                    if (!startsWith(line.text, "@")) {
+                        expanded.push_back(line);
+                        continue;
+                    }
+                    const std::vector<std::string> parts = tokenize(line.text.substr(1));
+                    const auto macro = this->macros.find(parts.empty() ? std::string() : parts[0]);
+                    if (macro == this->macros.end()) {
+                        this->error(line.number, "macro " + line.text + " not defined");
+                        continue;
+                    }
+                    if (parts.size() - 1 != macro->second.args.size()) {
+                        this->error(line.number, "incorrect number of arguments for macro " + parts[0]);
+                        continue;
+                    }
+                    for (std::string body: macro->second.body) {
+                        for (size_t i = 0; i < macro->second.args.size(); i++) {
+                            body = replaceWord(body, macro->second.args[i], parts[i + 1]);
+                        }
+                        expanded.push_back({line.number, body});
+                    }
+                }
+
+                for (Line &line: expanded) {
+                    for (size_t pos; (pos = line.text.find('%')) != std::string::npos;) {
+                        size_t end = pos + 1;
+                        while (end < line.text.size() && isWordChar(line.text[end])) {
+                            end++;
+                        }
+                        const std::string key = line.text.substr(pos + 1, end - pos - 1);
+                        const auto definition = this->definitions.find(key);
+                        if (definition == this->definitions.end()) {
+                            this->error(line.number, "definition %" + key + " not defined");
+                            line.text.erase(pos, end - pos);
+                            continue;
+                        }
+                        line.text.replace(pos, end - pos, definition->second);
+                    }
+                }
+                return expanded;
+            }
+
+            // Groups instructions by routine, a routine starts at a `.NAME:` line
+            void collectRoutines(const std::vector<Line> &lines) {
+                for (const Line &line: lines) {
+                    if (startsWith(line.text, ".")) {
+                        std::string label = line.text;
+                        if (label.back() == ':') {
+                            label.pop_back();
+                        }
+                        label = trim(label);
+                        if (std::any_of(this->routines.begin(), this->routines.end(),
+                                        [&](const Routine &r) { return r.label == label; })) {
+                            this->error(line.number, "routine " + label + " defined twice");
+                        }
+                        this->routines.push_back({label, {}});
+                    } else if (this->routines.empty()) {
+                        this->error(line.number, "instruction outside of a routine");
+                    } else {
+                        this->routines.back().body.push_back(line);
+                    }
+                }
+                // .main always starts at address 0
+                std::stable_partition(this->routines.begin(), this->routines.end(),
+                                      [](const Routine &r) { return r.label == ".main"; });
+            }
+
+            bool parseRegister(const Line &line, const std::string &token, unsigned int &out) {
+                const auto it = register_map.find(token);
+                if (it == register_map.end()) {
+                    this->error(line.number, "invalid register " + token);
+                    return false;
+                }
+                out = static_cast<unsigned int>(it->second);
+                return true;
+            }
+
+            unsigned int encode(const Line &line) {
+                const std::vector<std::string> parts = tokenize(line.text);
+                const Mnemonic *mnemonic = nullptr;
+                for (const Mnemonic &m: mnemonics) {
+                    if (parts[0] == m.name) {
+                        mnemonic = &m;
+                    }
+                }
+                if (!mnemonic) {
+                    this->error(line.number, "unknown instruction " + parts[0]);
+                    return 0;
+                }
+                const std::string operands = mnemonic->operands;
+                if (parts.size() - 1 != operands.size()) {
+                    this->error(line.number, "invalid number of arguments for " + parts[0]);
+                    return 0;
+                }
+
+                unsigned int instruction = static_cast<unsigned int>(mnemonic->opcode) << 27;
+                // Register operands fill X, Y and Z in order
+                int shift = 22;
+                for (size_t i = 0; i < operands.size(); i++) {
+                    const std::string &token = parts[i + 1];
+                    unsigned int value = 0;
+                    if (operands[i] == 'i' && startsWith(token, "#")) {
+                        if (!parseNumber(token.substr(1), 0, value)) {
+                            this->error(line.number, "invalid immediate value " + token);
+                            return 0;
+                        }
+                        instruction |= value;
+                    } else if (operands[i] == 'a') {
+                        if (const auto label = this->out.labels.find(token); label != this->out.labels.end()) {
+                            value = label->second;
+                        } else if (!parseNumber(token, 0, value)) {
+                            this->error(line.number, "unknown routine " + token);
+                            return 0;
+                        }
+                        instruction |= value;
+                    } else {
+                        // LOAD X, Y encodes like the Python assembler: LOAD opcode with Y in its field
+                        if (!this->parseRegister(line, token, value)) {
+                            return 0;
+                        }
+                        instruction |= value << shift;
+                        shift -= 5;
+                    }
+                }
+                return instruction;
+            }
+
+        public:
+            Assembler(std::string name, Assembly &out) : name(std::move(name)), out(out) {}
+
+            void run(const std::string &source) {
+                this->assemble(source);
+                // Passes report their errors in turn, list them in source order
+                std::stable_sort(this->errors.begin(), this->errors.end(),
+                                 [](const auto &a, const auto &b) { return a.first < b.first; });
+                for (auto &[line, message]: this->errors) {
+                    this->out.errors.push_back(std::move(message));
+                }
+            }
+
+        private:
+            void assemble(const std::string &source) {
+                std::vector<Line> lines;
+                std::istringstream stream(source);
+                std::string text;
+                for (unsigned int number = 1; std::getline(stream, text); number++) {
+                    // Comments run to the end of the line unless the ; is inside a string
+                    bool quoted = false;
+                    for (size_t i = 0; i < text.size(); i++) {
+                        quoted ^= text[i] == '"';
+                        if (text[i] == ';' && !quoted) {
+                            text.resize(i);
+                            break;
+                        }
+                    }
+                    if (std::string trimmed = trim(text); !trimmed.empty()) {
+                        lines.push_back({number, std::move(trimmed)});
+                    }
+                }
+
+                std::vector<std::pair<unsigned int, std::vector<unsigned short>>> places;
+                this->collectRoutines(this->substitute(this->collectDirectives(lines, places)));
+
+                // Two words per instruction
+                unsigned int addr = 0;
+                for (const Routine &routine: this->routines) {
+                    this->out.labels[routine.label] = static_cast<unsigned short>(addr);
+                    addr += 2 * static_cast<unsigned int>(routine.body.size());
+                }
+                if (addr > MEMORY_SIZE) {
+                    this->error(lines.empty() ? 0 : lines.back().number, "program does not fit in memory");
+                    return;
+                }
+                this->out.image.resize(addr);
+                addr = 0;
+                for (const Routine &routine: this->routines) {
+                    for (const Line &line: routine.body) {
+                        const unsigned int instruction = this->encode(line);
+                        this->out.image[addr] = static_cast<unsigned short>(instruction >> 16);
+                        this->out.image[addr + 1] = static_cast<unsigned short>(instruction);
+                        this->out.source_map.push_back({static_cast<unsigned short>(addr), line.number, line.text});
+                        addr += 2;
+                    }
+                }
+                // Data is written last and may overwrite code, like the Python assembler
+                for (const auto &[place_addr, words]: places) {
+                    this->place(place_addr, words);
+                }
+            }
+        };
+    }
+
+    bool Assembly::ok() const {
+        return this->errors.empty();
+    }
+
+    std::string Assembly::debugText() const {
+        std::string text;
+        for (const SourceLine &line: this->source_map) {
+            text += line.text;
+            text += '\n';
+        }
+        return text;
+    }
+
+    void Assembly::load(virt16 &vm) const {
+        vm.load(this->image.data(), static_cast<unsigned int>(this->image.size()));
+    }
+
+    Assembly assemble(const std::string &source, const std::string &name) {
+        Assembly assembly;
+        Assembler(name, assembly).run(source);
+        return assembly;
+    }
+
+    Assembly assembleFile(const char *path) {
+        std::ifstream file(path);
+        if (!file.is_open()) {
+            Assembly assembly;
+            assembly.errors.push_back(std::string(path) + ": cannot open file");
+            return assembly;
+        }
+        std::stringstream source;
+        source << file.rdbuf();
+        return assemble(source.str(), path);
+    }
+
+    std::vector<SourceLine> readDebugFile(const char *path) {
+        std::vector<SourceLine> lines;
+        std::ifstream file(path);
+        std::string text;
+        while (lines.size() < MEMORY_SIZE / 2 && std::getline(file, text)) {
+            if (!text.empty() && text.back() == '\r') {
+                text.pop_back();
+            }
+            const auto index = static_cast<unsigned int>(lines.size());
+            lines.push_back({static_cast<unsigned short>(2 * index), index + 1, std::move(text)});
+        }
+        return lines;
+    }
+} // Virt16
@@ -0,0 +1,57 @@
+//
+// In-process assembler for Virt16 assembly, compatible with assembler/assemble.py.
+//
+// Accepts the same source: `.NAME:` routines (.main is placed first at address 0), `;` comments,
+// `@macro name [args] ... @endmacro` expanded by `@name args`, `@define name value` substituted for `%name`,
+// and `.PLACE addr "text"` / `.PLACE addr [values]` data (an optional STRING or ARRAY keyword may follow
+// .PLACE). Produces the same words as the .bin the Python assembler writes, plus a source map, so a program
+// can go from text to a running VM without a process launch or file round trip.
+//
+
+#ifndef VIRT16_ASSEMBLER_H
+#define VIRT16_ASSEMBLER_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "virt16.h"
+
+namespace Virt16 {
+    // One assembled instruction
+    struct SourceLine {
+        unsigned short addr;
+        unsigned int line; // 1-based source line, the invoking line for instructions from a macro
+        std::string text; // Instruction after macro and definition substitution
+    };
+
+    struct Assembly {
+        // Memory contents from address 0, gaps between code and placed data are zero
+        std::vector<unsigned short> image;
+        // Instructions in address order
+        std::vector<SourceLine> source_map;
+        // Routine addresses
+        std::map<std::string, unsigned short> labels;
+        // "name:line: message", the image is incomplete when there is any
+        std::vector<std::string> errors;
+
+        [[nodiscard]] bool ok() const;
+
+        // Contents of the .debug file, one instruction per line in address order
+        [[nodiscard]] std::string debugText() const;
+
+        // Writes the image at address 0 like virt16::load_program()
+        void load(virt16 &vm) const;
+    };
+
+    // name is used in error messages
+    Assembly assemble(const std::string &source, const std::string &name = "<source>");
+
+    Assembly assembleFile(const char *path);
+
+    // Source map of a .debug file, its line i holds the instruction at address 2 * i. line is the line of the
+    // .debug file, empty when it cannot be read.
+    std::vector<SourceLine> readDebugFile(const char *path);
+} // Virt16
+
+#endif //VIRT16_ASSEMBLER_H
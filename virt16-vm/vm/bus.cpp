@@ -0,0 +1,223 @@
+//
+// Peripheral bus and devices, see bus.h.
+//
+
+#include "bus.h"
+
+#include <algorithm>
+#include <chrono>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define VIRT16_SERIAL_FD 1
+#include <poll.h>
+#include <unistd.h>
+#else
+#define VIRT16_SERIAL_FD 0
+#endif
+
+namespace Virt16 {
+    Bus::Bus() : cells(std::make_unique<Cell[]>(QUEUE_SIZE)) {
+        for (unsigned int i = 0; i < QUEUE_SIZE; i++) {
+            this->cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    void Bus::attach(const Registers port, Device *device) {
+        if (port >= P1 && port <= P4) {
+            this->devices[port - P1] = device;
+        }
+    }
+
+    Device *Bus::getDevice(const Registers port) const {
+        return port >= P1 && port <= P4 ? this->devices[port - P1] : nullptr;
+    }
+
+    bool Bus::post(const Registers port, const unsigned short value) {
+        if (port < P1 || port > P4) {
+            return false;
+        }
+        unsigned int position = this->enqueue.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &this->cells[position % QUEUE_SIZE];
+            const unsigned int sequence = cell->sequence.load(std::memory_order_acquire);
+            const int ahead = static_cast<int>(sequence - position);
+            if (ahead == 0) {
+                if (this->enqueue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (ahead < 0) {
+                return false; // Full, the VM has not taken the event posted QUEUE_SIZE ago
+            } else {
+                position = this->enqueue.load(std::memory_order_relaxed);
+            }
+        }
+        cell->event = {port, value};
+        cell->sequence.store(position + 1, std::memory_order_release);
+        this->ring();
+        return true;
+    }
+
+    bool Bus::take(Event &out) {
+        Cell &cell = this->cells[this->dequeue % QUEUE_SIZE];
+        if (cell.sequence.load(std::memory_order_acquire) != this->dequeue + 1) {
+            return false;
+        }
+        out = cell.event;
+        cell.sequence.store(this->dequeue + QUEUE_SIZE, std::memory_order_release);
+        this->dequeue++;
+        return true;
+    }
+
+    void Bus::ring() {
+        this->doorbell.fetch_add(1, std::memory_order_release);
+        this->doorbell.notify_all();
+    }
+
+    unsigned int Bus::rings() const {
+        return this->doorbell.load(std::memory_order_acquire);
+    }
+
+    void Bus::sleep(const unsigned int seen) const {
+        this->doorbell.wait(seen, std::memory_order_acquire);
+    }
+
+    bool Bus::service(virt16 &vm) {
+        bool changed = false;
+        Event event{};
+        while (this->take(event)) {
+            if (Device *device = this->devices[event.port - P1]) {
+                changed |= device->receive(vm, event.port, event.value);
+            }
+        }
+        for (unsigned int i = 0; i < PORT_COUNT; i++) {
+            if (this->devices[i]) {
+                changed |= this->devices[i]->poll(vm, static_cast<Registers>(P1 + i));
+            }
+        }
+        return changed;
+    }
+
+    unsigned long long Bus::deadline(const virt16 &vm) const {
+        unsigned long long earliest = Device::NEVER;
+        for (unsigned int i = 0; i < PORT_COUNT; i++) {
+            if (this->devices[i]) {
+                earliest = std::min(earliest, this->devices[i]->deadline(vm, static_cast<Registers>(P1 + i)));
+            }
+        }
+        return earliest;
+    }
+
+    bool Keyboard::receive(virt16 &vm, const Registers port, const unsigned short value) {
+        vm.setRegister(port, PRESSED | (value & 0xF));
+        vm.raise(port);
+        return true;
+    }
+
+    Timer::Timer(const unsigned long long period) : period(std::max(period, 1ull)) {}
+
+    bool Timer::poll(virt16 &vm, const Registers port) {
+        const unsigned long long expired = vm.getTicks() / this->period;
+        // The clock goes back on reset() and restore(), count from there without raising
+        const bool raised = expired > this->expired;
+        if (raised) {
+            vm.setRegister(port, static_cast<unsigned short>(vm.getRegister(port) + (expired - this->expired)));
+            vm.raise(port);
+        }
+        this->expired = expired;
+        return raised;
+    }
+
+    unsigned long long Timer::deadline(const virt16 &vm, Registers) const {
+        return (vm.getTicks() / this->period + 1) * this->period;
+    }
+
+    Serial::Serial(const Registers rx, const Registers tx, std::FILE *out) : rx(rx), tx(tx), out(out) {}
+
+    Serial::~Serial() {
+        this->quit.store(true, std::memory_order_relaxed);
+        if (this->reader.joinable()) {
+            this->reader.join();
+        }
+    }
+
+    bool Serial::open(Bus &bus, const int fd) {
+#if VIRT16_SERIAL_FD
+        if (this->reader.joinable()) {
+            return false;
+        }
+        this->closed.store(false, std::memory_order_release);
+        this->reader = std::thread([this, &bus, fd] {
+            unsigned char buffer[256];
+            while (!this->quit.load(std::memory_order_relaxed)) {
+                // Looks at quit every 50 ms while the line is idle
+                pollfd readable{fd, POLLIN, 0};
+                if (::poll(&readable, 1, 50) == 0) {
+                    continue;
+                }
+                const ssize_t count = ::read(fd, buffer, sizeof(buffer));
+                if (count <= 0) {
+                    break;
+                }
+                for (ssize_t i = 0; i < count; i++) {
+                    // A pipe holds the bytes back instead of losing them while the queue is full
+                    while (!bus.post(this->rx, buffer[i]) && !this->quit.load(std::memory_order_relaxed)) {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    }
+                }
+            }
+            this->closed.store(true, std::memory_order_release);
+            bus.ring();
+        });
+        return true;
+#else
+        (void) bus;
+        (void) fd;
+        return false;
+#endif
+    }
+
+    bool Serial::isOpen() const {
+        return !this->closed.load(std::memory_order_acquire);
+    }
+
+    bool Serial::deliver(virt16 &vm) {
+        if (this->input.empty() || vm.getRegister(this->rx) != 0) {
+            return false;
+        }
+        vm.setRegister(this->rx, FULL | this->input.front());
+        this->input.pop_front();
+        vm.raise(this->rx);
+        return true;
+    }
+
+    bool Serial::receive(virt16 &vm, const Registers port, const unsigned short value) {
+        if (port != this->rx) {
+            return false;
+        }
+        this->input.push_back(static_cast<unsigned char>(value));
+        return this->deliver(vm);
+    }
+
+    bool Serial::poll(virt16 &vm, const Registers port) {
+        if (port == this->rx) {
+            return this->deliver(vm);
+        }
+        const unsigned short value = vm.getRegister(this->tx);
+        if (port != this->tx || !(value & FULL)) {
+            return false;
+        }
+        std::fputc(value & 0xFF, this->out);
+        std::fflush(this->out);
+        vm.setRegister(this->tx, 0);
+        vm.raise(this->tx);
+        return true;
+    }
+
+    unsigned long long Serial::deadline(const virt16 &vm, const Registers port) const {
+        // Right away while there is something to move, the next slice boundary would do but WAIT would sleep
+        const bool ready = port == this->rx ? !this->input.empty() && vm.getRegister(this->rx) == 0
+                                            : port == this->tx && (vm.getRegister(this->tx) & FULL);
+        return ready ? vm.getTicks() : NEVER;
+    }
+} // Virt16
@@ -0,0 +1,181 @@
+//
+// Peripheral bus for the P1-P4 registers.
+//
+// Devices are attached to ports (the registers P1 to P4) of a Bus, and the Bus is attached to a VM with
+// virt16::setBus(). Host threads post events for a port through a bounded lock-free queue. The VM drains it
+// between two slices of run() (at most SLICE instructions, ending at block boundaries on the JIT), passes
+// every event to the device of its port and polls the devices. Devices write their port and raise its
+// interrupt line, see virt16::raise(). A device that needs polling at a certain clock tick (a timer) reports
+// it as its deadline, slices end there and a ROM asleep on WAIT skips straight to it. Without a deadline
+// run() returns and the host sleeps on the bus until the next event, so a waiting ROM burns no host CPU.
+//
+
+#ifndef VIRT16_BUS_H
+#define VIRT16_BUS_H
+
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <thread>
+
+#include "virt16.h"
+
+namespace Virt16 {
+    class Bus;
+
+    class Device {
+    public:
+        // Deadline of a device that only reacts to events
+        static constexpr unsigned long long NEVER = ~0ull;
+
+        virtual ~Device() = default;
+
+        // An event posted for port, on the VM thread. Returns true if it changed the VM.
+        virtual bool receive(virt16 &, Registers, unsigned short) {
+            return false;
+        }
+
+        // Called for each port of the device at every slice boundary, after the events. Returns true if it
+        // changed the VM.
+        virtual bool poll(virt16 &, Registers) {
+            return false;
+        }
+
+        // Clock tick by which poll() has to run again for port
+        [[nodiscard]] virtual unsigned long long deadline(const virt16 &, Registers) const {
+            return NEVER;
+        }
+    };
+
+    class Bus {
+    public:
+        struct Event {
+            Registers port;
+            unsigned short value;
+        };
+
+    private:
+        // Bounded multi-producer queue, a cell is free for position p while its sequence is p and holds the
+        // event of position p once it is p + 1
+        struct Cell {
+            std::atomic<unsigned int> sequence;
+            Event event;
+        };
+
+        static constexpr unsigned int PORT_COUNT = P4 - P1 + 1;
+
+        std::unique_ptr<Cell[]> cells;
+        alignas(64) std::atomic<unsigned int> enqueue{0};
+        alignas(64) unsigned int dequeue = 0; // VM thread only
+        alignas(64) std::atomic<unsigned int> doorbell{0}; // Counts posts and rings
+        Device *devices[PORT_COUNT]{};
+
+        bool take(Event &out);
+
+    public:
+        static constexpr unsigned int QUEUE_SIZE = 1024;
+        // Most instructions run() executes between two looks at the queue
+        static constexpr unsigned long long SLICE = 4096;
+
+        Bus();
+
+        Bus(const Bus &) = delete;
+
+        Bus &operator=(const Bus &) = delete;
+
+        // Attaches device to port (P1 to P4), nullptr detaches. A device may serve several ports. Not while the
+        // VM runs.
+        void attach(Registers port, Device *device);
+
+        [[nodiscard]] Device *getDevice(Registers port) const;
+
+        // Queues an event for the device of port, from any thread. Returns false if the queue is full.
+        bool post(Registers port, unsigned short value);
+
+        // Wakes sleep() without an event
+        void ring();
+
+        // Changes with every post() and ring(), read it before looking at the VM and pass it to sleep()
+        [[nodiscard]] unsigned int rings() const;
+
+        // Blocks until rings() differs from seen
+        void sleep(unsigned int seen) const;
+
+        // Passes the queued events to the devices and polls them, on the VM thread. Returns true if a device
+        // changed the VM.
+        bool service(virt16 &vm);
+
+        // Earliest deadline of the attached devices, Device::NEVER if there is none
+        [[nodiscard]] unsigned long long deadline(const virt16 &vm) const;
+    };
+
+    // Hex keypad. A key posted to its port is stored there as PRESSED | key and raises the port, the ROM
+    // clears the register once it took the key.
+    class Keyboard : public Device {
+    public:
+        static constexpr unsigned short PRESSED = 0x8000;
+
+        bool receive(virt16 &vm, Registers port, unsigned short value) override;
+    };
+
+    // Raises its port every period clock ticks and counts the expirations in it. Expirations are derived from
+    // the VM clock, so they happen at the same tick on every engine and after restore().
+    class Timer : public Device {
+    private:
+        unsigned long long period;
+        unsigned long long expired = 0; // Periods that ended by the last poll()
+
+    public:
+        explicit Timer(unsigned long long period);
+
+        bool poll(virt16 &vm, Registers port) override;
+
+        [[nodiscard]] unsigned long long deadline(const virt16 &vm, Registers port) const override;
+    };
+
+    // Serial console on two ports. Received bytes are stored one at a time as FULL | byte in rx, which raises
+    // rx. The ROM writes 0 to rx to take the next one. The ROM sends a byte by writing FULL | byte to tx, the
+    // device writes it to out, clears tx and raises it. A local pipe or pty stands in for the line: open()
+    // posts everything read from a file descriptor, other hosts post bytes to rx themselves.
+    class Serial : public Device {
+    private:
+        Registers rx;
+        Registers tx;
+        std::FILE *out;
+        std::deque<unsigned char> input; // Received and not yet stored in rx, VM thread only
+
+        std::thread reader;
+        std::atomic<bool> quit{false};
+        std::atomic<bool> closed{true};
+
+        // Stores the next received byte in rx once the ROM took the last one
+        bool deliver(virt16 &vm);
+
+    public:
+        static constexpr unsigned short FULL = 0x8000;
+
+        Serial(Registers rx, Registers tx, std::FILE *out = stdout);
+
+        Serial(const Serial &) = delete;
+
+        Serial &operator=(const Serial &) = delete;
+
+        // Posts every byte read from fd to rx on bus from a thread of its own, until end of file. Returns false
+        // if the host has no poll()/read() or input is already open.
+        bool open(Bus &bus, int fd);
+
+        // Input was opened and has not reached end of file
+        [[nodiscard]] bool isOpen() const;
+
+        bool receive(virt16 &vm, Registers port, unsigned short value) override;
+
+        bool poll(virt16 &vm, Registers port) override;
+
+        [[nodiscard]] unsigned long long deadline(const virt16 &vm, Registers port) const override;
+
+        ~Serial() override;
+    };
+} // Virt16
+
+#endif //VIRT16_BUS_H
@@ -0,0 +1,65 @@
+//
+// Clock pacing, see clock.h.
+//
+
+#include "clock.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace Virt16 {
+    void Clock::setFrequency(const unsigned long long frequency, const unsigned long long ticks) {
+        this->hz = frequency;
+        this->restart(ticks);
+    }
+
+    unsigned long long Clock::getFrequency() const {
+        return this->hz;
+    }
+
+    void Clock::restart(const unsigned long long ticks) {
+        this->since = std::chrono::steady_clock::now();
+        this->since_ticks = ticks;
+    }
+
+    std::chrono::steady_clock::time_point Clock::deadline(const unsigned long long ticks) const {
+        const double seconds = ticks > this->since_ticks
+                                   ? static_cast<double>(ticks - this->since_ticks) / static_cast<double>(this->hz)
+                                   : 0.0;
+        return this->since + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                   std::chrono::duration<double>(seconds));
+    }
+
+    unsigned long long Clock::due(const unsigned long long ticks) {
+        if (this->hz == 0) {
+            return ~0ull;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        const double elapsed = std::chrono::duration<double>(now - this->since).count();
+        unsigned long long target = this->since_ticks + static_cast<unsigned long long>(
+                                        elapsed * static_cast<double>(this->hz));
+        // Run at most MAX_LAG behind instead of catching up, also covers a VM that went back (reset, restore)
+        const unsigned long long lag = this->hz * MAX_LAG.count() / 1000;
+        if (target > ticks + lag) {
+            this->since = now;
+            this->since_ticks = ticks + lag;
+            target = this->since_ticks;
+        }
+        return target > ticks ? target - ticks : 0;
+    }
+
+    void Clock::wait(const unsigned long long ticks, const std::chrono::steady_clock::duration limit) const {
+        if (this->hz == 0) {
+            return;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        const unsigned long long batch = std::max(this->hz / BATCH_RATE, 1ull);
+        const auto until = now + std::min(this->deadline(ticks + batch) - now, limit);
+        if (until - now > SPIN) {
+            std::this_thread::sleep_until(until - SPIN);
+        }
+        while (std::chrono::steady_clock::now() < until) {
+            std::this_thread::yield();
+        }
+    }
+} // Virt16
@@ -0,0 +1,49 @@
+//
+// Paces a VM to a target clock rate.
+//
+// The VM counts clock ticks (OPCODE_TICKS per instruction) while it runs at full speed. A Clock compares them
+// with host time between batches of instructions: due() tells how many ticks may run now and wait() sleeps
+// until the next batch is due, one host sleep per batch with a short spin at the end to hit the deadline.
+// Nothing is checked per instruction, and a frequency of 0 runs unthrottled.
+//
+
+#ifndef VIRT16_CLOCK_H
+#define VIRT16_CLOCK_H
+
+#include <chrono>
+
+namespace Virt16 {
+    class Clock {
+    private:
+        unsigned long long hz = 0;
+        std::chrono::steady_clock::time_point since; // Host time at which since_ticks were due
+        unsigned long long since_ticks = 0;
+
+        [[nodiscard]] std::chrono::steady_clock::time_point deadline(unsigned long long ticks) const;
+
+    public:
+        // Batches per second of emulated time, wait() sleeps until a whole batch is due
+        static constexpr unsigned int BATCH_RATE = 1000;
+        // Left of a sleep to spin through, host sleeps overshoot by about this much
+        static constexpr std::chrono::microseconds SPIN{200};
+        // Backlog kept when the host falls behind (slow host, debugger stops), anything older is dropped
+        static constexpr std::chrono::milliseconds MAX_LAG{100};
+
+        // Target ticks per second, 0 is unthrottled. Starts counting from ticks now.
+        void setFrequency(unsigned long long frequency, unsigned long long ticks);
+
+        [[nodiscard]] unsigned long long getFrequency() const;
+
+        // Starts counting from ticks now, e.g. after the VM was stopped
+        void restart(unsigned long long ticks);
+
+        // Ticks that may run now when the VM is at ticks, ~0 when unthrottled
+        unsigned long long due(unsigned long long ticks);
+
+        // Sleeps until a batch past ticks is due, for at most limit
+        void wait(unsigned long long ticks,
+                  std::chrono::steady_clock::duration limit = std::chrono::steady_clock::duration::max()) const;
+    };
+} // Virt16
+
+#endif //VIRT16_CLOCK_H
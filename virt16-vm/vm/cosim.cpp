@@ -0,0 +1,279 @@
+//
+// Lockstep co-simulation, see cosim.h.
+//
+
+#include "cosim.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "trace.h"
+
+namespace Virt16 {
+    namespace {
+        // Memory differences listed per report
+        constexpr int MAX_WORDS = 16;
+
+        std::string flagsText(const virt16 &vm) {
+            std::string text;
+            const char names[] = "ZGLEC";
+            for (int flag = Z; flag <= C; flag++) {
+                text += vm.getFlag(static_cast<Flags>(flag)) ? names[flag] : '-';
+            }
+            return text;
+        }
+
+        // Pages either VM wrote between its from and to snapshots
+        std::vector<unsigned int> writtenPages(const Snapshot &from_reference, const Snapshot &to_reference,
+                                               const Snapshot &from_candidate, const Snapshot &to_candidate) {
+            std::vector<unsigned int> pages;
+            for (unsigned int i = 0; i < PAGE_COUNT; i++) {
+                if (!from_reference.sharesPage(to_reference, i) || !from_candidate.sharesPage(to_candidate, i)) {
+                    pages.push_back(i);
+                }
+            }
+            return pages;
+        }
+    }
+
+    bool CoSim::WriteLog::write(virt16 &vm, const unsigned short addr, const unsigned short value) {
+        this->writes.push_back({vm.getCycles(), addr, value});
+        return true;
+    }
+
+    CoSim::CoSim(const Snapshot &start, const Engine engine, const unsigned long long quantum,
+                 const bool compare_writes)
+        : reference(std::make_unique<virt16>()), candidate(std::make_unique<virt16>()),
+          compare_writes(compare_writes), quantum(std::max(quantum, 1ull)) {
+        this->reference->restore(start);
+        this->candidate->restore(start);
+        this->candidate->setEngine(engine);
+        this->reference->mapMemory(0, MEMORY_SIZE, &this->log);
+        if (compare_writes) {
+            this->candidate->mapMemory(0, MEMORY_SIZE, &this->candidate_log);
+        }
+        // step() executes whether the VM runs or not, run(0) starts it like the candidate's first run()
+        this->reference->run(0);
+    }
+
+    unsigned long long CoSim::stepReference(const unsigned long long count) {
+        const unsigned long long start = this->reference->getCycles();
+        while (this->reference->isRunning() && this->reference->getCycles() - start < count) {
+            const unsigned short pc = this->reference->getPC();
+            this->recent.push_back({this->reference->getCycles(), pc,
+                                    {this->reference->getMemory(pc),
+                                     this->reference->getMemory(static_cast<unsigned short>(pc + 1))}});
+            this->reference->step();
+        }
+        return this->reference->getCycles() - start;
+    }
+
+    std::string CoSim::compare(const std::vector<unsigned int> &pages, const unsigned long long since) const {
+        const virt16 &a = *this->reference;
+        const virt16 &b = *this->candidate;
+        std::string text;
+        char line[80];
+        if (a.getPC() != b.getPC()) {
+            snprintf(line, sizeof(line), "  PC: %04X vs %04X\n", a.getPC(), b.getPC());
+            text += line;
+        }
+        for (int reg = 0; reg < 32; reg++) {
+            const auto r = static_cast<Registers>(reg);
+            if (a.getRegister(r) != b.getRegister(r)) {
+                snprintf(line, sizeof(line), "  %s: %04X vs %04X\n", reg <= P4 ? register_names[reg] : "?",
+                         a.getRegister(r), b.getRegister(r));
+                text += line;
+            }
+        }
+        if (flagsText(a) != flagsText(b)) {
+            text += "  flags: " + flagsText(a) + " vs " + flagsText(b) + "\n";
+        }
+        if (a.getCycles() != b.getCycles()) {
+            snprintf(line, sizeof(line), "  cycles: %llu vs %llu\n", a.getCycles(), b.getCycles());
+            text += line;
+        }
+        if (a.getTicks() != b.getTicks()) {
+            snprintf(line, sizeof(line), "  ticks: %llu vs %llu\n", a.getTicks(), b.getTicks());
+            text += line;
+        }
+        if (a.isRunning() != b.isRunning() || a.isWaiting() != b.isWaiting()) {
+            const auto state = [](const virt16 &vm) {
+                return vm.isWaiting() ? "waiting" : vm.isRunning() ? "running" : "halted";
+            };
+            text += std::string("  state: ") + state(a) + " vs " + state(b) + "\n";
+        }
+        if (this->compare_writes) {
+            // Translated blocks only count their cycles at the end, so only the order of the writes is compared
+            auto write = std::find_if(this->log.writes.begin(), this->log.writes.end(),
+                                      [since](const Write &w) { return w.cycles >= since; });
+            const size_t total = static_cast<size_t>(this->log.writes.end() - write);
+            for (size_t i = 0; i < std::max(total, this->candidate_log.writes.size()); i++, ++write) {
+                const Write *b_write = i < this->candidate_log.writes.size() ? &this->candidate_log.writes[i] : nullptr;
+                const Write *a_write = i < total ? &*write : nullptr;
+                if (a_write && b_write && a_write->addr == b_write->addr && a_write->value == b_write->value) {
+                    continue;
+                }
+                const auto show = [](const Write *w) {
+                    char text[16] = "none";
+                    if (w) {
+                        snprintf(text, sizeof(text), "[%04X]=%04X", w->addr, w->value);
+                    }
+                    return std::string(text);
+                };
+                snprintf(line, sizeof(line), "  write %zu of the round: ", i + 1);
+                text += line + show(a_write) + " vs " + show(b_write) + "\n";
+                break;
+            }
+        }
+        int shown = 0;
+        unsigned short words_a[PAGE_WORDS];
+        unsigned short words_b[PAGE_WORDS];
+        for (const unsigned int page: pages) {
+            a.getMemory(page * PAGE_WORDS, words_a, PAGE_WORDS);
+            b.getMemory(page * PAGE_WORDS, words_b, PAGE_WORDS);
+            for (unsigned int i = 0; i < PAGE_WORDS; i++) {
+                if (words_a[i] == words_b[i]) {
+                    continue;
+                }
+                if (shown++ == MAX_WORDS) {
+                    text += "  more memory differs\n";
+                    return text;
+                }
+                snprintf(line, sizeof(line), "  [%04X]: %04X vs %04X\n", page * PAGE_WORDS + i, words_a[i], words_b[i]);
+                text += line;
+            }
+        }
+        return text;
+    }
+
+    void CoSim::describe(const Snapshot &from_reference, const Snapshot &from_candidate,
+                         const unsigned long long length, const std::string &difference) {
+        // Replays the round from its start, the candidate for k instructions and the reference up to the same
+        // count, until they first disagree
+        this->reference->restore(from_reference);
+        const unsigned long long start = this->reference->getCycles();
+        while (!this->recent.empty() && this->recent.back().cycles >= start) {
+            this->recent.pop_back();
+        }
+        while (!this->log.writes.empty() && this->log.writes.back().cycles >= start) {
+            this->log.writes.pop_back();
+        }
+        std::string found = difference;
+        for (unsigned long long k = 1; k <= length; k++) {
+            this->candidate->restore(from_candidate);
+            this->candidate_log.writes.clear();
+            this->candidate->run(k);
+            if (this->reference->getCycles() < this->candidate->getCycles()) {
+                this->stepReference(this->candidate->getCycles() - this->reference->getCycles());
+            }
+            Snapshot to_reference = this->reference->snapshot();
+            Snapshot to_candidate = this->candidate->snapshot();
+            if (std::string text = this->compare(writtenPages(from_reference, to_reference, from_candidate,
+                                                              to_candidate), start); !text.empty()) {
+                found = std::move(text);
+                break;
+            }
+        }
+
+        char line[96];
+        this->report.clear();
+        if (this->recent.empty() || this->recent.back().cycles < start) {
+            snprintf(line, sizeof(line), "candidate differs after cycle %llu\n", start);
+            this->report += line;
+        } else {
+            const Step &last = this->recent.back();
+            snprintf(line, sizeof(line), "candidate differs after instruction %llu at %04X (%s %04X %04X)\n",
+                     last.cycles + 1, last.pc, opcode_names[last.words[0] >> 11], last.words[0], last.words[1]);
+            this->report += line;
+        }
+        this->report += "reference instructions up to it:\n";
+        const size_t first = this->recent.size() > CONTEXT ? this->recent.size() - CONTEXT : 0;
+        auto write = this->log.writes.begin();
+        for (size_t i = first; i < this->recent.size(); i++) {
+            const Step &step = this->recent[i];
+            snprintf(line, sizeof(line), "  %10llu  %04X  %04X %04X  %-5s", step.cycles + 1, step.pc, step.words[0],
+                     step.words[1], opcode_names[step.words[0] >> 11]);
+            this->report += line;
+            for (; write != this->log.writes.end() && write->cycles <= step.cycles; ++write) {
+                if (write->cycles == step.cycles) {
+                    snprintf(line, sizeof(line), "  [%04X]=%04X", write->addr, write->value);
+                    this->report += line;
+                }
+            }
+            while (this->report.back() == ' ') {
+                this->report.pop_back();
+            }
+            this->report += "\n";
+        }
+        this->report += "reference vs candidate:\n" + found;
+    }
+
+    bool CoSim::run(const unsigned long long max_cycles) {
+        if (this->diverged) {
+            return false;
+        }
+        Snapshot from_reference = this->reference->snapshot();
+        Snapshot from_candidate = this->candidate->snapshot();
+        unsigned long long done = 0;
+        while (done < max_cycles && !this->halted()) {
+            // Earlier rounds only have to fill the context of a report
+            while (this->recent.size() > CONTEXT) {
+                this->recent.pop_front();
+            }
+            const unsigned long long oldest = this->recent.empty() ? 0 : this->recent.front().cycles;
+            while (!this->log.writes.empty() && this->log.writes.front().cycles < oldest) {
+                this->log.writes.pop_front();
+            }
+
+            const unsigned long long length = std::min(this->quantum, max_cycles - done);
+            const unsigned long long start = this->reference->getCycles();
+            this->candidate_log.writes.clear();
+            const unsigned long long executed = this->stepReference(length);
+            this->candidate->run(length);
+            Snapshot to_reference = this->reference->snapshot();
+            Snapshot to_candidate = this->candidate->snapshot();
+            if (const std::string text = this->compare(writtenPages(from_reference, to_reference, from_candidate,
+                                                                    to_candidate), start); !text.empty()) {
+                this->describe(from_reference, from_candidate, length, text);
+                this->diverged = true;
+                return false;
+            }
+            if (executed == 0) {
+                break; // Nothing left to execute
+            }
+            done += executed;
+            this->cycles += executed;
+            from_reference = std::move(to_reference);
+            from_candidate = std::move(to_candidate);
+        }
+        return true;
+    }
+
+    void CoSim::setFusion(const bool value) {
+        this->candidate->setFusion(value);
+    }
+
+    unsigned long long CoSim::getCycles() const {
+        return this->cycles;
+    }
+
+    bool CoSim::halted() const {
+        return !this->reference->isRunning() && !this->candidate->isRunning();
+    }
+
+    bool CoSim::hasDiverged() const {
+        return this->diverged;
+    }
+
+    const std::string &CoSim::getReport() const {
+        return this->report;
+    }
+
+    const virt16 &CoSim::getReference() const {
+        return *this->reference;
+    }
+
+    const virt16 &CoSim::getCandidate() const {
+        return *this->candidate;
+    }
+} // Virt16
@@ -0,0 +1,111 @@
+//
+// Lockstep co-simulation of two engines.
+//
+// A CoSim starts a reference VM driven by step() and a candidate VM on another engine from the same
+// state and runs them in rounds of at most `quantum` instructions, with the candidate free to execute
+// whole translated blocks. After every round it compares PC, registers, flags, run state, cycle and tick
+// counters and the memory pages either VM wrote. The reference records its memory writes in order for the
+// report. The candidate runs untouched so its fast paths are the ones being checked, unless its writes are
+// recorded too: then the write streams of every round have to match as well, which catches values that are
+// overwritten again before the round ends, and the candidate's loads and stores take the slow path. When a
+// round differs both VMs are put back to its start and replayed to find the first instruction after which the
+// candidate disagrees. An engine that only stops between blocks shows the divergence at the end of the block.
+//
+
+#ifndef VIRT16_COSIM_H
+#define VIRT16_COSIM_H
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "virt16.h"
+
+namespace Virt16 {
+    class CoSim {
+    private:
+        // Instruction the reference executed, cycles counts the ones before it
+        struct Step {
+            unsigned long long cycles;
+            unsigned short pc;
+            unsigned short words[2];
+        };
+
+        struct Write {
+            unsigned long long cycles;
+            unsigned short addr;
+            unsigned short value;
+        };
+
+        // Reference writes in order, every page of the reference is mapped to it
+        struct WriteLog : MemoryHook {
+            std::deque<Write> writes;
+
+            bool write(virt16 &vm, unsigned short addr, unsigned short value) override;
+        };
+
+        std::unique_ptr<virt16> reference;
+        std::unique_ptr<virt16> candidate;
+        WriteLog log;
+        // Candidate writes of the current round, mapped only if they are compared
+        WriteLog candidate_log;
+        bool compare_writes;
+        // Last CONTEXT reference instructions before the current round and the ones in it
+        std::deque<Step> recent;
+        unsigned long long quantum;
+        unsigned long long cycles = 0; // Instructions both executed and agreed on
+        bool diverged = false;
+        std::string report;
+
+        // Steps the reference up to count instructions while it runs, returns how many it executed
+        unsigned long long stepReference(unsigned long long count);
+
+        // Differences between the two VMs, pages lists the pages to compare and since the cycle from which on
+        // the write streams are compared. Empty if they agree.
+        [[nodiscard]] std::string compare(const std::vector<unsigned int> &pages, unsigned long long since) const;
+
+        // Finds the first instruction of the round starting at from_* that differs and describes it, the
+        // differences at the end of the round stand in if the replay agrees
+        void describe(const Snapshot &from_reference, const Snapshot &from_candidate, unsigned long long length,
+                      const std::string &difference);
+
+    public:
+        static constexpr unsigned long long DEFAULT_QUANTUM = 256;
+        // Reference instructions listed in front of a divergence
+        static constexpr unsigned int CONTEXT = 16;
+
+        // Both VMs start from start, the candidate on engine. With compare_writes the candidate's writes are
+        // recorded and compared in order.
+        CoSim(const Snapshot &start, Engine engine, unsigned long long quantum = DEFAULT_QUANTUM,
+              bool compare_writes = false);
+
+        CoSim(const CoSim &) = delete;
+
+        CoSim &operator=(const CoSim &) = delete;
+
+        // Runs until both halt, they diverge or max_cycles instructions were compared. Returns false on a
+        // divergence, getReport() then describes it. Can be called again to continue while they agree.
+        bool run(unsigned long long max_cycles = ~0ull);
+
+        // Runs the candidate with superinstructions, see virt16::setFusion()
+        void setFusion(bool value);
+
+        // Instructions both VMs executed with identical results
+        [[nodiscard]] unsigned long long getCycles() const;
+
+        // Both VMs stopped on HLT (or WAIT without devices) in the same state
+        [[nodiscard]] bool halted() const;
+
+        [[nodiscard]] bool hasDiverged() const;
+
+        // Divergence with the reference instructions leading to it and the state of both VMs
+        [[nodiscard]] const std::string &getReport() const;
+
+        [[nodiscard]] const virt16 &getReference() const;
+
+        [[nodiscard]] const virt16 &getCandidate() const;
+    };
+} // Virt16
+
+#endif //VIRT16_COSIM_H
@@ -0,0 +1,15 @@
+//
+// Opcode and PC edge coverage of the interpreter, see coverage.h.
+//
+
+#include "coverage.h"
+
+namespace Virt16 {
+    void Coverage::clear() {
+        for (const unsigned int counter: this->touched) {
+            this->hits[counter] = 0;
+        }
+        this->touched.clear();
+        this->previous = 0;
+    }
+} // Virt16
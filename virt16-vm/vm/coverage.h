@@ -0,0 +1,86 @@
+//
+// Opcode and PC edge coverage of the interpreter.
+//
+// A Coverage attached with virt16::setCoverage() counts what run() executes in a map of saturating byte
+// counters, the feedback of virt16-fuzz. The map has three sections:
+//   PAIRS      previous opcode x opcode x operand class, for instructions that continue with the next one
+//   TRANSFERS  previous opcode x opcode x transfer shape, for taken jumps, CALL, RET, IRET and interrupts
+//   EDGES      hashed (from PC, to PC) of the same control transfers, AFL style
+// The first two describe what the VM did independent of addresses, so they stay meaningful across fuzz
+// inputs that are all different programs. EDGES tells apart where the program went. Straight-line code adds
+// no PC edges, so inputs running through zeroed memory do not fill the map. touched lists the counters that
+// went from zero, so a caller never has to scan or clear the whole map.
+//
+
+#ifndef VIRT16_COVERAGE_H
+#define VIRT16_COVERAGE_H
+
+#include <cstddef>
+#include <vector>
+
+#include "virt16.h"
+
+namespace Virt16 {
+    class Coverage {
+    public:
+        // Previous opcode x opcode x operand class, see operands()
+        static constexpr size_t PAIRS = 0;
+        // Previous opcode x opcode x transfer shape, see transfer()
+        static constexpr size_t TRANSFERS = PAIRS + 32 * 32 * 8;
+        // Hashed (from, to) of every control transfer
+        static constexpr size_t EDGES = TRANSFERS + 32 * 32 * 32;
+        static constexpr unsigned int EDGE_BITS = 16;
+        static constexpr size_t SIZE = EDGES + (size_t{1} << EDGE_BITS);
+
+        unsigned char hits[SIZE]{};
+        // Counters that are not zero, in the order they were first hit
+        std::vector<unsigned int> touched;
+
+        // Counts the instruction op at at that continued at next
+        void record(const unsigned short at, const DecodedOp &op, const unsigned short next) {
+            const unsigned int pair = static_cast<unsigned int>(this->previous) << 5 | op.opcode;
+            if (next == static_cast<unsigned short>(at + 2)) {
+                this->count(static_cast<unsigned int>(PAIRS) + (pair << 3 | operands(op)));
+            } else {
+                this->count(static_cast<unsigned int>(TRANSFERS) + (pair << 5 | transfer(at, next)));
+                this->count(static_cast<unsigned int>(EDGES) + edge(at, next));
+            }
+            this->previous = op.opcode;
+        }
+
+        // Zeroes the touched counters and starts a new execution
+        void clear();
+
+    private:
+        unsigned char previous = 0;
+
+        void count(const unsigned int counter) {
+            unsigned char &hits = this->hits[counter];
+            if (hits == 0) {
+                this->touched.push_back(counter);
+            }
+            hits += hits != 0xFF;
+        }
+
+        // Backward, to another page, to an odd address, to the last word of a page (an instruction spanning two
+        // pages, never cached) and within 16 words
+        static unsigned int transfer(const unsigned short at, const unsigned short next) {
+            const unsigned int distance = next > at ? next - at : at - next;
+            return (next <= at) | ((next >> 8) != (at >> 8)) << 1 | (next & 1) << 2 | ((next & 0xFF) == 0xFF) << 3 |
+                   (distance <= 16) << 4;
+        }
+
+        static unsigned int edge(const unsigned short at, const unsigned short next) {
+            return (at * 0x9E3779B1u ^ next * 0x85EBCA6Bu) * 0xC2B2AE35u >> (32 - EDGE_BITS);
+        }
+
+        // An operand past P4, an operand in SP-P4, two operands naming the same register
+        static unsigned int operands(const DecodedOp &op) {
+            const auto special = [](const unsigned char r) { return r >= SP && r <= P4; };
+            return (op.x > P4 || op.y > P4 || op.z > P4) | (special(op.x) || special(op.y) || special(op.z)) << 1 |
+                   (op.x == op.y || op.y == op.z || op.x == op.z) << 2;
+        }
+    };
+} // Virt16
+
+#endif //VIRT16_COVERAGE_H
@@ -0,0 +1,336 @@
+//
+// Emulation thread, see emulator.h.
+//
+
+#include "emulator.h"
+
+#include <algorithm>
+
+namespace Virt16 {
+    Emulator::Emulator() : frames(std::make_unique<Frame[]>(3)),
+                           dirty(std::make_unique<std::atomic<unsigned long long>[]>(DIRTY_WORDS)),
+                           vm_dirty(std::make_unique<unsigned long long[]>(DIRTY_WORDS)),
+                           vm(std::make_unique<virt16>()),
+                           history(std::make_unique<History>(*this->vm)) {
+        this->bus.attach(P1, &this->keyboard);
+        this->vm->setBus(&this->bus);
+        this->last_publish = std::chrono::steady_clock::now();
+        // Give the frontend a valid frame before the thread starts
+        this->publish();
+        this->front = this->middle.exchange(this->front, std::memory_order_acq_rel) & ~FRESH;
+        this->thread = std::thread(&Emulator::loop, this);
+    }
+
+    Emulator::~Emulator() {
+        while (!this->post({Command::Quit, 0, 0, nullptr, nullptr})) {
+            std::this_thread::yield();
+        }
+        this->thread.join();
+        // Messages posted after Quit are never handled
+        for (unsigned int i = this->head; i != this->tail; i++) {
+            delete this->queue[i % QUEUE_SIZE].path;
+            delete this->queue[i % QUEUE_SIZE].image;
+        }
+    }
+
+    bool Emulator::post(const Message &message) {
+        const unsigned int tail = this->tail.load(std::memory_order_relaxed);
+        if (tail - this->head.load(std::memory_order_acquire) == QUEUE_SIZE) {
+            return false;
+        }
+        this->queue[tail % QUEUE_SIZE] = message;
+        this->tail.store(tail + 1, std::memory_order_release);
+        this->bus.ring();
+        return true;
+    }
+
+    bool Emulator::run() {
+        return this->post({Command::Run, 0, 0, nullptr, nullptr});
+    }
+
+    bool Emulator::stop() {
+        return this->post({Command::Stop, 0, 0, nullptr, nullptr});
+    }
+
+    bool Emulator::step() {
+        return this->post({Command::Step, 0, 0, nullptr, nullptr});
+    }
+
+    bool Emulator::stepBack(const unsigned long long count) {
+        return this->post({Command::StepBack, 0, count, nullptr, nullptr});
+    }
+
+    bool Emulator::backToWrite(const unsigned short addr) {
+        return this->post({Command::BackToWrite, addr, 0, nullptr, nullptr});
+    }
+
+    bool Emulator::reset() {
+        return this->post({Command::Reset, 0, 0, nullptr, nullptr});
+    }
+
+    bool Emulator::load(const char *path) {
+        auto *copy = new std::string(path);
+        if (!this->post({Command::Load, 0, 0, copy, nullptr})) {
+            delete copy;
+            return false;
+        }
+        return true;
+    }
+
+    bool Emulator::load(std::vector<unsigned short> image) {
+        auto *copy = new std::vector<unsigned short>(std::move(image));
+        if (!this->post({Command::LoadImage, 0, 0, nullptr, copy})) {
+            delete copy;
+            return false;
+        }
+        return true;
+    }
+
+    bool Emulator::setBreakpoint(const unsigned short addr, const BreakCondition condition) {
+        // The condition travels packed into the value
+        const unsigned long long value = condition.kind | condition.index << 8 | condition.value << 16;
+        return this->post({Command::SetBreakpoint, addr, value, nullptr, nullptr});
+    }
+
+    bool Emulator::clearBreakpoint(const unsigned short addr) {
+        return this->post({Command::ClearBreakpoint, addr, 0, nullptr, nullptr});
+    }
+
+    bool Emulator::setWatchpoint(const unsigned short addr, const unsigned char access) {
+        return this->post({Command::SetWatchpoint, addr, access, nullptr, nullptr});
+    }
+
+    bool Emulator::setMemory(const unsigned short addr, const unsigned short value) {
+        return this->post({Command::SetMemory, addr, value, nullptr, nullptr});
+    }
+
+    bool Emulator::setRegister(const Registers reg, const unsigned short value) {
+        return this->post({Command::SetRegister, static_cast<unsigned int>(reg), value, nullptr, nullptr});
+    }
+
+    bool Emulator::setEngine(const Engine engine) {
+        return this->post({Command::SetEngine, 0, static_cast<unsigned long long>(engine), nullptr, nullptr});
+    }
+
+    bool Emulator::setClock(const unsigned long long hz) {
+        return this->post({Command::SetClock, 0, hz, nullptr, nullptr});
+    }
+
+    bool Emulator::trackWrites(const unsigned short addr, const unsigned int count) {
+        return this->post({Command::TrackWrites, addr, count, nullptr, nullptr});
+    }
+
+    bool Emulator::pressKey(const unsigned char key) {
+        return this->bus.post(P1, key);
+    }
+
+    bool Emulator::takeDirty(unsigned long long *out) {
+        if (!this->any_dirty.exchange(false, std::memory_order_acquire)) {
+            return false;
+        }
+        for (unsigned int i = 0; i < DIRTY_WORDS; i++) {
+            if (this->dirty[i].load(std::memory_order_relaxed)) {
+                out[i] |= this->dirty[i].exchange(0, std::memory_order_acquire);
+            }
+        }
+        return true;
+    }
+
+    const Emulator::Frame &Emulator::latest() {
+        if (this->middle.load(std::memory_order_acquire) & FRESH) {
+            this->front = this->middle.exchange(this->front, std::memory_order_acq_rel) & ~FRESH;
+        }
+        return this->frames[this->front];
+    }
+
+    bool Emulator::handle(const Message &message) {
+        switch (message.command) {
+            case Command::Step:
+                if (!this->running) {
+                    this->history->step();
+                    this->at_breakpoint = this->vm->getHit().kind != DebugHit::None; // Watchpoint
+                }
+                break;
+            case Command::StepBack:
+                if (!this->running) {
+                    this->history->stepBack(message.value);
+                    this->at_breakpoint = false;
+                }
+                break;
+            case Command::BackToWrite:
+                if (!this->running) {
+                    this->history->backToWrite(static_cast<unsigned short>(message.target));
+                    this->at_breakpoint = false;
+                }
+                break;
+            case Command::Run:
+                if (!this->running) {
+                    this->running = true;
+                    this->at_breakpoint = false;
+                    this->clock.restart(this->vm->getTicks());
+                }
+                break;
+            case Command::Stop:
+                this->running = false;
+                this->vm->stop();
+                break;
+            case Command::Reset:
+                this->running = false;
+                this->at_breakpoint = false;
+                this->vm->reset();
+                this->history->clear();
+                break;
+            case Command::Load:
+                this->vm->load_program(message.path->c_str());
+                this->history->clear();
+                delete message.path;
+                break;
+            case Command::LoadImage:
+                this->vm->load(message.image->data(), static_cast<unsigned int>(message.image->size()));
+                this->history->clear();
+                delete message.image;
+                break;
+            case Command::SetBreakpoint: {
+                BreakCondition condition;
+                condition.kind = static_cast<BreakCondition::Kind>(message.value & 0xFF);
+                condition.index = static_cast<unsigned char>(message.value >> 8);
+                condition.value = static_cast<unsigned short>(message.value >> 16);
+                this->vm->setBreakpoint(message.target, condition);
+                break;
+            }
+            case Command::ClearBreakpoint:
+                this->vm->clearBreakpoint(message.target);
+                break;
+            case Command::SetWatchpoint:
+                this->vm->setWatchpoint(message.target, static_cast<unsigned char>(message.value));
+                break;
+            case Command::SetMemory:
+                this->vm->setMemory(message.target, static_cast<unsigned short>(message.value));
+                this->history->mark();
+                break;
+            case Command::SetRegister:
+                this->vm->setRegister(static_cast<Registers>(message.target), static_cast<unsigned short>(message.value));
+                this->history->mark();
+                break;
+            case Command::SetEngine:
+                this->vm->setEngine(static_cast<Engine>(message.value));
+                break;
+            case Command::SetClock:
+                this->clock.setFrequency(message.value, this->vm->getTicks());
+                break;
+            case Command::TrackWrites:
+                this->vm->trackWrites(message.target, static_cast<unsigned int>(message.value));
+                break;
+            case Command::Quit:
+                return false;
+        }
+        return true;
+    }
+
+    unsigned long long Emulator::execute(const unsigned long long max_cycles) {
+        // Breakpoints and watchpoints are checked by the VM, resuming from a breakpoint executes it first
+        const unsigned long long executed = this->history->run(max_cycles);
+        if (this->vm->getHit().kind != DebugHit::None) {
+            this->at_breakpoint = true;
+            this->running = false;
+        }
+        return executed;
+    }
+
+    void Emulator::publish() {
+        Frame &frame = this->frames[this->back];
+        for (int reg = R0; reg <= P4; reg++) {
+            frame.registers[reg] = this->vm->getRegister(static_cast<Registers>(reg));
+        }
+        frame.pc = this->vm->getPC();
+        for (int flag = Z; flag <= C; flag++) {
+            frame.flags[flag] = this->vm->getFlag(static_cast<Flags>(flag));
+        }
+        frame.running = this->running;
+        frame.waiting = this->vm->isWaiting();
+        frame.breakpoint = this->at_breakpoint;
+        frame.hit = this->at_breakpoint ? this->vm->getHit() : DebugHit{};
+        frame.engine = this->vm->getEngine();
+        frame.clock = this->clock.getFrequency();
+        frame.cycles = this->vm->getCycles();
+        frame.ticks = this->vm->getTicks();
+        frame.history_start = this->history->oldest();
+        frame.sequence = this->sequence++;
+        this->vm->getMemory(0, frame.memory, MEMORY_SIZE);
+
+        const auto now = std::chrono::steady_clock::now();
+        const double seconds = std::chrono::duration<double>(now - this->last_publish).count();
+        frame.cycles_per_second = this->running && seconds > 0 && frame.cycles >= this->last_publish_cycles
+                                      ? static_cast<double>(frame.cycles - this->last_publish_cycles) / seconds
+                                      : 0;
+        this->last_publish = now;
+        this->last_publish_cycles = frame.cycles;
+
+        this->back = this->middle.exchange(this->back | FRESH, std::memory_order_acq_rel) & ~FRESH;
+
+        // Every word marked here is already in the published frame
+        if (this->vm->takeDirty(this->vm_dirty.get())) {
+            for (unsigned int i = 0; i < DIRTY_WORDS; i++) {
+                if (this->vm_dirty[i]) {
+                    this->dirty[i].fetch_or(this->vm_dirty[i], std::memory_order_release);
+                    this->vm_dirty[i] = 0;
+                }
+            }
+            this->any_dirty.store(true, std::memory_order_release);
+        }
+    }
+
+    void Emulator::loop() {
+        const auto publish_interval = std::chrono::duration<double>(1.0 / PUBLISH_RATE);
+        while (true) {
+            // Commands and device events posted after this wake the sleeps below right away
+            const unsigned int seen = this->bus.rings();
+            bool changed = false;
+            for (unsigned int head = this->head.load(std::memory_order_relaxed);
+                 head != this->tail.load(std::memory_order_acquire); head++) {
+                const Message message = this->queue[head % QUEUE_SIZE];
+                this->head.store(head + 1, std::memory_order_release);
+                if (!this->handle(message)) {
+                    return;
+                }
+                changed = true;
+            }
+
+            if (!this->running) {
+                if (changed) {
+                    this->publish();
+                }
+                // Sleep until the frontend posts something
+                this->bus.sleep(seen);
+                continue;
+            }
+
+            unsigned long long budget = SLICE;
+            if (this->clock.getFrequency()) {
+                // Every instruction takes at least one tick, a slice that goes past the due ticks is waited off
+                budget = std::min(this->clock.due(this->vm->getTicks()), SLICE);
+                if (budget == 0) {
+                    // Still picks up commands every millisecond
+                    this->clock.wait(this->vm->getTicks(), std::chrono::milliseconds(1));
+                }
+            }
+
+            if (budget) {
+                this->execute(budget);
+                if (this->running && !this->vm->isRunning() && this->vm->isWaiting()) {
+                    // Asleep on WAIT without a device deadline, only a key press or a command wakes it
+                    this->publish();
+                    this->bus.sleep(seen);
+                    this->clock.restart(this->vm->getTicks());
+                    continue;
+                }
+                if (!this->vm->isRunning()) {
+                    this->running = false; // HLT
+                }
+            }
+            if (!this->running || std::chrono::steady_clock::now() - this->last_publish >= publish_interval) {
+                this->publish();
+            }
+        }
+    }
+} // Virt16
@@ -0,0 +1,176 @@
+//
+// Runs a virt16 on its own thread for interactive frontends.
+//
+// The frontend posts commands (run, stop, step, step back, reset, breakpoints, watchpoints, edits) through a
+// lock-free single-producer queue and reads the machine state from frames published through a triple buffer,
+// so neither side ever blocks the other. The emulation thread runs as fast as possible or paced to
+// a target clock rate by a Clock. Writes to tracked memory ranges are forwarded to the frontend as a dirty map.
+// The VM has a Bus with the hex keypad on P1, and a ROM asleep on WAIT leaves the thread asleep until a key or
+// a command arrives.
+//
+
+#ifndef VIRT16_EMULATOR_H
+#define VIRT16_EMULATOR_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bus.h"
+#include "clock.h"
+#include "history.h"
+#include "virt16.h"
+
+namespace Virt16 {
+    class Emulator {
+    public:
+        // Machine state as seen by the frontend, copied from the VM by the emulation thread
+        struct Frame {
+            unsigned short registers[P4 + 1];
+            unsigned short pc;
+            bool flags[C + 1]; // Indexed by Flags
+            bool running; // Emulation thread is executing (Run and not halted/stopped/at a breakpoint)
+            bool waiting; // The ROM is asleep on WAIT until a device raises an interrupt
+            bool breakpoint; // Stopped on a breakpoint or watchpoint
+            DebugHit hit; // The one that stopped it, while breakpoint is set
+            Engine engine;
+            unsigned long long clock; // Target clock ticks per second, 0 is unlimited
+            unsigned long long cycles;
+            unsigned long long ticks;
+            unsigned long long history_start; // Oldest cycle stepBack() can return to
+            double cycles_per_second; // Measured over the last publish interval
+            unsigned long long sequence; // Increments with every published frame
+            unsigned short memory[MEMORY_SIZE];
+        };
+
+    private:
+        enum class Command : unsigned char {
+            Step, StepBack, BackToWrite, Run, Stop, Reset, Load, LoadImage, SetBreakpoint, ClearBreakpoint,
+            SetWatchpoint, SetMemory, SetRegister, SetEngine, SetClock, TrackWrites, Quit
+        };
+
+        struct Message {
+            Command command;
+            unsigned int target; // Address or register
+            unsigned long long value;
+            std::string *path; // Load only, owned by the message
+            std::vector<unsigned short> *image; // LoadImage only, owned by the message
+        };
+
+        // Single producer (frontend), single consumer (emulation thread)
+        static constexpr unsigned int QUEUE_SIZE = 1024;
+        Message queue[QUEUE_SIZE]{};
+        alignas(64) std::atomic<unsigned int> head{0}; // Next slot to read, owned by the consumer
+        alignas(64) std::atomic<unsigned int> tail{0}; // Next slot to write, owned by the producer
+
+        // Triple buffer: the emulation thread fills frames[back] and swaps it with `middle`, the frontend
+        // swaps `middle` with frames[front] when it holds a newer frame
+        static constexpr unsigned int FRESH = 4;
+        std::unique_ptr<Frame[]> frames;
+        alignas(64) std::atomic<unsigned int> middle{1};
+        unsigned int back = 0; // Emulation thread only
+        unsigned int front = 2; // Frontend only
+
+        // Written words not yet taken by the frontend, only ORed in after the frame holding them was published
+        std::unique_ptr<std::atomic<unsigned long long>[]> dirty;
+        alignas(64) std::atomic<bool> any_dirty{false};
+        std::unique_ptr<unsigned long long[]> vm_dirty; // Emulation thread only
+
+        // Posts wake the emulation thread through its doorbell, commands ring it too
+        Bus bus;
+        Keyboard keyboard;
+
+        // Emulation thread only
+        std::unique_ptr<virt16> vm;
+        std::unique_ptr<History> history; // Checkpoints the VM while it runs, for stepping back
+        bool running = false;
+        bool at_breakpoint = false;
+        Clock clock;
+        unsigned long long sequence = 0;
+        std::chrono::steady_clock::time_point last_publish;
+        unsigned long long last_publish_cycles = 0;
+
+        std::thread thread;
+
+        bool post(const Message &message);
+
+        // Returns false once Quit was received
+        bool handle(const Message &message);
+
+        unsigned long long execute(unsigned long long max_cycles);
+
+        void publish();
+
+        void loop();
+
+    public:
+        // Executed between two checks of the command queue when the clock is unlimited
+        static constexpr unsigned long long SLICE = 200000;
+        // Frames published per second while running
+        static constexpr unsigned int PUBLISH_RATE = 120;
+
+        Emulator();
+
+        Emulator(const Emulator &) = delete;
+
+        Emulator &operator=(const Emulator &) = delete;
+
+        // Commands are applied in order by the emulation thread. They return false when the queue is full.
+        bool run();
+
+        bool stop();
+
+        bool step();
+
+        // Goes back count instructions while stopped, as far as the history reaches
+        bool stepBack(unsigned long long count = 1);
+
+        // Goes back to right before the last instruction that wrote addr while stopped
+        bool backToWrite(unsigned short addr);
+
+        bool reset();
+
+        // Loads a ROM at address 0 like virt16::load_program()
+        bool load(const char *path);
+
+        // Stores words from address 0, e.g. an Assembly image
+        bool load(std::vector<unsigned short> image);
+
+        // Stops Run in front of the instruction at addr while condition holds
+        bool setBreakpoint(unsigned short addr, BreakCondition condition = {});
+
+        bool clearBreakpoint(unsigned short addr);
+
+        // Stops Run after instructions accessing addr, access is a combination of WatchAccess flags, 0 clears
+        bool setWatchpoint(unsigned short addr, unsigned char access);
+
+        bool setMemory(unsigned short addr, unsigned short value);
+
+        bool setRegister(Registers reg, unsigned short value);
+
+        bool setEngine(Engine engine);
+
+        // Target clock rate in ticks per second (see OPCODE_TICKS), 0 runs as fast as possible
+        bool setClock(unsigned long long hz);
+
+        // Presses key 0x0-0xF of the hex keypad on P1, see Keyboard. Returns false when the bus queue is full.
+        bool pressKey(unsigned char key);
+
+        // Reports writes to count words from addr through takeDirty(), see virt16::trackWrites()
+        bool trackWrites(unsigned short addr, unsigned int count);
+
+        // ORs the tracked words written since the last call into out (DIRTY_WORDS entries), returns false if
+        // there were none. Call it before latest() so the frame holds the written values. Frontend thread only.
+        bool takeDirty(unsigned long long *out);
+
+        // Latest published frame, valid until the next call. Frontend thread only.
+        const Frame &latest();
+
+        ~Emulator();
+    };
+} // Virt16
+
+#endif //VIRT16_EMULATOR_H
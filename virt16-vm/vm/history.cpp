@@ -0,0 +1,176 @@
+//
+// Reverse execution, see history.h.
+//
+
+#include "history.h"
+
+#include <algorithm>
+
+namespace Virt16 {
+    History::History(virt16 &vm, const size_t budget, const unsigned long long interval)
+        : vm(vm), budget(budget), interval(std::max(interval, 1ull)) {
+        this->vm.setHistory(this);
+        this->mark();
+    }
+
+    History::~History() {
+        this->vm.setHistory(nullptr);
+    }
+
+    unsigned long long History::run(const unsigned long long max_cycles) {
+        unsigned long long executed = 0;
+        while (executed < max_cycles) {
+            const unsigned long long next = this->checkpoints.back().cycle + this->interval;
+            if (this->vm.getCycles() >= next) {
+                this->mark();
+                continue;
+            }
+            // Slices end on checkpoint boundaries, so every write lies between the checkpoints around it
+            const unsigned long long ran = this->vm.run(std::min(max_cycles - executed, next - this->vm.getCycles()));
+            executed += ran;
+            if (ran == 0 || !this->vm.isRunning()) {
+                break;
+            }
+        }
+        return executed;
+    }
+
+    void History::step() {
+        if (this->vm.getCycles() >= this->checkpoints.back().cycle + this->interval) {
+            this->mark();
+        }
+        this->vm.step();
+    }
+
+    void History::mark() {
+        if (!this->checkpoints.empty() && this->checkpoints.back().cycle == this->vm.getCycles()) {
+            this->checkpoint_bytes -= this->checkpoints.back().bytes;
+            this->checkpoints.pop_back();
+        }
+        Snapshot state = this->vm.snapshot();
+        const unsigned int pages = this->checkpoints.empty()
+                                       ? PAGE_COUNT
+                                       : state.distinctPages(this->checkpoints.back().state);
+        const size_t bytes = sizeof(Checkpoint) + pages * sizeof(Page);
+        this->checkpoints.push_back({
+            this->vm.getCycles(), std::move(state), this->journal_base + this->journal.size(), bytes
+        });
+        this->checkpoint_bytes += bytes;
+        this->trim();
+    }
+
+    void History::clear() {
+        this->checkpoints.clear();
+        this->journal.clear();
+        this->journal_base = 0;
+        this->checkpoint_bytes = 0;
+        this->mark();
+    }
+
+    void History::trim() {
+        while (this->memoryUsage() > this->budget && this->checkpoints.size() > 1) {
+            this->checkpoint_bytes -= this->checkpoints.front().bytes;
+            this->checkpoints.pop_front();
+            // The new oldest checkpoint now holds every page it shared with the dropped one
+            Checkpoint &oldest = this->checkpoints.front();
+            this->checkpoint_bytes += sizeof(Checkpoint) + PAGE_COUNT * sizeof(Page) - oldest.bytes;
+            oldest.bytes = sizeof(Checkpoint) + PAGE_COUNT * sizeof(Page);
+            while (this->journal_base < oldest.write) {
+                this->journal.pop_front();
+                this->journal_base++;
+            }
+        }
+        // Newer writes stay, so the last write to an address is either found or older than the journal
+        while (this->memoryUsage() > this->budget && !this->journal.empty()) {
+            this->journal.pop_front();
+            this->journal_base++;
+        }
+    }
+
+    void History::replay(const unsigned long long cycle) {
+        const Engine engine = this->vm.getEngine();
+        this->vm.setEngine(Engine::Switch);
+        // Devices were checkpointed when they changed the VM, the replay must not take new events
+        Bus *bus = this->vm.getBus();
+        this->vm.setBus(nullptr);
+        while (this->vm.getCycles() < cycle) {
+            if (this->vm.run(cycle - this->vm.getCycles()) == 0 && this->vm.isWaiting()) {
+                break; // Woken by an interrupt that was not checkpointed
+            }
+        }
+        this->vm.setBus(bus);
+        this->vm.setEngine(engine);
+    }
+
+    bool History::seek(const unsigned long long cycle) {
+        if (cycle < this->oldest()) {
+            return false;
+        }
+        while (this->checkpoints.back().cycle > cycle) {
+            this->checkpoint_bytes -= this->checkpoints.back().bytes;
+            this->checkpoints.pop_back();
+        }
+        const Checkpoint &from = this->checkpoints.back();
+        // The replay journals the writes up to cycle again
+        this->journal.resize(std::max(from.write, this->journal_base) - this->journal_base);
+        this->vm.restore(from.state);
+        this->replay(cycle);
+        return true;
+    }
+
+    unsigned long long History::stepBack(const unsigned long long count) {
+        const unsigned long long now = this->vm.getCycles();
+        if (now <= this->oldest()) {
+            return 0;
+        }
+        const unsigned long long target = now - std::min(count, now - this->oldest());
+        this->seek(target);
+        return now - target;
+    }
+
+    bool History::backToWrite(const unsigned short addr) {
+        size_t index = this->journal.size();
+        while (index > 0 && this->journal[index - 1].addr != addr) {
+            index--;
+        }
+        if (index == 0) {
+            return false;
+        }
+        const unsigned long long write = this->journal_base + index - 1;
+
+        // The write happened between the last checkpoint before it and the next one
+        const auto after = std::upper_bound(this->checkpoints.begin(), this->checkpoints.end(), write,
+                                            [](const unsigned long long w, const Checkpoint &checkpoint) {
+                                                return w < checkpoint.write;
+                                            });
+        if (after == this->checkpoints.begin()) {
+            return false;
+        }
+        const unsigned long long until = after == this->checkpoints.end() ? this->vm.getCycles() : after->cycle;
+
+        // Replay that interval without journaling to find the cycle of the last write
+        this->vm.restore(std::prev(after)->state);
+        this->searching = true;
+        this->watch = addr;
+        this->watch_before = until;
+        this->watch_found = false;
+        this->replay(until);
+        this->searching = false;
+
+        // Not found when the write was made from outside, the checkpoint taken after it is the closest state
+        return this->seek(this->watch_found ? this->watch_hit : until);
+    }
+
+    unsigned long long History::oldest() const {
+        return this->checkpoints.front().cycle;
+    }
+
+    size_t History::memoryUsage() const {
+        return this->checkpoint_bytes + this->journal.size() * sizeof(Write);
+    }
+
+    void History::setBudget(const size_t bytes) {
+        this->budget = bytes;
+        this->trim();
+    }
+} // Virt16
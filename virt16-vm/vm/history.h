@@ -0,0 +1,113 @@
+//
+// Reverse execution.
+//
+// A History attached to a VM checkpoints it every `interval` cycles and journals every memory write in
+// between. Checkpoints are snapshots, so each one only costs the pages written since the previous one.
+// Going back restores the newest checkpoint before the target and replays forward on the switch engine,
+// which takes at most one interval of instructions. The oldest checkpoints and writes are dropped once
+// they exceed the memory budget, which limits how far back the VM can go.
+//
+
+#ifndef VIRT16_HISTORY_H
+#define VIRT16_HISTORY_H
+
+#include <deque>
+
+#include "virt16.h"
+
+namespace Virt16 {
+    class History {
+    private:
+        struct Checkpoint {
+            unsigned long long cycle;
+            Snapshot state;
+            unsigned long long write; // Number of the first journal entry after it
+            size_t bytes; // Pages not shared with the previous checkpoint
+        };
+
+        // Writes are located by the checkpoints around them, the cycle is found again by replaying
+        struct Write {
+            unsigned short addr;
+            unsigned short value;
+        };
+
+        virt16 &vm;
+        size_t budget;
+        unsigned long long interval;
+        std::deque<Checkpoint> checkpoints;
+        std::deque<Write> journal;
+        unsigned long long journal_base = 0; // Number of the first journal entry
+        size_t checkpoint_bytes = 0;
+
+        // While searching for a write, writes are compared against watch instead of being journaled
+        bool searching = false;
+        unsigned short watch = 0;
+        unsigned long long watch_before = 0;
+        unsigned long long watch_hit = 0;
+        bool watch_found = false;
+
+        // Drops the oldest checkpoints and writes until the history fits in the budget
+        void trim();
+
+        // Goes to cycle from the newest checkpoint at or before it and forgets everything after it
+        bool seek(unsigned long long cycle);
+
+        // Runs the switch engine without the bus until cycle, HLT is skipped over
+        void replay(unsigned long long cycle);
+
+    public:
+        static constexpr size_t DEFAULT_BUDGET = 64ull << 20;
+        static constexpr unsigned long long DEFAULT_INTERVAL = 100000;
+
+        // Attaches to vm and checkpoints its current state
+        explicit History(virt16 &vm, size_t budget = DEFAULT_BUDGET, unsigned long long interval = DEFAULT_INTERVAL);
+
+        History(const History &) = delete;
+
+        History &operator=(const History &) = delete;
+
+        // virt16::run() that takes the checkpoints on the way, use it instead of running the VM directly
+        unsigned long long run(unsigned long long max_cycles);
+
+        void step();
+
+        // Called by the VM
+        void logWrite(const unsigned int addr, const unsigned short value) {
+            if (this->searching) [[unlikely]] {
+                if (addr == this->watch && this->vm.getCycles() < this->watch_before) {
+                    this->watch_hit = this->vm.getCycles();
+                    this->watch_found = true;
+                }
+                return;
+            }
+            this->journal.push_back({static_cast<unsigned short>(addr), value});
+        }
+
+        // Checkpoints the current state, replacing a checkpoint of the same cycle. Call it after changing the
+        // VM from outside (setMemory(), setRegister()) so replays start after the change.
+        void mark();
+
+        // Forgets everything and checkpoints the current state, for reset() and loading a ROM
+        void clear();
+
+        // Returns to the state count instructions ago, or as far back as the history reaches. Returns the
+        // number of instructions actually stepped back.
+        unsigned long long stepBack(unsigned long long count);
+
+        // Returns to the state right before the last instruction that wrote addr, so stepping executes the
+        // write again. Returns false if no write to addr is recorded.
+        bool backToWrite(unsigned short addr);
+
+        // Oldest cycle stepBack() can reach
+        [[nodiscard]] unsigned long long oldest() const;
+
+        // Estimated memory held by checkpoints and the journal
+        [[nodiscard]] size_t memoryUsage() const;
+
+        void setBudget(size_t bytes);
+
+        ~History();
+    };
+} // Virt16
+
+#endif //VIRT16_HISTORY_H
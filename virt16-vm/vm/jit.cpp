@@ -0,0 +1,1023 @@
+//
+// Basic block JIT for x86-64 hosts, see jit.h for the overview.
+//
+// Register conventions inside translated code:
+//   r15      virt16 * (memory, registers, decoded cache, pc and flags are addressed from it)
+//   r14      Jit::State * (budget, SMC flag, translated words and block entries)
+//   rbx, rbp, r12, r13  Virt16 registers cached for the current block, zero-extended 16-bit values
+//   rax, rcx, rdx, rsi, rdi  scratch
+// Every block starts with a budget check, so chained blocks still stop at the exact cycle.
+//
+
+#include <cstddef>
+#include <cstring>
+
+#include "jit.h"
+#include "opcodes.h"
+#include "history.h"
+#include "trace.h"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define VIRT16_JIT_X86_64 1
+#include <sys/mman.h>
+#else
+#define VIRT16_JIT_X86_64 0
+#endif
+
+namespace Virt16 {
+#if VIRT16_JIT_X86_64
+    namespace {
+        // Host registers, R8-R15 are qualified where used since Virt16::Registers has the same names
+        namespace x86 {
+            enum Reg { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+        }
+
+        using x86::Reg, x86::RAX, x86::RCX, x86::RDX, x86::RBX, x86::RSP, x86::RBP, x86::RSI, x86::RDI;
+        constexpr Reg SLOT = x86::R8; // Word index within a page for memory accesses
+
+        constexpr int NONE = -1;
+        constexpr Reg VM = x86::R15;
+        constexpr Reg STATE = x86::R14;
+        // Callee-saved registers, preserved by the trampoline
+        constexpr Reg CACHE_REGS[] = {RBX, RBP, x86::R12, x86::R13};
+
+        enum Cond { CC_B = 0x2, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7 };
+
+        // ALU opcodes (r/m32, r32)
+        enum Alu { ALU_ADD = 0x01, ALU_OR = 0x09, ALU_AND = 0x21, ALU_SUB = 0x29, ALU_XOR = 0x31, ALU_CMP = 0x39 };
+
+        // Room reserved for one block, the largest instruction sequences are well below 300 bytes
+        constexpr unsigned long BLOCK_RESERVE = 64 * 1024;
+
+        struct Mem {
+            int base;
+            int index;
+            int scale;
+            int disp;
+        };
+
+        // Minimal x86-64 encoder, memory operands always use a 32-bit displacement
+        class Emitter {
+        public:
+            unsigned char *p;
+
+            explicit Emitter(unsigned char *at) : p(at) {}
+
+            void u8(const unsigned v) { *p++ = static_cast<unsigned char>(v); }
+
+            void u16(const unsigned v) {
+                u8(v);
+                u8(v >> 8);
+            }
+
+            void u32(const unsigned v) {
+                u16(v);
+                u16(v >> 16);
+            }
+
+            void rex(const bool w, const int reg, const int index, const int base) {
+                const unsigned v = 0x40 | (w << 3) | (((reg >> 3) & 1) << 2) |
+                                   (index != NONE ? ((index >> 3) & 1) << 1 : 0) |
+                                   (base != NONE ? (base >> 3) & 1 : 0);
+                if (v != 0x40) {
+                    u8(v);
+                }
+            }
+
+            void rr(const int reg, const int rm) { u8(0xC0 | ((reg & 7) << 3) | (rm & 7)); }
+
+            void mem(const int reg, const Mem &m) {
+                if (m.index == NONE && (m.base & 7) != RSP) {
+                    u8(0x80 | ((reg & 7) << 3) | (m.base & 7));
+                } else {
+                    const int ss = m.scale == 8 ? 3 : m.scale == 4 ? 2 : m.scale == 2 ? 1 : 0;
+                    u8(0x84 | ((reg & 7) << 3));
+                    u8((ss << 6) | (((m.index == NONE ? RSP : m.index) & 7) << 3) | (m.base & 7));
+                }
+                u32(m.disp);
+            }
+
+            // movzx r32, word [m]
+            void load16(const int dst, const Mem &m) {
+                rex(false, dst, m.index, m.base);
+                u8(0x0F);
+                u8(0xB7);
+                mem(dst, m);
+            }
+
+            // movzx r32, r16
+            void zext16(const int dst, const int src) {
+                rex(false, dst, NONE, src);
+                u8(0x0F);
+                u8(0xB7);
+                rr(dst, src);
+            }
+
+            // mov word [m], r16
+            void store16(const Mem &m, const int src) {
+                u8(0x66);
+                rex(false, src, m.index, m.base);
+                u8(0x89);
+                mem(src, m);
+            }
+
+            // mov word [m], imm16
+            void store16(const Mem &m, const unsigned imm) {
+                u8(0x66);
+                rex(false, 0, m.index, m.base);
+                u8(0xC7);
+                mem(0, m);
+                u16(imm);
+            }
+
+            // mov byte [m], imm8
+            void store8(const Mem &m, const unsigned imm) {
+                rex(false, 0, m.index, m.base);
+                u8(0xC6);
+                mem(0, m);
+                u8(imm);
+            }
+
+            // cmp byte [m], imm8
+            void cmp8(const Mem &m, const unsigned imm) {
+                rex(false, 0, m.index, m.base);
+                u8(0x80);
+                mem(7, m);
+                u8(imm);
+            }
+
+            // test byte [m], imm8
+            void test8(const Mem &m, const unsigned imm) {
+                rex(false, 0, m.index, m.base);
+                u8(0xF6);
+                mem(0, m);
+                u8(imm);
+            }
+
+            // or byte [m], r8 (al, cl, dl only)
+            void or8(const Mem &m, const int src) {
+                rex(false, src, m.index, m.base);
+                u8(0x08);
+                mem(src, m);
+            }
+
+            // op qword [m], imm32 with op = /0 add, /5 sub, /7 cmp
+            void alu64(const int ext, const Mem &m, const unsigned imm) {
+                rex(true, 0, m.index, m.base);
+                u8(0x81);
+                mem(ext, m);
+                u32(imm);
+            }
+
+            // mov r64, qword [m]
+            void load64(const int dst, const Mem &m) {
+                rex(true, dst, m.index, m.base);
+                u8(0x8B);
+                mem(dst, m);
+            }
+
+            void mov(const int dst, const int src) {
+                rex(false, src, NONE, dst);
+                u8(0x89);
+                rr(src, dst);
+            }
+
+            void mov64(const int dst, const int src) {
+                rex(true, src, NONE, dst);
+                u8(0x89);
+                rr(src, dst);
+            }
+
+            void movi(const int dst, const unsigned imm) {
+                rex(false, 0, NONE, dst);
+                u8(0xB8 | (dst & 7));
+                u32(imm);
+            }
+
+            void alu(const Alu op, const int dst, const int src) {
+                rex(false, src, NONE, dst);
+                u8(op);
+                rr(src, dst);
+            }
+
+            // op r32, imm32 with op = /0 add, /4 and, /5 sub, /7 cmp
+            void alui(const int ext, const int dst, const unsigned imm) {
+                rex(false, 0, NONE, dst);
+                u8(0x81);
+                rr(ext, dst);
+                u32(imm);
+            }
+
+            void inc(const int r) {
+                rex(false, 0, NONE, r);
+                u8(0xFF);
+                rr(0, r);
+            }
+
+            void dec(const int r) {
+                rex(false, 0, NONE, r);
+                u8(0xFF);
+                rr(1, r);
+            }
+
+            void bitwise_not(const int r) {
+                rex(false, 0, NONE, r);
+                u8(0xF7);
+                rr(2, r);
+            }
+
+            // shl/shr r32, cl
+            void shift(const int ext, const int r) {
+                rex(false, 0, NONE, r);
+                u8(0xD3);
+                rr(ext, r);
+            }
+
+            void shri(const int r, const unsigned n) {
+                rex(false, 0, NONE, r);
+                u8(0xC1);
+                rr(5, r);
+                u8(n);
+            }
+
+            // setcc r8 (al, cl, dl only)
+            void setcc(const Cond cc, const int r) {
+                u8(0x0F);
+                u8(0x90 | cc);
+                rr(0, r);
+            }
+
+            void movi64(const int dst, const unsigned long long imm) {
+                rex(true, 0, NONE, dst);
+                u8(0xB8 | (dst & 7));
+                u32(static_cast<unsigned>(imm));
+                u32(static_cast<unsigned>(imm >> 32));
+            }
+
+            void call(const int r) {
+                rex(false, 0, NONE, r);
+                u8(0xFF);
+                rr(2, r);
+            }
+
+            void test64(const int a, const int b) {
+                rex(true, b, NONE, a);
+                u8(0x85);
+                rr(b, a);
+            }
+
+            void jmp(const int r) {
+                rex(false, 0, NONE, r);
+                u8(0xFF);
+                rr(4, r);
+            }
+
+            void push(const int r) {
+                rex(false, 0, NONE, r);
+                u8(0x50 | (r & 7));
+            }
+
+            void pop(const int r) {
+                rex(false, 0, NONE, r);
+                u8(0x58 | (r & 7));
+            }
+
+            // Jumps return the end of the instruction, the rel32 sits right before it
+            unsigned char *jcc(const Cond cc) {
+                u8(0x0F);
+                u8(0x80 | cc);
+                u32(0);
+                return p;
+            }
+
+            unsigned char *jmp() {
+                u8(0xE9);
+                u32(0);
+                return p;
+            }
+
+            static void patch(unsigned char *end, const unsigned char *target) {
+                const auto rel = static_cast<int>(target - end);
+                std::memcpy(end - 4, &rel, 4);
+            }
+        };
+
+        struct Instr {
+            unsigned short addr;
+            DecodedOp op;
+        };
+
+        bool is_terminator(const unsigned char opcode) {
+            switch (opcode) {
+                case JMP: case JZ: case JE: case JNE: case JG: case JL: case CALL: case RET: case HLT:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        // Registers read or written by an instruction, used to pick the ones worth caching
+        int register_uses(const DecodedOp &op, int uses[3]) {
+            switch (op.opcode) {
+                case LOAD_IMM: case LOAD_ADDR: case INC: case DEC:
+                    uses[0] = op.x;
+                    return 1;
+                case STORE_ADDR: case MOV: case NOT: case CMP:
+                    uses[0] = op.x;
+                    uses[1] = op.y;
+                    return 2;
+                case ADD: case SUB: case AND: case OR: case XOR: case SHL: case SHR:
+                    uses[0] = op.x;
+                    uses[1] = op.y;
+                    uses[2] = op.z;
+                    return 3;
+                case PUSH: case POP:
+                    uses[0] = op.x;
+                    uses[1] = SP;
+                    return 2;
+                case CALL: case RET:
+                    uses[0] = SP;
+                    return 1;
+                default:
+                    return 0;
+            }
+        }
+
+        bool writes_register(const DecodedOp &op, const int reg) {
+            switch (op.opcode) {
+                case LOAD_IMM: case LOAD_ADDR: case MOV: case INC: case DEC:
+                case AND: case OR: case XOR: case NOT: case SHL: case SHR:
+                    return op.x == reg;
+                case POP:
+                    return op.x == reg || reg == SP;
+                case PUSH: case CALL: case RET:
+                    return reg == SP;
+                default:
+                    return false;
+            }
+        }
+    }
+
+    Jit::Jit(virt16 &vm) : vm(vm) {
+        void *cache = mmap(nullptr, CODE_CACHE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (cache == MAP_FAILED) {
+            return;
+        }
+        this->code = static_cast<unsigned char *>(cache);
+        this->code_size = CODE_CACHE_SIZE;
+        this->state = new State{};
+
+        // void trampoline(virt16 *vm, State *state, void *block)
+        Emitter e(this->code);
+        for (const Reg r: {RBX, RBP, x86::R12, x86::R13, x86::R14, x86::R15}) {
+            e.push(r);
+        }
+        e.u8(0x48); // sub rsp, 8 (keep the stack 16-byte aligned)
+        e.u8(0x83);
+        e.u8(0xEC);
+        e.u8(0x08);
+        e.mov64(VM, RDI);
+        e.mov64(STATE, RSI);
+        e.jmp(RDX);
+
+        this->epilogue = e.p;
+        e.u8(0x48); // add rsp, 8
+        e.u8(0x83);
+        e.u8(0xC4);
+        e.u8(0x08);
+        for (const Reg r: {x86::R15, x86::R14, x86::R13, x86::R12, RBP, RBX}) {
+            e.pop(r);
+        }
+        e.u8(0xC3); // ret
+
+        this->trampoline_size = e.p - this->code;
+        this->cursor = e.p;
+        this->trampoline = reinterpret_cast<Trampoline>(this->code);
+        if (!this->protect(true)) {
+            // W^X policies (SELinux execmem, PaX) refuse executable pages that were writable
+            munmap(this->code, this->code_size);
+            this->code = nullptr;
+        }
+    }
+
+    Jit::~Jit() {
+        if (this->code) {
+            munmap(this->code, this->code_size);
+        }
+        delete this->state;
+    }
+
+    bool Jit::ready() const {
+        return this->code != nullptr;
+    }
+
+    bool Jit::protect(const bool executable) {
+        return mprotect(this->code, this->code_size, executable ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE) == 0;
+    }
+
+    void Jit::flush() {
+        if (!this->state) {
+            return;
+        }
+        std::memset(this->state->code_words, 0, sizeof(this->state->code_words));
+        std::memset(this->state->entry, 0, sizeof(this->state->entry));
+        std::memset(this->block_length, 0, sizeof(this->block_length));
+        std::memset(this->hits, 0, sizeof(this->hits));
+        for (unsigned char &flags: this->vm.page_flags) {
+            flags &= ~PAGE_CODE;
+        }
+        this->pending.clear();
+        this->cursor = this->code + this->trampoline_size;
+    }
+
+    void Jit::invalidate(const unsigned int addr) {
+        if (this->state && this->state->code_words[addr & 0xFFFF]) {
+            this->flush();
+        }
+    }
+
+    void *Jit::translate(const unsigned short start) {
+        // Collect the block
+        Instr block[MAX_BLOCK_INSTRUCTIONS];
+        int n = 0;
+        for (unsigned short addr = start; n < MAX_BLOCK_INSTRUCTIONS; addr += 2) {
+            const DecodedOp &op = this->vm.decode(addr);
+            if (op.opcode > NOP) {
+                break; // IRET, WAIT or an invalid opcode, leave it to the interpreter
+            }
+            block[n++] = {addr, op};
+            if (is_terminator(op.opcode)) {
+                break;
+            }
+        }
+        if (n == 0) {
+            return nullptr;
+        }
+
+        if (this->cursor + BLOCK_RESERVE > this->code + this->code_size) {
+            this->flush();
+        }
+        if (!this->protect(false)) {
+            return nullptr;
+        }
+
+        // Cache the most used registers of the block
+        int counts[32]{};
+        unsigned int block_ticks = 0;
+        for (int i = 0; i < n; i++) {
+            int uses[3];
+            const int count = register_uses(block[i].op, uses);
+            for (int u = 0; u < count; u++) {
+                counts[uses[u]]++;
+            }
+            block_ticks += OPCODE_TICKS[block[i].op.opcode];
+        }
+        // Blocks that never look at TIME advance it once on entry, the others before every instruction
+        const bool uses_time = counts[TIME] != 0;
+        if (uses_time) {
+            counts[TIME] += n;
+        }
+        int cached[32];
+        bool written[32]{};
+        std::fill(std::begin(cached), std::end(cached), NONE);
+        int cached_regs[std::size(CACHE_REGS)];
+        int cached_count = 0;
+        for (const Reg host: CACHE_REGS) {
+            int best = NONE;
+            for (int r = 0; r < 32; r++) {
+                if (cached[r] == NONE && counts[r] >= 2 && (best == NONE || counts[r] > counts[best])) {
+                    best = r;
+                }
+            }
+            if (best == NONE) {
+                break;
+            }
+            cached[best] = host;
+            cached_regs[cached_count++] = best;
+            for (int i = 0; i < n; i++) {
+                written[best] |= writes_register(block[i].op, best) || best == TIME;
+            }
+        }
+
+        const auto offset = [this](const void *field) {
+            return static_cast<int>(static_cast<const char *>(field) - reinterpret_cast<const char *>(&this->vm));
+        };
+        const int off_regs = offset(this->vm.registers);
+        const int off_pages = offset(this->vm.pages);
+        const int off_flags = offset(this->vm.page_flags);
+        const int off_words = static_cast<int>(offsetof(Page, words));
+        const int off_ops = static_cast<int>(offsetof(Page, ops) + offsetof(DecodedOp, opcode));
+        const int off_fused = static_cast<int>(offsetof(Page, ops) + offsetof(DecodedOp, fused));
+        const Mem pc_mem{VM, NONE, 1, offset(&this->vm.pc)};
+        const Mem running_mem{VM, NONE, 1, offset(&this->vm.running)};
+        const Mem remaining_mem{STATE, NONE, 1, static_cast<int>(offsetof(State, remaining))};
+        const Mem ticks_mem{VM, NONE, 1, offset(&this->vm.ticks)};
+        const Mem smc_mem{STATE, NONE, 1, static_cast<int>(offsetof(State, smc))};
+        const int off_entry = static_cast<int>(offsetof(State, entry));
+        const auto reg_mem = [&](const int r) { return Mem{VM, NONE, 1, off_regs + 2 * r}; };
+        const auto flag_mem = [&](const bool &flag) { return Mem{VM, NONE, 1, offset(&flag)}; };
+
+        Emitter e(this->cursor);
+        unsigned char *const entry = e.p;
+
+        const auto load = [&](const int dst, const int r) {
+            if (cached[r] != NONE) {
+                e.mov(dst, cached[r]);
+            } else {
+                e.load16(dst, reg_mem(r));
+            }
+        };
+        const auto store = [&](const int r, const int src) {
+            if (cached[r] != NONE) {
+                e.zext16(cached[r], src);
+            } else {
+                e.store16(reg_mem(r), src);
+            }
+        };
+        const auto flush_registers = [&] {
+            for (int i = 0; i < cached_count; i++) {
+                if (written[cached_regs[i]]) {
+                    e.store16(reg_mem(cached_regs[i]), cached[cached_regs[i]]);
+                }
+            }
+        };
+        // Exit to a known address, chained straight into its block when it is translated
+        const auto exit_to = [&](const unsigned short target) {
+            flush_registers();
+            e.store16(pc_mem, static_cast<unsigned>(target));
+            unsigned char *jump = e.jmp();
+            if (this->state->entry[target]) {
+                Emitter::patch(jump, static_cast<unsigned char *>(this->state->entry[target]));
+            } else {
+                Emitter::patch(jump, this->epilogue);
+                this->pending[target].push_back(jump);
+            }
+        };
+        // rdx = page of addr (zero-extended 16-bit value in a register), SLOT = word index within it
+        const auto page_of = [&](const int addr) {
+            e.mov(RDX, addr);
+            e.shri(RDX, 8);
+            e.load64(RDX, Mem{VM, RDX, 8, off_pages});
+            e.mov(SLOT, addr);
+            e.alui(4, SLOT, 0xFF);
+        };
+        // Reads of mapped pages go through Jit::read() out of line, the check is only emitted while the VM has
+        // hooks since mapMemory() flushes the cache
+        struct SlowRead {
+            unsigned char *jump;
+            unsigned char *back;
+            int addr;
+            int dst;
+        };
+        std::vector<SlowRead> slow_reads;
+        const bool mapped = this->vm.hooks != nullptr;
+        const auto read = [&](const int dst, const int addr) {
+            unsigned char *slow = nullptr;
+            if (mapped) {
+                e.mov(RDX, addr);
+                e.shri(RDX, 8);
+                e.test8(Mem{VM, RDX, 1, off_flags}, PAGE_MAPPED);
+                slow = e.jcc(CC_NE);
+            }
+            page_of(addr);
+            e.load16(dst, Mem{RDX, SLOT, 2, off_words});
+            if (slow) {
+                slow_reads.push_back({slow, e.p, addr, dst});
+            }
+        };
+        // Self-modifying code: leave the block once the instruction is complete and flush the cache
+        std::vector<std::pair<unsigned char *, int>> smc_exits;
+        struct SlowWrite {
+            unsigned char *jump; // Branch from the fast path
+            unsigned char *back; // Where the fast path continues
+            int addr;
+            int value;
+            int index;
+            bool check; // Leave through the SMC exit right after the call
+        };
+        std::vector<SlowWrite> slow_writes;
+        // Store to memory[addr] (zero-extended 16-bit values in registers). Private pages without translated
+        // code are written inline, anything else goes through Jit::write() out of line.
+        const auto write = [&](const int addr, const int value, const int index, const bool check = true) {
+            e.mov(RDX, addr);
+            e.shri(RDX, 8);
+            e.cmp8(Mem{VM, RDX, 1, off_flags}, 0);
+            unsigned char *slow = e.jcc(CC_NE);
+            e.load64(RDX, Mem{VM, RDX, 8, off_pages});
+            e.mov(SLOT, addr);
+            e.alui(4, SLOT, 0xFF);
+            e.store16(Mem{RDX, SLOT, 2, off_words}, value);
+            e.store8(Mem{RDX, SLOT, 8, off_ops + 8}, UNDECODED);
+            e.store8(Mem{RDX, SLOT, 8, off_ops}, UNDECODED);
+            e.store8(Mem{RDX, SLOT, 8, off_fused + 8}, UNDECODED);
+            e.store8(Mem{RDX, SLOT, 8, off_fused}, UNDECODED);
+            slow_writes.push_back({slow, e.p, addr, value, index, check});
+        };
+        // For instructions with several writes, Jit::write() only records the hit
+        const auto check_smc = [&](const int index) {
+            e.cmp8(smc_mem, 0);
+            smc_exits.emplace_back(e.jcc(CC_NE), index);
+        };
+        unsigned short next_pc[MAX_BLOCK_INSTRUCTIONS];
+
+        // Budget check, the predecessor already stored pc
+        e.alu64(7, remaining_mem, n);
+        Emitter::patch(e.jcc(CC_B), this->epilogue);
+        e.alu64(5, remaining_mem, n);
+        for (int i = 0; i < cached_count; i++) {
+            e.load16(cached[cached_regs[i]], reg_mem(cached_regs[i]));
+        }
+        const auto advance_time = [&](const unsigned int ticks) {
+            load(RAX, TIME);
+            e.alui(0, RAX, ticks);
+            store(TIME, RAX);
+        };
+        e.alu64(0, ticks_mem, block_ticks);
+        if (!uses_time) {
+            advance_time(block_ticks);
+        }
+
+        for (int i = 0; i < n; i++) {
+            const DecodedOp &op = block[i].op;
+            const unsigned short addr = block[i].addr;
+            next_pc[i] = addr + 2;
+            if (uses_time) {
+                advance_time(OPCODE_TICKS[op.opcode]);
+            }
+            switch (op.opcode) {
+                case LOAD_IMM:
+                    e.movi(RAX, op.imm);
+                    store(op.x, RAX);
+                    break;
+                case LOAD_ADDR:
+                    // Y is used as the address itself, like step()
+                    if (this->vm.page_flags[op.y >> 8] & PAGE_MAPPED) {
+                        e.movi(RCX, op.y);
+                        read(RAX, RCX);
+                        store(op.x, RAX);
+                        break;
+                    }
+                    e.load64(RDX, Mem{VM, NONE, 1, off_pages + 8 * (op.y >> 8)});
+                    e.load16(RAX, Mem{RDX, NONE, 1, off_words + 2 * (op.y & 0xFF)});
+                    store(op.x, RAX);
+                    break;
+                case STORE_ADDR:
+                    load(RSI, op.x);
+                    load(RCX, op.y);
+                    write(RSI, RCX, i);
+                    break;
+                case MOV:
+                    load(RAX, op.y);
+                    store(op.x, RAX);
+                    break;
+                case INC:
+                case DEC:
+                    load(RAX, op.x);
+                    if (op.opcode == INC) {
+                        e.inc(RAX);
+                    } else {
+                        e.dec(RAX);
+                    }
+                    store(op.x, RAX);
+                    break;
+                case ADD:
+                case SUB: {
+                    load(RAX, op.y);
+                    load(RCX, op.z);
+                    e.alu(op.opcode == ADD ? ALU_ADD : ALU_SUB, RAX, RCX);
+                    load(RSI, op.x);
+                    e.alui(7, RAX, 0xFFFF);
+                    unsigned char *carry = e.jcc(CC_A);
+                    write(RSI, RAX, i);
+                    unsigned char *done = e.jmp();
+                    // Result does not fit 16 bits: high word at X, low word at X + 1 and C set
+                    Emitter::patch(carry, e.p);
+                    e.store8(flag_mem(this->vm.c), 1);
+                    e.mov(RCX, RAX);
+                    e.shri(RCX, 16);
+                    write(RSI, RCX, i, false);
+                    e.mov(RDI, RSI);
+                    e.inc(RDI);
+                    e.alui(4, RDI, 0xFFFF);
+                    write(RDI, RAX, i, false);
+                    check_smc(i);
+                    Emitter::patch(done, e.p);
+                    break;
+                }
+                case AND:
+                case OR:
+                case XOR:
+                    load(RAX, op.y);
+                    load(RCX, op.z);
+                    e.alu(op.opcode == AND ? ALU_AND : op.opcode == OR ? ALU_OR : ALU_XOR, RAX, RCX);
+                    store(op.x, RAX);
+                    break;
+                case NOT:
+                    load(RAX, op.y);
+                    e.bitwise_not(RAX);
+                    store(op.x, RAX);
+                    break;
+                case SHL:
+                case SHR: {
+                    load(RAX, op.y);
+                    load(RCX, op.z);
+                    e.shift(op.opcode == SHL ? 4 : 5, RAX);
+                    // x86 masks the count to 5 bits, counts of 16 and more leave 0 like the interpreter
+                    e.alui(7, RCX, 15);
+                    unsigned char *fits = e.jcc(CC_BE);
+                    e.movi(RAX, 0);
+                    Emitter::patch(fits, e.p);
+                    store(op.x, RAX);
+                    break;
+                }
+                case CMP:
+                    load(RAX, op.x);
+                    load(RCX, op.y);
+                    e.alu(ALU_CMP, RAX, RCX);
+                    e.setcc(CC_E, RDX);
+                    e.setcc(CC_A, RCX);
+                    e.setcc(CC_B, RAX);
+                    e.or8(flag_mem(this->vm.e), RDX);
+                    e.or8(flag_mem(this->vm.g), RCX);
+                    e.or8(flag_mem(this->vm.l), RAX);
+                    break;
+                case JMP:
+                    // step() adds 2 after every instruction, jumps included
+                    exit_to(op.imm + 2);
+                    break;
+                case JZ:
+                case JE:
+                case JNE:
+                case JG:
+                case JL: {
+                    const bool &flag = op.opcode == JZ ? this->vm.z
+                                       : op.opcode == JG ? this->vm.g
+                                       : op.opcode == JL ? this->vm.l
+                                       : this->vm.e;
+                    e.cmp8(flag_mem(flag), 0);
+                    unsigned char *taken = e.jcc(op.opcode == JNE ? CC_E : CC_NE);
+                    exit_to(addr + 2);
+                    Emitter::patch(taken, e.p);
+                    exit_to(op.imm + 2);
+                    break;
+                }
+                case CALL:
+                    next_pc[i] = op.imm;
+                    load(RAX, SP);
+                    e.dec(RAX);
+                    e.alui(4, RAX, 0xFFFF);
+                    store(SP, RAX);
+                    e.mov(RSI, RAX);
+                    e.movi(RCX, addr);
+                    write(RSI, RCX, i);
+                    exit_to(op.imm);
+                    break;
+                case RET:
+                    load(RAX, SP);
+                    read(RCX, RAX);
+                    e.inc(RAX);
+                    store(SP, RAX);
+                    e.alui(0, RCX, 2);
+                    e.alui(4, RCX, 0xFFFF);
+                    flush_registers();
+                    e.store16(pc_mem, RCX);
+                    // Chain through the block table when the return address is translated
+                    e.load64(RAX, Mem{STATE, RCX, 8, off_entry});
+                    e.test64(RAX, RAX);
+                    Emitter::patch(e.jcc(CC_E), this->epilogue);
+                    e.jmp(RAX);
+                    break;
+                case PUSH:
+                    load(RAX, SP);
+                    e.dec(RAX);
+                    e.alui(4, RAX, 0xFFFF);
+                    store(SP, RAX);
+                    e.mov(RSI, RAX);
+                    load(RCX, op.x);
+                    write(RSI, RCX, i);
+                    break;
+                case POP:
+                    load(RAX, SP);
+                    read(RCX, RAX);
+                    store(op.x, RCX);
+                    load(RAX, SP);
+                    e.inc(RAX);
+                    store(SP, RAX);
+                    break;
+                case HLT:
+                    // pc stays on the HLT, like step()
+                    e.store8(running_mem, 0);
+                    flush_registers();
+                    e.store16(pc_mem, static_cast<unsigned>(addr));
+                    Emitter::patch(e.jmp(), this->epilogue);
+                    break;
+                default: // NOP
+                    break;
+            }
+        }
+        if (!is_terminator(block[n - 1].op.opcode)) {
+            exit_to(block[n - 1].addr + 2);
+        }
+
+        // Slow writes, the scratch registers still in use are preserved around the call
+        for (const SlowWrite &w: slow_writes) {
+            Emitter::patch(w.jump, e.p);
+            for (const Reg r: {RAX, RCX, RSI, RDI}) {
+                e.push(r);
+            }
+            e.mov(RDX, w.value);
+            if (w.addr != RSI) {
+                e.mov(RSI, w.addr);
+            }
+            e.mov64(RDI, VM);
+            e.movi64(RAX, reinterpret_cast<unsigned long long>(&Jit::write));
+            e.call(RAX);
+            e.mov(RDX, RAX);
+            for (const Reg r: {RDI, RSI, RCX, RAX}) {
+                e.pop(r);
+            }
+            if (w.check) {
+                e.alu(ALU_OR, RDX, RDX);
+                smc_exits.emplace_back(e.jcc(CC_NE), w.index);
+            }
+            Emitter::patch(e.jmp(), w.back);
+        }
+
+        // Slow reads, like slow writes
+        for (const SlowRead &r: slow_reads) {
+            Emitter::patch(r.jump, e.p);
+            for (const Reg reg: {RAX, RCX, RSI, RDI}) {
+                e.push(reg);
+            }
+            if (r.addr != RSI) {
+                e.mov(RSI, r.addr);
+            }
+            e.mov64(RDI, VM);
+            e.movi64(RAX, reinterpret_cast<unsigned long long>(&Jit::read));
+            e.call(RAX);
+            e.mov(RDX, RAX);
+            for (const Reg reg: {RDI, RSI, RCX, RAX}) {
+                e.pop(reg);
+            }
+            e.mov(r.dst, RDX);
+            Emitter::patch(e.jmp(), r.back);
+        }
+
+        // Out-of-line exits for writes that hit translated code
+        for (int i = 0; i < n; i++) {
+            unsigned char *stub = nullptr;
+            for (const auto &[jump, index]: smc_exits) {
+                if (index != i) {
+                    continue;
+                }
+                if (!stub) {
+                    stub = e.p;
+                    flush_registers();
+                    e.store16(pc_mem, static_cast<unsigned>(next_pc[i]));
+                    if (n - (i + 1) > 0) {
+                        e.alu64(0, remaining_mem, n - (i + 1)); // Refund the instructions not executed
+                        unsigned int refund = 0;
+                        for (int j = i + 1; j < n; j++) {
+                            refund += OPCODE_TICKS[block[j].op.opcode];
+                        }
+                        e.alu64(5, ticks_mem, refund);
+                        if (!uses_time) {
+                            load(RAX, TIME);
+                            e.alui(5, RAX, refund);
+                            store(TIME, RAX);
+                        }
+                    }
+                    e.store8(smc_mem, 1);
+                    Emitter::patch(e.jmp(), this->epilogue);
+                }
+                Emitter::patch(jump, stub);
+            }
+        }
+        this->cursor = e.p;
+
+        // Publish the block and link the exits that were waiting for it
+        this->state->entry[start] = entry;
+        this->block_length[start] = n;
+        for (int i = 0; i < n; i++) {
+            for (const unsigned short word: {block[i].addr, static_cast<unsigned short>(block[i].addr + 1)}) {
+                this->state->code_words[word] = 1;
+                this->vm.page_flags[word >> 8] |= PAGE_CODE;
+            }
+        }
+        if (const auto it = this->pending.find(start); it != this->pending.end()) {
+            for (unsigned char *jump: it->second) {
+                Emitter::patch(jump, entry);
+            }
+            this->pending.erase(it);
+        }
+        if (!this->protect(true)) {
+            // Nothing can run from the cache any more, stay on the interpreter
+            this->flush();
+            return nullptr;
+        }
+        return entry;
+    }
+
+    unsigned int Jit::read(virt16 *vm, const unsigned int addr) {
+        return vm->readSlow(addr);
+    }
+
+    unsigned int Jit::write(virt16 *vm, const unsigned int addr, const unsigned int value) {
+        const unsigned char flags = vm->page_flags[addr >> 8];
+        if ((flags & PAGE_MAPPED) &&
+            !vm->hooks[addr >> 8]->write(*vm, static_cast<unsigned short>(addr), static_cast<unsigned short>(value))) {
+            return 0;
+        }
+        if (flags & PAGE_SHARED) {
+            vm->unshare(addr >> 8);
+        }
+        vm->storeWord(addr, static_cast<unsigned short>(value));
+        if (flags & PAGE_TRACKED) {
+            vm->markDirty(addr);
+        }
+        if (flags & PAGE_TRACED) {
+            vm->trace->logWrite(addr, static_cast<unsigned short>(value));
+        }
+        if (flags & PAGE_JOURNALED) {
+            vm->history->logWrite(addr, static_cast<unsigned short>(value));
+        }
+        if ((flags & PAGE_CODE) && vm->jit->state->code_words[addr]) {
+            vm->jit->state->smc = 1;
+            return 1;
+        }
+        return 0;
+    }
+
+    unsigned long long Jit::run(const unsigned long long max_cycles) {
+        this->vm.running = true;
+        this->state->remaining = max_cycles;
+        while (this->state->remaining && this->vm.running) {
+            const unsigned short pc = this->vm.pc;
+            void *block = this->state->entry[pc];
+            if (!block && this->hits[pc] != 0xFF && ++this->hits[pc] >= HOT_THRESHOLD) {
+                block = this->translate(pc);
+                if (!block) {
+                    this->hits[pc] = 0xFF;
+                }
+            }
+            if (!block || this->block_length[pc] > this->state->remaining) {
+                this->vm.interpret();
+                this->state->remaining--;
+                continue;
+            }
+
+            const unsigned long long before = this->state->remaining;
+            this->trampoline(&this->vm, this->state, block);
+            this->vm.cycles += before - this->state->remaining;
+            if (this->state->smc) {
+                this->state->smc = 0;
+                this->flush();
+            }
+        }
+        return max_cycles - this->state->remaining;
+    }
+#else
+    Jit::Jit(virt16 &vm) : vm(vm) {}
+
+    Jit::~Jit() = default;
+
+    bool Jit::ready() const {
+        return false;
+    }
+
+    void Jit::flush() {}
+
+    void Jit::invalidate(unsigned int) {}
+
+    void *Jit::translate(unsigned short) {
+        return nullptr;
+    }
+
+    unsigned long long Jit::run(unsigned long long) {
+        return 0;
+    }
+#endif
+
+    bool virt16::jitAvailable() {
+        if (!this->jit) {
+            this->jit = std::make_unique<Jit>(*this);
+        }
+        return this->jit->ready();
+    }
+
+    unsigned long long virt16::runJit(const unsigned long long max_cycles) {
+        if (!this->jit) {
+            this->jit = std::make_unique<Jit>(*this);
+        }
+        if (!this->jit->ready()) {
+            return this->runThreaded<false>(max_cycles);
+        }
+        return this->jit->run(max_cycles);
+    }
+
+    void virt16::invalidateJit(const unsigned int addr) {
+        if (this->jit) {
+            this->jit->invalidate(addr);
+        }
+    }
+} // Virt16
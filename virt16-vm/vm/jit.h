@@ -0,0 +1,91 @@
+//
+// Basic block JIT for x86-64 hosts.
+//
+// Straight-line code up to the next JMP/JZ/JE/JNE/JG/JL/CALL/RET/HLT is translated into native code
+// once its first instruction has been reached HOT_THRESHOLD times. Up to four of the most used
+// Virt16 registers of a block live in host registers, exits to known targets are chained with
+// direct jumps and RET looks its target up in the block table. Writes that hit translated words
+// flush the whole code cache. Anything that cannot be translated (invalid opcodes, a block that
+// does not fit the remaining budget, cold code) runs through the interpreter.
+//
+// The code cache is never writable and executable at once: it is mapped read/write, and switched to
+// read/execute once the trampoline is emitted and after every translation, which also patches the exits
+// that waited for the new block.
+//
+
+#ifndef VIRT16_JIT_H
+#define VIRT16_JIT_H
+
+#include <unordered_map>
+#include <vector>
+
+#include "virt16.h"
+
+namespace Virt16 {
+    class Jit {
+    public:
+        static constexpr unsigned char HOT_THRESHOLD = 4;
+        static constexpr int MAX_BLOCK_INSTRUCTIONS = 64;
+        static constexpr unsigned long CODE_CACHE_SIZE = 8 * 1024 * 1024;
+
+        explicit Jit(virt16 &vm);
+
+        ~Jit();
+
+        Jit(const Jit &) = delete;
+
+        Jit &operator=(const Jit &) = delete;
+
+        // False when the host is not x86-64 or the code cache could not be mapped or made executable
+        [[nodiscard]] bool ready() const;
+
+        // Same contract as virt16::run(max_cycles)
+        unsigned long long run(unsigned long long max_cycles);
+
+        // Drops every translation
+        void flush();
+
+        // Called for interpreter writes to a page that holds translated code
+        void invalidate(unsigned int addr);
+
+    private:
+        // State reachable from generated code through a base register, keep it standard layout
+        struct State {
+            unsigned long long remaining; // Budget left, blocks subtract their length on entry
+            unsigned char smc; // Set by generated code when a write hit translated code
+            unsigned char code_words[MEMORY_SIZE]; // Non-zero for every word covered by a translation
+            void *entry[MEMORY_SIZE]; // Native entry point per Virt16 address
+        };
+
+        virt16 &vm;
+        State *state = nullptr;
+
+        unsigned char *code = nullptr; // mmap'd code cache, read/execute outside of translate()
+        unsigned long code_size = 0;
+        unsigned long trampoline_size = 0;
+        unsigned char *epilogue = nullptr;
+        unsigned char *cursor = nullptr; // Next free byte of the cache
+
+        unsigned char block_length[MEMORY_SIZE]{}; // Instructions per translated block
+        unsigned char hits[MEMORY_SIZE]{}; // Times the dispatcher reached an untranslated address
+        // Exit jumps waiting for their target to be translated, keyed by target address
+        std::unordered_map<unsigned short, std::vector<unsigned char *>> pending;
+
+        using Trampoline = void (*)(virt16 *vm, State *state, void *block);
+        Trampoline trampoline = nullptr;
+
+        void *translate(unsigned short start);
+
+        // Switches the code cache between read/write and read/execute, false if the host refuses
+        bool protect(bool executable);
+
+        // Reads of mapped pages from generated code
+        static unsigned int read(virt16 *vm, unsigned int addr);
+
+        // Slow path of memory writes from generated code (shared page, mapped page or translated code in the
+        // page), returns non-zero when the write hit translated code
+        static unsigned int write(virt16 *vm, unsigned int addr, unsigned int value);
+    };
+} // Virt16
+
+#endif //VIRT16_JIT_H
@@ -0,0 +1,118 @@
+//
+// Opcode numbers shared by the execution engines. Only included by the VM sources, the
+// short names would clash with user code.
+//
+
+#ifndef VIRT16_OPCODES_H
+#define VIRT16_OPCODES_H
+
+/*
+## Opcode Translation Table
+| OPCode | Instruction      | Description                                      | Example               |
+|--------|------------------|--------------------------------------------------|-----------------------|
+| 0x00   | LOAD X, #IMM     | Load immediate value into X                      | LOAD R1, #0x0001      |
+| 0x01   | LOAD X, Y        | Load value from memory into X                    | LOAD R0, R1           |
+| 0x02   | STORE X, Y       | Store value from Y into memory address in X      | STORE R0, R1          |
+| 0x03   | MOV X, Y         | Move value from Y to X                           | MOV R0, R1            |
+| 0x04   | INC X            | Increment X by 1                                 | INC R1                |
+| 0x05   | DEC X            | Decrement X by 1                                 | DEC R1                |
+| 0x06   | ADD X, Y, Z      | Add Y and Z and store in addr and addr+1 at X    | ADD R1, R2, R3        |
+| 0x07   | SUB X, Y, Z      | Sub Z from Y and store in addr and addr+1 at X   | SUB R1, R2, R2        |
+| 0x08   | AND X, Y, Z      | Bitwise AND Y and Z and store in X               | AND R1, R2, R3        |
+| 0x09   | OR X, Y, Z       | Bitwise OR Y and Z and store in X                | OR R1, R2, R3         |
+| 0x0A   | XOR X, Y, Z      | Bitwise XOR Y and Z and store in X               | XOR R1, R2, R3        |
+| 0x0B   | NOT X, Y         | Bitwise NOT Y and store in X                     | NOT R1, R2            |
+| 0x0C   | SHL X, Y, Z      | Shift Y left by Z bits and store in X            | SHL R1, R2, R3        |
+| 0x0D   | SHR X, Y, Z      | Shift Y right by Z bits and store in X           | SHR R1, R2, R3        |
+| 0x0E   | CMP X, Y         | Compare X and Y - Flags will pop up              | CMP R1, R2            |
+| 0x0F   | JMP addr         | Jump to address                                  | JMP 0x0001            |
+| 0x10   | JZ addr          | Jump if zero                                     | JZ 0x0001             |
+| 0x11   | JE addr          | Jump if equal                                    | JE 0x0001             |
+| 0x12   | JNE addr         | Jump if not equal                                | JNE 0x0001            |
+| 0x13   | JG addr          | Jump if greater                                  | JG 0x0001             |
+| 0x14   | JL addr          | Jump if less                                     | JL 0x0001             |
+| 0x15   | CALL addr        | Call subroutine                                  | CALL 0x0001           |
+| 0x16   | RET              | Return from subroutine                           | RET                   |
+| 0x17   | PUSH X           | Push value from register onto stack              | PUSH R1               |
+| 0x18   | POP X            | Pop value from stack into register               | POP R1                |
+| 0x19   | HLT              | Halt the program                                 | HLT                   |
+| 0x1A   | NOP              | No Operation                                     | NOP                   |
+| 0x1B   | IRET             | Return from interrupt, pops flags and PC         | IRET                  |
+| 0x1C   | WAIT             | Sleep until an interrupt is delivered            | WAIT                  |
+| 0x1D   | NOP              | No Operation                                     | NOP                   |
+| 0x1E   | NOP              | No Operation                                     | NOP                   |
+| 0x1F   | NOP              | No Operation                                     | NOP                   |
+
+TOTAL: 32 Instructions (0x00 - 0x1F) 5 bits
+*/
+
+#define LOAD_IMM 0x00
+#define LOAD_ADDR 0x01
+#define STORE_ADDR 0x02
+#define MOV 0x03
+#define INC 0x04
+#define DEC 0x05
+#define ADD 0x06
+#define SUB 0x07
+#define AND 0x08
+#define OR 0x09
+#define XOR 0x0A
+#define NOT 0x0B
+#define SHL 0x0C
+#define SHR 0x0D
+#define CMP 0x0E
+#define JMP 0x0F
+#define JZ 0x10
+#define JE 0x11
+#define JNE 0x12
+#define JG 0x13
+#define JL 0x14
+#define CALL 0x15
+#define RET 0x16
+#define PUSH 0x17
+#define POP 0x18
+#define HLT 0x19
+#define NOP 0x1A
+#define IRET 0x1B
+#define WAIT 0x1C
+
+// Superinstructions of the threaded engine, numbered past UNDECODED (0x20). A fused instruction runs the
+// instruction it is cached for and the ones after it with one dispatch, see virt16::setFusion().
+#define FUSED_CMP_JE 0x21 // CMP + JE
+#define FUSED_CMP_JNE 0x22 // CMP + JNE
+#define FUSED_CMP_JG 0x23 // CMP + JG
+#define FUSED_CMP_JL 0x24 // CMP + JL
+#define FUSED_LOAD_STORE 0x25 // LOAD #IMM + STORE
+#define FUSED_INC_CMP_JNE 0x26 // INC + CMP + JNE, a counting loop tail
+#define FUSED_DEC_CMP_JNE 0x27 // DEC + CMP + JNE
+#define FUSED_PUSH_PUSH 0x28 // PUSH + PUSH, saving registers around a CALL
+#define FUSED_POP_POP 0x29 // POP + POP, restoring them
+#define FUSED_PUSH_CALL 0x2A // PUSH + CALL
+#define FUSED_END 0x2B
+
+// Superinstruction that starts with first followed by second, 0 if none. INC and DEC only fuse with a CMP that is
+// followed by JNE, which the caller checks.
+static constexpr unsigned char fusedOpcode(const unsigned char first, const unsigned char second) {
+    switch (first) {
+        case CMP:
+            return second == JE ? FUSED_CMP_JE
+                   : second == JNE ? FUSED_CMP_JNE
+                   : second == JG ? FUSED_CMP_JG
+                   : second == JL ? FUSED_CMP_JL
+                   : 0;
+        case LOAD_IMM:
+            return second == STORE_ADDR ? FUSED_LOAD_STORE : 0;
+        case INC:
+            return second == CMP ? FUSED_INC_CMP_JNE : 0;
+        case DEC:
+            return second == CMP ? FUSED_DEC_CMP_JNE : 0;
+        case PUSH:
+            return second == PUSH ? FUSED_PUSH_PUSH : second == CALL ? FUSED_PUSH_CALL : 0;
+        case POP:
+            return second == POP ? FUSED_POP_POP : 0;
+        default:
+            return 0;
+    }
+}
+
+#endif //VIRT16_OPCODES_H
@@ -0,0 +1,141 @@
+//
+// Work-stealing VM pool, see pool.h.
+//
+
+#include "pool.h"
+
+#include <algorithm>
+
+namespace Virt16 {
+    VMPool::VMPool(unsigned threads, const unsigned long long quantum) : quantum(std::max(quantum, 1ull)) {
+        if (threads == 0) {
+            threads = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+        this->start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < threads; i++) {
+            this->workers.push_back(std::make_unique<Worker>());
+        }
+        for (unsigned i = 0; i < threads; i++) {
+            this->threads.emplace_back(&VMPool::work, this, i);
+        }
+    }
+
+    VMPool::~VMPool() {
+        this->wait();
+        {
+            std::lock_guard lock(this->sleep_lock);
+            this->stopping = true;
+        }
+        this->wake.notify_all();
+        for (std::thread &thread: this->threads) {
+            thread.join();
+        }
+    }
+
+    size_t VMPool::submit(virt16 &vm, const unsigned long long max_cycles, Callback callback) {
+        const size_t id = this->next_id++;
+        {
+            std::lock_guard lock(this->done_lock);
+            this->pending++;
+        }
+        auto *job = new Job{id, &vm, max_cycles, 0, std::move(callback)};
+        this->push(this->next_worker++ % this->workers.size(), job);
+        return id;
+    }
+
+    void VMPool::wait() {
+        std::unique_lock lock(this->done_lock);
+        this->done.wait(lock, [this] { return this->pending == 0; });
+    }
+
+    VMPool::Stats VMPool::stats() const {
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - this->start).count();
+        const unsigned long long executed = this->cycles;
+        return {
+            this->next_id, this->completed, executed, this->slices, this->steals, seconds,
+            seconds > 0 ? static_cast<double>(executed) / seconds : 0
+        };
+    }
+
+    unsigned VMPool::threadCount() const {
+        return static_cast<unsigned>(this->threads.size());
+    }
+
+    void VMPool::push(const size_t worker, Job *job) {
+        {
+            std::lock_guard lock(this->workers[worker]->lock);
+            this->workers[worker]->jobs.push_back(job);
+        }
+        this->queued++;
+        // Take the lock so a worker between its last check and wait() cannot miss the notification
+        if (this->sleeping) {
+            std::lock_guard lock(this->sleep_lock);
+            this->wake.notify_one();
+        }
+    }
+
+    VMPool::Job *VMPool::take(const size_t worker) {
+        {
+            Worker &own = *this->workers[worker];
+            std::lock_guard lock(own.lock);
+            if (!own.jobs.empty()) {
+                Job *job = own.jobs.front();
+                own.jobs.pop_front();
+                this->queued--;
+                return job;
+            }
+        }
+        // Steal from the back of the other deques, the owners work from the front
+        for (size_t i = 1; i < this->workers.size(); i++) {
+            Worker &victim = *this->workers[(worker + i) % this->workers.size()];
+            std::lock_guard lock(victim.lock);
+            if (!victim.jobs.empty()) {
+                Job *job = victim.jobs.back();
+                victim.jobs.pop_back();
+                this->queued--;
+                this->steals++;
+                return job;
+            }
+        }
+        return nullptr;
+    }
+
+    void VMPool::work(const size_t worker) {
+        while (true) {
+            Job *job = this->take(worker);
+            if (!job) {
+                std::unique_lock lock(this->sleep_lock);
+                this->sleeping++;
+                this->wake.wait(lock, [this] { return this->stopping || this->queued > 0; });
+                this->sleeping--;
+                if (this->stopping && this->queued == 0) {
+                    return;
+                }
+                continue;
+            }
+
+            const unsigned long long executed = job->vm->run(std::min(this->quantum, job->remaining));
+            job->remaining -= executed;
+            job->executed += executed;
+            this->cycles += executed;
+            this->slices++;
+
+            if (job->vm->isRunning() && job->remaining > 0) {
+                this->push(worker, job);
+                continue;
+            }
+
+            if (job->callback) {
+                job->callback({job->id, !job->vm->isRunning(), job->executed}, *job->vm);
+            }
+            delete job;
+            this->completed++;
+            {
+                std::lock_guard lock(this->done_lock);
+                if (--this->pending == 0) {
+                    this->done.notify_all();
+                }
+            }
+        }
+    }
+} // Virt16
@@ -0,0 +1,115 @@
+//
+// Runs many independent virt16 instances across all cores.
+//
+// Every submitted VM becomes a job that is executed in slices of at most `quantum` cycles. Each worker
+// thread owns a deque of jobs: it takes work from the front and puts unfinished jobs back at the end,
+// idle workers steal from the end of the other deques. A job completes when its VM halts (HLT or stop())
+// or when its cycle budget is exhausted; the completion callback then runs on the worker thread.
+//
+
+#ifndef VIRT16_POOL_H
+#define VIRT16_POOL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "virt16.h"
+
+namespace Virt16 {
+    class VMPool {
+    public:
+        struct Completion {
+            size_t id; // Value returned by submit()
+            bool halted; // False when the cycle budget ran out first
+            unsigned long long cycles; // Executed by this job
+        };
+
+        // Called on a worker thread, the VM is not touched by the pool afterwards
+        using Callback = std::function<void(const Completion &completion, virt16 &vm)>;
+
+        struct Stats {
+            size_t submitted;
+            size_t completed;
+            unsigned long long cycles;
+            unsigned long long slices;
+            unsigned long long steals;
+            double seconds; // Since the pool was created
+            double cycles_per_second;
+        };
+
+    private:
+        struct Job {
+            size_t id;
+            virt16 *vm;
+            unsigned long long remaining;
+            unsigned long long executed;
+            Callback callback;
+        };
+
+        struct Worker {
+            std::mutex lock;
+            std::deque<Job *> jobs;
+        };
+
+        unsigned long long quantum;
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::vector<std::thread> threads;
+
+        std::atomic<size_t> queued{0}; // Jobs sitting in a deque
+        std::atomic<unsigned> sleeping{0};
+        std::atomic<bool> stopping{false};
+        std::mutex sleep_lock;
+        std::condition_variable wake;
+
+        std::mutex done_lock;
+        std::condition_variable done;
+        size_t pending = 0; // Submitted but not completed, guarded by done_lock
+
+        std::atomic<size_t> next_id{0};
+        std::atomic<size_t> next_worker{0};
+        std::atomic<size_t> completed{0};
+        std::atomic<unsigned long long> cycles{0};
+        std::atomic<unsigned long long> slices{0};
+        std::atomic<unsigned long long> steals{0};
+        std::chrono::steady_clock::time_point start;
+
+        void push(size_t worker, Job *job);
+
+        Job *take(size_t worker);
+
+        void work(size_t worker);
+
+    public:
+        static constexpr unsigned long long DEFAULT_QUANTUM = 100000;
+
+        // threads = 0 uses one worker per hardware thread
+        explicit VMPool(unsigned threads = 0, unsigned long long quantum = DEFAULT_QUANTUM);
+
+        VMPool(const VMPool &) = delete;
+
+        VMPool &operator=(const VMPool &) = delete;
+
+        // Queues vm to run until it halts or has executed max_cycles instructions. The VM is not owned
+        // by the pool and must stay alive and untouched by the caller until its callback ran or wait() returned.
+        size_t submit(virt16 &vm, unsigned long long max_cycles = ~0ull, Callback callback = {});
+
+        // Blocks until every submitted job has completed
+        void wait();
+
+        [[nodiscard]] Stats stats() const;
+
+        [[nodiscard]] unsigned threadCount() const;
+
+        // Waits for the remaining jobs and joins the workers
+        ~VMPool();
+    };
+} // Virt16
+
+#endif //VIRT16_POOL_H
@@ -0,0 +1,298 @@
+//
+// Execution profiler, see profile.h.
+//
+
+#include "profile.h"
+
+#include <algorithm>
+
+#include "opcodes.h"
+#include "trace.h"
+
+namespace Virt16 {
+    Profiler::Profiler() : counts(std::make_unique<unsigned long long[]>(MEMORY_SIZE)),
+                           taken(std::make_unique<unsigned long long[]>(MEMORY_SIZE)) {
+        this->nodes.push_back({0, 0});
+    }
+
+    void Profiler::record(const unsigned short pc, const unsigned char opcode, const unsigned short next) {
+        this->total++;
+        this->counts[pc]++;
+        this->opcodes[opcode & 0x1F]++;
+        if (this->previous >= 0 && pc == this->follows) {
+            this->pairs[this->previous][opcode & 0x1F]++;
+        }
+        this->previous = next == static_cast<unsigned short>(pc + 2) ? opcode & 0x1F : -1;
+        this->follows = next;
+        this->nodes[this->node].self++;
+        switch (opcode) {
+            case JZ:
+            case JE:
+            case JNE:
+            case JG:
+            case JL:
+                this->branches[pc] = true;
+                if (next != static_cast<unsigned short>(pc + 2)) {
+                    this->taken[pc]++;
+                }
+                break;
+            case CALL:
+                this->enter(next);
+                break;
+            case RET:
+                this->leave();
+                break;
+            default:
+                break;
+        }
+    }
+
+    void Profiler::enter(const unsigned short target) {
+        Totals &totals = this->routines[target];
+        totals.routine.addr = target;
+        totals.routine.calls++;
+        if (this->stack.size() >= MAX_DEPTH) {
+            this->untracked++;
+            return;
+        }
+        totals.active++;
+        const auto [path, added] = this->paths.try_emplace(static_cast<unsigned long long>(this->node) << 16 | target,
+                                                           static_cast<unsigned int>(this->nodes.size()));
+        if (added) {
+            this->nodes.push_back({target, this->node});
+        }
+        this->node = path->second;
+        this->stack.push_back({target, this->node, this->total});
+    }
+
+    void Profiler::leave() {
+        if (this->untracked) {
+            this->untracked--;
+            return;
+        }
+        if (this->stack.empty()) {
+            return; // Returns from a call made before the profiler was attached
+        }
+        close(this->routines, this->stack, this->total);
+        this->node = this->stack.empty() ? 0 : this->stack.back().node;
+    }
+
+    void Profiler::close(std::unordered_map<unsigned short, Totals> &routines, std::vector<Frame> &stack,
+                         const unsigned long long total) {
+        const Frame frame = stack.back();
+        stack.pop_back();
+        const unsigned long long inclusive = total - frame.start;
+        Totals &totals = routines[frame.routine];
+        totals.routine.exclusive += inclusive - frame.children;
+        if (--totals.active == 0) {
+            totals.routine.inclusive += inclusive;
+        }
+        if (!stack.empty()) {
+            stack.back().children += inclusive;
+        }
+    }
+
+    void Profiler::resync() {
+        while (!this->stack.empty()) {
+            close(this->routines, this->stack, this->total);
+        }
+        this->node = 0;
+        this->untracked = 0;
+        this->previous = -1;
+    }
+
+    void Profiler::clear() {
+        std::fill_n(this->counts.get(), MEMORY_SIZE, 0);
+        std::fill_n(this->taken.get(), MEMORY_SIZE, 0);
+        this->branches.reset();
+        std::fill_n(this->opcodes, 32, 0);
+        std::fill_n(&this->pairs[0][0], 32 * 32, 0);
+        this->previous = -1;
+        this->total = 0;
+        this->routines.clear();
+        this->nodes.assign(1, {0, 0});
+        this->paths.clear();
+        this->stack.clear();
+        this->node = 0;
+        this->untracked = 0;
+    }
+
+    void Profiler::setSourceMap(std::vector<SourceLine> lines) {
+        this->source_map = std::move(lines);
+        std::stable_sort(this->source_map.begin(), this->source_map.end(),
+                         [](const SourceLine &a, const SourceLine &b) { return a.addr < b.addr; });
+    }
+
+    void Profiler::setLabel(const unsigned short addr, std::string name) {
+        this->labels[addr] = std::move(name);
+    }
+
+    const SourceLine *Profiler::source(const unsigned short addr) const {
+        const auto line = std::lower_bound(this->source_map.begin(), this->source_map.end(), addr,
+                                           [](const SourceLine &l, const unsigned short a) { return l.addr < a; });
+        return line != this->source_map.end() && line->addr == addr ? &*line : nullptr;
+    }
+
+    std::string Profiler::name(const unsigned short addr) const {
+        if (const auto label = this->labels.find(addr); label != this->labels.end()) {
+            return label->second;
+        }
+        char hex[8];
+        std::snprintf(hex, sizeof(hex), "0x%04X", addr);
+        return hex;
+    }
+
+    unsigned long long Profiler::instructions() const {
+        return this->total;
+    }
+
+    unsigned long long Profiler::count(const unsigned short addr) const {
+        return this->counts[addr];
+    }
+
+    unsigned long long Profiler::takenCount(const unsigned short addr) const {
+        return this->taken[addr];
+    }
+
+    unsigned long long Profiler::opcodeCount(const unsigned char opcode) const {
+        return this->opcodes[opcode & 0x1F];
+    }
+
+    unsigned long long Profiler::pairCount(const unsigned char first, const unsigned char second) const {
+        return this->pairs[first & 0x1F][second & 0x1F];
+    }
+
+    std::vector<Profiler::Routine> Profiler::routineTotals() const {
+        auto routines = this->routines;
+        auto stack = this->stack;
+        while (!stack.empty()) {
+            close(routines, stack, this->total);
+        }
+        std::vector<Routine> out;
+        out.reserve(routines.size());
+        for (const auto &[addr, totals]: routines) {
+            out.push_back(totals.routine);
+        }
+        std::sort(out.begin(), out.end(), [](const Routine &a, const Routine &b) {
+            return a.inclusive != b.inclusive ? a.inclusive > b.inclusive : a.addr < b.addr;
+        });
+        return out;
+    }
+
+    bool Profiler::writeFlat(std::FILE *out, const unsigned int top) const {
+        const auto percent = [this](const unsigned long long value) {
+            return this->total ? 100.0 * static_cast<double>(value) / static_cast<double>(this->total) : 0.0;
+        };
+        const auto location = [this, out](const unsigned short addr) {
+            if (const SourceLine *line = this->source(addr)) {
+                std::fprintf(out, "  0x%04X  %5u  %s\n", addr, line->line, line->text.c_str());
+            } else {
+                std::fprintf(out, "  0x%04X\n", addr);
+            }
+        };
+        std::fprintf(out, "Flat profile: %llu instructions\n", this->total);
+
+        std::vector<unsigned char> ops;
+        for (unsigned char opcode = 0; opcode < 32; opcode++) {
+            if (this->opcodes[opcode]) {
+                ops.push_back(opcode);
+            }
+        }
+        std::stable_sort(ops.begin(), ops.end(), [this](const unsigned char a, const unsigned char b) {
+            return this->opcodes[a] > this->opcodes[b];
+        });
+        std::fprintf(out, "\nOpcodes\n      count        %%  opcode\n");
+        for (const unsigned char opcode: ops) {
+            std::fprintf(out, "%11llu  %6.2f%%  0x%02X %s\n", this->opcodes[opcode], percent(this->opcodes[opcode]),
+                         opcode, opcode_names[opcode]);
+        }
+
+        // The candidates for superinstructions, marked if the threaded engine fuses them
+        std::vector<std::pair<unsigned char, unsigned char>> sequences;
+        for (unsigned char first = 0; first < 32; first++) {
+            for (unsigned char second = 0; second < 32; second++) {
+                if (this->pairs[first][second]) {
+                    sequences.emplace_back(first, second);
+                }
+            }
+        }
+        const size_t shown_pairs = std::min<size_t>(top, sequences.size());
+        std::partial_sort(sequences.begin(), sequences.begin() + static_cast<std::ptrdiff_t>(shown_pairs),
+                          sequences.end(), [this](const auto &a, const auto &b) {
+                              return this->pairs[a.first][a.second] > this->pairs[b.first][b.second];
+                          });
+        std::fprintf(out, "\nOpcode pairs (%zu of %zu)\n      count        %%  first  second\n", shown_pairs,
+                     sequences.size());
+        for (size_t i = 0; i < shown_pairs; i++) {
+            const auto [first, second] = sequences[i];
+            std::fprintf(out, "%11llu  %6.2f%%  %-5s  %-6s%s\n", this->pairs[first][second],
+                         percent(this->pairs[first][second]), opcode_names[first], opcode_names[second],
+                         fusedOpcode(first, second) ? "  fused" : "");
+        }
+
+        std::vector<unsigned short> hot;
+        for (unsigned int addr = 0; addr < MEMORY_SIZE; addr++) {
+            if (this->counts[addr]) {
+                hot.push_back(static_cast<unsigned short>(addr));
+            }
+        }
+        const auto by_count = [this](const unsigned short a, const unsigned short b) {
+            return this->counts[a] != this->counts[b] ? this->counts[a] > this->counts[b] : a < b;
+        };
+        const size_t shown = std::min<size_t>(top, hot.size());
+        std::partial_sort(hot.begin(), hot.begin() + static_cast<std::ptrdiff_t>(shown), hot.end(), by_count);
+        std::fprintf(out, "\nHot spots (%zu of %zu addresses)\n      count        %%    addr   line  source\n",
+                     shown, hot.size());
+        for (size_t i = 0; i < shown; i++) {
+            std::fprintf(out, "%11llu  %6.2f%%", this->counts[hot[i]], percent(this->counts[hot[i]]));
+            location(hot[i]);
+        }
+
+        std::fprintf(out, "\nRoutines\n      calls    inclusive        %%    exclusive        %%    addr  name\n");
+        for (const Routine &routine: this->routineTotals()) {
+            std::fprintf(out, "%11llu  %11llu  %6.2f%%  %11llu  %6.2f%%  0x%04X  %s\n", routine.calls,
+                         routine.inclusive, percent(routine.inclusive), routine.exclusive,
+                         percent(routine.exclusive), routine.addr, this->name(routine.addr).c_str());
+        }
+
+        std::vector<unsigned short> jumps;
+        for (unsigned int addr = 0; addr < MEMORY_SIZE; addr++) {
+            if (this->branches[addr]) {
+                jumps.push_back(static_cast<unsigned short>(addr));
+            }
+        }
+        const size_t shown_jumps = std::min<size_t>(top, jumps.size());
+        std::partial_sort(jumps.begin(), jumps.begin() + static_cast<std::ptrdiff_t>(shown_jumps), jumps.end(),
+                          by_count);
+        std::fprintf(out, "\nConditional jumps (%zu of %zu)\n   executed        taken    not taken  taken %%"
+                     "    addr   line  source\n", shown_jumps, jumps.size());
+        for (size_t i = 0; i < shown_jumps; i++) {
+            const unsigned long long executed = this->counts[jumps[i]];
+            const unsigned long long taken = std::min(this->taken[jumps[i]], executed);
+            std::fprintf(out, "%11llu  %11llu  %11llu  %6.2f%%", executed, taken, executed - taken,
+                         executed ? 100.0 * static_cast<double>(taken) / static_cast<double>(executed) : 0.0);
+            location(jumps[i]);
+        }
+        return std::fflush(out) == 0 && !std::ferror(out);
+    }
+
+    bool Profiler::writeFolded(std::FILE *out) const {
+        std::vector<std::string> names;
+        for (unsigned int i = 0; i < this->nodes.size(); i++) {
+            if (this->nodes[i].self == 0) {
+                continue;
+            }
+            names.clear();
+            for (unsigned int at = i; at != 0; at = this->nodes[at].parent) {
+                names.push_back(this->name(this->nodes[at].routine));
+            }
+            std::string line = "(top)";
+            for (auto name = names.rbegin(); name != names.rend(); ++name) {
+                line += ';';
+                line += *name;
+            }
+            std::fprintf(out, "%s %llu\n", line.c_str(), this->nodes[i].self);
+        }
+        return std::fflush(out) == 0 && !std::ferror(out);
+    }
+} // Virt16
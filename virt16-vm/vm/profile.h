@@ -0,0 +1,136 @@
+//
+// Execution profiler.
+//
+// A Profiler attached with virt16::setProfiler() counts every instruction the VM executes: per address, per
+// opcode, taken and not taken for the conditional jumps, and per CALL target the calls with their inclusive
+// and exclusive cycles, and pairs of opcodes executed one after the other. Calls are followed on a shadow stack that assumes routines return with RET. The
+// counts are exact, not sampled. writeFlat() prints them as a hot-spot report with the source lines of the
+// program, writeFolded() as folded stacks for flamegraph.pl, inferno or speedscope.
+//
+// Only built with the VIRT16_PROFILE CMake option, without it the VM has no profiler hooks at all.
+//
+
+#ifndef VIRT16_PROFILE_H
+#define VIRT16_PROFILE_H
+
+#include <bitset>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "assembler.h"
+
+namespace Virt16 {
+    class Profiler {
+    public:
+        // Per CALL target
+        struct Routine {
+            unsigned short addr = 0;
+            unsigned long long calls = 0;
+            unsigned long long inclusive = 0; // Cycles from its first instruction to its RET, callees included
+            unsigned long long exclusive = 0; // The same without the cycles spent in callees
+        };
+
+    private:
+        struct Totals {
+            Routine routine;
+            unsigned int active = 0; // Frames of it on the shadow stack, recursion is only counted once
+        };
+
+        // One call path, nodes[0] is the code outside of any call
+        struct Node {
+            unsigned short routine;
+            unsigned int parent;
+            unsigned long long self = 0;
+        };
+
+        struct Frame {
+            unsigned short routine;
+            unsigned int node;
+            unsigned long long start; // Instructions counted before its first one
+            unsigned long long children = 0; // Inclusive cycles of the calls it made
+        };
+
+        std::unique_ptr<unsigned long long[]> counts; // Per address
+        std::unique_ptr<unsigned long long[]> taken; // Per address, conditional jumps only
+        std::bitset<MEMORY_SIZE> branches; // Addresses a conditional jump was executed at
+        unsigned long long opcodes[32]{};
+        unsigned long long pairs[32][32]{}; // First opcode, the one after it without a jump in between
+        int previous = -1; // Opcode of the last instruction if the next one follows it, -1 after a jump
+        unsigned short follows = 0; // Address of that next instruction
+        unsigned long long total = 0;
+
+        std::unordered_map<unsigned short, Totals> routines;
+        std::vector<Node> nodes;
+        std::unordered_map<unsigned long long, unsigned int> paths; // parent << 16 | routine to node
+        std::vector<Frame> stack;
+        unsigned int node = 0;
+        unsigned int untracked = 0; // Calls past MAX_DEPTH that were not pushed
+
+        std::vector<SourceLine> source_map;
+        std::map<unsigned short, std::string> labels;
+
+        void enter(unsigned short target);
+
+        void leave();
+
+        // Closes the innermost frame at the current instruction count into routines
+        static void close(std::unordered_map<unsigned short, Totals> &routines, std::vector<Frame> &stack,
+                          unsigned long long total);
+
+        [[nodiscard]] const SourceLine *source(unsigned short addr) const;
+
+        [[nodiscard]] std::string name(unsigned short addr) const;
+
+    public:
+        // Deeper calls are counted but not followed
+        static constexpr unsigned int MAX_DEPTH = 4096;
+
+        Profiler();
+
+        Profiler(const Profiler &) = delete;
+
+        Profiler &operator=(const Profiler &) = delete;
+
+        // Called by the VM for the instruction at pc that has just been executed, next is the new PC
+        void record(unsigned short pc, unsigned char opcode, unsigned short next);
+
+        // The VM state was replaced wholesale (reset(), restore()), the shadow stack no longer matches it
+        void resync();
+
+        // Drops every count
+        void clear();
+
+        // Source lines for the reports, e.g. Assembly::source_map, RomImage::getSourceMap() or readDebugFile()
+        void setSourceMap(std::vector<SourceLine> lines);
+
+        // Routine name for the reports, addresses without one are shown in hex
+        void setLabel(unsigned short addr, std::string name);
+
+        [[nodiscard]] unsigned long long instructions() const;
+
+        [[nodiscard]] unsigned long long count(unsigned short addr) const;
+
+        // Times the conditional jump at addr jumped
+        [[nodiscard]] unsigned long long takenCount(unsigned short addr) const;
+
+        [[nodiscard]] unsigned long long opcodeCount(unsigned char opcode) const;
+
+        // Times second ran right after first, in straight-line code
+        [[nodiscard]] unsigned long long pairCount(unsigned char first, unsigned char second) const;
+
+        // Every CALL target by inclusive cycles, calls that have not returned yet count up to now
+        [[nodiscard]] std::vector<Routine> routineTotals() const;
+
+        // Opcodes, opcode pairs, the top addresses, routines and conditional jumps as text
+        bool writeFlat(std::FILE *out, unsigned int top = 20) const;
+
+        // One "outer;inner cycles" line per call path
+        bool writeFolded(std::FILE *out) const;
+    };
+} // Virt16
+
+#endif //VIRT16_PROFILE_H
@@ -0,0 +1,266 @@
+//
+// Versioned ROM images, see rom.h.
+//
+
+#include "rom.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define VIRT16_ROM_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define VIRT16_ROM_MMAP 0
+#endif
+
+namespace Virt16 {
+    namespace {
+        constexpr char MAGIC[4] = {'V', '1', '6', 'I'};
+
+        enum DebugKind : unsigned char {
+            DEBUG_LABEL = 1,
+            DEBUG_LINE = 2
+        };
+
+        unsigned int read16(const unsigned char *p) {
+            return static_cast<unsigned int>(p[0]) << 8 | p[1];
+        }
+
+        unsigned int read32(const unsigned char *p) {
+            return read16(p) << 16 | read16(p + 2);
+        }
+
+        void write16(std::vector<unsigned char> &out, const unsigned int value) {
+            out.push_back(static_cast<unsigned char>(value >> 8));
+            out.push_back(static_cast<unsigned char>(value));
+        }
+
+        void write32(std::vector<unsigned char> &out, const unsigned int value) {
+            write16(out, value >> 16);
+            write16(out, value);
+        }
+
+        void writeRecord(std::vector<unsigned char> &out, const DebugKind kind, const unsigned short addr,
+                         const unsigned int line, const std::string &text) {
+            const size_t length = std::min<size_t>(text.size(), 0xFFFF);
+            out.push_back(kind);
+            write16(out, addr);
+            write32(out, line);
+            write16(out, static_cast<unsigned int>(length));
+            out.insert(out.end(), text.begin(), text.begin() + static_cast<std::ptrdiff_t>(length));
+        }
+    }
+
+    bool RomImage::parse(const unsigned char *data, const size_t size) {
+        virt16 vm;
+        this->header = size >= sizeof(MAGIC) && std::memcmp(data, MAGIC, sizeof(MAGIC)) == 0;
+
+        if (!this->header) {
+            if (size % 2 || size > 2 * MEMORY_SIZE) {
+                this->error = "raw image must hold an even number of bytes up to 128 KiB";
+                return false;
+            }
+            this->raw.resize(size / 2);
+            for (size_t i = 0; i < this->raw.size(); i++) {
+                this->raw[i] = static_cast<unsigned short>(data[2 * i] | data[2 * i + 1] << 8);
+            }
+            vm.load(this->raw.data(), static_cast<unsigned int>(this->raw.size()));
+            this->boot_state = vm.snapshot();
+            return true;
+        }
+
+        if (size < HEADER_SIZE) {
+            this->error = "truncated header";
+            return false;
+        }
+        if (const unsigned int version = read16(data + 4); version != VERSION) {
+            this->error = "unsupported image version " + std::to_string(version);
+            return false;
+        }
+        const unsigned int segments = read16(data + 6);
+        this->entry = static_cast<unsigned short>(read16(data + 8));
+        this->sp = static_cast<unsigned short>(read16(data + 10));
+        this->disp = static_cast<unsigned short>(read16(data + 12));
+        const size_t debug_offset = read32(data + 16);
+        const size_t debug_size = read32(data + 20);
+        if (HEADER_SIZE + segments * SEGMENT_SIZE > size) {
+            this->error = "truncated segment table";
+            return false;
+        }
+
+        std::vector<unsigned short> words;
+        for (unsigned int i = 0; i < segments; i++) {
+            const unsigned char *segment = data + HEADER_SIZE + i * SEGMENT_SIZE;
+            const unsigned int addr = read16(segment);
+            const unsigned int count = read16(segment + 2);
+            const size_t offset = read32(segment + 4);
+            if (offset > size || 2 * count > size - offset) {
+                this->error = "segment " + std::to_string(i) + " runs past the end of the file";
+                return false;
+            }
+            if (addr + count > MEMORY_SIZE) {
+                this->error = "segment " + std::to_string(i) + " runs past the end of memory";
+                return false;
+            }
+            words.resize(count);
+            for (unsigned int w = 0; w < count; w++) {
+                words[w] = static_cast<unsigned short>(read16(data + offset + 2 * w));
+            }
+            vm.load(words.data(), count, addr);
+        }
+
+        if (debug_offset) {
+            if (debug_offset > size || debug_size > size - debug_offset) {
+                this->error = "debug table runs past the end of the file";
+                return false;
+            }
+            const unsigned char *p = data + debug_offset;
+            const unsigned char *end = p + debug_size;
+            while (p < end) {
+                if (end - p < 9 || static_cast<size_t>(end - p - 9) < read16(p + 7)) {
+                    this->error = "truncated debug record";
+                    return false;
+                }
+                const auto addr = static_cast<unsigned short>(read16(p + 1));
+                const unsigned int line = read32(p + 3);
+                std::string text(reinterpret_cast<const char *>(p + 9), read16(p + 7));
+                if (p[0] == DEBUG_LABEL) {
+                    this->labels.push_back({addr, std::move(text)});
+                } else if (p[0] == DEBUG_LINE) {
+                    this->source_map.push_back({addr, line, std::move(text)});
+                }
+                // Unknown kinds are skipped so newer tables stay readable
+                p += 9 + read16(p + 7);
+            }
+        }
+
+        vm.setRegister(SP, this->sp);
+        vm.setRegister(DISP, this->disp);
+        vm.setPC(this->entry);
+        this->boot_state = vm.snapshot();
+        return true;
+    }
+
+    bool RomImage::open(const char *path) {
+        *this = RomImage();
+#if VIRT16_ROM_MMAP
+        const int fd = ::open(path, O_RDONLY);
+        struct stat st{};
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            this->error = std::string(path) + ": " + std::strerror(errno);
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            return false;
+        }
+        const auto size = static_cast<size_t>(st.st_size);
+        void *data = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            this->error = std::string(path) + ": " + std::strerror(errno);
+            return false;
+        }
+        const bool ok = this->parse(static_cast<const unsigned char *>(data), size);
+        if (data) {
+            munmap(data, size);
+        }
+#else
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            this->error = std::string(path) + ": cannot open file";
+            return false;
+        }
+        const std::vector<char> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        const bool ok = this->parse(reinterpret_cast<const unsigned char *>(bytes.data()), bytes.size());
+#endif
+        if (!ok) {
+            this->error = std::string(path) + ": " + this->error;
+        }
+        return ok;
+    }
+
+    const std::string &RomImage::getError() const {
+        return this->error;
+    }
+
+    bool RomImage::hasHeader() const {
+        return this->header;
+    }
+
+    unsigned short RomImage::getEntry() const {
+        return this->entry;
+    }
+
+    const std::vector<Symbol> &RomImage::getLabels() const {
+        return this->labels;
+    }
+
+    const std::vector<SourceLine> &RomImage::getSourceMap() const {
+        return this->source_map;
+    }
+
+    void RomImage::boot(virt16 &vm) const {
+        vm.restore(this->boot_state);
+    }
+
+    void RomImage::load(virt16 &vm) const {
+        if (this->header) {
+            this->boot(vm);
+        } else {
+            vm.load(this->raw.data(), static_cast<unsigned int>(this->raw.size()));
+        }
+    }
+
+    bool RomImage::write(const char *path, const Assembly &assembly, const unsigned short sp,
+                         const unsigned short disp, std::string &error) {
+        if (assembly.image.size() > 0xFFFF) {
+            error = "image does not fit in one segment";
+            return false;
+        }
+        const auto entry = assembly.labels.find(".main");
+        std::vector<unsigned char> out(MAGIC, MAGIC + sizeof(MAGIC));
+        write16(out, VERSION);
+        write16(out, 1);
+        write16(out, entry != assembly.labels.end() ? entry->second : 0);
+        write16(out, sp);
+        write16(out, disp);
+        write16(out, 0);
+        const size_t debug_offset_at = out.size();
+        write32(out, 0);
+        write32(out, 0);
+
+        write16(out, 0);
+        write16(out, static_cast<unsigned int>(assembly.image.size()));
+        write32(out, static_cast<unsigned int>(HEADER_SIZE + SEGMENT_SIZE));
+        for (const unsigned short word: assembly.image) {
+            write16(out, word);
+        }
+
+        const size_t debug_offset = out.size();
+        for (const auto &[name, addr]: assembly.labels) {
+            writeRecord(out, DEBUG_LABEL, addr, 0, name);
+        }
+        for (const SourceLine &line: assembly.source_map) {
+            writeRecord(out, DEBUG_LINE, line.addr, line.line, line.text);
+        }
+        const size_t debug_size = out.size() - debug_offset;
+        for (int i = 0; i < 4; i++) {
+            out[debug_offset_at + i] = static_cast<unsigned char>(debug_offset >> (24 - 8 * i));
+            out[debug_offset_at + 4 + i] = static_cast<unsigned char>(debug_size >> (24 - 8 * i));
+        }
+
+        std::ofstream file(path, std::ios::binary);
+        file.write(reinterpret_cast<const char *>(out.data()), static_cast<std::streamsize>(out.size()));
+        if (!file) {
+            error = std::string(path) + ": cannot write file";
+            return false;
+        }
+        return true;
+    }
+} // Virt16
@@ -0,0 +1,79 @@
+//
+// Versioned ROM images.
+//
+// File layout, every field big-endian:
+//   header     "V16I", u16 version, u16 segment count, u16 entry PC, u16 SP, u16 DISP, u16 reserved,
+//              u32 debug table offset (0 if there is none), u32 debug table size in bytes
+//   segments   u16 load address, u16 word count, u32 file offset of the words
+//   debug      records of u8 kind (1 label, 2 source line), u16 address, u32 line, u16 length, text
+// Files without the magic are raw images in the format assembler/assemble.py writes: little-endian
+// words loaded from address 0.
+//
+// Opening an image maps the file, validates it and builds the boot state once. Booting a VM from it
+// shares the memory pages copy-on-write, so starting thousands of VMs from one image copies nothing.
+//
+
+#ifndef VIRT16_ROM_H
+#define VIRT16_ROM_H
+
+#include <string>
+#include <vector>
+
+#include "assembler.h"
+#include "virt16.h"
+
+namespace Virt16 {
+    struct Symbol {
+        unsigned short addr;
+        std::string name;
+    };
+
+    class RomImage {
+    private:
+        Snapshot boot_state;
+        // Raw images are loaded word by word on top of the existing memory by virt16::load_program()
+        std::vector<unsigned short> raw;
+        bool header = false;
+        unsigned short entry = 0;
+        unsigned short sp = 0;
+        unsigned short disp = 0;
+        std::vector<Symbol> labels;
+        std::vector<SourceLine> source_map;
+        std::string error;
+
+        bool parse(const unsigned char *data, size_t size);
+
+    public:
+        static constexpr unsigned short VERSION = 1;
+        static constexpr size_t HEADER_SIZE = 24;
+        static constexpr size_t SEGMENT_SIZE = 8;
+
+        // Returns false and sets getError() if the file cannot be read or is malformed
+        bool open(const char *path);
+
+        [[nodiscard]] const std::string &getError() const;
+
+        // False for raw images without a header, they carry no entry point, registers or debug table
+        [[nodiscard]] bool hasHeader() const;
+
+        [[nodiscard]] unsigned short getEntry() const;
+
+        [[nodiscard]] const std::vector<Symbol> &getLabels() const;
+
+        [[nodiscard]] const std::vector<SourceLine> &getSourceMap() const;
+
+        // Resets vm to the power-on state of the image: segments in memory, everything else zero, PC at
+        // the entry point and SP/DISP from the header. The engine is kept.
+        void boot(virt16 &vm) const;
+
+        // Stores the image like virt16::load_program(): raw images are written from address 0 over the
+        // current memory, images with a header boot the VM
+        void load(virt16 &vm) const;
+
+        // Writes an assembled program as a single segment at address 0 with its labels and source map
+        static bool write(const char *path, const Assembly &assembly, unsigned short sp, unsigned short disp,
+                          std::string &error);
+    };
+} // Virt16
+
+#endif //VIRT16_ROM_H
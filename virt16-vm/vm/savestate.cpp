@@ -0,0 +1,291 @@
+//
+// Save states, see savestate.h.
+//
+
+#include "savestate.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+namespace Virt16 {
+    namespace {
+        constexpr char MAGIC[4] = {'V', '1', '6', 'S'};
+        constexpr size_t MACHINE_SIZE = 2 + 2 * 32 + 3 + 8 + 8;
+        constexpr size_t BITMAP_SIZE = PAGE_COUNT / 8;
+
+        enum Kind : unsigned char {
+            KIND_FULL = 0,
+            KIND_INCREMENTAL = 1
+        };
+
+        // Longest literal and repeat runs
+        constexpr unsigned int MAX_LITERAL = 0x80;
+        constexpr unsigned int MAX_REPEAT = 0x81;
+
+        unsigned int read16(const unsigned char *p) {
+            return static_cast<unsigned int>(p[0]) << 8 | p[1];
+        }
+
+        unsigned long long read64(const unsigned char *p) {
+            unsigned long long value = 0;
+            for (int i = 0; i < 8; i++) {
+                value = value << 8 | p[i];
+            }
+            return value;
+        }
+
+        void write16(std::vector<unsigned char> &out, const unsigned int value) {
+            out.push_back(static_cast<unsigned char>(value >> 8));
+            out.push_back(static_cast<unsigned char>(value));
+        }
+
+        void write64(std::vector<unsigned char> &out, const unsigned long long value) {
+            for (int shift = 56; shift >= 0; shift -= 8) {
+                out.push_back(static_cast<unsigned char>(value >> shift));
+            }
+        }
+
+        unsigned long long fnv1a(unsigned long long hash, const unsigned char *data, const size_t size) {
+            for (size_t i = 0; i < size; i++) {
+                hash = (hash ^ data[i]) * 0x100000001B3ull;
+            }
+            return hash;
+        }
+
+        // Repeats of two or more words become one run, everything in between literal runs
+        void encodeRuns(std::vector<unsigned char> &out, const unsigned short *words) {
+            unsigned int i = 0;
+            while (i < PAGE_WORDS) {
+                unsigned int repeat = 1;
+                while (i + repeat < PAGE_WORDS && repeat < MAX_REPEAT && words[i + repeat] == words[i]) {
+                    repeat++;
+                }
+                if (repeat >= 2) {
+                    out.push_back(static_cast<unsigned char>(0x80 + repeat - 2));
+                    write16(out, words[i]);
+                    i += repeat;
+                    continue;
+                }
+                unsigned int literal = 1;
+                while (i + literal < PAGE_WORDS && literal < MAX_LITERAL &&
+                       (i + literal + 1 >= PAGE_WORDS || words[i + literal] != words[i + literal + 1])) {
+                    literal++;
+                }
+                out.push_back(static_cast<unsigned char>(literal - 1));
+                for (unsigned int j = 0; j < literal; j++) {
+                    write16(out, words[i + j]);
+                }
+                i += literal;
+            }
+        }
+
+        // Returns false if the runs do not fill exactly one page
+        bool decodeRuns(const unsigned char *data, const size_t size, unsigned short *words) {
+            size_t at = 0;
+            unsigned int filled = 0;
+            while (at < size) {
+                const unsigned int control = data[at++];
+                const unsigned int count = control < 0x80 ? control + 1 : control - 0x80 + 2;
+                const size_t bytes = control < 0x80 ? 2 * count : 2;
+                if (filled + count > PAGE_WORDS || at + bytes > size) {
+                    return false;
+                }
+                for (unsigned int j = 0; j < count; j++) {
+                    words[filled + j] = static_cast<unsigned short>(read16(&data[at + (control < 0x80 ? 2 * j : 0)]));
+                }
+                filled += count;
+                at += bytes;
+            }
+            return filled == PAGE_WORDS;
+        }
+    }
+
+    void SaveState::writeMachine(std::vector<unsigned char> &out, const Snapshot &state) {
+        write16(out, state.pc);
+        for (const unsigned short value: state.registers) {
+            write16(out, value);
+        }
+        out.push_back(static_cast<unsigned char>(state.z | state.g << 1 | state.l << 2 | state.e << 3 | state.c << 4));
+        out.push_back(static_cast<unsigned char>(state.running | state.interrupts << 1 | state.waiting << 2));
+        out.push_back(state.pending);
+        write64(out, state.cycles);
+        write64(out, state.ticks);
+    }
+
+    unsigned long long SaveState::id(const Snapshot &state) {
+        std::vector<unsigned char> machine;
+        writeMachine(machine, state);
+        unsigned long long hash = fnv1a(0xCBF29CE484222325ull, machine.data(), machine.size());
+        unsigned char bytes[2 * PAGE_WORDS];
+        for (const Page *page: state.pages) {
+            for (unsigned int i = 0; i < PAGE_WORDS; i++) {
+                bytes[2 * i] = static_cast<unsigned char>(page->words[i] >> 8);
+                bytes[2 * i + 1] = static_cast<unsigned char>(page->words[i]);
+            }
+            hash = fnv1a(hash, bytes, sizeof(bytes));
+        }
+        return hash;
+    }
+
+    bool SaveState::write(const char *path, const Snapshot &state, const bool incremental) {
+        const unsigned long long state_id = id(state);
+        std::vector<unsigned char> out(MAGIC, MAGIC + sizeof(MAGIC));
+        write16(out, VERSION);
+        out.push_back(incremental ? KIND_INCREMENTAL : KIND_FULL);
+        write64(out, state_id);
+        write64(out, incremental ? this->base_id : 0);
+        writeMachine(out, state);
+
+        // Pages still shared with the base were not written since, the others are compared word by word
+        const size_t bitmap_at = out.size();
+        out.resize(out.size() + BITMAP_SIZE);
+        for (unsigned int i = 0; i < PAGE_COUNT; i++) {
+            const unsigned short *words = state.pages[i]->words;
+            const bool stored = incremental
+                                    ? state.pages[i] != this->base.pages[i] &&
+                                      std::memcmp(words, this->base.pages[i]->words, sizeof(Page::words)) != 0
+                                    : std::any_of(words, words + PAGE_WORDS, [](const unsigned short w) { return w; });
+            if (!stored) {
+                continue;
+            }
+            out[bitmap_at + i / 8] |= static_cast<unsigned char>(1 << (i % 8));
+            const size_t size_at = out.size();
+            write16(out, 0);
+            encodeRuns(out, words);
+            const size_t size = out.size() - size_at - 2;
+            out[size_at] = static_cast<unsigned char>(size >> 8);
+            out[size_at + 1] = static_cast<unsigned char>(size);
+        }
+
+        // A checkpoint that is cut short must not replace the last good one
+        const std::string temporary = std::string(path) + ".tmp";
+        {
+            std::ofstream file(temporary, std::ios::binary);
+            file.write(reinterpret_cast<const char *>(out.data()), static_cast<std::streamsize>(out.size()));
+            if (!file.flush()) {
+                std::remove(temporary.c_str());
+                this->error = std::string(path) + ": cannot write file";
+                return false;
+            }
+        }
+        if (std::rename(temporary.c_str(), path) != 0) {
+            std::remove(temporary.c_str());
+            this->error = std::string(path) + ": cannot replace file";
+            return false;
+        }
+        this->written = out.size();
+        if (!incremental) {
+            this->base = state;
+            this->base_id = state_id;
+        }
+        this->error.clear();
+        return true;
+    }
+
+    bool SaveState::save(const char *path, virt16 &vm) {
+        return this->write(path, vm.snapshot(), false);
+    }
+
+    bool SaveState::saveIncremental(const char *path, virt16 &vm) {
+        return this->write(path, vm.snapshot(), this->base.valid());
+    }
+
+    bool SaveState::load(const char *path, virt16 &vm) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            this->error = std::string(path) + ": cannot open file";
+            return false;
+        }
+        const std::vector<unsigned char> data{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+        const auto fail = [&](const char *reason) {
+            this->error = std::string(path) + ": " + reason;
+            return false;
+        };
+        if (data.size() < HEADER_SIZE + MACHINE_SIZE + BITMAP_SIZE ||
+            std::memcmp(data.data(), MAGIC, sizeof(MAGIC)) != 0) {
+            return fail("not a save state");
+        }
+        if (read16(&data[4]) != VERSION) {
+            return fail("unsupported save state version");
+        }
+        const unsigned char kind = data[6];
+        const unsigned long long state_id = read64(&data[7]);
+        const unsigned long long base_id = read64(&data[15]);
+        if (kind != KIND_FULL && kind != KIND_INCREMENTAL) {
+            return fail("unknown save state kind");
+        }
+
+        // Incremental states start from the VM, full ones from zeroed memory
+        Snapshot state;
+        if (kind == KIND_INCREMENTAL) {
+            state = vm.snapshot();
+            if (id(state) != base_id) {
+                return fail("incremental state was not saved against the current state of the VM");
+            }
+        } else {
+            static constexpr unsigned short zero[PAGE_WORDS]{};
+            for (unsigned int i = 0; i < PAGE_COUNT; i++) {
+                state.setPage(i, zero);
+            }
+        }
+
+        const unsigned char *machine = &data[HEADER_SIZE];
+        state.pc = static_cast<unsigned short>(read16(machine));
+        for (int i = 0; i < 32; i++) {
+            state.registers[i] = static_cast<unsigned short>(read16(&machine[2 + 2 * i]));
+        }
+        const unsigned char flags = machine[66];
+        state.z = flags & 1;
+        state.g = flags & 2;
+        state.l = flags & 4;
+        state.e = flags & 8;
+        state.c = flags & 16;
+        state.running = machine[67] & 1;
+        state.interrupts = machine[67] & 2;
+        state.waiting = machine[67] & 4;
+        state.pending = machine[68] & 0xF;
+        state.cycles = read64(&machine[69]);
+        state.ticks = read64(&machine[77]);
+
+        const unsigned char *bitmap = &machine[MACHINE_SIZE];
+        size_t at = HEADER_SIZE + MACHINE_SIZE + BITMAP_SIZE;
+        unsigned short words[PAGE_WORDS];
+        for (unsigned int i = 0; i < PAGE_COUNT; i++) {
+            if (!(bitmap[i / 8] & (1 << (i % 8)))) {
+                continue;
+            }
+            if (at + 2 > data.size()) {
+                return fail("truncated save state");
+            }
+            const size_t size = read16(&data[at]);
+            at += 2;
+            if (at + size > data.size() || !decodeRuns(&data[at], size, words)) {
+                return fail("corrupt page in save state");
+            }
+            at += size;
+            state.setPage(i, words);
+        }
+        if (at != data.size() || id(state) != state_id) {
+            return fail("save state does not match its id");
+        }
+
+        vm.restore(state);
+        if (kind == KIND_FULL) {
+            this->base = std::move(state);
+            this->base_id = state_id;
+        }
+        this->error.clear();
+        return true;
+    }
+
+    unsigned long long SaveState::size() const {
+        return this->written;
+    }
+
+    const std::string &SaveState::getError() const {
+        return this->error;
+    }
+} // Virt16
@@ -0,0 +1,68 @@
+//
+// Save states.
+//
+// A save state holds everything a VM needs to resume: memory, registers, PC, flags, the run state, the
+// cycle and tick counters and the interrupt state. A full state stands on its own. An incremental state
+// only holds the pages that differ from the full state last saved or loaded by the same SaveState, so a
+// long run can checkpoint every few seconds for a few KiB. It is loaded on top of that full state.
+//
+// File layout, every multi-byte field big-endian:
+//   header     "V16S", u16 version, u8 kind (0 full, 1 incremental), u64 state id, u64 base id (0 if full)
+//   machine    u16 pc, 32 x u16 registers, u8 flags, u8 running | interrupts << 1 | waiting << 2,
+//              u8 pending interrupt lines, u64 cycles, u64 ticks
+//   memory     32-byte bitmap of the stored pages, then for each of them u16 size in bytes and its runs
+//   runs       u8 n < 0x80 followed by n + 1 words, or u8 n >= 0x80 followed by one word repeated
+//              n - 0x7E times
+// Flags are Z | G << 1 | L << 2 | E << 3 | C << 4. A full state leaves out the pages that hold only zeros,
+// an incremental one the pages that equal its base. The id is a 64-bit FNV-1a hash of the machine
+// section and all 64K words of memory: loading checks the result against it, and an incremental state
+// only loads into a VM whose id is its base id.
+//
+
+#ifndef VIRT16_SAVESTATE_H
+#define VIRT16_SAVESTATE_H
+
+#include <string>
+#include <vector>
+
+#include "virt16.h"
+
+namespace Virt16 {
+    class SaveState {
+    private:
+        // State of the last full save() or load(), saveIncremental() stores the pages that differ from it
+        Snapshot base;
+        unsigned long long base_id = 0;
+        unsigned long long written = 0;
+        std::string error;
+
+        static void writeMachine(std::vector<unsigned char> &out, const Snapshot &state);
+
+        bool write(const char *path, const Snapshot &state, bool incremental);
+
+    public:
+        static constexpr unsigned short VERSION = 1;
+        static constexpr size_t HEADER_SIZE = 23;
+
+        // Id a save of state would carry
+        static unsigned long long id(const Snapshot &state);
+
+        // Writes the complete state of vm and makes it the base of the following incremental saves. The file
+        // is replaced once it has been written completely. Returns false and sets getError() on failure.
+        bool save(const char *path, virt16 &vm);
+
+        // Writes the pages of vm that changed since the base, a full state if there is no base yet
+        bool saveIncremental(const char *path, virt16 &vm);
+
+        // Restores vm from a full state, which becomes the base, or from an incremental one saved against
+        // the state vm is in. The engine, breakpoints and attached trace, history and bus are kept.
+        bool load(const char *path, virt16 &vm);
+
+        // Size of the last file written
+        [[nodiscard]] unsigned long long size() const;
+
+        [[nodiscard]] const std::string &getError() const;
+    };
+} // Virt16
+
+#endif //VIRT16_SAVESTATE_H
@@ -0,0 +1,407 @@
+//
+// Threaded execution engine.
+//
+// Dispatches on the pre-decoded opcode with computed gotos (GCC/Clang labels-as-values): every
+// handler ends in its own indirect jump, so the branch predictor can learn opcode sequences
+// instead of sharing the single jump of a switch. Other compilers get a switch with the same
+// handler bodies. pc, the cycle budget and the clock ticks live in locals for the whole run and the
+// running flag is only touched by HLT and WAIT, so there is no per-instruction bookkeeping besides the budget
+// and a constant tick count per handler. TIME is only brought up to date for instructions that use it.
+// The Checked build, used while breakpoints or watchpoints are set, checks every instruction before it
+// runs and leaves once a watchpoint cleared the running flag.
+// The Fused build, used with virt16::setFusion(), dispatches on DecodedOp::fused instead of the opcode and so
+// runs the common sequences listed in opcodes.h with one dispatch. A superinstruction only checks that the
+// instructions after the first still have the opcodes it was fused from; a write invalidates their slots but
+// not the first one. Without the budget for all of them, or once they changed, it runs the first instruction
+// on its own.
+//
+
+
+#include "virt16.h"
+#include "opcodes.h"
+
+#if defined(__GNUC__) && !defined(VIRT16_NO_COMPUTED_GOTO)
+#define VIRT16_COMPUTED_GOTO 1
+#else
+#define VIRT16_COMPUTED_GOTO 0
+#endif
+
+// Count the ticks of opcode when its handler starts, TIME only follows for instructions that use it
+#define TICK(opcode) \
+    ticks += OPCODE_TICKS[opcode]; \
+    if (op->time) [[unlikely]] { SYNC_TIME(); }
+
+// Handler number of the cached instruction op
+#define DISPATCH_OPCODE (Fused ? op->fused : op->opcode)
+
+// FIRST_HANDLER is for the instructions superinstructions start with, they fall back to its label. Fused
+// handlers count their ticks themselves.
+#if VIRT16_COMPUTED_GOTO
+#define HANDLER(label, opcode) label: TICK(opcode);
+#define FIRST_HANDLER(label, opcode) label: TICK(opcode);
+#define FUSED_HANDLER(label, fused) label:
+#define DECODE_HANDLER op_decode:
+#define INVALID_HANDLER op_invalid: TICK(op->opcode);
+#define DISPATCH() goto *handlers[DISPATCH_OPCODE]
+#else
+#define HANDLER(label, opcode) case opcode: TICK(opcode);
+#define FIRST_HANDLER(label, opcode) case opcode: label: TICK(opcode);
+#define FUSED_HANDLER(label, fused) case fused:
+#define DECODE_HANDLER case UNDECODED:
+#define INVALID_HANDLER default: TICK(op->opcode);
+#define DISPATCH() continue
+#endif
+
+// The cached instruction next still is what a superinstruction was fused from
+#define FOLLOWS(next, expected) ((next).opcode == (expected) && !(next).time)
+
+// CMP flags are sticky, a comparison only ever sets them
+#define COMPARE(x_val, y_val) \
+    if ((x_val) == (y_val)) this->e = true; \
+    if ((x_val) > (y_val)) this->g = true; \
+    if ((x_val) < (y_val)) this->l = true
+
+// CMP followed by a conditional jump that is taken when condition holds
+#define CMP_JUMP_HANDLER(label, fused, jump, condition) \
+    FUSED_HANDLER(label, fused) \
+        if (remaining < 2 || !FOLLOWS(op[2], jump)) goto op_cmp; \
+        ticks += OPCODE_TICKS[CMP] + OPCODE_TICKS[jump]; \
+        COMPARE(regs[op->x], regs[op->y]); \
+        remaining--; \
+        pc = (condition) ? op[2].imm : pc + 2; \
+        NEXT();
+
+// INC or DEC, then CMP and a JNE back to the top of the loop
+#define LOOP_TAIL_HANDLER(label, fused, first, first_label, delta) \
+    FUSED_HANDLER(label, fused) \
+        if (remaining < 3 || !FOLLOWS(op[2], CMP) || !FOLLOWS(op[4], JNE)) goto first_label; \
+        ticks += OPCODE_TICKS[first] + OPCODE_TICKS[CMP] + OPCODE_TICKS[JNE]; \
+        regs[op->x] = regs[op->x] + (delta); \
+        COMPARE(regs[op[2].x], regs[op[2].y]); \
+        remaining -= 2; \
+        pc = !this->e ? op[4].imm : pc + 4; \
+        NEXT();
+
+// Add the ticks counted since the last sync to TIME
+#define SYNC_TIME() \
+    regs[TIME] = static_cast<unsigned short>(regs[TIME] + (ticks - synced)); \
+    synced = ticks
+
+// Decode the instruction at pc for checkBefore(), leave in front of a breakpoint
+#define CHECK_BEFORE() \
+    this->pc = pc; \
+    SYNC_TIME(); \
+    op = this->cachedOp(pc); \
+    if (op->opcode == UNDECODED) op = &this->decode(pc); \
+    if (this->checkBefore(*op)) goto out
+
+// Advance to the next instruction, leave once the budget is spent
+#define NEXT() \
+    pc += 2; \
+    if (--remaining == 0) goto out; \
+    if constexpr (Checked) { \
+        if (!this->running) goto out; \
+        CHECK_BEFORE(); \
+        DISPATCH(); \
+    } \
+    op = this->cachedOp(pc); \
+    DISPATCH()
+
+namespace Virt16 {
+    template<bool Checked, bool Fused>
+    unsigned long long virt16::runThreaded(const unsigned long long max_cycles) {
+        static_assert(!(Checked && Fused), "superinstructions skip the checks between their instructions");
+        this->running = true;
+        if (max_cycles == 0) {
+            return 0;
+        }
+
+        unsigned short *const regs = this->registers;
+        unsigned short pc = this->pc;
+        unsigned long long remaining = max_cycles;
+        unsigned long long ticks = 0;
+        unsigned long long synced = 0; // Ticks already added to TIME
+        const DecodedOp *op = this->cachedOp(pc);
+        if constexpr (Checked) {
+            CHECK_BEFORE();
+        }
+
+#if VIRT16_COMPUTED_GOTO
+        static const void *const handlers[FUSED_END] = {
+            &&op_load_imm, &&op_load_addr, &&op_store_addr, &&op_mov,
+            &&op_inc, &&op_dec, &&op_add, &&op_sub,
+            &&op_and, &&op_or, &&op_xor, &&op_not,
+            &&op_shl, &&op_shr, &&op_cmp, &&op_jmp,
+            &&op_jz, &&op_je, &&op_jne, &&op_jg,
+            &&op_jl, &&op_call, &&op_ret, &&op_push,
+            &&op_pop, &&op_hlt, &&op_nop, &&op_iret,
+            &&op_wait, &&op_invalid, &&op_invalid, &&op_invalid,
+            &&op_decode, // UNDECODED
+            &&op_cmp_je, &&op_cmp_jne, &&op_cmp_jg, &&op_cmp_jl,
+            &&op_load_store, &&op_inc_cmp_jne, &&op_dec_cmp_jne, &&op_push_push,
+            &&op_pop_pop, &&op_push_call
+        };
+        DISPATCH();
+#else
+        for (;;) {
+        switch (DISPATCH_OPCODE) {
+#endif
+
+        DECODE_HANDLER
+            if constexpr (Fused) {
+                op = &this->decodeFused(pc);
+            } else {
+                op = &this->decode(pc);
+            }
+            DISPATCH();
+
+        FIRST_HANDLER(op_load_imm, LOAD_IMM)
+            regs[op->x] = op->imm;
+            NEXT();
+
+        HANDLER(op_load_addr, LOAD_ADDR)
+            // Y is used as the address itself, like step()
+            regs[op->x] = this->loadMemory(op->y);
+            NEXT();
+
+        HANDLER(op_store_addr, STORE_ADDR)
+            this->writeMemory(regs[op->x], regs[op->y]);
+            NEXT();
+
+        HANDLER(op_mov, MOV)
+            regs[op->x] = regs[op->y];
+            NEXT();
+
+        FIRST_HANDLER(op_inc, INC)
+            regs[op->x] = regs[op->x] + 1;
+            NEXT();
+
+        FIRST_HANDLER(op_dec, DEC)
+            regs[op->x] = regs[op->x] - 1;
+            NEXT();
+
+        HANDLER(op_add, ADD) {
+            const unsigned short dst = regs[op->x];
+            if (const unsigned int sum = regs[op->y] + regs[op->z]; sum > 0xFFFF) {
+                this->writeMemory(dst, (sum & 0xFFFF0000) >> 16);
+                this->writeMemory(dst + 1u, sum & 0x0000FFFF);
+                this->setFlag(C, true);
+            } else {
+                this->writeMemory(dst, sum);
+            }
+            NEXT();
+        }
+
+        HANDLER(op_sub, SUB) {
+            const unsigned short dst = regs[op->x];
+            if (const unsigned int diff = regs[op->y] - regs[op->z]; diff > 0xFFFF) {
+                this->writeMemory(dst, (diff & 0xFFFF0000) >> 16);
+                this->writeMemory(dst + 1u, diff & 0x0000FFFF);
+                this->setFlag(C, true);
+            } else {
+                this->writeMemory(dst, diff);
+            }
+            NEXT();
+        }
+
+        HANDLER(op_and, AND)
+            regs[op->x] = regs[op->y] & regs[op->z];
+            NEXT();
+
+        HANDLER(op_or, OR)
+            regs[op->x] = regs[op->y] | regs[op->z];
+            NEXT();
+
+        HANDLER(op_xor, XOR)
+            regs[op->x] = regs[op->y] ^ regs[op->z];
+            NEXT();
+
+        HANDLER(op_not, NOT)
+            regs[op->x] = ~regs[op->y];
+            NEXT();
+
+        HANDLER(op_shl, SHL)
+            regs[op->x] = regs[op->z] < 16 ? regs[op->y] << regs[op->z] : 0;
+            NEXT();
+
+        HANDLER(op_shr, SHR)
+            regs[op->x] = regs[op->z] < 16 ? regs[op->y] >> regs[op->z] : 0;
+            NEXT();
+
+        FIRST_HANDLER(op_cmp, CMP) {
+            const unsigned short x_val = regs[op->x];
+            const unsigned short y_val = regs[op->y];
+            COMPARE(x_val, y_val);
+            NEXT();
+        }
+
+        HANDLER(op_jmp, JMP)
+            pc = op->imm;
+            NEXT();
+
+        HANDLER(op_jz, JZ)
+            if (this->z) {
+                pc = op->imm;
+            }
+            NEXT();
+
+        HANDLER(op_je, JE)
+            if (this->e) {
+                pc = op->imm;
+            }
+            NEXT();
+
+        HANDLER(op_jne, JNE)
+            if (!this->e) {
+                pc = op->imm;
+            }
+            NEXT();
+
+        HANDLER(op_jg, JG)
+            if (this->g) {
+                pc = op->imm;
+            }
+            NEXT();
+
+        HANDLER(op_jl, JL)
+            if (this->l) {
+                pc = op->imm;
+            }
+            NEXT();
+
+        HANDLER(op_call, CALL) {
+            const unsigned short target = op->imm;
+            regs[SP] = regs[SP] - 1;
+            this->writeMemory(regs[SP], pc);
+            pc = target - 2;
+            NEXT();
+        }
+
+        HANDLER(op_ret, RET)
+            pc = this->loadMemory(regs[SP]);
+            regs[SP] = regs[SP] + 1;
+            NEXT();
+
+        FIRST_HANDLER(op_push, PUSH)
+            regs[SP] = regs[SP] - 1;
+            this->writeMemory(regs[SP], regs[op->x]);
+            NEXT();
+
+        FIRST_HANDLER(op_pop, POP)
+            regs[op->x] = this->loadMemory(regs[SP]);
+            regs[SP] = regs[SP] + 1;
+            NEXT();
+
+        HANDLER(op_hlt, HLT)
+            // pc stays on the HLT, like step()
+            this->running = false;
+            remaining--;
+            goto out;
+
+        HANDLER(op_nop, NOP)
+            NEXT();
+
+        HANDLER(op_iret, IRET)
+            this->setFlagWord(this->loadMemory(regs[SP]));
+            pc = this->loadMemory(regs[SP] + 1u) - 2;
+            regs[SP] = regs[SP] + 2;
+            this->interrupts = true;
+            NEXT();
+
+        HANDLER(op_wait, WAIT)
+            // Leaves on the next instruction, run() resumes there once an interrupt handler returned
+            this->waiting = true;
+            this->running = false;
+            pc += 2;
+            remaining--;
+            goto out;
+
+        INVALID_HANDLER
+            // Spare encodings run as NOP
+            NEXT();
+
+        CMP_JUMP_HANDLER(op_cmp_je, FUSED_CMP_JE, JE, this->e)
+        CMP_JUMP_HANDLER(op_cmp_jne, FUSED_CMP_JNE, JNE, !this->e)
+        CMP_JUMP_HANDLER(op_cmp_jg, FUSED_CMP_JG, JG, this->g)
+        CMP_JUMP_HANDLER(op_cmp_jl, FUSED_CMP_JL, JL, this->l)
+
+        LOOP_TAIL_HANDLER(op_inc_cmp_jne, FUSED_INC_CMP_JNE, INC, op_inc, 1)
+        LOOP_TAIL_HANDLER(op_dec_cmp_jne, FUSED_DEC_CMP_JNE, DEC, op_dec, -1)
+
+        FUSED_HANDLER(op_load_store, FUSED_LOAD_STORE)
+            if (remaining < 2 || !FOLLOWS(op[2], STORE_ADDR)) goto op_load_imm;
+            ticks += OPCODE_TICKS[LOAD_IMM] + OPCODE_TICKS[STORE_ADDR];
+            regs[op->x] = op->imm;
+            remaining--;
+            pc += 2;
+            op += 2;
+            this->writeMemory(regs[op->x], regs[op->y]);
+            NEXT();
+
+        FUSED_HANDLER(op_pop_pop, FUSED_POP_POP)
+            if (remaining < 2 || !FOLLOWS(op[2], POP)) goto op_pop;
+            ticks += OPCODE_TICKS[POP] * 2;
+            regs[op->x] = this->loadMemory(regs[SP]);
+            regs[SP] = regs[SP] + 1;
+            remaining--;
+            pc += 2;
+            op += 2;
+            regs[op->x] = this->loadMemory(regs[SP]);
+            regs[SP] = regs[SP] + 1;
+            NEXT();
+
+        // The first PUSH may overwrite the second instruction or copy a shared page, so that one is fetched
+        // again after it
+        FUSED_HANDLER(op_push_push, FUSED_PUSH_PUSH)
+            if (remaining < 2 || !FOLLOWS(op[2], PUSH)) goto op_push;
+            ticks += OPCODE_TICKS[PUSH];
+            regs[SP] = regs[SP] - 1;
+            this->writeMemory(regs[SP], regs[op->x]);
+            remaining--;
+            pc += 2;
+            op = this->cachedOp(pc);
+            if (!FOLLOWS(*op, PUSH)) {
+                DISPATCH();
+            }
+            ticks += OPCODE_TICKS[PUSH];
+            regs[SP] = regs[SP] - 1;
+            this->writeMemory(regs[SP], regs[op->x]);
+            NEXT();
+
+        FUSED_HANDLER(op_push_call, FUSED_PUSH_CALL)
+            if (remaining < 2 || !FOLLOWS(op[2], CALL)) goto op_push;
+            ticks += OPCODE_TICKS[PUSH];
+            regs[SP] = regs[SP] - 1;
+            this->writeMemory(regs[SP], regs[op->x]);
+            remaining--;
+            pc += 2;
+            op = this->cachedOp(pc);
+            if (!FOLLOWS(*op, CALL)) {
+                DISPATCH();
+            }
+            ticks += OPCODE_TICKS[CALL];
+            regs[SP] = regs[SP] - 1;
+            this->writeMemory(regs[SP], pc);
+            pc = op->imm - 2;
+            NEXT();
+
+#if !VIRT16_COMPUTED_GOTO
+        }
+        }
+#endif
+
+    out:
+        SYNC_TIME();
+        this->pc = pc;
+        const unsigned long long executed = max_cycles - remaining;
+        this->cycles += executed;
+        this->ticks += ticks;
+        return executed;
+    }
+
+    template unsigned long long virt16::runThreaded<false>(unsigned long long max_cycles);
+
+    template unsigned long long virt16::runThreaded<true>(unsigned long long max_cycles);
+
+    template unsigned long long virt16::runThreaded<false, true>(unsigned long long max_cycles);
+} // Virt16
@@ -0,0 +1,388 @@
+//
+// Execution traces, see trace.h.
+//
+
+#include "trace.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "virt16.h"
+
+#if defined(__SSE2__)
+#define VIRT16_TRACE_SSE2 1
+#include <emmintrin.h>
+#else
+#define VIRT16_TRACE_SSE2 0
+#endif
+
+namespace Virt16 {
+    namespace {
+        constexpr char MAGIC[4] = {'V', '1', '6', 'T'};
+
+        // Bit n is set if register n differs, compared for every instruction of step() and profiled runs
+        unsigned int changedRegisters(const unsigned short *a, const unsigned short *b) {
+#if VIRT16_TRACE_SSE2
+            unsigned int changed = 0;
+            for (int half = 0; half < 2; half++) {
+                const auto *x = reinterpret_cast<const __m128i *>(a + 16 * half);
+                const auto *y = reinterpret_cast<const __m128i *>(b + 16 * half);
+                const __m128i low = _mm_cmpeq_epi16(_mm_loadu_si128(x), _mm_loadu_si128(y));
+                const __m128i high = _mm_cmpeq_epi16(_mm_loadu_si128(x + 1), _mm_loadu_si128(y + 1));
+                changed |= (~_mm_movemask_epi8(_mm_packs_epi16(low, high)) & 0xFFFFu) << (16 * half);
+            }
+            return changed;
+#else
+            unsigned int changed = 0;
+            for (unsigned int reg = 0; reg < 32; reg++) {
+                changed |= static_cast<unsigned int>(a[reg] != b[reg]) << reg;
+            }
+            return changed;
+#endif
+        }
+    }
+
+    bool TraceWriter::open(const char *path) {
+        if (this->file) {
+            std::fclose(this->file);
+        }
+        this->file = std::fopen(path, "wb");
+        if (!this->file) {
+            this->error = std::string(path) + ": " + std::strerror(errno);
+            return false;
+        }
+        if (!this->buffer) {
+            this->buffer = std::make_unique<unsigned char[]>(BUFFER_SIZE);
+        }
+        this->error.clear();
+        this->used = 0;
+        this->written = 0;
+        unsigned char *out = this->reserve(sizeof(MAGIC) + 2);
+        out = std::copy(MAGIC, MAGIC + sizeof(MAGIC), out);
+        this->commit(put16(out, VERSION));
+        this->writes.clear();
+        this->keyframe = true;
+        return true;
+    }
+
+    bool TraceWriter::close(const virt16 &vm) {
+        if (!this->file) {
+            return false;
+        }
+        this->sync(vm);
+        unsigned char *out = this->reserve(3);
+        *out++ = RECORD_END;
+        this->commit(put16(out, vm.pc));
+        this->flush();
+        if (std::fclose(this->file) != 0 && this->error.empty()) {
+            this->error = std::strerror(errno);
+        }
+        this->file = nullptr;
+        return this->error.empty();
+    }
+
+    const std::string &TraceWriter::getError() const {
+        return this->error;
+    }
+
+    unsigned long long TraceWriter::size() const {
+        return this->written + this->used;
+    }
+
+    void TraceWriter::flush() {
+        if (this->file && this->used && this->error.empty()) {
+            if (std::fwrite(this->buffer.get(), 1, this->used, this->file) != this->used) {
+                this->error = std::strerror(errno);
+            }
+        }
+        this->written += this->used;
+        this->used = 0;
+    }
+
+    void TraceWriter::resync() {
+        this->keyframe = true;
+    }
+
+    void TraceWriter::sync(const virt16 &vm) {
+        const auto current = static_cast<unsigned char>(vm.flagWord());
+        if (this->keyframe) {
+            this->keyframe = false;
+            this->writes.clear();
+
+            // Bitmap of the pages holding anything but zeros, then their contents
+            std::vector<unsigned short> words(MEMORY_SIZE);
+            vm.getMemory(0, words.data(), MEMORY_SIZE);
+            unsigned char pages[PAGE_COUNT / 8]{};
+            for (unsigned int page = 0; page < PAGE_COUNT; page++) {
+                if (std::any_of(&words[page * PAGE_WORDS], &words[(page + 1) * PAGE_WORDS],
+                                [](const unsigned short word) { return word != 0; })) {
+                    pages[page / 8] |= 1 << (page % 8);
+                }
+            }
+
+            unsigned char *out = this->reserve(1 + 2 + sizeof(this->registers) + 1 + 8 + sizeof(pages));
+            *out++ = RECORD_KEYFRAME;
+            out = put16(out, vm.pc);
+            for (const unsigned short value: vm.registers) {
+                out = put16(out, value);
+            }
+            std::memcpy(this->registers, vm.registers, sizeof(this->registers));
+            *out++ = current;
+            this->flags = current;
+            for (int shift = 48; shift >= 0; shift -= 16) {
+                out = put16(out, static_cast<unsigned int>(vm.cycles >> shift));
+            }
+            out = std::copy(pages, pages + sizeof(pages), out);
+            this->commit(out);
+            for (unsigned int page = 0; page < PAGE_COUNT; page++) {
+                if (pages[page / 8] & (1 << (page % 8))) {
+                    out = this->reserve(2 * PAGE_WORDS);
+                    for (unsigned int i = 0; i < PAGE_WORDS; i++) {
+                        out = put16(out, words[page * PAGE_WORDS + i]);
+                    }
+                    this->commit(out);
+                }
+            }
+            this->next_pc = vm.pc;
+            return;
+        }
+
+        if (current == this->flags && this->writes.empty() &&
+            std::memcmp(vm.registers, this->registers, sizeof(this->registers)) == 0) {
+            return;
+        }
+        unsigned char *out = this->reserve(3 + 3 * 32 + 10);
+        *out++ = RECORD_SYNC;
+        *out++ = current;
+        this->flags = current;
+        unsigned char *count = out++;
+        *count = 0;
+        out = this->putRegisters(out, vm.registers, changedRegisters(vm.registers, this->registers), count);
+        for (size_t remaining = this->writes.size(); ; remaining >>= 7) {
+            *out++ = static_cast<unsigned char>((remaining & 0x7F) | (remaining > 0x7F ? 0x80 : 0));
+            if (remaining <= 0x7F) {
+                break;
+            }
+        }
+        this->commit(out);
+        for (const auto &[addr, value]: this->writes) {
+            out = this->reserve(4);
+            this->commit(put16(put16(out, addr), value));
+        }
+        this->writes.clear();
+    }
+
+    void TraceWriter::record(const virt16 &vm, const unsigned short pc, const unsigned char opcode) {
+        // TIME differs by the ticks of the instruction until the record applies them
+        this->record(vm, pc, opcode, changedRegisters(vm.registers, this->registers), true);
+    }
+
+    TraceWriter::~TraceWriter() {
+        if (this->file) {
+            this->flush();
+            std::fclose(this->file);
+        }
+    }
+
+    bool TraceReader::open(const char *path) {
+        if (this->file) {
+            std::fclose(this->file);
+        }
+        this->current = TraceState();
+        this->keyframes = 0;
+        this->ended = false;
+        this->error.clear();
+        this->file = std::fopen(path, "rb");
+        if (!this->file) {
+            this->error = std::string(path) + ": " + std::strerror(errno);
+            return false;
+        }
+        char magic[sizeof(MAGIC)];
+        unsigned short version;
+        if (!this->read(magic, sizeof(magic)) || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+            !this->read16(version)) {
+            this->error = std::string(path) + ": not a trace file";
+            return false;
+        }
+        if (version != TraceWriter::VERSION) {
+            this->error = std::string(path) + ": unsupported trace version " + std::to_string(version);
+            return false;
+        }
+        return true;
+    }
+
+    bool TraceReader::read(void *out, const size_t size) {
+        return this->file && std::fread(out, 1, size, this->file) == size;
+    }
+
+    bool TraceReader::read16(unsigned short &out) {
+        unsigned char bytes[2];
+        if (!this->read(bytes, 2)) {
+            return false;
+        }
+        out = static_cast<unsigned short>(bytes[0] << 8 | bytes[1]);
+        return true;
+    }
+
+    bool TraceReader::readRegisters() {
+        unsigned char count;
+        if (!this->read(&count, 1)) {
+            return false;
+        }
+        for (unsigned int i = 0; i < count; i++) {
+            unsigned char reg;
+            unsigned short value;
+            if (!this->read(&reg, 1) || !this->read16(value) || reg >= 32) {
+                return false;
+            }
+            this->current.registers[reg] = value;
+        }
+        return true;
+    }
+
+    bool TraceReader::readWrites(const size_t count, std::vector<std::pair<unsigned short, unsigned short>> *out) {
+        for (size_t i = 0; i < count; i++) {
+            unsigned short addr, value;
+            if (!this->read16(addr) || !this->read16(value)) {
+                return false;
+            }
+            this->current.memory[addr] = value;
+            if (out) {
+                out->emplace_back(addr, value);
+            }
+        }
+        return true;
+    }
+
+    bool TraceReader::readKeyframe() {
+        unsigned char bytes[8];
+        unsigned char used[PAGE_COUNT / 8];
+        if (!this->read16(this->current.pc)) {
+            return false;
+        }
+        for (unsigned short &reg: this->current.registers) {
+            if (!this->read16(reg)) {
+                return false;
+            }
+        }
+        if (!this->read(&this->current.flags, 1) || !this->read(bytes, 8) || !this->read(used, sizeof(used))) {
+            return false;
+        }
+        this->current.cycles = 0;
+        for (const unsigned char byte: bytes) {
+            this->current.cycles = this->current.cycles << 8 | byte;
+        }
+        std::fill(this->current.memory.begin(), this->current.memory.end(), 0);
+        for (unsigned int page = 0; page < PAGE_COUNT; page++) {
+            if (used[page / 8] & (1 << (page % 8))) {
+                for (unsigned int i = 0; i < PAGE_WORDS; i++) {
+                    if (!this->read16(this->current.memory[page * PAGE_WORDS + i])) {
+                        return false;
+                    }
+                }
+            }
+        }
+        this->keyframes++;
+        return true;
+    }
+
+    bool TraceReader::next(TraceStep &step) {
+        unsigned char tag;
+        while (!this->ended && this->read(&tag, 1)) {
+            if (tag == TraceWriter::RECORD_KEYFRAME) {
+                if (!this->readKeyframe()) {
+                    this->error = "truncated keyframe";
+                    return false;
+                }
+                continue;
+            }
+            if (tag == TraceWriter::RECORD_SYNC) {
+                size_t count = 0;
+                bool ok = this->read(&this->current.flags, 1) && this->readRegisters();
+                for (unsigned int shift = 0; ok; shift += 7) {
+                    unsigned char byte;
+                    ok = shift < 64 && this->read(&byte, 1);
+                    if (!ok) {
+                        break;
+                    }
+                    count |= static_cast<size_t>(byte & 0x7F) << shift;
+                    if (!(byte & 0x80)) {
+                        break;
+                    }
+                }
+                if (!ok || !this->readWrites(count, nullptr)) {
+                    this->error = "truncated sync record";
+                    return false;
+                }
+                continue;
+            }
+            if (tag == TraceWriter::RECORD_END) {
+                if (!this->read16(this->current.pc)) {
+                    this->error = "truncated end record";
+                    return false;
+                }
+                this->ended = true;
+                return false;
+            }
+            if (tag & TraceWriter::RECORD_KEYFRAME) {
+                this->error = "unknown record type " + std::to_string(tag);
+                return false;
+            }
+
+            step.cycle = this->current.cycles;
+            step.pc = this->current.pc;
+            step.opcode = tag & 0x1F;
+            step.flags_changed = (tag & TraceWriter::RECORD_FLAGS) != 0;
+            step.registers.clear();
+            step.writes.clear();
+            unsigned char count;
+            bool ok = this->read(&count, 1) &&
+                      (!(tag & TraceWriter::RECORD_PC) || this->read16(step.pc)) &&
+                      (!(tag & TraceWriter::RECORD_FLAGS) || this->read(&this->current.flags, 1));
+            if (ok) {
+                this->current.registers[TIME] = this->current.registers[TIME] + OPCODE_TICKS[step.opcode];
+                for (unsigned int i = 0; ok && i < (count & 0x3F); i++) {
+                    unsigned char reg;
+                    unsigned short value;
+                    ok = this->read(&reg, 1) && this->read16(value) && reg < 32;
+                    if (ok) {
+                        this->current.registers[reg] = value;
+                        step.registers.emplace_back(reg, value);
+                    }
+                }
+                ok = ok && this->readWrites(count >> 6, &step.writes);
+            }
+            if (!ok) {
+                this->error = "truncated instruction record";
+                return false;
+            }
+            this->current.pc = static_cast<unsigned short>(step.pc + 2);
+            this->current.cycles++;
+            return true;
+        }
+        return false;
+    }
+
+    const TraceState &TraceReader::state() const {
+        return this->current;
+    }
+
+    unsigned int TraceReader::keyframeCount() const {
+        return this->keyframes;
+    }
+
+    bool TraceReader::complete() const {
+        return this->ended;
+    }
+
+    const std::string &TraceReader::getError() const {
+        return this->error;
+    }
+
+    TraceReader::~TraceReader() {
+        if (this->file) {
+            std::fclose(this->file);
+        }
+    }
+} // Virt16
@@ -0,0 +1,249 @@
+//
+// Execution traces.
+//
+// A TraceWriter attached with virt16::setTrace() receives every instruction the VM executes together
+// with the registers, flags and memory words it changed. TraceReader replays such a file and rebuilds
+// the machine state after every instruction, so two runs can be compared offline.
+//
+// File layout, every multi-byte field big-endian:
+//   header      "V16T", u16 version
+//   keyframe    0x80, u16 pc, 32 x u16 registers, u8 flags, u64 cycles, 32-byte bitmap of the non-zero
+//               pages followed by the 256 words of each of them
+//   sync        0x81, u8 flags, u8 register count, (u8 register, u16 value)*, LEB128 write count,
+//               (u16 addr, u16 value)* - changes made between instructions (setRegister(), setMemory())
+//   instruction u8 opcode | 0x20 flags follow | 0x40 pc follows, u8 register count | write count << 6,
+//               [u16 pc], [u8 flags], (u8 register, u16 value)*, (u16 addr, u16 value)*
+//   end         0xFF, u16 pc
+// pc is only stored when the instruction is not the one after the previous instruction, flags are
+// Z | G << 1 | L << 2 | E << 3 | C << 4. TIME advances by OPCODE_TICKS of every instruction record before its
+// registers are applied, so it is only stored when the program writes it. A keyframe starts every trace and
+// follows reset() / restore().
+//
+
+#ifndef VIRT16_TRACE_H
+#define VIRT16_TRACE_H
+
+#include <bit>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "virt16.h"
+
+namespace Virt16 {
+    inline constexpr const char *opcode_names[32] = {
+            "LOAD", "LOAD", "STORE", "MOV", "INC", "DEC", "ADD", "SUB",
+            "AND", "OR", "XOR", "NOT", "SHL", "SHR", "CMP", "JMP",
+            "JZ", "JE", "JNE", "JG", "JL", "CALL", "RET", "PUSH",
+            "POP", "HLT", "NOP", "IRET", "WAIT", "NOP", "NOP", "NOP"
+    };
+
+    class TraceWriter {
+    public:
+        enum Record : unsigned char {
+            RECORD_FLAGS = 0x20,
+            RECORD_PC = 0x40,
+            RECORD_KEYFRAME = 0x80,
+            RECORD_SYNC = 0x81,
+            RECORD_END = 0xFF
+        };
+
+    private:
+        // Bytes buffered before they are handed to the file
+        static constexpr size_t BUFFER_SIZE = 1 << 16;
+
+        std::FILE *file = nullptr;
+        std::unique_ptr<unsigned char[]> buffer;
+        size_t used = 0;
+        unsigned long long written = 0;
+        std::string error;
+
+        // State as a reader of the file sees it, changes are encoded relative to it
+        unsigned short registers[32]{};
+        unsigned short next_pc = 0;
+        unsigned char flags = 0;
+        bool keyframe = true;
+
+        // Memory writes since the last record, filled by the VM
+        std::vector<std::pair<unsigned short, unsigned short>> writes;
+
+        static unsigned char *put16(unsigned char *out, const unsigned int value) {
+            out[0] = static_cast<unsigned char>(value >> 8);
+            out[1] = static_cast<unsigned char>(value);
+            return out + 2;
+        }
+
+        // Room for bytes more bytes in the buffer, fill it and pass the end to commit()
+        unsigned char *reserve(const size_t bytes) {
+            if (this->used + bytes > BUFFER_SIZE) [[unlikely]] {
+                this->flush();
+            }
+            return &this->buffer[this->used];
+        }
+
+        void commit(const unsigned char *end) {
+            this->used = static_cast<size_t>(end - this->buffer.get());
+        }
+
+        // Registers of candidates that differ from the last record, updates it and count
+        unsigned char *putRegisters(unsigned char *out, const unsigned short *current, unsigned int candidates,
+                                    unsigned char *count) {
+            while (candidates) {
+                const auto reg = static_cast<unsigned char>(std::countr_zero(candidates));
+                candidates &= candidates - 1;
+                if (current[reg] != this->registers[reg]) {
+                    *out++ = reg;
+                    out = put16(out, current[reg]);
+                    this->registers[reg] = current[reg];
+                    ++*count;
+                }
+            }
+            return out;
+        }
+
+        void flush();
+
+    public:
+        static constexpr unsigned short VERSION = 2;
+
+        TraceWriter() = default;
+
+        TraceWriter(const TraceWriter &) = delete;
+
+        TraceWriter &operator=(const TraceWriter &) = delete;
+
+        // Returns false and sets getError() if the file cannot be created
+        bool open(const char *path);
+
+        // Writes the end record and the buffered data, returns false if anything could not be written
+        bool close(const virt16 &vm);
+
+        [[nodiscard]] const std::string &getError() const;
+
+        // Bytes written so far, including the buffer
+        [[nodiscard]] unsigned long long size() const;
+
+        // Called by the VM
+        void logWrite(const unsigned int addr, const unsigned short value) {
+            this->writes.emplace_back(static_cast<unsigned short>(addr), value);
+        }
+
+        // The next record is a keyframe, the VM state was replaced wholesale
+        void resync();
+
+        // Records changes made to vm since the last instruction
+        void sync(const virt16 &vm);
+
+        // Records the instruction at pc that has just been executed
+        void record(const virt16 &vm, unsigned short pc, unsigned char opcode);
+
+        // record() for a caller that knows what the instruction can change: only the registers in candidates
+        // are compared, and the flags if flags is set. Anything else it changed goes into the next sync().
+        void record(const virt16 &vm, const unsigned short pc, const unsigned char opcode,
+                    const unsigned int candidates, const bool flags) {
+            // Members are read up front, stores through the byte pointer would make the compiler reload them
+            const unsigned short expected = this->next_pc;
+            const size_t written = this->writes.size();
+            const unsigned char before = this->flags;
+            // TIME advances by the ticks of the instruction without being stored, only other changes are recorded
+            this->registers[TIME] = this->registers[TIME] + OPCODE_TICKS[opcode];
+            // opcode, counts, pc, flags, every register and two writes
+            unsigned char *const start = this->reserve(2 + 2 + 1 + 3 * 32 + 2 * 4);
+            unsigned char *out = start + 2;
+            unsigned char tag = opcode;
+            if (pc != expected) {
+                tag |= RECORD_PC;
+                out = put16(out, pc);
+            }
+            if (flags) {
+                if (const auto current = static_cast<unsigned char>(vm.flagWord()); current != before) {
+                    tag |= RECORD_FLAGS;
+                    *out++ = current;
+                    this->flags = current;
+                }
+            }
+            unsigned char count = 0;
+            out = this->putRegisters(out, vm.registers, candidates, &count);
+            // No instruction writes more than 2 words, sync() took everything written before it
+            start[0] = tag;
+            start[1] = static_cast<unsigned char>(count | written << 6);
+            if (written) {
+                for (const auto &[addr, value]: this->writes) {
+                    out = put16(put16(out, addr), value);
+                }
+                this->writes.clear();
+            }
+            this->commit(out);
+            this->next_pc = pc + 2;
+        }
+
+        ~TraceWriter();
+    };
+
+    // One instruction of a trace with its effects
+    struct TraceStep {
+        unsigned long long cycle; // Cycle count before the instruction
+        unsigned short pc;
+        unsigned char opcode;
+        bool flags_changed;
+        std::vector<std::pair<unsigned char, unsigned short>> registers;
+        std::vector<std::pair<unsigned short, unsigned short>> writes;
+    };
+
+    // Machine state rebuilt from a trace
+    struct TraceState {
+        unsigned short pc = 0; // Address of the next instruction, the final PC once the trace ended
+        unsigned short registers[32]{};
+        unsigned char flags = 0;
+        unsigned long long cycles = 0;
+        std::vector<unsigned short> memory = std::vector<unsigned short>(65536);
+    };
+
+    class TraceReader {
+    private:
+        std::FILE *file = nullptr;
+        std::string error;
+        TraceState current;
+        unsigned int keyframes = 0;
+        bool ended = false;
+
+        bool read(void *out, size_t size);
+
+        bool read16(unsigned short &out);
+
+        bool readRegisters();
+
+        bool readWrites(size_t count, std::vector<std::pair<unsigned short, unsigned short>> *out);
+
+        bool readKeyframe();
+
+    public:
+        TraceReader() = default;
+
+        TraceReader(const TraceReader &) = delete;
+
+        TraceReader &operator=(const TraceReader &) = delete;
+
+        // Returns false and sets getError() if the file cannot be read or is not a trace
+        bool open(const char *path);
+
+        // Applies the next instruction to state(). Returns false at the end of the trace or when the file
+        // is malformed, getError() tells them apart.
+        bool next(TraceStep &step);
+
+        [[nodiscard]] const TraceState &state() const;
+
+        // Number of keyframes applied so far, memory only changes outside of steps at keyframes
+        [[nodiscard]] unsigned int keyframeCount() const;
+
+        // True once the end record was read, false for a trace cut short
+        [[nodiscard]] bool complete() const;
+
+        [[nodiscard]] const std::string &getError() const;
+
+        ~TraceReader();
+    };
+} // Virt16
+
+#endif //VIRT16_TRACE_H
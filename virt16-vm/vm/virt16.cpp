@@ -2,85 +2,208 @@
 // Created by johnny on 22/09/24.
 //
 
+#include <algorithm>
+#include <bit>
+#include <cstdlib>
 #include <cstring>
 #include "virt16.h"
+#include "bus.h"
+#include "coverage.h"
+#include "history.h"
+#include "jit.h"
+#include "opcodes.h"
+#include "rom.h"
+#include "trace.h"
+
+#ifdef VIRT16_PROFILE
+#include "profile.h"
+#endif
 
-#include <fstream>
 #include <iostream>
 
 
-/*
-## Opcode Translation Table
-| OPCode | Instruction      | Description                                      | Example               |
-|--------|------------------|--------------------------------------------------|-----------------------|
-| 0x00   | LOAD X, #IMM     | Load immediate value into X                      | LOAD R1, #0x0001      |
-| 0x01   | LOAD X, Y        | Load value from memory into X                    | LOAD R0, R1           |
-| 0x02   | STORE X, Y       | Store value from Y into memory address in X      | STORE R0, R1          |
-| 0x03   | MOV X, Y         | Move value from Y to X                           | MOV R0, R1            |
-| 0x04   | INC X            | Increment X by 1                                 | INC R1                |
-| 0x05   | DEC X            | Decrement X by 1                                 | DEC R1                |
-| 0x06   | ADD X, Y, Z      | Add Y and Z and store in addr and addr+1 at X    | ADD R1, R2, R3        |
-| 0x07   | SUB X, Y, Z      | Sub Z from Y and store in addr and addr+1 at X   | SUB R1, R2, R2        |
-| 0x08   | AND X, Y, Z      | Bitwise AND Y and Z and store in X               | AND R1, R2, R3        |
-| 0x09   | OR X, Y, Z       | Bitwise OR Y and Z and store in X                | OR R1, R2, R3         |
-| 0x0A   | XOR X, Y, Z      | Bitwise XOR Y and Z and store in X               | XOR R1, R2, R3        |
-| 0x0B   | NOT X, Y         | Bitwise NOT Y and store in X                     | NOT R1, R2            |
-| 0x0C   | SHL X, Y, Z      | Shift Y left by Z bits and store in X            | SHL R1, R2, R3        |
-| 0x0D   | SHR X, Y, Z      | Shift Y right by Z bits and store in X           | SHR R1, R2, R3        |
-| 0x0E   | CMP X, Y         | Compare X and Y - Flags will pop up              | CMP R1, R2            |
-| 0x0F   | JMP addr         | Jump to address                                  | JMP 0x0001            |
-| 0x10   | JZ addr          | Jump if zero                                     | JZ 0x0001             |
-| 0x11   | JE addr          | Jump if equal                                    | JE 0x0001             |
-| 0x12   | JNE addr         | Jump if not equal                                | JNE 0x0001            |
-| 0x13   | JG addr          | Jump if greater                                  | JG 0x0001             |
-| 0x14   | JL addr          | Jump if less                                     | JL 0x0001             |
-| 0x15   | CALL addr        | Call subroutine                                  | CALL 0x0001           |
-| 0x16   | RET              | Return from subroutine                           | RET                   |
-| 0x17   | PUSH X           | Push value from register onto stack              | PUSH R1               |
-| 0x18   | POP X            | Pop value from stack into register               | POP R1                |
-| 0x19   | HLT              | Halt the program                                 | HLT                   |
-| 0x1A   | NOP              | No Operation                                     | NOP                   |
-| 0x1B   | NOP              | No Operation                                     | NOP                   |
-| 0x1C   | NOP              | No Operation                                     | NOP                   |
-| 0x1D   | NOP              | No Operation                                     | NOP                   |
-| 0x1E   | NOP              | No Operation                                     | NOP                   |
-| 0x1F   | NOP              | No Operation                                     | NOP                   |
-
-TOTAL: 32 Instructions (0x00 - 0x1F) 5 bits
-*/
-
-#define LOAD_IMM 0x00
-#define LOAD_ADDR 0x01
-#define STORE_ADDR 0x02
-#define MOV 0x03
-#define INC 0x04
-#define DEC 0x05
-#define ADD 0x06
-#define SUB 0x07
-#define AND 0x08
-#define OR 0x09
-#define XOR 0x0A
-#define NOT 0x0B
-#define SHL 0x0C
-#define SHR 0x0D
-#define CMP 0x0E
-#define JMP 0x0F
-#define JZ 0x10
-#define JE 0x11
-#define JNE 0x12
-#define JG 0x13
-#define JL 0x14
-#define CALL 0x15
-#define RET 0x16
-#define PUSH 0x17
-#define POP 0x18
-#define HLT 0x19
-#define NOP 0x1A
+namespace Virt16 {
+    namespace {
+        // Big endian: first word holds the opcode and registers, second word the immediate/address
+        void decodeInstruction(const unsigned short instr_l, const unsigned short instr_h, DecodedOp &op) {
+            // OPCODE (5 bits) | X (5 bits) | Y (5 bits) | Z (5 bits) | ... - IMM/ADDR are the last 16 bits
+            const unsigned int instr = (instr_l << 16) | instr_h;
+            op.opcode = (instr & 0xf8000000) >> 27;
+            op.x = (instr & 0b00000111110000000000000000000000) >> (32 - 5 - 5);
+            op.y = (instr & 0b00000000001111100000000000000000) >> (32 - 5 - 5 - 5);
+            op.z = (instr & 0b00000000000000011111000000000000) >> (32 - 5 - 5 - 5 - 5);
+            op.imm = (instr & 0x0000FFFF);
+            op.time = op.x == TIME || op.y == TIME || op.z == TIME;
+            op.fused = op.opcode;
+        }
+
+        // Fuses the decoded instruction in slot with the ones after it if they form a superinstruction. Every
+        // part has to be cached in the same page and leave TIME alone, so the fused handlers only count ticks.
+        void fuse(DecodedOp *ops, const unsigned int slot) {
+            DecodedOp &op = ops[slot];
+            op.fused = op.opcode;
+            if (op.time || slot + 2 >= PAGE_WORDS || ops[slot + 2].time) {
+                return;
+            }
+            const unsigned char fused = fusedOpcode(op.opcode, ops[slot + 2].opcode);
+            if (fused == FUSED_INC_CMP_JNE || fused == FUSED_DEC_CMP_JNE) {
+                if (slot + 4 >= PAGE_WORDS || ops[slot + 4].opcode != JNE || ops[slot + 4].time) {
+                    return;
+                }
+            }
+            if (fused) {
+                op.fused = fused;
+            }
+        }
 
+        // What each opcode can change besides PC and memory, the Traced builds of runSwitch() only compare that
+        constexpr unsigned char WRITES_X = 1;
+        constexpr unsigned char WRITES_SP = 2;
+        constexpr unsigned char WRITES_FLAGS = 4;
+        constexpr unsigned char OPCODE_WRITES[32] = {
+                WRITES_X, WRITES_X, 0, WRITES_X, WRITES_X, WRITES_X, WRITES_FLAGS, WRITES_FLAGS, // LOAD # - SUB
+                WRITES_X, WRITES_X, WRITES_X, WRITES_X, WRITES_X, WRITES_X, WRITES_FLAGS, 0, // AND - JMP
+                0, 0, 0, 0, 0, WRITES_SP, WRITES_SP, WRITES_SP, // JZ - PUSH
+                WRITES_X | WRITES_SP, 0, 0, WRITES_SP | WRITES_FLAGS, 0, 0, 0, 0 // POP, HLT, NOP, IRET, WAIT
+        };
+
+        unsigned int writtenRegisters(const DecodedOp &op) {
+            return (OPCODE_WRITES[op.opcode] & WRITES_X ? 1u << op.x : 0) |
+                   (OPCODE_WRITES[op.opcode] & WRITES_SP ? 1u << SP : 0);
+        }
+
+        // Fills every cacheable slot, shared pages are immutable so they have to be complete
+        void decodePage(Page *page) {
+            for (unsigned int slot = 0; slot < PAGE_WORDS - 1; slot++) {
+                decodeInstruction(page->words[slot], page->words[slot + 1], page->ops[slot + 1]);
+            }
+            page->ops[0].opcode = UNDECODED;
+            page->ops[0].fused = UNDECODED;
+            page->ops[PAGE_WORDS].opcode = UNDECODED;
+            page->ops[PAGE_WORDS].fused = UNDECODED;
+            for (unsigned int slot = 1; slot < PAGE_WORDS; slot++) {
+                fuse(page->ops, slot);
+            }
+        }
+
+        void retain(Page *page) {
+            page->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void release(Page *page) {
+            if (page && page->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                delete page;
+            }
+        }
+
+        // Shared by every VM until it writes, the static reference keeps it alive
+        Page *zeroPage() {
+            static Page *const page = [] {
+                auto *zero = new Page{};
+                zero->refs = 1;
+                decodePage(zero);
+                return zero;
+            }();
+            return page;
+        }
+
+        // Base of a VM whose pages are all the zero page, the snapshot() bases follow it
+        constexpr unsigned long long ZERO_BASE = 1;
+        std::atomic<unsigned long long> next_base{ZERO_BASE + 1};
+    }
+
+    Snapshot::Snapshot(const Snapshot &other) {
+        *this = other;
+    }
+
+    Snapshot::Snapshot(Snapshot &&other) noexcept {
+        *this = std::move(other);
+    }
+
+    Snapshot &Snapshot::operator=(const Snapshot &other) {
+        if (this == &other) {
+            return *this;
+        }
+        for (unsigned int i = 0; i < PAGE_COUNT; i++) {
+            if (other.pages[i]) {
+                retain(other.pages[i]);
+            }
+            release(this->pages[i]);
+            this->pages[i] = other.pages[i];
+        }
+        std::memcpy(this->registers, other.registers, sizeof(this->registers));
+        this->pc = other.pc;
+        this->z = other.z;
+        this->g = other.g;
+        this->l = other.l;
+        this->e = other.e;
+        this->c = other.c;
+        this->running = other.running;
+        this->cycles = other.cycles;
+        this->ticks = other.ticks;
+        this->pending = other.pending;
+        this->interrupts = other.interrupts;
+        this->waiting = other.waiting;
+        this->base = other.base;
+        return *this;
+    }
+
+    Snapshot &Snapshot::operator=(Snapshot &&other) noexcept {
+        if (this == &other) {
+            return *this;
+        }
+        *this = static_cast<const Snapshot &>(other);
+        for (Page *&page: other.pages) {
+            release(page);
+            page = nullptr;
+        }
+        other.base = 0;
+        return *this;
+    }
+
+    bool Snapshot::valid() const {
+        return this->pages[0] != nullptr;
+    }
+
+    unsigned int Snapshot::distinctPages(const Snapshot &other) const {
+        unsigned int count = 0;
+        for (unsigned int i = 0; i < PAGE_COUNT; i++) {
+            count += this->pages[i] != other.pages[i];
+        }
+        return count;
+    }
+
+    bool Snapshot::sharesPage(const Snapshot &other, const unsigned int page) const {
+        return this->pages[page] == other.pages[page];
+    }
+
+    void Snapshot::setPage(const unsigned int page, const unsigned short *words) {
+        Page *fresh = zeroPage();
+        if (std::any_of(words, words + PAGE_WORDS, [](const unsigned short word) { return word != 0; })) {
+            fresh = new Page{};
+            std::memcpy(fresh->words, words, sizeof(fresh->words));
+            fresh->refs = 0;
+            decodePage(fresh);
+        }
+        retain(fresh);
+        release(this->pages[page]);
+        this->pages[page] = fresh;
+        this->base = 0;
+    }
+
+    Snapshot::~Snapshot() {
+        for (Page *page: this->pages) {
+            release(page);
+        }
+    }
 
-namespace Virt16 {
     virt16::virt16() {
-        std::memset(memory, 0, sizeof(memory));
+        for (unsigned int i = 0; i < PAGE_COUNT; i++) {
+            retain(zeroPage());
+            pages[i] = zeroPage();
+            page_flags[i] = PAGE_SHARED;
+        }
+        base = ZERO_BASE;
         std::memset(registers, 0, sizeof(registers));
         pc = 0;
 
@@ -88,15 +211,31 @@ namespace Virt16 {
         g = false;
         l = false;
         e = false;
+        c = false;
 
         running = false;
+        cycles = 0;
+        ticks = 0;
+        engine = Engine::Switch;
     }
 
-    virt16::~virt16() = default;
+    virt16::~virt16() {
+        for (Page *page: pages) {
+            release(page);
+        }
+    }
 
     void virt16::reset() {
-        // Clear memory
-        std::memset(memory, 0, sizeof(memory));
+        // Clear memory, every page goes back to the shared zero page
+        this->replacePages(nullptr, ZERO_BASE);
+        if (trace) {
+            trace->resync();
+        }
+#ifdef VIRT16_PROFILE
+        if (profiler) {
+            profiler->resync();
+        }
+#endif
         std::memset(registers, 0, sizeof(registers));
 
         pc = 0;
@@ -105,10 +244,29 @@ namespace Virt16 {
         g = false;
         l = false;
         e = false;
+        c = false;
+
+        cycles = 0;
+        ticks = 0;
+
+        pending = 0;
+        interrupts = true;
+        waiting = false;
     }
 
     unsigned short virt16::getMemory(const unsigned int addr) const {
-        return this->memory[addr];
+        return this->readMemory(addr);
+    }
+
+    void virt16::getMemory(unsigned int addr, unsigned short *out, unsigned int count) const {
+        while (count) {
+            addr &= 0xFFFF;
+            const unsigned int chunk = std::min(count, PAGE_WORDS - (addr & 0xFF));
+            std::memcpy(out, &this->pages[addr >> 8]->words[addr & 0xFF], chunk * sizeof(unsigned short));
+            out += chunk;
+            addr += chunk;
+            count -= chunk;
+        }
     }
 
     unsigned short virt16::getRegister(const Registers reg) const {
@@ -121,6 +279,7 @@ namespace Virt16 {
             case G: return g;
             case L: return l;
             case E: return e;
+            case C: return c;
             default: return false; // or throw an exception
         }
     }
@@ -133,9 +292,25 @@ namespace Virt16 {
         return this->pc;
     }
 
+    bool virt16::isRunning() const {
+        return this->running;
+    }
+
+    bool virt16::isWaiting() const {
+        return this->waiting;
+    }
+
+    unsigned long long virt16::getCycles() const {
+        return this->cycles;
+    }
+
+    unsigned long long virt16::getTicks() const {
+        return this->ticks;
+    }
+
     // Setters
     void virt16::setMemory(const unsigned int addr, const unsigned short value) {
-        this->memory[addr] = value;
+        this->writeMemory(addr, value);
     }
 
     void virt16::setRegister(const Registers reg, unsigned short value) {
@@ -152,6 +327,8 @@ namespace Virt16 {
                 break;
             case E: e = value;
                 break;
+            case C: c = value;
+                break;
             default: break; // or throw an exception
         }
     }
@@ -160,58 +337,375 @@ namespace Virt16 {
         this->setRegister(DISP, value);
     }
 
-    void virt16::step() {
-        // Implement the step function (big endian)
-        const unsigned short instr_l = this->getMemory(this->pc);
-        const unsigned short instr_h = this->getMemory(this->pc + 1);
-
-
-        Registers X, Y, Z;
-        unsigned short addr;
-        unsigned short imm;
-        // OPCODE 5 bits (0x00 - 0x1F)
-        // ADDR 16 bits
-        // IMM 16 bits
-        // REG 5 bits
-        // Max 32 instructions (0x00 - 0x1F)
-        // Instruction is 32 bits, first 16 bits is instr_l and last 16 bits is instr_h
-        const unsigned int instr = (instr_l << 16) | instr_h;
-        // Opcode is the first 5 bits
-        switch (unsigned char opcode = (instr & 0xf8000000) >> 27) {
+    void virt16::setPC(const unsigned short value) {
+        this->pc = value;
+    }
+
+    void virt16::setEngine(const Engine value) {
+        this->engine = value;
+    }
+
+    Engine virt16::getEngine() const {
+        return this->engine;
+    }
+
+    void virt16::setFusion(const bool value) {
+        if (value && !this->fusion) {
+            // Sealed pages were fused when they were decoded, private ones only when the fused engine decodes them
+            for (unsigned int n = 0; n < this->written_count; n++) {
+                if (const unsigned int page = this->written[n]; !(this->page_flags[page] & PAGE_SHARED)) {
+                    for (unsigned int slot = 1; slot < PAGE_WORDS; slot++) {
+                        fuse(this->pages[page]->ops, slot);
+                    }
+                }
+            }
+        }
+        this->fusion = value;
+    }
+
+    bool virt16::getFusion() const {
+        return this->fusion;
+    }
+
+    const DecodedOp &virt16::decode(const unsigned short addr) {
+        // Shared pages are read-only and the last word's instruction depends on the next page, decode those on the side
+        const bool cacheable = (addr & 0xFF) != 0xFF && !(this->page_flags[addr >> 8] & PAGE_SHARED);
+        DecodedOp &op = cacheable ? *this->cachedOp(addr) : this->scratch_op;
+        decodeInstruction(this->readMemory(addr), this->readMemory(addr + 1u), op);
+        return op;
+    }
+
+    const DecodedOp &virt16::decodeFused(const unsigned short addr) {
+        const DecodedOp &op = this->decode(addr);
+        if (&op == &this->scratch_op) {
+            return op;
+        }
+        switch (op.opcode) {
+            case CMP: case LOAD_IMM: case INC: case DEC: case PUSH: case POP: break;
+            default: return op;
+        }
+        // Straight-line code is decoded in order, the instructions a pattern needs after this one are not yet
+        DecodedOp *ops = this->pages[addr >> 8]->ops;
+        const unsigned int slot = (addr & 0xFF) + 1;
+        for (unsigned int next = slot + 2; next <= slot + 4 && next < PAGE_WORDS; next += 2) {
+            if (ops[next].opcode == UNDECODED) {
+                this->decode(static_cast<unsigned short>(addr + (next - slot)));
+            }
+        }
+        fuse(ops, slot);
+        return op;
+    }
+
+    void virt16::writeSlow(const unsigned int addr, const unsigned short value) {
+        const unsigned int page = addr >> 8;
+        const unsigned char flags = this->page_flags[page];
+        if ((flags & PAGE_MAPPED) && !this->hooks[page]->write(*this, static_cast<unsigned short>(addr), value)) {
+            return;
+        }
+        if (flags & PAGE_SHARED) {
+            this->unshare(page);
+        }
+        this->storeWord(addr, value);
+        if (flags & PAGE_CODE) {
+            this->invalidateJit(addr);
+        }
+        if (flags & PAGE_TRACKED) {
+            this->markDirty(addr);
+        }
+        if (flags & PAGE_TRACED) {
+            this->trace->logWrite(addr, value);
+        }
+        if (flags & PAGE_JOURNALED) {
+            this->history->logWrite(addr, value);
+        }
+        if (flags & PAGE_WATCHED) {
+            this->watchWrite(addr);
+        }
+    }
+
+    void virt16::watchWrite(const unsigned int addr) {
+        if ((this->debug->watch[addr] & WATCH_WRITE) && this->hit.kind == DebugHit::None) {
+            this->hit = {DebugHit::Write, static_cast<unsigned short>(addr)};
+            this->running = false;
+        }
+    }
+
+    bool virt16::checkBefore(const DecodedOp &op) {
+        Debugger &debugger = *this->debug;
+        const bool resume = debugger.resume;
+        debugger.resume = false;
+        if (debugger.breakpoints[this->pc] && !resume) {
+            bool holds = true;
+            if (const auto it = debugger.conditions.find(this->pc); it != debugger.conditions.end()) {
+                const BreakCondition &condition = it->second;
+                const unsigned short value = this->registers[condition.index & 31];
+                const bool flags[] = {this->z, this->g, this->l, this->e, this->c};
+                const bool flag = condition.index <= C && flags[condition.index];
+                switch (condition.kind) {
+                    case BreakCondition::Equal: holds = value == condition.value;
+                        break;
+                    case BreakCondition::NotEqual: holds = value != condition.value;
+                        break;
+                    case BreakCondition::Less: holds = value < condition.value;
+                        break;
+                    case BreakCondition::Greater: holds = value > condition.value;
+                        break;
+                    case BreakCondition::FlagSet: holds = flag;
+                        break;
+                    case BreakCondition::FlagClear: holds = !flag;
+                        break;
+                    default: break;
+                }
+            }
+            if (holds) {
+                this->hit = {DebugHit::Breakpoint, this->pc};
+                this->running = false;
+                return true;
+            }
+        }
+        if (debugger.watch_count) {
+            unsigned short addr;
+            switch (op.opcode) {
+                case LOAD_ADDR: addr = op.y;
+                    break;
+                case RET:
+                case POP:
+                case IRET: addr = this->registers[SP];
+                    break;
+                default: return false;
+            }
+            if ((debugger.watch[addr] & WATCH_READ) && this->hit.kind == DebugHit::None) {
+                this->hit = {DebugHit::Read, addr};
+                this->running = false;
+            }
+        }
+        return false;
+    }
+
+    void virt16::markPageDirty(const unsigned int page) {
+        if (this->page_flags[page] & PAGE_TRACKED) {
+            std::fill_n(&this->dirty[page * (PAGE_WORDS / 64)], PAGE_WORDS / 64, ~0ull);
+            this->any_dirty = true;
+        }
+    }
+
+    void virt16::unshare(const unsigned int page) {
+        Page *shared = this->pages[page];
+        if (shared->refs.load(std::memory_order_acquire) != 1) {
+            auto *copy = new Page;
+            std::memcpy(copy->ops, shared->ops, sizeof(copy->ops));
+            std::memcpy(copy->words, shared->words, sizeof(copy->words));
+            copy->refs = 1;
+            this->pages[page] = copy;
+            release(shared);
+        }
+        this->page_flags[page] &= ~PAGE_SHARED;
+        // Shared again only by seal(), reset() and restore(), which start a new list
+        this->written[this->written_count++] = static_cast<unsigned char>(page);
+    }
+
+    void virt16::seal() {
+        // Every private page was unshared since the last reset(), restore() or snapshot()
+        for (unsigned int n = 0; n < this->written_count; n++) {
+            const unsigned int i = this->written[n];
+            if (!(this->page_flags[i] & PAGE_SHARED)) {
+                decodePage(this->pages[i]);
+                this->page_flags[i] |= PAGE_SHARED;
+            }
+        }
+        this->written_count = 0;
+    }
+
+    void virt16::replacePages(Page *const *target, const unsigned long long base) {
+        bool stale_code = false;
+        const auto replace = [&](const unsigned int i) {
+            Page *page = target ? target[i] : zeroPage();
+            if (this->pages[i] == page) {
+                return; // Still shared, so it was not written since the base
+            }
+            stale_code |= (this->page_flags[i] & PAGE_CODE) != 0;
+            retain(page);
+            release(this->pages[i]);
+            this->pages[i] = page;
+            this->page_flags[i] = PAGE_SHARED | (this->page_flags[i] & (PAGE_CODE | PAGE_STICKY));
+            this->markPageDirty(i);
+        };
+        if (base != 0 && base == this->base) {
+            for (unsigned int n = 0; n < this->written_count; n++) {
+                replace(this->written[n]);
+            }
+        } else {
+            for (unsigned int i = 0; i < PAGE_COUNT; i++) {
+                replace(i);
+            }
+        }
+        this->base = base;
+        this->written_count = 0;
+        // Translations of pages that were not replaced still match their words
+        if (stale_code) {
+            this->jit->flush();
+        }
+    }
+
+    Snapshot virt16::snapshot() {
+        // Pages that were not written since the base are still the pages of that base
+        if (this->written_count || this->base == 0) {
+            this->base = next_base.fetch_add(1, std::memory_order_relaxed);
+        }
+        this->seal();
+        Snapshot snapshot;
+        snapshot.base = this->base;
+        for (unsigned int i = 0; i < PAGE_COUNT; i++) {
+            retain(this->pages[i]);
+            snapshot.pages[i] = this->pages[i];
+        }
+        std::memcpy(snapshot.registers, this->registers, sizeof(snapshot.registers));
+        snapshot.pc = this->pc;
+        snapshot.z = this->z;
+        snapshot.g = this->g;
+        snapshot.l = this->l;
+        snapshot.e = this->e;
+        snapshot.c = this->c;
+        snapshot.running = this->running;
+        snapshot.cycles = this->cycles;
+        snapshot.ticks = this->ticks;
+        snapshot.pending = this->pending;
+        snapshot.interrupts = this->interrupts;
+        snapshot.waiting = this->waiting;
+        return snapshot;
+    }
+
+    void virt16::restore(const Snapshot &snapshot) {
+        if (!snapshot.valid()) {
+            return;
+        }
+        this->replacePages(snapshot.pages, snapshot.base);
+        if (trace) {
+            trace->resync();
+        }
+#ifdef VIRT16_PROFILE
+        if (profiler) {
+            profiler->resync();
+        }
+#endif
+        std::memcpy(this->registers, snapshot.registers, sizeof(this->registers));
+        this->pc = snapshot.pc;
+        this->z = snapshot.z;
+        this->g = snapshot.g;
+        this->l = snapshot.l;
+        this->e = snapshot.e;
+        this->c = snapshot.c;
+        this->running = snapshot.running;
+        this->cycles = snapshot.cycles;
+        this->ticks = snapshot.ticks;
+        this->pending = snapshot.pending;
+        this->interrupts = snapshot.interrupts;
+        this->waiting = snapshot.waiting;
+    }
+
+    std::unique_ptr<virt16> virt16::fork() {
+        auto child = std::make_unique<virt16>();
+        child->restore(this->snapshot());
+        child->engine = this->engine;
+        return child;
+    }
+
+    unsigned int virt16::privatePages() const {
+        unsigned int count = 0;
+        for (const Page *page: this->pages) {
+            count += page->refs.load(std::memory_order_relaxed) == 1;
+        }
+        return count;
+    }
+
+    void virt16::trackWrites(const unsigned int addr, const unsigned int count) {
+        if (!this->dirty) {
+            this->dirty = std::make_unique<unsigned long long[]>(DIRTY_WORDS);
+        }
+        // Pages touched by the range, which may start and end in the middle of a page and wrap around
+        const unsigned int first = (addr & 0xFFFF) >> 8;
+        const unsigned int touched = std::min((addr % PAGE_WORDS + count + PAGE_WORDS - 1) / PAGE_WORDS, PAGE_COUNT);
+        for (unsigned int i = 0; i < touched; i++) {
+            const unsigned int page = (first + i) % PAGE_COUNT;
+            if (!(this->page_flags[page] & PAGE_TRACKED)) {
+                this->page_flags[page] |= PAGE_TRACKED;
+                this->markPageDirty(page);
+            }
+        }
+    }
+
+    bool virt16::takeDirty(unsigned long long *out) {
+        if (!this->any_dirty) {
+            return false;
+        }
+        for (unsigned int i = 0; i < DIRTY_WORDS; i++) {
+            out[i] |= this->dirty[i];
+            this->dirty[i] = 0;
+        }
+        this->any_dirty = false;
+        return true;
+    }
+
+    void virt16::mapMemory(const unsigned int addr, const unsigned int count, MemoryHook *hook) {
+        if (!this->hooks) {
+            this->hooks = std::make_unique<MemoryHook *[]>(PAGE_COUNT);
+        }
+        const unsigned int first = (addr & 0xFFFF) >> 8;
+        const unsigned int touched = std::min((addr % PAGE_WORDS + count + PAGE_WORDS - 1) / PAGE_WORDS, PAGE_COUNT);
+        for (unsigned int i = 0; i < touched; i++) {
+            const unsigned int page = (first + i) % PAGE_COUNT;
+            this->hooks[page] = hook;
+            this->page_flags[page] = static_cast<unsigned char>(
+                hook ? this->page_flags[page] | PAGE_MAPPED : this->page_flags[page] & ~PAGE_MAPPED);
+        }
+        // Translations read plain pages inline
+        if (this->jit) {
+            this->jit->flush();
+        }
+    }
+
+    MemoryHook *virt16::getMemoryHook(const unsigned int addr) const {
+        const unsigned int page = (addr & 0xFFFF) >> 8;
+        return this->page_flags[page] & PAGE_MAPPED ? this->hooks[page] : nullptr;
+    }
+
+    unsigned short virt16::readSlow(const unsigned int addr) {
+        return this->hooks[addr >> 8]->read(*this, static_cast<unsigned short>(addr), this->readMemory(addr));
+    }
+
+    inline const DecodedOp &virt16::fetch(const unsigned short addr) {
+        if (const DecodedOp *op = this->cachedOp(addr); op->opcode != UNDECODED) {
+            return *op;
+        }
+        return this->decode(addr);
+    }
+
+    inline void virt16::execute(const DecodedOp &op) {
+        const auto X = static_cast<Registers>(op.x);
+        const auto Y = static_cast<Registers>(op.y);
+        const auto Z = static_cast<Registers>(op.z);
+        const unsigned short imm = op.imm;
+        const unsigned short addr = op.imm;
+        switch (op.opcode) {
             case (LOAD_IMM):
-                // OPCODE (5 bits) | REG (5 bits) | Empty (6 bits) | IMM (16 bits) - 32 bits Big Endian (MSB) Read Left to Right
-                X = static_cast<Registers>((instr & 0b00000111110000000000000000000000) >> 22);
-                imm = (instr & 0x0000FFFF);
                 this->setRegister(X, imm);
                 break;
             case (LOAD_ADDR):
-                X = static_cast<Registers>((instr & 0b00000111110000000000000000000000) >> (32 - 5 - 5));
-                Y = static_cast<Registers>((instr & 0b00000000001111100000000000000000) >> (32 - 5 - 5 - 5));
-                this->setRegister(X, this->getMemory(Y));
+                this->setRegister(X, this->loadMemory(Y));
                 break;
             case (STORE_ADDR):
-                X = static_cast<Registers>((instr & 0b00000111110000000000000000000000) >> (32 - 5 - 5));
-                Y = static_cast<Registers>((instr & 0b00000000001111100000000000000000) >> (32 - 5 - 5 - 5));
                 this->setMemory(this->getRegister(X), this->getRegister(Y));
-            break;
+                break;
             case (MOV):
-                X = static_cast<Registers>((instr & 0b00000111110000000000000000000000) >> (32 - 5 - 5));
-            Y = static_cast<Registers>((instr & 0b00000000001111100000000000000000) >> (32 - 5 - 5 - 5));
-            this->setRegister(X, this->getRegister(Y));
-            break;
+                this->setRegister(X, this->getRegister(Y));
+                break;
             case (INC):
-                X = static_cast<Registers>((instr & 0b00000111110000000000000000000000) >> (32 - 5 - 5));
-            this->setRegister(X, this->getRegister(X) + 1);
-            break;
+                this->setRegister(X, this->getRegister(X) + 1);
+                break;
             case (DEC):
-                X = static_cast<Registers>((instr & 0b00000111110000000000000000000000) >> (32 - 5 - 5));
-            this->setRegister(X, this->getRegister(X) - 1);
-            break;
+                this->setRegister(X, this->getRegister(X) - 1);
+                break;
             case (ADD): {
-                X = static_cast<Registers>((instr & 0b00000111110000000000000000000000) >> (32 - 5 - 5));
-                Y = static_cast<Registers>((instr & 0b00000000001111100000000000000000) >> (32 - 5 - 5 - 5));
-                Z = static_cast<Registers>((instr & 0b00000000000000011111000000000000) >> (32 - 5 - 5 - 5 - 5));
-
                 if (const unsigned int sum = this->getRegister(Y) + this->getRegister(Z); sum > 0xFFFF) {
                     const unsigned short sum_msb = (sum & 0xFFFF0000) >> 16;
                     const unsigned short sum_lsb = sum & 0x0000FFFF;
@@ -226,10 +720,6 @@ namespace Virt16 {
                 break;
             }
             case (SUB): {
-                X = static_cast<Registers>((instr & 0b00000111110000000000000000000000) >> (32 - 5 - 5));
-                Y = static_cast<Registers>((instr & 0b00000000001111100000000000000000) >> (32 - 5 - 5 - 5));
-                Z = static_cast<Registers>((instr & 0b00000000000000011111000000000000) >> (32 - 5 - 5 - 5 - 5));
-
                 // Check if carry result is larger than 2 bytes
                 if (const unsigned int diff = this->getRegister(Y) - this->getRegister(Z); diff > 0xFFFF) {
                     const unsigned short diff_msb = (diff & 0xFFFF0000) >> 16;
@@ -245,55 +735,31 @@ namespace Virt16 {
                 break;
             }
             case (AND):
-                X = static_cast<Registers>((instr & 0b00000111110000000000000000000000) >> (32 - 5 - 5));
-                Y = static_cast<Registers>((instr & 0b00000000001111100000000000000000) >> (32 - 5 - 5 - 5));
-                Z = static_cast<Registers>((instr & 0b00000000000000011111000000000000) >> (32 - 5 - 5 - 5 - 5));
-
                 this->setRegister(X, this->getRegister(Y) & this->getRegister(Z));
                 break;
 
             case (OR):
-                X = static_cast<Registers>((instr & 0b00000111110000000000000000000000) >> (32 - 5 - 5));
-                Y = static_cast<Registers>((instr & 0b00000000001111100000000000000000) >> (32 - 5 - 5 - 5));
-                Z = static_cast<Registers>((instr & 0b00000000000000011111000000000000) >> (32 - 5 - 5 - 5 - 5));
-
                 this->setRegister(X, this->getRegister(Y) | this->getRegister(Z));
                 break;
 
             case (XOR):
-                X = static_cast<Registers>((instr & 0b00000111110000000000000000000000) >> (32 - 5 - 5));
-                Y = static_cast<Registers>((instr & 0b00000000001111100000000000000000) >> (32 - 5 - 5 - 5));
-                Z = static_cast<Registers>((instr & 0b00000000000000011111000000000000) >> (32 - 5 - 5 - 5 - 5));
-
                 this->setRegister(X, this->getRegister(Y) ^ this->getRegister(Z));
                 break;
 
             case (NOT):
-                X = static_cast<Registers>((instr & 0b00000111110000000000000000000000) >> (32 - 5 - 5));
-                Y = static_cast<Registers>((instr & 0b00000000001111100000000000000000) >> (32 - 5 - 5 - 5));
                 this->setRegister(X, ~this->getRegister(Y));
                 break;
 
             case (SHL):
-                X = static_cast<Registers>((instr & 0b00000111110000000000000000000000) >> (32 - 5 - 5));
-                Y = static_cast<Registers>((instr & 0b00000000001111100000000000000000) >> (32 - 5 - 5 - 5));
-                Z = static_cast<Registers>((instr & 0b00000000000000011111000000000000) >> (32 - 5 - 5 - 5 - 5));
-
-                this->setRegister(X, this->getRegister(Y) << this->getRegister(Z));
+                // Counts of 16 and more shift every bit out, larger shifts of the promoted int are undefined
+                this->setRegister(X, this->getRegister(Z) < 16 ? this->getRegister(Y) << this->getRegister(Z) : 0);
                 break;
             case (SHR):
-                X = static_cast<Registers>((instr & 0b00000111110000000000000000000000) >> (32 - 5 - 5));
-                Y = static_cast<Registers>((instr & 0b00000000001111100000000000000000) >> (32 - 5 - 5 - 5));
-                Z = static_cast<Registers>((instr & 0b00000000000000011111000000000000) >> (32 - 5 - 5 - 5 - 5));
-
-                this->setRegister(X, this->getRegister(Y) >> this->getRegister(Z));
+                this->setRegister(X, this->getRegister(Z) < 16 ? this->getRegister(Y) >> this->getRegister(Z) : 0);
                 break;
 
             case (CMP):
             {
-                X = static_cast<Registers>((instr & 0b00000111110000000000000000000000) >> (32 - 5 - 5));
-                Y = static_cast<Registers>((instr & 0b00000000001111100000000000000000) >> (32 - 5 - 5 - 5));
-
                 const unsigned short x_val = this->getRegister(X);
                 const unsigned short y_val = this->getRegister(Y);
 
@@ -309,57 +775,48 @@ namespace Virt16 {
                 break;
             }
             case (JMP):
-                addr = (instr & 0xFFFF);
                 this->pc = addr;
                 break;
             case (JZ):
-                addr = (instr & 0xFFFF);
                 if (this->getFlag(Virt16::Z)) {
                     this->pc = addr;
                 }
                 break;
             case (JE):
-                addr = (instr & 0xFFFF);
                 if (this->getFlag(Virt16::E)) {
                     this->pc = addr;
                 }
                 break;
             case (JNE):
-                addr = (instr & 0xFFFF);
                 if (!this->getFlag(Virt16::E)) {
                     this->pc = addr;
                 }
                 break;
             case (JG):
-                addr = (instr & 0xFFFF);
                 if (this->getFlag(Virt16::G)) {
                     this->pc = addr;
                 }
                 break;
             case (JL):
-                addr = (instr & 0xFFFF);
                 if (this->getFlag(Virt16::L)) {
                     this->pc = addr;
                 }
                 break;
             case (CALL):
-                addr = (instr & 0xFFFF);
                 this->setRegister(SP, this->getRegister(SP) - 1);
                 this->setMemory(this->getRegister(SP), this->pc);
                 this->pc = addr - 2;
                 break;
             case (RET):
-                this->pc = this->getMemory(this->getRegister(SP));
+                this->pc = this->loadMemory(this->getRegister(SP));
                 this->setRegister(SP, this->getRegister(SP) + 1);
                 break;
             case (PUSH):
-                X = static_cast<Registers>((instr & 0b00000111110000000000000000000000) >> (32 - 5 - 5));
                 this->setRegister(SP, this->getRegister(SP) - 1);
                 this->setMemory(this->getRegister(SP), this->getRegister(X));
                 break;
             case (POP):
-                X = static_cast<Registers>((instr & 0b00000111110000000000000000000000) >> (32 - 5 - 5));
-                this->setRegister(X, this->getMemory(this->getRegister(SP)));
+                this->setRegister(X, this->loadMemory(this->getRegister(SP)));
                 this->setRegister(SP, this->getRegister(SP) + 1);
                 break;
             case (HLT):
@@ -368,41 +825,452 @@ namespace Virt16 {
                 break;
             case (NOP):
                 break;
+            case (IRET):
+                // Pops what interrupt() pushed and lands exactly on the interrupted instruction
+                this->setFlagWord(this->loadMemory(this->getRegister(SP)));
+                this->pc = this->loadMemory(this->getRegister(SP) + 1u) - 2;
+                this->setRegister(SP, this->getRegister(SP) + 2);
+                this->interrupts = true;
+                break;
+            case (WAIT):
+                // The next instruction runs once an interrupt handler returned, see runDevices()
+                this->waiting = true;
+                this->running = false;
+                break;
             default:
-                // Invalid opcode
-                std::cout << "Invalid opcode: " << opcode << std::endl;
+                // 0x1D-0x1F are spare encodings that run as NOP, see opcodes.h
                 break;
         }
         this->pc += 2;
+        this->cycles++;
     }
 
-    void virt16::load_program(const char *program) noexcept {
-        // Open the file in binary mode
-        std::ifstream file(program, std::ios::binary);
-        if (!file.is_open()) {
-            std::cerr << "Failed to open file: " << program << std::endl;
-            //throw std::runtime_error("Failed to open file");
+    void virt16::step() {
+        this->hit = {};
+        if (this->bus || this->pending || this->waiting) [[unlikely]] {
+            this->service();
+            if (this->waiting && this->skipToDeadline()) {
+                this->service();
+            }
+            if (this->waiting) {
+                return; // Nothing to execute until a device raises an interrupt
+            }
         }
+        if (this->checked) [[unlikely]] {
+            // A step always executes, only watchpoints are checked
+            this->debug->resume = true;
+            this->checkBefore(this->fetch(this->pc));
+        }
+        if (this->instrumented()) [[unlikely]] {
+            if (this->trace) {
+                this->trace->sync(*this);
+            }
+            const unsigned short at = this->pc;
+            const unsigned char opcode = this->readMemory(at) >> 11;
+            this->interpret();
+            if (this->trace) {
+                this->trace->record(*this, at, opcode);
+            }
+#ifdef VIRT16_PROFILE
+            if (this->profiler) {
+                this->profiler->record(at, opcode, this->pc);
+            }
+#endif
+            return;
+        }
+        this->interpret();
+    }
+
+    void virt16::interpret() {
+        const DecodedOp &op = this->fetch(this->pc);
+        // TIME and the clock advance when the instruction starts
+        this->registers[TIME] = this->registers[TIME] + OPCODE_TICKS[op.opcode];
+        this->ticks += OPCODE_TICKS[op.opcode];
+        this->execute(op);
+    }
 
-        // Read the file contents into the memory array
-        unsigned short address = 0;
-        unsigned short data;
+    void virt16::load(const unsigned short *words, const unsigned int count, const unsigned int addr) {
+        for (unsigned int i = 0; i < count; i++) {
+            this->writeMemory(addr + i, words[i]);
+        }
+    }
+
+    bool virt16::load_program(const char *program) noexcept {
+        RomImage image;
+        if (!image.open(program)) {
+            std::cerr << "Failed to load program: " << image.getError() << std::endl;
+            return false;
+        }
         std::cout << "Loading program: " << program << std::endl;
-        while (file) {
-            // Read 2 bytes at a time
-            file.read(reinterpret_cast<char *>(&data), 2);
-            if (file) {
-                this->setMemory(address++, data);
+        image.load(*this);
+        return true;
+    }
+
+    void virt16::run() {
+        this->run(~0ull);
+    }
+
+    unsigned long long virt16::run(const unsigned long long max_cycles) {
+        if (this->checked) [[unlikely]] {
+            this->debug->resume = this->hit.kind == DebugHit::Breakpoint && this->hit.addr == this->pc;
+        }
+        this->hit = {};
+        if (this->bus || this->pending || this->waiting) [[unlikely]] {
+            return this->runDevices(max_cycles);
+        }
+        return this->runSlice(max_cycles);
+    }
+
+    unsigned long long virt16::runSlice(const unsigned long long max_cycles) {
+        if (this->instrumented()) [[unlikely]] {
+            return this->runInstrumented(max_cycles);
+        }
+        return this->runEngine(max_cycles);
+    }
+
+    unsigned long long virt16::runDevices(const unsigned long long max_cycles) {
+        unsigned long long executed = 0;
+        this->running = true;
+        while (true) {
+            this->service();
+            if (this->waiting) {
+                // Asleep until a device deadline or, without one, until the host posts an event. Returns either
+                // way, so a paced caller can wait off the skipped ticks.
+                this->running = this->skipToDeadline();
+                break;
+            }
+            if (executed == max_cycles) {
+                break;
+            }
+            unsigned long long budget = std::min(max_cycles - executed, Bus::SLICE);
+            if (const unsigned long long deadline = this->bus ? this->bus->deadline(*this) : Device::NEVER;
+                deadline != Device::NEVER) {
+                // No opcode takes more than 3 ticks, so the slice ends at or before the deadline
+                budget = std::min(budget, std::max((deadline > this->ticks ? deadline - this->ticks : 0) / 3, 1ull));
+            }
+            executed += this->runSlice(budget);
+            if (!this->running && !this->waiting) {
+                break; // HLT, stop(), breakpoint or watchpoint
             }
         }
-        file.close();
+        return executed;
     }
 
-    void virt16::run() {
+    bool virt16::service() {
+        bool changed = this->bus && this->bus->service(*this);
+        changed |= this->interrupt();
+        // Replays run without the bus, so only changes made by devices are checkpointed
+        if (changed && this->bus && this->history) {
+            this->history->mark();
+        }
+        return changed;
+    }
+
+    bool virt16::skipToDeadline() {
+        const unsigned long long deadline = this->bus ? this->bus->deadline(*this) : Device::NEVER;
+        // With interrupts disabled no deadline can wake WAIT, sleep until the host steps in
+        if (deadline == Device::NEVER || !this->interrupts) {
+            return false;
+        }
+        if (deadline > this->ticks) {
+            this->registers[TIME] = static_cast<unsigned short>(this->registers[TIME] + (deadline - this->ticks));
+            this->ticks = deadline;
+            if (this->history) {
+                this->history->mark();
+            }
+        }
+        return true;
+    }
+
+    bool virt16::interrupt() {
+        while (this->pending && this->interrupts) {
+            const unsigned int line = std::countr_zero(this->pending);
+            this->pending &= ~(1u << line);
+            const unsigned short vector = this->readMemory(INTERRUPT_VECTORS + line);
+            if (vector == 0) {
+                continue; // The program does not handle this port
+            }
+            // Like CALL with the flags on top, IRET pops both
+            this->registers[SP] = this->registers[SP] - 1;
+            this->writeMemory(this->registers[SP], this->pc);
+            this->registers[SP] = this->registers[SP] - 1;
+            this->writeMemory(this->registers[SP], this->flagWord());
+            this->pc = vector;
+            this->interrupts = false;
+            if (this->waiting) {
+                this->waiting = false;
+                this->running = true; // Woken, a stepping caller sees it running again
+            }
+            if (this->debug) {
+                this->debug->resume = false; // A breakpoint at the interrupted instruction stops again after IRET
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void virt16::setFlagWord(const unsigned short value) {
+        this->z = value & 1;
+        this->g = value & 2;
+        this->l = value & 4;
+        this->e = value & 8;
+        this->c = value & 16;
+    }
+
+    void virt16::raise(const Registers port) {
+        if (port >= P1 && port <= P4) {
+            this->pending |= 1 << (port - P1);
+        }
+    }
+
+    void virt16::setBus(Bus *value) {
+        this->bus = value;
+    }
+
+    Bus *virt16::getBus() const {
+        return this->bus;
+    }
+
+    unsigned long long virt16::runEngine(const unsigned long long max_cycles) {
+        if (this->coverage) [[unlikely]] {
+            return this->checked ? this->runSwitch<true, true>(max_cycles) : this->runSwitch<false, true>(max_cycles);
+        }
+        if (this->checked) [[unlikely]] {
+            // Translated code has no checks, the threaded engine stands in for the JIT
+            return this->engine == Engine::Switch ? this->runSwitch<true>(max_cycles)
+                                                  : this->runThreaded<true>(max_cycles);
+        }
+        switch (this->engine) {
+            case Engine::Threaded:
+                return this->fusion ? this->runThreaded<false, true>(max_cycles) : this->runThreaded<false>(max_cycles);
+            case Engine::Jit: return this->runJit(max_cycles);
+            default: return this->runSwitch<false>(max_cycles);
+        }
+    }
+
+    template<bool Checked, bool Covered, bool Traced>
+    unsigned long long virt16::runSwitch(const unsigned long long max_cycles) {
+        const unsigned long long start = this->cycles;
+        // Ticks are counted here and only added to TIME when an instruction or a breakpoint condition uses it
+        unsigned long long ticks = 0;
+        unsigned long long synced = 0;
+        const auto sync_time = [&] {
+            this->registers[TIME] = static_cast<unsigned short>(this->registers[TIME] + (ticks - synced));
+            synced = ticks;
+        };
         this->running = true;
-        while (this->running) {
-            this->step();
+        while (this->running && this->cycles - start < max_cycles) {
+            const DecodedOp &op = this->fetch(this->pc);
+            if constexpr (Checked) {
+                sync_time();
+                if (this->checkBefore(op)) {
+                    break;
+                }
+            }
+            ticks += OPCODE_TICKS[op.opcode];
+            if (op.time) [[unlikely]] {
+                sync_time();
+            }
+            if constexpr (Covered || Traced) {
+                // op may be gone once the instruction wrote its own page
+                const unsigned short at = this->pc;
+                const DecodedOp executed = op;
+                this->execute(op);
+                if constexpr (Traced) {
+                    // TIME only needs to be current when the instruction wrote it, op.time synced it before.
+                    // Registers changed behind the instruction's back (memory hooks) go into the next sync().
+                    this->trace->record(*this, at, executed.opcode, writtenRegisters(executed),
+                                        OPCODE_WRITES[executed.opcode] & WRITES_FLAGS);
+                }
+                if (Covered || (Traced && this->coverage)) {
+                    this->coverage->record(at, executed, this->pc);
+                }
+            } else {
+                this->execute(op);
+            }
+        }
+        sync_time();
+        this->ticks += ticks;
+        return this->cycles - start;
+    }
+
+    unsigned long long virt16::runInstrumented(const unsigned long long max_cycles) {
+        if (this->trace) {
+            this->trace->sync(*this);
+        }
+#ifdef VIRT16_PROFILE
+        if (this->profiler) {
+            return this->runProfiled(max_cycles);
+        }
+#endif
+        // Traced runs take the switch engine whichever engine is selected, it records as it executes
+        return this->checked ? this->runSwitch<true, false, true>(max_cycles)
+                             : this->runSwitch<false, false, true>(max_cycles);
+    }
+
+#ifdef VIRT16_PROFILE
+    unsigned long long virt16::runProfiled(const unsigned long long max_cycles) {
+        const unsigned long long start = this->cycles;
+        this->running = true;
+        while (this->running && this->cycles - start < max_cycles) {
+            const unsigned short at = this->pc;
+            const unsigned char opcode = this->readMemory(at) >> 11;
+            if (this->engine == Engine::Switch) {
+                if (this->checked && this->checkBefore(this->fetch(at))) [[unlikely]] {
+                    break;
+                }
+                this->interpret();
+            } else if (this->runEngine(1) == 0) {
+                break; // Breakpoint
+            }
+            if (this->trace) {
+                this->trace->record(*this, at, opcode);
+            }
+            this->profiler->record(at, opcode, this->pc);
+        }
+        return this->cycles - start;
+    }
+#endif
+
+    void virt16::setTrace(TraceWriter *writer) {
+        if (this->trace && this->trace != writer) {
+            // Changes made since the last instruction still belong to the old trace
+            this->trace->sync(*this);
+        }
+        this->trace = writer;
+        for (unsigned char &flags: this->page_flags) {
+            flags = static_cast<unsigned char>(writer ? flags | PAGE_TRACED : flags & ~PAGE_TRACED);
+        }
+        if (writer) {
+            writer->resync();
+        }
+    }
+
+    TraceWriter *virt16::getTrace() const {
+        return this->trace;
+    }
+
+    void virt16::setCoverage(Coverage *value) {
+        this->coverage = value;
+    }
+
+    Coverage *virt16::getCoverage() const {
+        return this->coverage;
+    }
+
+    void virt16::setHistory(History *value) {
+        this->history = value;
+        for (unsigned char &flags: this->page_flags) {
+            flags = static_cast<unsigned char>(value ? flags | PAGE_JOURNALED : flags & ~PAGE_JOURNALED);
+        }
+    }
+
+    History *virt16::getHistory() const {
+        return this->history;
+    }
+
+#ifdef VIRT16_PROFILE
+    void virt16::setProfiler(Profiler *value) {
+        this->profiler = value;
+        if (value) {
+            value->resync();
+        }
+    }
+
+    Profiler *virt16::getProfiler() const {
+        return this->profiler;
+    }
+#endif
+
+    virt16::Debugger &virt16::debugger() {
+        if (!this->debug) {
+            this->debug = std::make_unique<Debugger>();
+        }
+        return *this->debug;
+    }
+
+    void virt16::setBreakpoint(const unsigned short addr, const BreakCondition condition) {
+        Debugger &debugger = this->debugger();
+        if (!debugger.breakpoints[addr]) {
+            debugger.breakpoints[addr] = true;
+            debugger.breakpoint_count++;
+        }
+        if (condition.kind == BreakCondition::Always) {
+            debugger.conditions.erase(addr);
+        } else {
+            debugger.conditions[addr] = condition;
+        }
+        this->checked = true;
+    }
+
+    void virt16::clearBreakpoint(const unsigned short addr) {
+        if (!this->hasBreakpoint(addr)) {
+            return;
+        }
+        this->debug->breakpoints[addr] = false;
+        this->debug->conditions.erase(addr);
+        this->debug->breakpoint_count--;
+        this->checked = this->debug->breakpoint_count || this->debug->watch_count;
+    }
+
+    bool virt16::hasBreakpoint(const unsigned short addr) const {
+        return this->debug && this->debug->breakpoints[addr];
+    }
+
+    void virt16::setWatchpoint(const unsigned short addr, const unsigned char access) {
+        Debugger &debugger = this->debugger();
+        const unsigned int page = addr >> 8;
+        const bool watched = debugger.watch[addr] != 0;
+        debugger.watch[addr] = access & (WATCH_READ | WATCH_WRITE);
+        if (watched != (debugger.watch[addr] != 0)) {
+            const int change = watched ? -1 : 1;
+            debugger.watched[page] += change;
+            debugger.watch_count += change;
+        }
+        this->page_flags[page] = static_cast<unsigned char>(
+            debugger.watched[page] ? this->page_flags[page] | PAGE_WATCHED : this->page_flags[page] & ~PAGE_WATCHED);
+        this->checked = debugger.breakpoint_count || debugger.watch_count;
+    }
+
+    unsigned char virt16::getWatchpoint(const unsigned short addr) const {
+        return this->debug ? this->debug->watch[addr] : 0;
+    }
+
+    const DebugHit &virt16::getHit() const {
+        return this->hit;
+    }
+
+    bool BreakCondition::parse(const std::string &text, BreakCondition &out) {
+        out = {};
+        if (text.empty()) {
+            return true;
+        }
+        static const std::map<std::string, Flags> flag_names = {{"Z", Z}, {"G", G}, {"L", L}, {"E", E}, {"C", C}};
+        const bool negated = text[0] == '!';
+        if (const auto flag = flag_names.find(text.substr(negated)); flag != flag_names.end()) {
+            out = {negated ? FlagClear : FlagSet, static_cast<unsigned char>(flag->second), 0};
+            return true;
+        }
+
+        static const std::pair<const char *, Kind> operators[] = {
+            {"==", Equal}, {"!=", NotEqual}, {"<", Less}, {">", Greater}
+        };
+        for (const auto &[op, kind]: operators) {
+            const auto at = text.find(op);
+            if (at == std::string::npos) {
+                continue;
+            }
+            const auto reg = register_map.find(text.substr(0, at));
+            const std::string number = text.substr(at + std::strlen(op));
+            char *end = nullptr;
+            const unsigned long value = std::strtoul(number.c_str(), &end, 0);
+            if (reg == register_map.end() || number.empty() || *end != '\0' || value > 0xFFFF) {
+                return false;
+            }
+            out = {kind, static_cast<unsigned char>(reg->second), static_cast<unsigned short>(value)};
+            return true;
         }
+        return false;
     }
 
     void virt16::stop() {
@@ -6,8 +6,12 @@
 #define VIRT16_H
 
 #define MEMORY_SIZE 65536
+#include <atomic>
+#include <bitset>
 #include <map>
+#include <memory>
 #include <string>
+#include <unordered_map>
 
 namespace Virt16 {
     enum Registers {
@@ -54,10 +58,214 @@ namespace Virt16 {
         Z, G, L, E, C
     };
 
+    // Clock ticks each opcode takes. TIME advances by them when the instruction starts, so an instruction that
+    // writes TIME overrides its own tick and one that reads it sees it included. Memory accesses and control
+    // transfers take longer than register operations, the unused opcodes 0x1D-0x1F run as NOP.
+    static constexpr unsigned char OPCODE_TICKS[32] = {
+            1, 2, 2, 1, 1, 1, 2, 2, // LOAD #, LOAD, STORE, MOV, INC, DEC, ADD, SUB
+            1, 1, 1, 1, 1, 1, 1, 2, // AND, OR, XOR, NOT, SHL, SHR, CMP, JMP
+            2, 2, 2, 2, 2, 3, 3, 2, // JZ, JE, JNE, JG, JL, CALL, RET, PUSH
+            2, 1, 1, 3, 1, 1, 1, 1 // POP, HLT, NOP, IRET, WAIT
+    };
+
+    // Interrupt vectors of P1 to P4, one word each. An interrupt raised by a port jumps to its vector, 0 drops it.
+    static constexpr unsigned short INTERRUPT_VECTORS = 0x28FC;
+
+    // Memory layout the frontends draw from
+    static constexpr unsigned short TEXT_MEMORY = 0x2900; // 16x16 console characters, one ASCII code per word
+    static constexpr unsigned short DISPLAY_MEMORY = 0x3000; // DISP the GUI starts with, 32x32 pixels
+    static constexpr unsigned short FONT_MEMORY = 0x3100; // Console glyphs, 4 words each
+
+    // Instruction fields extracted once and cached per address, so hot code is only decoded the first time
+    struct DecodedOp {
+        unsigned char opcode; // UNDECODED when the slot has to be (re)decoded from memory
+        unsigned char x;
+        unsigned char y;
+        unsigned char z;
+        unsigned short imm; // Immediate value or address (low 16 bits of the instruction)
+        unsigned char time; // X, Y or Z may be TIME, engines that count ticks in locals bring it up to date first
+        // Superinstruction starting here that the threaded engine runs with fusion on (see opcodes.h), opcode
+        // otherwise. Invalidated together with opcode.
+        unsigned char fused;
+    };
+
+    // First value past the 5-bit opcode space, engines can index their dispatch tables with it
+    static constexpr unsigned char UNDECODED = 0x20;
+
+    static constexpr unsigned int PAGE_WORDS = 256;
+    static constexpr unsigned int PAGE_COUNT = MEMORY_SIZE / PAGE_WORDS;
+
+    // 256 words of memory together with the decoded instructions starting in them. Pages are reference
+    // counted and shared copy-on-write between VMs and snapshots, a shared page is never modified.
+    struct Page {
+        // ops[s + 1] caches the instruction starting at word s. The one at the last word spans into the next
+        // page and is never cached, ops[0] is a spare slot that absorbs its invalidation when word 0 is written.
+        DecodedOp ops[PAGE_WORDS + 1];
+        unsigned short words[PAGE_WORDS];
+        std::atomic<unsigned int> refs;
+    };
+
+    // Per-page state of a VM, any flag sends writes to that page through the slow path
+    enum PageFlags : unsigned char {
+        PAGE_SHARED = 1, // Page may be referenced by a snapshot or another VM, copy it before writing
+        PAGE_CODE = 2, // Page holds JIT translated code
+        PAGE_TRACKED = 4, // Writes to the page are recorded in the dirty map, see virt16::trackWrites()
+        PAGE_TRACED = 8, // Writes to the page are passed to the attached TraceWriter
+        PAGE_JOURNALED = 16, // Writes to the page are passed to the attached History
+        PAGE_WATCHED = 32, // Words of the page have watchpoints, see virt16::setWatchpoint()
+        PAGE_MAPPED = 64 // Instruction reads and writes go through a MemoryHook, see virt16::mapMemory()
+    };
+
+    // Flags that describe the VM rather than the page contents, they survive reset() and restore()
+    static constexpr unsigned char PAGE_STICKY =
+            PAGE_TRACKED | PAGE_TRACED | PAGE_JOURNALED | PAGE_WATCHED | PAGE_MAPPED;
+
+    // Words in a dirty map, bit (addr % 64) of word (addr / 64) is set when addr was written
+    static constexpr unsigned int DIRTY_WORDS = MEMORY_SIZE / 64;
+
+    // Interchangeable interpreters, all of them produce the same architectural results
+    enum class Engine {
+        Switch, // step() in a loop
+        Threaded, // Computed-goto dispatch with the run loop inside the engine
+        Jit // x86-64 basic block translation, falls back to Threaded on other hosts
+    };
+
+    inline constexpr const char *engine_names[] = {"switch", "threaded", "jit"};
+
+    // Condition attached to a breakpoint, the breakpoint only stops while it holds
+    struct BreakCondition {
+        enum Kind : unsigned char {
+            Always,
+            Equal, NotEqual, Less, Greater, // Register index compared with value
+            FlagSet, FlagClear // Flag index
+        };
+
+        Kind kind = Always;
+        unsigned char index = 0;
+        unsigned short value = 0;
+
+        // Parses "R3==5", "SP<0x100", "A!=0", "Z" or "!E", empty text is Always. Returns false if text is invalid.
+        static bool parse(const std::string &text, BreakCondition &out);
+    };
+
+    // Accesses a watchpoint stops on
+    enum WatchAccess : unsigned char {
+        WATCH_READ = 1, // LOAD from the address, RET and POP from the stack
+        WATCH_WRITE = 2
+    };
+
+    // Why the last run() or step() stopped, see virt16::getHit()
+    struct DebugHit {
+        enum Kind : unsigned char {
+            None, Breakpoint, Read, Write
+        };
+
+        Kind kind = None;
+        unsigned short addr = 0; // Address of the breakpoint or of the watched word
+    };
+
+    class Jit;
+
+    class TraceWriter;
+
+    class History;
+
+    class Bus;
+
+    class SaveState;
+
+    class virt16;
+
+    class Coverage;
+
+#ifdef VIRT16_PROFILE
+    class Profiler;
+#endif
+
+    // Complete machine state taken by virt16::snapshot(), memory pages stay shared with the VM until written
+    class Snapshot {
+    private:
+        Page *pages[PAGE_COUNT]{};
+        unsigned short registers[32]{};
+        unsigned short pc = 0;
+        bool z = false;
+        bool g = false;
+        bool l = false;
+        bool e = false;
+        bool c = false;
+        bool running = false;
+        unsigned long long cycles = 0;
+        unsigned long long ticks = 0;
+        unsigned char pending = 0;
+        bool interrupts = true;
+        bool waiting = false;
+        // Identifies the snapshot() the pages were taken by, copies keep it and setPage() clears it
+        unsigned long long base = 0;
+
+        friend class virt16;
+
+        friend class SaveState;
+
+        // Replaces a page with a private copy of words, decoded like a sealed page
+        void setPage(unsigned int page, const unsigned short *words);
+
+    public:
+        Snapshot() = default;
+
+        Snapshot(const Snapshot &other);
+
+        Snapshot(Snapshot &&other) noexcept;
+
+        Snapshot &operator=(const Snapshot &other);
+
+        Snapshot &operator=(Snapshot &&other) noexcept;
+
+        // False for a default constructed or moved-from snapshot
+        [[nodiscard]] bool valid() const;
+
+        // Pages that are not shared with other
+        [[nodiscard]] unsigned int distinctPages(const Snapshot &other) const;
+
+        // Page holds the same words in both because neither was written since they shared it
+        [[nodiscard]] bool sharesPage(const Snapshot &other, unsigned int page) const;
+
+        ~Snapshot();
+    };
+
+    // Device behind a range of memory pages, see virt16::mapMemory(). Hooks run on the VM thread for the data
+    // accesses of instructions (LOAD, STORE, ADD/SUB to memory, the stack) and for setMemory(), instruction
+    // fetches and getMemory() see the words in memory. Hooks may raise() interrupts but not change registers or
+    // memory, and History replays call them again, so they should only depend on the VM state.
+    class MemoryHook {
+    public:
+        virtual ~MemoryHook() = default;
+
+        // Value an instruction reads from addr, stored is the word in memory
+        virtual unsigned short read(virt16 &, unsigned short, const unsigned short stored) {
+            return stored;
+        }
+
+        // Called before value is written to addr. Returns false to keep it out of memory.
+        virtual bool write(virt16 &, unsigned short, unsigned short) {
+            return true;
+        }
+    };
+
     class virt16 {
     private:
-        unsigned short memory[MEMORY_SIZE]{};
-        unsigned short registers[24]{};
+        // Memory is a table of copy-on-write pages, a fresh VM points every entry at one shared zero page
+        Page *pages[PAGE_COUNT]{};
+        unsigned char page_flags[PAGE_COUNT]{};
+        // Pages are those of the last reset() (ZERO_BASE), restore() or snapshot() of a snapshot with this base,
+        // apart from the written ones, which were unshared since. Going back there only has to look at those.
+        unsigned long long base;
+        unsigned char written[PAGE_COUNT]{};
+        unsigned int written_count = 0;
+        // Register fields are 5 bits wide, the 8 encodings past P4 land on scratch slots instead of VM state
+        unsigned short registers[32]{};
+
+        // Holds instructions that cannot be cached in their page (shared page or last word of a page)
+        DecodedOp scratch_op{};
 
         unsigned short pc;
 
@@ -69,13 +277,222 @@ namespace Virt16 {
 
         bool running;
 
+        unsigned long long cycles;
+
+        unsigned long long ticks; // Clock ticks, OPCODE_TICKS of every executed instruction
+
+        // Interrupt lines raised and not delivered yet, bit n for P1 + n
+        unsigned char pending = 0;
+        // Cleared while an interrupt handler runs, IRET sets it again
+        bool interrupts = true;
+        // Asleep on WAIT until an interrupt is delivered
+        bool waiting = false;
+
+        Engine engine;
+
+        // Superinstructions are dispatched, see setFusion()
+        bool fusion = false;
+
+        // Translated code cache, created the first time the JIT engine runs
+        std::unique_ptr<Jit> jit;
+
+        // Words written to tracked pages since the last takeDirty(), created by the first trackWrites()
+        std::unique_ptr<unsigned long long[]> dirty;
+        bool any_dirty = false;
+
+        // Receives every executed instruction while set, see setTrace()
+        TraceWriter *trace = nullptr;
+
+        // Receives every memory write while set, see setHistory()
+        History *history = nullptr;
+
+        // Devices serviced between slices of run() while set, see setBus()
+        Bus *bus = nullptr;
+
+        // Counts the edges run() executes while set, see setCoverage()
+        Coverage *coverage = nullptr;
+
+        // Hook of every page, created by the first mapMemory(). Only pages flagged PAGE_MAPPED look at it.
+        std::unique_ptr<MemoryHook *[]> hooks;
+
+#ifdef VIRT16_PROFILE
+        // Counts every executed instruction while set, see setProfiler()
+        Profiler *profiler = nullptr;
+#endif
+
+        // Breakpoints and watchpoints, created by the first setBreakpoint() or setWatchpoint()
+        struct Debugger {
+            std::bitset<MEMORY_SIZE> breakpoints;
+            std::unordered_map<unsigned short, BreakCondition> conditions; // Breakpoints that are not Always
+            unsigned char watch[MEMORY_SIZE]{}; // WatchAccess per word
+            unsigned short watched[PAGE_COUNT]{}; // Watched words per page
+            unsigned int breakpoint_count = 0;
+            unsigned int watch_count = 0;
+            bool resume = false; // Next instruction is the breakpoint the last run stopped at, execute it
+        };
+
+        std::unique_ptr<Debugger> debug;
+        // Breakpoints or watchpoints are set, runs take the checked engines
+        bool checked = false;
+        DebugHit hit;
+
+        friend class Jit;
+
+        friend class TraceWriter;
+
+        // Cache slot of the instruction starting at addr
+        [[nodiscard]] DecodedOp *cachedOp(const unsigned short addr) const {
+            return &this->pages[addr >> 8]->ops[(addr & 0xFF) + 1];
+        }
+
+        [[nodiscard]] unsigned short readMemory(unsigned int addr) const {
+            addr &= 0xFFFF;
+            return this->pages[addr >> 8]->words[addr & 0xFF];
+        }
+
+        // Data read by an instruction. Plain pages are read directly, mapped ones go through their hook.
+        unsigned short loadMemory(unsigned int addr) {
+            addr &= 0xFFFF;
+            if (this->page_flags[addr >> 8] & PAGE_MAPPED) [[unlikely]] {
+                return this->readSlow(addr);
+            }
+            return this->pages[addr >> 8]->words[addr & 0xFF];
+        }
+
+        unsigned short readSlow(unsigned int addr);
+
+        // Stores into a private page. An instruction spans two words, so the one starting right before
+        // addr is invalidated too.
+        void storeWord(const unsigned int addr, const unsigned short value) {
+            Page *page = this->pages[addr >> 8];
+            const unsigned int slot = addr & 0xFF;
+            page->words[slot] = value;
+            page->ops[slot + 1].opcode = UNDECODED;
+            page->ops[slot + 1].fused = UNDECODED;
+            page->ops[slot].opcode = UNDECODED;
+            page->ops[slot].fused = UNDECODED;
+        }
+
+        // Addresses wrap around at 64K words, ADD/SUB can target addr + 1 = 0x10000
+        void writeMemory(unsigned int addr, const unsigned short value) {
+            addr &= 0xFFFF;
+            if (this->page_flags[addr >> 8]) [[unlikely]] {
+                this->writeSlow(addr, value);
+                return;
+            }
+            this->storeWord(addr, value);
+        }
+
+        void writeSlow(unsigned int addr, unsigned short value);
+
+        // Stops the run after the current instruction if addr has a write watchpoint
+        void watchWrite(unsigned int addr);
+
+        // Checks the instruction at pc before it executes. Returns true if a breakpoint stops the run in front
+        // of it, a read watchpoint stops the run after it.
+        bool checkBefore(const DecodedOp &op);
+
+        Debugger &debugger();
+
+        void markDirty(const unsigned int addr) {
+            this->dirty[addr >> 6] |= 1ull << (addr & 63);
+            this->any_dirty = true;
+        }
+
+        // Marks every word of a tracked page, for changes that replace the whole page
+        void markPageDirty(unsigned int page);
+
+        // Gives the VM its own copy of a shared page
+        void unshare(unsigned int page);
+
+        // Decodes every private page completely and marks it shared, shared pages are read-only from then on
+        void seal();
+
+        // Points every page that differs from target (the zero page if null) at it and makes base the new base,
+        // in O(written pages) when base is the current one
+        void replacePages(Page *const *target, unsigned long long base);
+
+        void invalidateJit(unsigned int addr);
+
+        const DecodedOp &decode(unsigned short addr);
+
+        // decode() for the fused threaded engine, also decodes the instructions after a cached one and fuses them
+        const DecodedOp &decodeFused(unsigned short addr);
+
+        const DecodedOp &fetch(unsigned short addr);
+
+        void execute(const DecodedOp &op);
+
+        // Z | G << 1 | L << 2 | E << 3 | C << 4, the word an interrupt pushes and IRET pops
+        [[nodiscard]] unsigned short flagWord() const {
+            return this->z | this->g << 1 | this->l << 2 | this->e << 3 | this->c << 4;
+        }
+
+        void setFlagWord(unsigned short value);
+
+        // Jumps to the handler of the lowest pending line while interrupts are enabled. Returns true if it did.
+        bool interrupt();
+
+        // Passes queued events to the devices, polls them and delivers a pending interrupt. Changes made there
+        // are checkpointed in the History, replays never cross them. Returns true if anything changed.
+        bool service();
+
+        // Moves the clock to the next device deadline while WAIT sleeps. Returns false if there is none or
+        // interrupts are disabled.
+        bool skipToDeadline();
+
+        // run() with devices or interrupts: slices of at most Bus::SLICE instructions, cut at device deadlines
+        unsigned long long runDevices(unsigned long long max_cycles);
+
+        unsigned long long runSlice(unsigned long long max_cycles);
+
+        // Executes the instruction at pc, step() without tracing
+        void interpret();
+
+        unsigned long long runEngine(unsigned long long max_cycles);
+
+        // A trace or profiler is attached, see runInstrumented()
+        [[nodiscard]] bool instrumented() const {
+#ifdef VIRT16_PROFILE
+            return this->trace || this->profiler;
+#else
+            return this->trace;
+#endif
+        }
+
+        // Passes every instruction to the trace and profiler
+        unsigned long long runInstrumented(unsigned long long max_cycles);
+
+#ifdef VIRT16_PROFILE
+        // Runs the engine one instruction at a time for the profiler, and the trace if one is attached too
+        unsigned long long runProfiled(unsigned long long max_cycles);
+#endif
+
+        // The Checked builds stop on breakpoints and watchpoints, the others never look at them. The Covered
+        // builds count every instruction into coverage, the Traced builds record it into trace and count it
+        // into coverage if one is attached.
+        template<bool Checked, bool Covered = false, bool Traced = false>
+        unsigned long long runSwitch(unsigned long long max_cycles);
+
+        // The Fused build dispatches superinstructions, it is never Checked
+        template<bool Checked, bool Fused = false>
+        unsigned long long runThreaded(unsigned long long max_cycles);
+
+        unsigned long long runJit(unsigned long long max_cycles);
+
     public:
         virt16();
 
+        // Clears memory and registers. Only looks at the pages written since the last reset() unless restore()
+        // was called in between.
         void reset();
 
+        // Word in memory, without calling the hook of a mapped page
         [[nodiscard]] unsigned short getMemory(unsigned int addr) const;
 
+        // Copies count words starting at addr, wrapping around at the end of memory
+        void getMemory(unsigned int addr, unsigned short *out, unsigned int count) const;
+
         [[nodiscard]] unsigned short getRegister(Registers reg) const;
 
         [[nodiscard]] bool getFlag(Flags flag) const;
@@ -84,6 +501,19 @@ namespace Virt16 {
 
         [[nodiscard]] unsigned short getPC() const;
 
+        [[nodiscard]] bool isRunning() const;
+
+        // Executed WAIT and no interrupt was delivered since. run() returns with isRunning() false once only an
+        // event posted to the bus can wake it, and with isRunning() true after it skipped to a device deadline.
+        [[nodiscard]] bool isWaiting() const;
+
+        // Number of instructions executed since the last reset
+        [[nodiscard]] unsigned long long getCycles() const;
+
+        // Clock ticks since the last reset, TIME holds the low 16 bits unless the program writes it
+        [[nodiscard]] unsigned long long getTicks() const;
+
+        // Writes like a STORE, a mapped page's hook sees the value first
         void setMemory(unsigned int addr, unsigned short value);
 
         void setRegister(Registers reg, unsigned short value);
@@ -92,14 +522,123 @@ namespace Virt16 {
 
         void setDisp(unsigned short value);
 
+        void setPC(unsigned short value);
+
+        void setEngine(Engine value);
+
+        [[nodiscard]] Engine getEngine() const;
+
+        // False when Engine::Jit cannot translate on this host (not x86-64, or the code cache cannot be made
+        // executable) and runs the threaded engine instead
+        [[nodiscard]] bool jitAvailable();
+
+        // Runs common instruction sequences (CMP and a conditional jump, LOAD # and STORE, INC/DEC + CMP + JNE loop
+        // tails, PUSH and POP pairs, PUSH + CALL) as one superinstruction in the threaded engine. Off by default.
+        void setFusion(bool value);
+
+        [[nodiscard]] bool getFusion() const;
+
         void step();
 
-        void load_program(const char *program) noexcept;
+        // Stores count words starting at addr
+        void load(const unsigned short *words, unsigned int count, unsigned int addr = 0);
+
+        // Loads a ROM image (see rom.h), returns false and reports the reason on stderr if it is unreadable
+        bool load_program(const char *program) noexcept;
 
         void run();
 
+        // Runs until HLT, stop(), WAIT or until max_cycles instructions have been executed.
+        // Returns the number of instructions executed by this call.
+        unsigned long long run(unsigned long long max_cycles);
+
         void stop();
 
+        // Captures the whole machine state in O(pages written since the last snapshot)
+        Snapshot snapshot();
+
+        // Returns to the state of a valid snapshot, only pages that differ from it are replaced. Restoring the
+        // snapshot last taken or restored only looks at the pages written since.
+        void restore(const Snapshot &snapshot);
+
+        // New VM with the same state and engine, memory pages are shared copy-on-write with this one
+        std::unique_ptr<virt16> fork();
+
+        // Records every instruction executed by step() and run() into writer until called with nullptr, the
+        // writer has to stay open while attached. Traced runs take the switch engine whichever engine is
+        // selected and send every memory write through the slow path.
+        void setTrace(TraceWriter *writer);
+
+        [[nodiscard]] TraceWriter *getTrace() const;
+
+        // Counts the edges of every instruction executed by run() in value until called with nullptr, see
+        // coverage.h. Covered runs take the switch engine whichever engine is selected.
+        void setCoverage(Coverage *value);
+
+        [[nodiscard]] Coverage *getCoverage() const;
+
+        // Passes every memory write to history until called with nullptr, done by the History itself. Writes
+        // take the slow path while attached.
+        void setHistory(History *value);
+
+        [[nodiscard]] History *getHistory() const;
+
+        // Services the devices of bus between slices of run() and before step() until called with nullptr, see
+        // bus.h. The bus has to outlive the attachment.
+        void setBus(Bus *value);
+
+        [[nodiscard]] Bus *getBus() const;
+
+        // Raises the interrupt line of port (P1 to P4). It is delivered before the next slice of run() or
+        // step() while interrupts are enabled: the address of the next instruction and the flags word are
+        // pushed, execution continues at the port's word of INTERRUPT_VECTORS and further interrupts wait
+        // until IRET. Lines are delivered lowest port first.
+        void raise(Registers port);
+
+#ifdef VIRT16_PROFILE
+        // Counts every instruction executed by step() and run() in value until called with nullptr. Profiled
+        // runs execute one instruction at a time on the selected engine.
+        void setProfiler(Profiler *value);
+
+        [[nodiscard]] Profiler *getProfiler() const;
+#endif
+
+        // Stops run() in front of the instruction at addr while condition holds. Running again from there
+        // executes it. Engines only check breakpoints and watchpoints while any are set, the JIT engine runs
+        // the threaded engine in the meantime.
+        void setBreakpoint(unsigned short addr, BreakCondition condition = {});
+
+        void clearBreakpoint(unsigned short addr);
+
+        [[nodiscard]] bool hasBreakpoint(unsigned short addr) const;
+
+        // Stops run() after an instruction that accesses addr as given by WatchAccess flags, 0 removes the
+        // watchpoint. Only writes to watched pages take the slow path.
+        void setWatchpoint(unsigned short addr, unsigned char access);
+
+        [[nodiscard]] unsigned char getWatchpoint(unsigned short addr) const;
+
+        // Breakpoint or watchpoint that stopped the last run() or step(), kind None otherwise
+        [[nodiscard]] const DebugHit &getHit() const;
+
+        // Pages that are not shared with any snapshot or other VM
+        [[nodiscard]] unsigned int privatePages() const;
+
+        // Records writes to the pages covering count words from addr, for frontends that redraw only what
+        // changed. Writes to tracked pages take the slow path. Newly tracked pages start out fully dirty.
+        void trackWrites(unsigned int addr, unsigned int count);
+
+        // ORs the words written to tracked pages since the last call into out (DIRTY_WORDS entries) and
+        // clears them. Returns false if nothing was written.
+        bool takeDirty(unsigned long long *out);
+
+        // Sends the data accesses to the pages covering count words from addr through hook, nullptr returns them
+        // to plain memory. Pages without a hook cost loads and stores nothing. Not while the VM runs.
+        void mapMemory(unsigned int addr, unsigned int count, MemoryHook *hook);
+
+        // Hook of the page holding addr, nullptr for plain memory
+        [[nodiscard]] MemoryHook *getMemoryHook(unsigned int addr) const;
+
         ~virt16();
     };
 } // Virt16